@@ -31,7 +31,7 @@ void config_read(uint8_t* data)
 	// verify information contained is valid, or force-set defaults
 	if (data[CONFIG_OFFSET_VALIDITY] == CONFIG_EEPROM_VALIDITY)
 	{
-		debug(DEBUG_CONFIG_FOUND);
+		debug(MAIN, DEBUG_INFO, DEBUG_CONFIG_FOUND);
 		// data is at least theoretically OK, sanity check some items
 
 		// check if device IDS are between 0 and 6
@@ -56,7 +56,7 @@ void config_read(uint8_t* data)
 	}
 	else
 	{
-		debug(DEBUG_CONFIG_NOT_FOUND);
+		debug(MAIN, DEBUG_INFO, DEBUG_CONFIG_NOT_FOUND);
 		// EEPROM data is not set, we must handle everything ourselves
 		data[CONFIG_OFFSET_FLAGS] = GLOBAL_CONFIG_DEFAULTS;
 		data[CONFIG_OFFSET_ID_HDD] = DEVICE_ID_HDD;
@@ -69,3 +69,14 @@ void config_read(uint8_t* data)
 		data[CONFIG_OFFSET_MAC + 5] = NET_MAC_DEFAULT_ADDR_6;
 	}
 }
+
+void config_write_flags(uint8_t flags)
+{
+	uint8_t data[CONFIG_EEPROM_LENGTH];
+	config_read(data);
+	data[CONFIG_OFFSET_VALIDITY] = CONFIG_EEPROM_VALIDITY;
+	data[CONFIG_OFFSET_FLAGS] = flags;
+	eeprom_update_block((const void*) data,
+			(void*) CONFIG_EEPROM_ADDR,
+			CONFIG_EEPROM_LENGTH);
+}
@@ -25,6 +25,8 @@
 	#include "hw_v01.h"
 #elif defined(HW_DRV_V01)
 	#include "hw_drv_v01.h"
+#elif defined(HW_HOST)
+	#include "hw_host.h"
 #else
 	#error "You must define a hardware revision, like -DHW_V01"
 #endif
@@ -53,18 +55,37 @@
  */
 #define GLOBAL_CONFIG_REGISTER  GPIOR1
 
+/*
+ * Defines the GPIO register holding the runtime mask of debugging categories
+ * that may produce output; see debug.h. This is loaded at startup with either
+ * all categories or none depending on GLOBAL_FLAG_DEBUG, and may be changed
+ * afterwards by the host.
+ */
+#define DEBUG_MASK_REGISTER     GPIOR0
+
 /*
  * Default value, and the location of status flags within the global
  * configuration register.
  */
 #define GLOBAL_FLAG_PARITY      _BV(0)
 #define GLOBAL_FLAG_DEBUG       _BV(1)
+#define GLOBAL_FLAG_WCE         _BV(3)
+#define GLOBAL_FLAG_CRC         _BV(4)
 #define GLOBAL_CONFIG_DEFAULTS  GLOBAL_FLAG_PARITY
 
 /*
- * The number of bus devices that we are able to support at the same time.
+ * The most volumes the memory card can be split into, each answering as its
+ * own target; see hdd.h.
  */
-#define LOGIC_DEVICE_COUNT      2
+#define HDD_VOLUME_MAX          3
+
+/*
+ * The number of bus devices that we are able to support at the same time:
+ * each volume uses the logic device matching its number, and the link device
+ * comes after them.
+ */
+#define LOGIC_DEVICE_COUNT      (HDD_VOLUME_MAX + 1)
+#define LOGIC_DEVICE_LINK       HDD_VOLUME_MAX
 
 /*
  * Defines the default "ROM" MAC address of the device used during startup, in 
@@ -81,6 +102,13 @@
 #define NET_MAC_DEFAULT_ADDR_5  0xEE
 #define NET_MAC_DEFAULT_ADDR_6  0xEF
 
+/*
+ * The time, in microseconds, to wait after sending the 6 byte header of a
+ * packet read before sending the packet itself. Some DaynaPort drivers need
+ * this to parse the header. Must not exceed PHY_TIMER_MAX_US.
+ */
+#define LINK_HEADER_DELAY_US    100
+
 /*
  * Defines the default device IDs in the event that there is no configuration
  * data stored for this in EEPROM.
@@ -130,6 +158,18 @@
 #define MEM_BAUDCTRL_INIT       39
 #define MEM_BAUDCTRL_NORMAL     0
 
+/*
+ * Sends a byte through a USART in MSPI mode, and takes the oldest received
+ * byte out of its receive buffer. Outside of the PHY these are used for every
+ * memory card and Ethernet controller data register access, so that the host
+ * build in host/ can replace them with simulated devices: a plain read of the
+ * register has a side effect that C can't otherwise see.
+ */
+#ifndef usart_tx
+	#define usart_tx(u, v)      ((u).DATA = (v))
+	#define usart_rx(u)         ((u).DATA)
+#endif
+
 /*
  * ****************************************************************************
  * 
@@ -200,6 +240,104 @@
 #define PHY_TIMER_RST_CHMUX     EVSYS.CH6MUX
 #define PHY_TIMER_RST_CHCTRL    EVSYS.CH6CTRL
 
+/*
+ * Free-running timer used for bus timing, counting at the CPU clock rate.
+ * 
+ * The timer also captures the time of each /BSY release into CCA through an
+ * event channel, which is used to measure how long selection takes.
+ */
+#define PHY_TIMER_DESKEW        TCD0
+#define PHY_TIMER_DESKEW_CHMUX  EVSYS.CH3MUX
+#define PHY_TIMER_DESKEW_EVSEL  TC_EVSEL_CH3_gc
+
+/*
+ * ============================================================================
+ *  
+ *   SYSTEM TIMER AND SCHEDULER
+ * 
+ * ============================================================================
+ * 
+ * The system timer is a free-running 16 bit timer used for measuring time
+ * spent on background tasks. At 2us per tick it wraps about every 131ms.
+ * 
+ * A second timer counts overflows of the first through an event channel, so
+ * the pair can be read as a 32 bit count for measuring longer periods, which
+ * wraps about every 2.4 hours.
+ */
+#define SYSTEM_TIMER            TCE1
+#define SYSTEM_TIMER_CLKSEL     TC_CLKSEL_DIV64_gc
+#define SYSTEM_TIMER_TICK_US    2
+#define SYSTEM_TIMER_HIGH       TCF0
+#define SYSTEM_TIMER_HIGH_CHMUX EVSYS.CH4MUX
+#define SYSTEM_TIMER_HIGH_EVMUX EVSYS_CHMUX_TCE1_OVF_gc
+#define SYSTEM_TIMER_HIGH_CLKSEL TC_CLKSEL_EVCH4_gc
+
+/*
+ * The maximum number of background tasks the main loop scheduler can hold.
+ */
+#define MAIN_TASK_MAX           4
+
+/*
+ * Time budgets for each background task, in system timer ticks.
+ */
+#define MAIN_TASK_LINK_INIT_BUDGET      50
+#define MAIN_TASK_CARD_INIT_BUDGET      250
+#define MAIN_TASK_HDD_CACHE_BUDGET      250
+#define MAIN_TASK_HDD_PROBE_BUDGET      50
+
+/*
+ * How long to wait before trying to bring up the memory card again after
+ * initialization fails, such as when no card is inserted, in system timer
+ * ticks.
+ */
+#define MAIN_CARD_RETRY_DELAY   500000
+
+/*
+ * Card removal detection. While the card is idle it is sent CMD13 every
+ * HDD_CARD_PROBE_INTERVAL system timer ticks, and once HDD_CARD_FAULT_LIMIT
+ * probes or commands have failed without a successful probe in between, the
+ * card is treated as removed and brought up again from scratch.
+ */
+#define HDD_CARD_PROBE_INTERVAL 250000
+#define HDD_CARD_FAULT_LIMIT    3
+
+/*
+ * Size of the hard drive write-back cache in 512 byte blocks, used when
+ * GLOBAL_FLAG_WCE is set, and how long to wait after the last write into the
+ * cache before flushing it to the card, in system timer ticks. The wait gives
+ * sequential writes a chance to be combined into a single card operation, and
+ * repeated writes to the same blocks a chance to replace each other.
+ * 
+ * The maximum age bounds how long any write may stay in the cache, in system
+ * timer ticks since the cached run was started, even if writes keep arriving.
+ * This must be less than the system timer's 32 bit wrap time.
+ */
+#define HDD_CACHE_BLOCKS        2
+#define HDD_CACHE_DELAY         2500
+#define HDD_CACHE_MAX_AGE       50000
+
+/*
+ * When GLOBAL_FLAG_CRC is set, the number of extra times a block that fails
+ * the CRC check on its way out of the memory card is read back to see if the
+ * card itself is at fault, before the read is reported as a MEDIUM ERROR.
+ */
+#define HDD_CRC_RETRIES         1
+
+/*
+ * How long to wait for a busy memory card where the operation can't simply
+ * be reported as busy and tried again later, in system timer ticks. Cards
+ * may stay busy for up to 500ms after a write.
+ */
+#define MEM_BUSY_TIMEOUT        250000
+
+/*
+ * The number of events kept by the flight recorder, see flight.h. This must
+ * be a power of two no larger than 32. Twice this many 4 byte records are
+ * kept in SRAM, one copy for the running session and one for the session
+ * before the last reset.
+ */
+#define FLIGHT_LENGTH           16
+
 /*
  * ============================================================================
  *  
@@ -215,4 +353,11 @@
  */
 void config_read(uint8_t*);
 
+/*
+ * Stores a new flags byte in EEPROM, keeping the rest of the configuration as
+ * it would have been read by the above call. Other settings become valid in
+ * EEPROM if they were not already.
+ */
+void config_write_flags(uint8_t);
+
 #endif /* CONFIG_H */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "config.h"
+#include "debug.h"
+#include "ring.h"
+
+#if defined(DEBUGGING) || defined(TRACING)
+
+uint8_t debug_ring[256] __attribute__ ((aligned (256)));
+volatile uint8_t debug_head;
+volatile uint8_t debug_tail;
+uint16_t debug_dropped;
+
+/*
+ * Bytes (or records, when tracing) dropped since the last report.
+ */
+uint8_t debug_unreported;
+
+#ifdef TRACING
+
+uint8_t debug_report_dropped(void)
+{
+	if (debug_ring_free() < 2 * TRACE_RECORD_LENGTH) return 0;
+
+	uint8_t d = debug_unreported;
+	debug_unreported = 0;
+	debug_record(TRACE_DROPPED, d);
+	return 1;
+}
+
+#else
+
+void debug_put(uint8_t v)
+{
+	if (debug_unreported)
+	{
+		if (debug_ring_free() < 3)
+		{
+			// not worth sending this without the report in front of it
+			if (debug_unreported < 255) debug_unreported++;
+			debug_dropped++;
+			return;
+		}
+		uint8_t h = debug_head;
+		debug_ring[h++] = DEBUG_OUTPUT_DROPPED;
+		debug_ring[h++] = debug_unreported;
+		debug_head = h;
+		debug_unreported = 0;
+	}
+	else if (debug_ring_free() == 0)
+	{
+		debug_unreported = 1;
+		debug_dropped++;
+		return;
+	}
+
+	uint8_t h = debug_head;
+	debug_ring[h++] = v;
+	debug_head = h;
+	debug_ring_kick();
+}
+
+#endif /* TRACING */
+
+/*
+ * Sends the next byte from the ring, turning the interrupt off once the ring
+ * has been emptied.
+ */
+ISR(DEBUG_USART_DRE_vect)
+{
+	uint8_t t = debug_tail;
+	if (t == debug_head)
+	{
+		DEBUG_USART.CTRLA = USART_DREINTLVL_OFF_gc;
+	}
+	else
+	{
+		DEBUG_USART.DATA = debug_ring[t++];
+		debug_tail = t;
+	}
+}
+
+#endif /* DEBUGGING || TRACING */
@@ -21,26 +21,41 @@
 #define DEBUG_H
 
 #include <avr/io.h>
+#include "ring.h"
+
+/*
+ * Debugging output goes through the output ring in ring.h, so debug() never
+ * waits for the USART.
+ */
 
 /*
  * Some constants for spitting out the current position of work, i.e. the
  * printf() of the embedded world. I should really get a proper debugging
  * rig at some point...
  */
+#define DEBUG_OUTPUT_DROPPED                      0x0F
 #define DEBUG_MAIN_MEM_INIT_FOLLOWS               0x10
 #define DEBUG_MAIN_ACTIVE_NO_TARGET               0x11
+#define DEBUG_MAIN_CARD_RETRY                     0x12
+#define DEBUG_MAIN_TARGET_CONFLICT                0x13
 #define DEBUG_MAIN_BAD_CSD_REQUEST                0x1A
+#define DEBUG_MAIN_FLIGHT_RECORDER                0x1B
+#define DEBUG_MAIN_BAD_SCR_REQUEST                0x1C
 #define DEBUG_CONFIG_FOUND                        0x1D
 #define DEBUG_CONFIG_NOT_FOUND                    0x1E
 #define DEBUG_CONFIG_START                        0x1F
 #define DEBUG_MEM_NOT_READY                       0x20
 #define DEBUG_MEM_CMD_REJECTED                    0x21
 #define DEBUG_MEM_BAD_DATA_TOKEN                  0x22
+#define DEBUG_MEM_CRC_SELF_TEST                   0x23
+#define DEBUG_MEM_CARD_BUSY                       0x24
 #define DEBUG_LOGIC_BAD_LUN                       0x50
 #define DEBUG_LOGIC_EXTENDED_MESSAGE              0x51
 #define DEBUG_LOGIC_BAD_CMD                       0x52
 #define DEBUG_LOGIC_BAD_CMD_ARGS                  0x53
 #define DEBUG_LOGIC_MESSAGE                       0x5F
+#define DEBUG_HDD_WRITE_SAME                      0x79
+#define DEBUG_HDD_SYNC_CACHE                      0x7A
 #define DEBUG_HDD_MODE_SENSE                      0x7B
 #define DEBUG_HDD_MODE_SELECT                     0x7C
 #define DEBUG_HDD_READ_BUFFER                     0x7D
@@ -50,17 +65,32 @@
 #define DEBUG_HDD_READ_OKAY                       0x81
 #define DEBUG_HDD_WRITE_STARTING                  0x82
 #define DEBUG_HDD_WRITE_OKAY                      0x83
+#define DEBUG_HDD_CACHE_STAGED                    0x84
+#define DEBUG_HDD_CACHE_FLUSH                     0x85
 #define DEBUG_HDD_READ_SINGLE                     0x86
 #define DEBUG_HDD_READ_MULTIPLE                   0x87
 #define DEBUG_HDD_WRITE_SINGLE                    0x88
 #define DEBUG_HDD_WRITE_MULTIPLE                  0x89
 #define DEBUG_HDD_PACKET_START                    0x8A
 #define DEBUG_HDD_PACKET_END                      0x8B
+#define DEBUG_HDD_IMAGE_FOUND                     0x8C
+#define DEBUG_HDD_IMAGE_UNUSABLE                  0x8D
 #define DEBUG_HDD_NOT_READY                       0x90
 #define DEBUG_HDD_OP_INVALID                      0x91
 #define DEBUG_HDD_MEM_CMD_REJECTED                0x92
 #define DEBUG_HDD_MEM_BAD_HEADER                  0x93
 #define DEBUG_HDD_MEM_CARD_BUSY                   0x94
+#define DEBUG_HDD_PRE_ERASE_REJECTED              0x95
+#define DEBUG_HDD_CARD_AU                         0x96
+#define DEBUG_HDD_ERASE                           0x97
+#define DEBUG_HDD_MISCOMPARE                      0x98
+#define DEBUG_HDD_CRC_READ_FAILED                 0x99
+#define DEBUG_HDD_CRC_WRITE_FAILED                0x9A
+#define DEBUG_HDD_CARD_LOST                       0x9B
+#define DEBUG_HDD_PROBE_FAILED                    0x9C
+#define DEBUG_HDD_CACHE_OTHER_CARD                0x9D
+#define DEBUG_HDD_VOLUME_TABLE                    0x9E
+#define DEBUG_HDD_VOLUME_INVALID                  0x9F
 #define DEBUG_LINK_TX_REQUESTED                   0xA0
 #define DEBUG_LINK_INQUIRY                        0xA8
 #define DEBUG_LINK_RX_ASKING_RESEL                0xB0
@@ -71,6 +101,8 @@
 #define DEBUG_LINK_RX_ENDING                      0xB5
 #define DEBUG_LINK_RX_FILTER_UNICAST              0xBA
 #define DEBUG_LINK_RX_FILTER_MULTICAST            0xBB
+#define DEBUG_ENC_PHY_BUSY                        0xC0
+#define DEBUG_ENC_PHY_SCANNING                    0xC1
 #define DEBUG_PHY_RESELECT_REQUESTED              0xD0
 #define DEBUG_PHY_RESELECT_STARTING               0xD1
 #define DEBUG_PHY_RESELECT_ARB_LOST               0xD2
@@ -82,44 +114,146 @@
 #define led_on()              LED_PORT.DIR |= LED_PIN;
 #define led_off()             LED_PORT.DIR &= ~LED_PIN;
 
-// alias for use below
-#define debug_enabled()       (GLOBAL_CONFIG_REGISTER & GLOBAL_FLAG_DEBUG)
+/*
+ * ============================================================================
+ *  
+ *   CATEGORIES AND LEVELS
+ * 
+ * ============================================================================
+ * 
+ * Each debugging point belongs to one category and has one level. A point is
+ * compiled in only if its level is at or below the level chosen for its
+ * category at build time, and produces output only if its category is set in
+ * DEBUG_MASK_REGISTER at runtime.
+ * 
+ * Levels are:
+ * 
+ * 0) Nothing: all points in the category are removed.
+ * 1) Errors that will be reported back to the initiator.
+ * 2) Information about uncommon commands and state changes.
+ * 3) Verbose output from the read/write/packet paths, once or more per
+ *    command. This will overrun the ring under sustained load.
+ * 
+ * The build level for each category defaults to DEBUG_LEVEL, which is 2 when
+ * DEBUGGING is defined and 0 otherwise, and can be set individually with
+ * options like -DDEBUG_LEVEL_HDD=3. Running "make sizes" builds the firmware
+ * at each global level and reports the size of each.
+ * 
+ * A point that is compiled out costs nothing. A point that is compiled in
+ * costs a SBIS test against the GPIO register (one or two cycles, 2 bytes of
+ * flash) plus the ring write when the category is enabled: about 30 cycles
+ * and a call for debug_put(), or an inlined 4 byte write for tracing builds.
+ * The flash cost is around 8 bytes per point for plain debugging.
+ */
+#define DEBUG_CAT_PHY               _BV(0)
+#define DEBUG_CAT_LOGIC             _BV(1)
+#define DEBUG_CAT_HDD               _BV(2)
+#define DEBUG_CAT_LINK              _BV(3)
+#define DEBUG_CAT_MEM               _BV(4)
+#define DEBUG_CAT_ENC               _BV(5)
+#define DEBUG_CAT_MAIN              _BV(6)
+
+#define DEBUG_ERROR                 1
+#define DEBUG_INFO                  2
+#define DEBUG_VERBOSE               3
+
+#ifndef DEBUG_LEVEL
+	#ifdef DEBUGGING
+		#define DEBUG_LEVEL         DEBUG_INFO
+	#else
+		#define DEBUG_LEVEL         0
+	#endif
+#endif
+#ifndef DEBUGGING
+	// nowhere for output to go, so force everything off
+	#undef DEBUG_LEVEL
+	#define DEBUG_LEVEL             0
+	#undef DEBUG_LEVEL_PHY
+	#undef DEBUG_LEVEL_LOGIC
+	#undef DEBUG_LEVEL_HDD
+	#undef DEBUG_LEVEL_LINK
+	#undef DEBUG_LEVEL_MEM
+	#undef DEBUG_LEVEL_ENC
+	#undef DEBUG_LEVEL_MAIN
+#endif
+#ifndef DEBUG_LEVEL_PHY
+	#define DEBUG_LEVEL_PHY         DEBUG_LEVEL
+#endif
+#ifndef DEBUG_LEVEL_LOGIC
+	#define DEBUG_LEVEL_LOGIC       DEBUG_LEVEL
+#endif
+#ifndef DEBUG_LEVEL_HDD
+	#define DEBUG_LEVEL_HDD         DEBUG_LEVEL
+#endif
+#ifndef DEBUG_LEVEL_LINK
+	#define DEBUG_LEVEL_LINK        DEBUG_LEVEL
+#endif
+#ifndef DEBUG_LEVEL_MEM
+	#define DEBUG_LEVEL_MEM         DEBUG_LEVEL
+#endif
+#ifndef DEBUG_LEVEL_ENC
+	#define DEBUG_LEVEL_ENC         DEBUG_LEVEL
+#endif
+#ifndef DEBUG_LEVEL_MAIN
+	#define DEBUG_LEVEL_MAIN        DEBUG_LEVEL
+#endif
+
+/*
+ * Sends one or two bytes of debugging output for the given category and level,
+ * like debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_READ_OKAY). The level must be a
+ * constant so disabled points fold away.
+ */
+#define debug(cat, level, v) \
+	do { \
+		if (DEBUG_LEVEL_##cat >= (level) \
+				&& (DEBUG_MASK_REGISTER & DEBUG_CAT_##cat)) \
+			debug_out(v); \
+	} while (0)
+#define debug_dual(cat, level, v, p) \
+	do { \
+		if (DEBUG_LEVEL_##cat >= (level) \
+				&& (DEBUG_MASK_REGISTER & DEBUG_CAT_##cat)) \
+		{ \
+			debug_out(v); \
+			debug_out(p); \
+		} \
+	} while (0)
 
-#ifdef DEBUGGING
-static inline __attribute__((always_inline)) void debug(uint8_t v)
+/*
+ * Provides the build level of each category, in bit order, for reporting to
+ * the host. The array must be at least 7 bytes long.
+ */
+#define debug_levels(b) \
+	do { \
+		(b)[0] = DEBUG_LEVEL_PHY; \
+		(b)[1] = DEBUG_LEVEL_LOGIC; \
+		(b)[2] = DEBUG_LEVEL_HDD; \
+		(b)[3] = DEBUG_LEVEL_LINK; \
+		(b)[4] = DEBUG_LEVEL_MEM; \
+		(b)[5] = DEBUG_LEVEL_ENC; \
+		(b)[6] = DEBUG_LEVEL_MAIN; \
+	} while (0)
+
+#if defined(DEBUGGING) && defined(TRACING)
+// the ring only carries trace records, so send through that instead
+static inline __attribute__((always_inline)) void debug_out(uint8_t v)
 {
-	if (debug_enabled())
-	{
-		while (! (DEBUG_USART.STATUS & USART_DREIF_bm));
-		DEBUG_USART.DATA = v;
-	}
+	debug_record(TRACE_DEBUG, v);
 }
-static inline __attribute__((always_inline)) void debug_dual(
-		uint8_t v, uint8_t p)
+#elif defined(DEBUGGING)
+static inline __attribute__((always_inline)) void debug_out(uint8_t v)
 {
-	if (debug_enabled())
-	{
-		while (! (DEBUG_USART.STATUS & USART_DREIF_bm));
-		DEBUG_USART.DATA = v;
-		while (! (DEBUG_USART.STATUS & USART_DREIF_bm));
-		DEBUG_USART.DATA = p;
-	}
+	debug_put(v);
 }
 #else
 // silence the compiler when debugging is turned off
-static inline __attribute__((always_inline)) void debug(
+static inline __attribute__((always_inline)) void debug_out(
 		__attribute__((unused)) uint8_t v)
 {
 	// do nothing
 }
-static inline __attribute__((always_inline)) void debug(
-		__attribute__((unused)) uint8_t v, __attribute__((unused)) uint8_t p)
-{
-	// do nothing
-}
 #endif
 
-#endif /* DEBUG_H */
 static inline __attribute__((always_inline)) void jgk_debug(uint8_t v)
 {
 	if (0)
@@ -127,4 +261,6 @@ static inline __attribute__((always_inline)) void jgk_debug(uint8_t v)
 		while (! (DEBUG_USART.STATUS & USART_DREIF_bm));
 		DEBUG_USART.DATA = v;
 	}
-}
\ No newline at end of file
+}
+
+#endif /* DEBUG_H */
\ No newline at end of file
@@ -19,6 +19,7 @@
 
 #include <util/delay.h>
 #include "config.h"
+#include "debug.h"
 #include "enc.h"
 
 #ifdef ENC_ENABLED
@@ -38,13 +39,13 @@ static uint8_t bank;
 static uint8_t enc_exchange_byte(uint8_t op, uint8_t send)
 {
 	ENC_PORT.OUTCLR = ENC_PIN_CS;
-	ENC_USART.DATA = op;
-	ENC_USART.DATA = send;
+	usart_tx(ENC_USART, op);
+	usart_tx(ENC_USART, send);
 
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-	ENC_USART.DATA; // corresponds to command, ignored
+	usart_rx(ENC_USART); // corresponds to command, ignored
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-	uint8_t received = ENC_USART.DATA;
+	uint8_t received = usart_rx(ENC_USART);
 
 	ENC_PORT.OUTSET = ENC_PIN_CS;
 
@@ -59,16 +60,16 @@ static uint8_t enc_exchange_byte(uint8_t op, uint8_t send)
 static uint8_t enc_exchange_special(uint8_t op)
 {
 	ENC_PORT.OUTCLR = ENC_PIN_CS;
-	ENC_USART.DATA = op;
-	ENC_USART.DATA = 0; // dummy byte
+	usart_tx(ENC_USART, op);
+	usart_tx(ENC_USART, 0); // dummy byte
 
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-	ENC_USART.DATA; // corresponds to command, ignored
-	ENC_USART.DATA = 0; // clocks for data response
+	usart_rx(ENC_USART); // corresponds to command, ignored
+	usart_tx(ENC_USART, 0); // clocks for data response
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-	ENC_USART.DATA; // corresponds to dummy, ignored
+	usart_rx(ENC_USART); // corresponds to dummy, ignored
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-	uint8_t received = ENC_USART.DATA; // actual data, finally
+	uint8_t received = usart_rx(ENC_USART); // actual data, finally
 
 	ENC_PORT.OUTSET = ENC_PIN_CS;
 
@@ -270,10 +271,12 @@ uint8_t enc_phy_read(uint8_t phy_register, uint16_t* response)
 			(ENC_MISTAT & ENC_REG_MASK) | ENC_OP_RCR);
 	if (r & ENC_BUSY_bm)
 	{
+		debug_dual(ENC, DEBUG_INFO, DEBUG_ENC_PHY_BUSY, phy_register);
 		return ENC_ERR_PHYBSY;
 	}
 	if (r & ENC_SCAN_bm)
 	{
+		debug_dual(ENC, DEBUG_INFO, DEBUG_ENC_PHY_SCANNING, phy_register);
 		return ENC_ERR_PHYSCANNING;
 	}
 
@@ -329,10 +332,12 @@ uint8_t enc_phy_write(uint8_t phy_register, uint16_t value)
 			(ENC_MISTAT & ENC_REG_MASK) | ENC_OP_RCR);
 	if (r & ENC_BUSY_bm)
 	{
+		debug_dual(ENC, DEBUG_INFO, DEBUG_ENC_PHY_BUSY, phy_register);
 		return ENC_ERR_PHYBSY;
 	}
 	if (r & ENC_SCAN_bm)
 	{
+		debug_dual(ENC, DEBUG_INFO, DEBUG_ENC_PHY_SCANNING, phy_register);
 		return ENC_ERR_PHYSCANNING;
 	}
 
@@ -373,10 +378,12 @@ uint8_t enc_phy_scan(uint8_t phy_register)
 			(ENC_MISTAT & ENC_REG_MASK) | ENC_OP_RCR);
 	if (r & ENC_BUSY_bm)
 	{
+		debug_dual(ENC, DEBUG_INFO, DEBUG_ENC_PHY_BUSY, phy_register);
 		return ENC_ERR_PHYBSY;
 	}
 	if (r & ENC_SCAN_bm)
 	{
+		debug_dual(ENC, DEBUG_INFO, DEBUG_ENC_PHY_SCANNING, phy_register);
 		return ENC_ERR_PHYSCANNING;
 	}
 
@@ -401,14 +408,14 @@ uint8_t enc_phy_scan(uint8_t phy_register)
 void enc_read_start(void)
 {
 	ENC_PORT.OUTCLR = ENC_PIN_CS;
-	ENC_USART.DATA = ENC_OP_RBM;
+	usart_tx(ENC_USART, ENC_OP_RBM);
 }
 
 void enc_write_start(void)
 {
 	ENC_USART.CTRLB &= ~USART_RXEN_bm;
 	ENC_PORT.OUTCLR = ENC_PIN_CS;
-	ENC_USART.DATA = ENC_OP_WBM;
+	usart_tx(ENC_USART, ENC_OP_WBM);
 }
 
 void enc_data_end(void)
@@ -418,7 +425,7 @@ void enc_data_end(void)
 	{
 		while (ENC_USART.STATUS & USART_RXCIF_bm)
 		{
-			ENC_USART.DATA;
+			usart_rx(ENC_USART);
 		}
 	}
 	else
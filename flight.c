@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include "config.h"
+#include "debug.h"
+#include "flight.h"
+
+#if FLIGHT_BYTES > 128 || (FLIGHT_BYTES & (FLIGHT_BYTES - 1))
+	#error "FLIGHT_LENGTH must be a power of two no larger than 32"
+#endif
+
+// marks the ring as having been set up by a previous session
+#define FLIGHT_MAGIC            0x5C2E
+
+FlightLog flight_log __attribute__((section(".noinit")));
+static uint8_t saved[FLIGHT_SAVED_LENGTH] __attribute__((section(".noinit")));
+
+void flight_init(uint8_t rst_stat)
+{
+	uint8_t* r = flight_log.records;
+	uint8_t valid = flight_log.magic == FLIGHT_MAGIC
+			&& (flight_log.head & (FLIGHT_RECORD_LENGTH - 1)) == 0
+			&& flight_log.head < FLIGHT_BYTES
+			&& ! (rst_stat & (RST_PORF_bm | RST_BORF_bm));
+
+	if (! valid)
+	{
+		for (uint8_t i = 0; i < FLIGHT_SAVED_LENGTH; i++)
+		{
+			saved[i] = 0;
+		}
+	}
+	else
+	{
+		/*
+		 * Count the records in the ring: unused slots have an ID of zero. A
+		 * session that only recorded its own startup isn't worth keeping.
+		 */
+		uint8_t count = 0;
+		for (uint8_t i = 0; i < FLIGHT_BYTES; i += FLIGHT_RECORD_LENGTH)
+		{
+			if (r[i]) count++;
+		}
+		if (count > 1)
+		{
+			saved[0] = rst_stat;
+			saved[1] = count;
+			uint8_t* s = saved + FLIGHT_HEADER_LENGTH;
+			uint8_t h = flight_log.head;
+			for (uint8_t i = 0; i < FLIGHT_BYTES; i++)
+			{
+				// oldest first, skipping unused slots
+				if (r[h & ~(FLIGHT_RECORD_LENGTH - 1)])
+				{
+					*s++ = r[h];
+				}
+				h = (h + 1) & (FLIGHT_BYTES - 1);
+			}
+		}
+	}
+
+	for (uint8_t i = 0; i < FLIGHT_BYTES; i++)
+	{
+		r[i] = 0;
+	}
+	flight_log.head = 0;
+	flight_log.magic = FLIGHT_MAGIC;
+	flight(TRACE_BOOT, rst_stat);
+}
+
+uint8_t* flight_saved(void)
+{
+	return saved;
+}
+
+void flight_dump(void)
+{
+	if (saved[1] == 0) return;
+	uint8_t length = FLIGHT_HEADER_LENGTH
+			+ saved[1] * FLIGHT_RECORD_LENGTH;
+
+	debug(MAIN, DEBUG_INFO, DEBUG_MAIN_FLIGHT_RECORDER);
+	for (uint8_t i = 0; i < length; i++)
+	{
+		debug(MAIN, DEBUG_INFO, saved[i]);
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <avr/io.h>
+#include "config.h"
+#include "init.h"
+#include "ring.h"
+
+/*
+ * Flight recorder for figuring out what the device was doing before a reset.
+ * 
+ * The last FLIGHT_LENGTH selections, commands, phase changes, status bytes
+ * and messages are always kept in a small ring in the .noinit section, which
+ * is not cleared by a software reset. Hangs on the bus usually end with the
+ * host asserting /RST, which resets the MCU, so at the next startup the ring
+ * still holds the events leading up to the hang.
+ * 
+ * Records use the same 4 byte format and event IDs as the trace system (see
+ * ring.h), so tools/tracedecode.cpp can decode them.
+ * 
+ * During startup, flight_init() moves the previous ring into a saved copy
+ * ordered from oldest to newest, unless that ring holds nothing but its own
+ * startup event, so repeated resets don't wipe out the interesting session.
+ * The saved copy can be fetched with the vendor READ BUFFER command, and is
+ * written to the debug port at startup when debugging is enabled. After a
+ * power-on or brown-out reset the SRAM contents are meaningless and both
+ * copies are cleared.
+ * 
+ * The saved copy is provided with a 2 byte header: the RST.STATUS value for
+ * the reset that ended the session, then the number of records that follow.
+ */
+#define FLIGHT_RECORD_LENGTH    TRACE_RECORD_LENGTH
+#define FLIGHT_HEADER_LENGTH    2
+#define FLIGHT_BYTES            (FLIGHT_LENGTH * FLIGHT_RECORD_LENGTH)
+#define FLIGHT_SAVED_LENGTH     (FLIGHT_HEADER_LENGTH + FLIGHT_BYTES)
+
+typedef struct FlightLog
+{
+	uint16_t magic;
+	uint8_t head;
+	uint8_t records[FLIGHT_BYTES];
+} FlightLog;
+extern FlightLog flight_log;
+
+/*
+ * Called once during startup with the RST.STATUS value, before any events are
+ * recorded. This saves the previous session as described above, then starts
+ * a new session with a TRACE_BOOT event.
+ */
+void flight_init(uint8_t rst_stat);
+
+/*
+ * Provides the saved copy of the previous session, with the header described
+ * above, as FLIGHT_SAVED_LENGTH bytes.
+ */
+uint8_t* flight_saved(void);
+
+/*
+ * Writes the saved copy to the debug port, if there is anything in it.
+ */
+void flight_dump(void);
+
+/*
+ * Records an event. This is always compiled in and costs about a dozen
+ * instructions, so it is only used at the start of each phase and command,
+ * not within data transfers.
+ */
+static inline __attribute__((always_inline)) void flight(
+		uint8_t id, uint8_t arg)
+{
+	uint16_t now = system_time();
+	uint8_t h = flight_log.head;
+	flight_log.records[h] = id;
+	flight_log.records[h + 1] = arg;
+	flight_log.records[h + 2] = (uint8_t) now;
+	flight_log.records[h + 3] = (uint8_t) (now >> 8);
+	flight_log.head = (h + FLIGHT_RECORD_LENGTH) & (FLIGHT_BYTES - 1);
+}
+
+#endif /* FLIGHT_H */
@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <avr/pgmspace.h>
+#include "config.h"
+#include "mem.h"
+#include "fs.h"
+
+#ifdef HDD_ENABLED
+
+#define FS_TYPE_NONE            0
+#define FS_TYPE_FAT32           1
+#define FS_TYPE_EXFAT           2
+
+/*
+ * Geometry of the filesystem being searched. Block numbers are on the card,
+ * including the start of the partition.
+ */
+static uint32_t fs_fat;         // first block of the (first) FAT
+static uint32_t fs_heap;        // first block of cluster 2
+static uint32_t fs_clusters;    // number of clusters after that
+static uint32_t fs_root;        // first cluster of the root directory
+static uint8_t fs_shift;        // log2 of the blocks per cluster
+
+/*
+ * The card block currently in the buffer, so walking the FAT only reads each
+ * FAT block once, the number of blocks read so far, and whether any of those
+ * reads failed.
+ */
+static uint32_t fs_lba;
+static uint16_t fs_reads;
+static uint8_t fs_failed;
+
+static const uint8_t fs_fat32_id[] PROGMEM = "FAT32   ";
+static const uint8_t fs_exfat_id[] PROGMEM = "EXFAT   ";
+static const uint8_t fs_short_name[] PROGMEM = "SCUZNET IMG";
+static const uint8_t fs_long_name[] PROGMEM = "SCUZNET.IMG";
+#define FS_NAME_LENGTH          11
+
+static uint16_t fs_get16(uint8_t* data)
+{
+	return ((uint16_t) data[1] << 8) | data[0];
+}
+
+static uint32_t fs_get32(uint8_t* data)
+{
+	return ((uint32_t) data[3] << 24)
+			| ((uint32_t) data[2] << 16)
+			| ((uint32_t) data[1] << 8)
+			| data[0];
+}
+
+static uint8_t fs_match(uint8_t* data, const uint8_t* id, uint8_t length)
+{
+	for (uint8_t i = 0; i < length; i++)
+	{
+		if (data[i] != pgm_read_byte(&(id[i]))) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Reads the given card block into the buffer, unless it is already there.
+ */
+static uint8_t fs_read(uint32_t lba, uint8_t* buffer)
+{
+	if (lba == fs_lba) return 1;
+	if (fs_reads < 0xFFFF)
+	{
+		fs_reads++;
+	}
+	if (! mem_read_block(lba, buffer))
+	{
+		fs_lba = 0xFFFFFFFF;
+		fs_failed = 1;
+		return 0;
+	}
+	fs_lba = lba;
+	return 1;
+}
+
+#define fs_valid(c)             ((c) >= 2 && (c) - 2 < fs_clusters)
+#define fs_cluster_block(c)     (fs_heap + (((c) - 2) << fs_shift))
+
+/*
+ * Provides the cluster after the given one from the FAT, or 0 if it is the
+ * last one, or the FAT could not be read. The upper 4 bits of FAT32 entries
+ * are reserved; exFAT uses all 32, but no card has enough clusters to need
+ * them, and the end-of-chain marker is still out of range after masking.
+ */
+static uint32_t fs_next(uint32_t cluster, uint8_t* buffer)
+{
+	if (! fs_read(fs_fat + (cluster >> 7), buffer)) return 0;
+	uint32_t next = fs_get32(buffer + (((uint16_t) cluster & 0x7F) << 2))
+			& 0x0FFFFFFF;
+	if (! fs_valid(next)) return 0;
+	return next;
+}
+
+/*
+ * Checks if the block in the buffer is the boot sector of a filesystem we
+ * can read, starting at the given card block, and if so sets up the
+ * geometry from it.
+ */
+static uint8_t fs_mount(uint8_t* vbr, uint32_t part)
+{
+	if (vbr[510] != 0x55 || vbr[511] != 0xAA) return FS_TYPE_NONE;
+
+	if (fs_match(vbr + 3, fs_exfat_id, 8))
+	{
+		if (vbr[108] != 9 || vbr[109] > 15) return FS_TYPE_NONE;
+		fs_fat = part + fs_get32(vbr + 80);
+		fs_heap = part + fs_get32(vbr + 88);
+		fs_clusters = fs_get32(vbr + 92);
+		fs_root = fs_get32(vbr + 96);
+		fs_shift = vbr[109];
+		return FS_TYPE_EXFAT;
+	}
+	else if (fs_match(vbr + 82, fs_fat32_id, 8))
+	{
+		uint8_t spc = vbr[13];
+		if (fs_get16(vbr + 11) != 512 || spc == 0 || (spc & (spc - 1)))
+		{
+			return FS_TYPE_NONE;
+		}
+		uint32_t reserved = fs_get16(vbr + 14);
+		uint32_t data = reserved + vbr[16] * fs_get32(vbr + 36);
+		uint32_t total = fs_get32(vbr + 32);
+		if (total <= data) return FS_TYPE_NONE;
+
+		fs_shift = 0;
+		while (spc > 1)
+		{
+			spc >>= 1;
+			fs_shift++;
+		}
+		fs_fat = part + reserved;
+		fs_heap = part + data;
+		fs_clusters = (total - data) >> fs_shift;
+		fs_root = fs_get32(vbr + 44);
+		return FS_TYPE_FAT32;
+	}
+	return FS_TYPE_NONE;
+}
+
+/*
+ * Compares an exFAT file name entry against the image name. exFAT names are
+ * in UTF-16 and matched without regard to case.
+ */
+static uint8_t fs_match_long(uint8_t* name)
+{
+	for (uint8_t i = 0; i < FS_NAME_LENGTH; i++)
+	{
+		uint8_t c = name[i << 1];
+		if (name[(i << 1) + 1] != 0) return 0;
+		if (c >= 'a' && c <= 'z')
+		{
+			c -= 'a' - 'A';
+		}
+		if (c != pgm_read_byte(&(fs_long_name[i]))) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Where the search is between calls to fs_find_step():
+ * 
+ * - FS_STEP_PARTITION: looking for a filesystem in the partitions listed in
+ *   fs_parts, with fs_part the next one to try.
+ * - FS_STEP_DIRECTORY: reading block fs_block of root directory cluster
+ *   fs_cluster, which is the fs_count'th cluster of the directory. fs_entry
+ *   tracks exFAT directory entry sets that cross into the next block.
+ * - FS_STEP_NEXT: moving on to the next cluster of the root directory.
+ * - FS_STEP_CONTIGUOUS: checking the FAT entries of the image from cluster
+ *   fs_cluster up to (but not including) fs_count.
+ */
+#define FS_STEP_PARTITION       0
+#define FS_STEP_DIRECTORY       1
+#define FS_STEP_NEXT            2
+#define FS_STEP_CONTIGUOUS      3
+static uint8_t fs_step;
+static uint8_t fs_type;
+static uint8_t fs_part;
+static uint32_t fs_parts[4];
+static uint32_t fs_cluster;
+static uint32_t fs_count;
+static uint16_t fs_block;
+static uint8_t fs_entry;
+
+/*
+ * Looks through the root directory block in the buffer for the image file.
+ * If found, this leaves the first cluster in the start field of the image
+ * and its length in the blocks field, and returns 1 if the file is known to
+ * be contiguous or 2 if the FAT needs to be checked. Returns 3 if the end of
+ * the directory was reached, or 0 if the next block should be checked.
+ */
+static uint8_t fs_search(uint8_t* buffer, FsImage* image)
+{
+	for (uint16_t i = 0; i < 512; i += 32)
+	{
+		uint8_t* e = buffer + i;
+		if (e[0] == 0x00) return 3;
+
+		if (fs_type == FS_TYPE_FAT32)
+		{
+			// skip deleted entries, long names, labels and directories
+			if (e[0] == 0xE5 || (e[11] & 0x18)) continue;
+			if (fs_match(e, fs_short_name, FS_NAME_LENGTH))
+			{
+				image->start = ((uint32_t) fs_get16(e + 20) << 16)
+						| fs_get16(e + 26);
+				image->blocks = fs_get32(e + 28) >> 9;
+				return 2;
+			}
+		}
+		else if (e[0] == 0x85)
+		{
+			// file entry, which must not be a directory
+			fs_entry = (e[4] & 0x10) ? 0 : 1;
+		}
+		else if (e[0] == 0xC0 && fs_entry == 1)
+		{
+			// stream extension, with the name length and location
+			uint32_t high = fs_get32(e + 28);
+			fs_entry = 0;
+			if (e[3] == FS_NAME_LENGTH && high < 512)
+			{
+				image->start = fs_get32(e + 20);
+				image->blocks = (fs_get32(e + 24) >> 9) | (high << 23);
+				fs_entry = (e[1] & 0x02) ? 2 : 3;
+			}
+		}
+		else if (e[0] == 0xC1 && fs_entry >= 2)
+		{
+			// first name entry, which holds 15 characters
+			if (fs_match_long(e + 2)) return fs_entry - 1;
+			fs_entry = 0;
+		}
+		else
+		{
+			fs_entry = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Starts reading the root directory of the filesystem just mounted.
+ */
+static void fs_directory(void)
+{
+	fs_step = FS_STEP_DIRECTORY;
+	fs_cluster = fs_root;
+	fs_count = 0;
+	fs_block = 0;
+	fs_entry = 0;
+}
+
+/*
+ * Checks the image that fs_search() found, given what it returned, and sets
+ * up the contiguity check if one is needed.
+ */
+static uint8_t fs_found(uint8_t found, FsImage* image)
+{
+	uint32_t first = image->start;
+	uint32_t count = ((image->blocks - 1) >> fs_shift) + 1;
+	if (image->blocks == 0
+			|| ! fs_valid(first)
+			|| count > fs_clusters - (first - 2))
+	{
+		return FS_IMAGE_INVALID;
+	}
+	image->start = fs_cluster_block(first);
+	if (found == 1) return FS_IMAGE_FOUND;
+
+	// each cluster has to point to the one right after it
+	fs_step = FS_STEP_CONTIGUOUS;
+	fs_cluster = first;
+	fs_count = first + count - 1;
+	return FS_IMAGE_BUSY;
+}
+
+void fs_find_start(uint8_t* buffer, FsImage* image)
+{
+	fs_lba = 0;
+	fs_reads = 0;
+	fs_failed = 0;
+	image->start = 0;
+	image->blocks = 0;
+	image->reads = 0;
+
+	// either the whole card or one of the MBR partitions
+	fs_type = fs_mount(buffer, 0);
+	fs_step = FS_STEP_PARTITION;
+	fs_part = 4;
+	if (fs_type != FS_TYPE_NONE)
+	{
+		fs_directory();
+	}
+	else if (buffer[510] == 0x55 && buffer[511] == 0xAA)
+	{
+		for (uint8_t i = 0; i < 4; i++)
+		{
+			uint8_t* p = buffer + 446 + (i << 4);
+			if (p[4] == 0x07 || p[4] == 0x0B || p[4] == 0x0C)
+			{
+				fs_parts[i] = fs_get32(p + 8);
+			}
+			else
+			{
+				fs_parts[i] = 0;
+			}
+		}
+		fs_part = 0;
+	}
+}
+
+uint8_t fs_find_step(uint8_t* buffer, FsImage* image)
+{
+	uint8_t result = FS_IMAGE_BUSY;
+	if (fs_step == FS_STEP_PARTITION)
+	{
+		while (fs_part < 4 && fs_parts[fs_part] == 0)
+		{
+			fs_part++;
+		}
+		if (fs_part >= 4)
+		{
+			result = FS_IMAGE_NONE;
+		}
+		else
+		{
+			uint32_t part = fs_parts[fs_part++];
+			if (fs_read(part, buffer))
+			{
+				fs_type = fs_mount(buffer, part);
+				if (fs_type != FS_TYPE_NONE)
+				{
+					fs_directory();
+				}
+			}
+		}
+	}
+	else if (fs_step == FS_STEP_DIRECTORY)
+	{
+		if (fs_count >= fs_clusters || ! fs_valid(fs_cluster))
+		{
+			result = FS_IMAGE_NONE;
+		}
+		else if (fs_read(fs_cluster_block(fs_cluster) + fs_block, buffer))
+		{
+			uint8_t found = fs_search(buffer, image);
+			if (found == 3)
+			{
+				result = FS_IMAGE_NONE;
+			}
+			else if (found)
+			{
+				result = fs_found(found, image);
+			}
+			else if (++fs_block >= (1U << fs_shift))
+			{
+				fs_step = FS_STEP_NEXT;
+			}
+		}
+	}
+	else if (fs_step == FS_STEP_NEXT)
+	{
+		fs_cluster = fs_next(fs_cluster, buffer);
+		fs_count++;
+		fs_block = 0;
+		fs_step = FS_STEP_DIRECTORY;
+	}
+	else
+	{
+		// only the entries in one FAT block are checked each time
+		uint32_t end = (fs_cluster | 0x7F) + 1;
+		if (end > fs_count)
+		{
+			end = fs_count;
+		}
+		while (result == FS_IMAGE_BUSY && fs_cluster < end)
+		{
+			if (fs_next(fs_cluster, buffer) != fs_cluster + 1)
+			{
+				result = FS_IMAGE_FRAGMENTED;
+			}
+			fs_cluster++;
+		}
+		if (fs_cluster >= fs_count && result == FS_IMAGE_BUSY)
+		{
+			result = FS_IMAGE_FOUND;
+		}
+	}
+
+	// a failed read may have hidden the image, or the filesystem itself
+	if (fs_failed)
+	{
+		result = FS_IMAGE_ERROR;
+	}
+	if (result != FS_IMAGE_BUSY && result != FS_IMAGE_FOUND)
+	{
+		image->start = 0;
+		image->blocks = 0;
+	}
+	image->reads = fs_reads;
+	return result;
+}
+
+#endif /* HDD_ENABLED */
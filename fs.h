@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FS_H
+#define FS_H
+
+#include <avr/io.h>
+#include "config.h"
+
+#ifdef HDD_ENABLED
+
+/*
+ * Minimal FAT32 and exFAT reader, used to find a disk image stored as a file
+ * on the memory card so it can be served instead of the raw card.
+ * 
+ * The filesystem may either fill the card or be in one of the four primary
+ * partitions of an MBR partition table; the first usable one is taken. The
+ * image must be called SCUZNET.IMG, in the root directory, and must be
+ * contiguous on the card, which is normally the case for a file copied onto
+ * a freshly formatted card. This lets the image be described by its first
+ * block and length alone, so commands are translated to card blocks by a
+ * single addition, just as for the raw card, and the FAT is never read after
+ * the image has been found.
+ * 
+ * Only 512 byte sectors are supported, which is all SD cards use.
+ */
+typedef struct FsImage_t {
+	uint32_t start;   // first card block of the image
+	uint32_t blocks;  // length of the image, in blocks
+	uint16_t reads;   // card blocks read while looking, saturating
+} FsImage;
+
+/*
+ * Results from fs_find_step(). An image that was found but is fragmented,
+ * or whose directory entry does not make sense, is reported as such so it is
+ * not mistaken for a card without an image. If any card read fails, the
+ * result is FS_IMAGE_ERROR, since it can't be told if there is an image.
+ */
+#define FS_IMAGE_NONE           0
+#define FS_IMAGE_FOUND          1
+#define FS_IMAGE_FRAGMENTED     2
+#define FS_IMAGE_INVALID        3
+#define FS_IMAGE_ERROR          4
+#define FS_IMAGE_BUSY           0xFF
+
+/*
+ * Starts looking for the image file, given the first block of the card in a
+ * 512 byte buffer, which is then used as working space.
+ */
+void fs_find_start(uint8_t* buffer, FsImage* image);
+
+/*
+ * Continues looking for the image file, given the same buffer and image
+ * structure as fs_find_start(), neither of which may be touched by anything
+ * else until this gives back a result other than FS_IMAGE_BUSY. Each call
+ * reads at most one card block, so the search can be spread out around
+ * other work.
+ * 
+ * The image structure is filled in with the location of the image if it was
+ * found, and with the number of blocks read in any case. Checking that the
+ * image is contiguous takes one read per 128 clusters unless the filesystem
+ * already records it (exFAT files written without a FAT chain), so on large
+ * images with small clusters this can take many calls.
+ */
+uint8_t fs_find_step(uint8_t* buffer, FsImage* image);
+
+#endif /* HDD_ENABLED */
+#endif /* FS_H */
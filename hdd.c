@@ -17,13 +17,20 @@
  * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include "config.h"
 #include "debug.h"
+#include "flight.h"
+#include "fs.h"
+#include "init.h"
 #include "logic.h"
+#include "main.h"
 #include "mem.h"
+#include "meter.h"
 #include "hdd.h"
+#include "trace.h"
 
 #ifdef HDD_ENABLED
 
@@ -40,24 +47,584 @@ const uint8_t inquiry_data[] PROGMEM = {
 	'0', '.', '1', 'a'
 };
 
-// READ CAPACITY information
-static uint8_t capacity_data[8] = {
-	0x00, 0x00, 0x00, 0x00, // size in blocks, inits to 0
-	0x00, 0x00, 0x02, 0x00  // 512 byte blocks
-};
-
 static uint8_t hdd_ready;
 static uint8_t hdd_error;
 
+// set by hdd_set_failed() if the card could not be brought up
+static uint8_t hdd_no_card;
+
+/*
+ * Card removal tracking. Failed commands and probes are counted until a probe
+ * succeeds, and once there are HDD_CARD_FAULT_LIMIT of them the card is
+ * treated as lost until it is brought up again. When that happens, or any
+ * other time a card becomes ready after the first, the next command is told
+ * the medium may have changed; this is tracked for each volume.
+ */
+static uint8_t card_faults;
+static uint8_t card_lost;
+static uint8_t card_seen;
+static uint32_t card_probe_time;
+
+/*
+ * Features of the current card, found from its SCR by hdd_set_ready(). Every
+ * SD card supports ACMD23, the pre-erase hint for multiple block writes, and
+ * the CMD32/CMD33/CMD38 erase sequence, but MMC cards do not; those have no
+ * SCR at all. The SCR also says whether erased blocks read back as all ones
+ * or all zeroes. The allocation unit size comes from the SD Status, in
+ * blocks, and is 0 if unknown.
+ */
+#define HDD_CARD_PRE_ERASE      _BV(0)
+#define HDD_CARD_ERASE          _BV(1)
+#define HDD_CARD_ERASED_ONES    _BV(2)
+#define HDD_CARD_CRC            _BV(3)
+static uint8_t card_flags;
+static uint32_t card_au;
+
+// the number of blocks on the card, see hdd_set_ready()
+static uint32_t card_blocks;
+
+/*
+ * Where hdd_setup_step() is in bringing a new card up. The volume table or
+ * filesystem is read into a free cache block, if there is one; commands are
+ * answered with NOT READY until setup is over, so nothing else touches it.
+ */
+#define HDD_STEP_CRC            0
+#define HDD_STEP_CID            1
+#define HDD_STEP_FLUSH          2
+#define HDD_STEP_TABLE          3
+#define HDD_STEP_IMAGE          4
+static uint8_t setup_step;
+static uint8_t* setup_buffer;
+static FsImage setup_image;
+
+/*
+ * The volumes served from the card, each answering as its own target, as
+ * read from the volume table described in hdd.h. Without a table there is a
+ * single volume covering the image file on the card, or the whole card if it
+ * has no image. Each volume has its own sense data
+ * in the logic layer, its own write-back cache setting, and its own pending
+ * UNIT ATTENTION after the card changes.
+ * 
+ * To conform with the sizing reported by the rigid disk geometry page in
+ * MODE SENSE, the last block of a volume is always at a multiple of 4096, so
+ * sizes are rounded down to a multiple of 4096 plus one.
+ */
+#define hdd_volume_size(b)      ((((b) - 1) & 0xFFFFF000) + 1)
+#define HDD_VOLUME_WCE          _BV(0)
+typedef struct HddVolume_t {
+	uint8_t id;
+	uint8_t flags;
+	uint8_t changed;
+	uint32_t offset;
+	uint32_t blocks;
+} HddVolume;
+static HddVolume volumes[HDD_VOLUME_MAX];
+static uint8_t volume_count;
+
+// the volume the current command is for
+static HddVolume* vol = volumes;
+
+/*
+ * Counts of blocks that failed the CRC check when GLOBAL_FLAG_CRC is set:
+ * blocks read from the card that arrived damaged, how many of those read back
+ * intact when checked again, and blocks the card refused as damaged when
+ * they were written.
+ */
+typedef struct HddCrcStats_t {
+	uint16_t read_errors;
+	uint16_t read_recovered;
+	uint16_t write_errors;
+} HddCrcStats;
+static HddCrcStats crc_stats;
+
 // cache for storing page data
 static uint8_t mode_data[256];
 
 // generic buffer for READ/WRITE BUFFER commands
 #define BUFFER_LENGTH 68
+
+/*
+ * READ/WRITE BUFFER vendor specific mode, and the buffer IDs supported in it.
+ * The debug buffer reads as the runtime category mask followed by the build
+ * level of each category, and a single byte written to it sets the mask. The
+ * flight buffer reads as the session saved before the last reset, as
+ * described in flight.h. The meter buffer reads as the bus measurements
+ * described in meter.h, and writing nothing to it resets them. The CRC buffer
+ * reads as 1 if CRC checking is active, then the three counts kept in
+ * crc_stats, big endian, and writing nothing to it also resets them.
+ * The boot buffer reads as the startup phase timings described in main.h.
+ */
+#define HDD_BUFFER_MODE_VENDOR  0x01
+#define HDD_BUFFER_ID_TASKS     0x00
+#define HDD_BUFFER_ID_DEBUG     0x01
+#define HDD_BUFFER_ID_FLIGHT    0x02
+#define HDD_BUFFER_ID_METER     0x03
+#define HDD_BUFFER_ID_CRC       0x04
+#define HDD_BUFFER_ID_BOOT      0x05
+#define HDD_BUFFER_DEBUG_LENGTH 8
+#define HDD_BUFFER_CRC_LENGTH   7
 static uint8_t buffer[BUFFER_LENGTH] = {
 	0x00, 0x00, 0x00, 0x40
 };
 
+/*
+ * Write-back cache, used when GLOBAL_FLAG_WCE is set. This holds one run of
+ * up to HDD_CACHE_BLOCKS consecutive blocks that have been acknowledged to the
+ * initiator but not yet written to the card, starting at the given LBA.
+ * 
+ * Runs are not allowed to grow past the end of the card allocation unit they
+ * started in, which is tracked as the run limit, so each flush touches only
+ * one allocation unit. A run that reaches the limit is flushed right away,
+ * since the next write will be going somewhere else.
+ * 
+ * The cache lives in .noinit so a software reset caused by /RST or BUS DEVICE
+ * RESET doesn't lose it: hdd_init() keeps the contents after such a reset,
+ * and hdd_set_ready() writes them out once the card is back (or leaves them
+ * to hdd_cache_task() if the card is busy). The LBA is stored twice to help
+ * catch SRAM contents that aren't really ours.
+ * 
+ * The same happens when the card is lost and comes back, so the card is
+ * identified by the serial number from its CID. Contents meant for one card
+ * are never written to another.
+ */
+#define HDD_CACHE_MAGIC         0xCA5E
+typedef struct HddCache_t {
+	uint16_t magic;
+	uint32_t lba;
+	uint32_t lba_check;
+	uint32_t card;
+	uint8_t count;
+	uint8_t data[HDD_CACHE_BLOCKS][512];
+} HddCache;
+static HddCache cache __attribute__((section(".noinit")));
+static uint32_t cache_time;
+static uint32_t cache_start;
+static uint32_t cache_limit;
+static uint8_t cache_error;
+
+// command latency histograms, for READ/WRITE and TEST UNIT READY
+static const uint8_t hist_opcodes[] = { 0x00, 0x08, 0x0A, 0x28, 0x2A };
+static uint16_t hist_counts[(sizeof(hist_opcodes) + 1) * LOGIC_HIST_BUCKETS];
+static LogicHist hist = { hist_opcodes, sizeof(hist_opcodes), hist_counts };
+
+/*
+ * Called when the card fails in a way that suggests it may have been removed,
+ * such as not answering a command or not sending a data token.
+ */
+static void hdd_card_fault(void)
+{
+	hdd_error = 1;
+	card_faults++;
+	if (hdd_ready && card_faults >= HDD_CARD_FAULT_LIMIT)
+	{
+		debug(HDD, DEBUG_ERROR, DEBUG_HDD_CARD_LOST);
+		hdd_ready = 0;
+		card_lost = 1;
+	}
+}
+
+/*
+ * ============================================================================
+ * 
+ *   CARD WRITE HELPERS
+ * 
+ * ============================================================================
+ * 
+ * Pieces of the card write process shared between direct writes and cache
+ * flushes. These must be called between mem_op_start() and mem_op_end().
+ */
+
+/*
+ * Sends clocks until the card stops signalling busy.
+ */
+static void hdd_card_wait(void)
+{
+	uint8_t response;
+	do
+	{
+		usart_tx(MEM_USART, 0xFF);
+		while (mem_data_not_ready());
+		response = usart_rx(MEM_USART);
+	}
+	while (response != 0xFF);
+}
+
+/*
+ * Finishes sending a block once the 512 data bytes have gone out, resyncing
+ * RX, sending the CRC, and collecting the data response, which is returned.
+ * Use hdd_card_accepted() to check the response.
+ * 
+ * If CRC checking is on, the CRC module must have been started before the
+ * block and given each byte of it; otherwise a fake CRC is sent.
+ */
+#define hdd_card_accepted(r)    (((r) & 0x1F) == 0x05)
+#define hdd_card_crc_error(r)   (((r) & 0x1F) == 0x0B)
+static uint8_t hdd_card_block_end(void)
+{
+	uint16_t crc = 0xFFFF;
+	if (card_flags & HDD_CARD_CRC)
+	{
+		crc = mem_crc_value();
+	}
+
+	// wait for byte sending to stop so RX can be re-synced
+	while (! (MEM_USART.STATUS & USART_TXCIF_bm));
+	while (MEM_USART.STATUS & USART_RXCIF_bm)
+	{
+		usart_rx(MEM_USART);
+	}
+
+	/*
+	 * Finish sending packet, by providing 16 bit CRC, the clocks
+	 * for the data response, and an extra 8 clocks to commit the
+	 * writing process.
+	 */
+	uint8_t response;
+	usart_tx(MEM_USART, (uint8_t) (crc >> 8)); // CRCH
+	usart_tx(MEM_USART, (uint8_t) crc); // CRCL
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART); // CRCH back
+	usart_tx(MEM_USART, 0xFF); // data response
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART); // CRCL back
+	usart_tx(MEM_USART, 0xFF); // commit clocks
+	while (mem_data_not_ready());
+	response = usart_rx(MEM_USART); // data response back
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART);
+
+	if (hdd_card_crc_error(response))
+	{
+		debug(HDD, DEBUG_ERROR, DEBUG_HDD_CRC_WRITE_FAILED);
+		crc_stats.write_errors++;
+	}
+	return response;
+}
+
+/*
+ * Puts a block address into the given command argument array.
+ */
+static void hdd_card_arg(uint8_t* arg, uint32_t lba)
+{
+	arg[0] = (uint8_t) (lba >> 24);
+	arg[1] = (uint8_t) (lba >> 16);
+	arg[2] = (uint8_t) (lba >> 8);
+	arg[3] = (uint8_t) lba;
+}
+
+/*
+ * Collects the byte left in the USART by a command, so another command can
+ * follow it in the same operation.
+ */
+static void hdd_card_skip(void)
+{
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART);
+}
+
+/*
+ * Tells the card how many blocks the CMD25 about to be sent will write, so it
+ * can erase them all up front instead of one at a time as they arrive. This
+ * is only a hint, so the write goes ahead even if it is rejected.
+ */
+static void hdd_card_pre_erase(uint32_t count)
+{
+	if (! (card_flags & HDD_CARD_PRE_ERASE)) return;
+
+	uint8_t arg[4];
+	hdd_card_arg(arg, count & 0x7FFFFF);
+	uint8_t v = mem_op_acmd_args(23, arg);
+	hdd_card_skip();
+	if (v != 0x00)
+	{
+		debug_dual(HDD, DEBUG_INFO, DEBUG_HDD_PRE_ERASE_REJECTED, v);
+	}
+}
+
+/*
+ * Ends a CMD25 operation once the card is no longer busy.
+ */
+static void hdd_card_stop(void)
+{
+	/*
+	 * Send a stop token, a trailing 0xFF that we do not check to get
+	 * the process started, then keep sending clocks until the card
+	 * goes back to idle.
+	 */
+	usart_tx(MEM_USART, MEM_STOP_TOKEN);
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART);
+	usart_tx(MEM_USART, 0xFF);
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART);
+	hdd_card_wait();
+}
+
+/*
+ * Writes blocks from memory to the card as a single CMD24 or CMD25 operation.
+ * The source moves forward by the given stride after each block, so giving
+ * 512 writes consecutive blocks and giving 0 writes the same block over and
+ * over. Returns nonzero if the card accepted everything.
+ */
+static uint8_t hdd_card_write(uint32_t lba, uint32_t count,
+		uint8_t* data, uint16_t stride)
+{
+	uint8_t opcode = 24;
+	uint8_t token = MEM_DATA_TOKEN;
+	if (count > 1)
+	{
+		opcode = 25;
+		token = MEM_DATA_TOKEN_MULTIPLE;
+		hdd_card_pre_erase(count);
+	}
+
+	uint8_t arg[4];
+	hdd_card_arg(arg, lba);
+	uint8_t v = mem_op_cmd_args(opcode, arg);
+	if (v != 0x00)
+	{
+		debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_CMD_REJECTED, v);
+		return 0;
+	}
+
+	uint8_t okay = 1;
+	for (uint32_t i = 0; okay && i < count; i++)
+	{
+		hdd_card_wait();
+		MEM_USART.STATUS = USART_TXCIF_bm;
+		if (card_flags & HDD_CARD_CRC)
+		{
+			mem_crc_start();
+		}
+		while (! (MEM_USART.STATUS & USART_DREIF_bm));
+		usart_tx(MEM_USART, token);
+		for (uint16_t j = 0; j < 512; j++)
+		{
+			while (! (MEM_USART.STATUS & USART_DREIF_bm));
+			usart_tx(MEM_USART, data[j]);
+			CRC.DATAIN = phy_reverse(data[j]);
+		}
+		data += stride;
+		v = hdd_card_block_end();
+		okay = hdd_card_accepted(v);
+	}
+	hdd_card_wait();
+	if (opcode == 25)
+	{
+		hdd_card_stop();
+	}
+
+	if (! okay)
+	{
+		debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_BAD_HEADER, v);
+	}
+	return okay;
+}
+
+/*
+ * Erases the given inclusive range of blocks with CMD32, CMD33 and CMD38,
+ * and waits for the card to finish. Erasing a large range may keep the card
+ * busy for several seconds. Returns nonzero if the card accepted the erase.
+ */
+static uint8_t hdd_card_erase(uint32_t first, uint32_t last)
+{
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_ERASE);
+
+	uint8_t arg[4];
+	hdd_card_arg(arg, first);
+	uint8_t v = mem_op_cmd_args(32, arg);
+	hdd_card_skip();
+	if (v == 0x00)
+	{
+		hdd_card_arg(arg, last);
+		v = mem_op_cmd_args(33, arg);
+		hdd_card_skip();
+	}
+	if (v == 0x00)
+	{
+		v = mem_op_cmd(38);
+		hdd_card_wait();
+	}
+
+	if (v != 0x00)
+	{
+		debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_CMD_REJECTED, v);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Called when a block read from the card fails the CRC check, once the read
+ * operation has been ended. The block is read again up to HDD_CRC_RETRIES
+ * times, without sending it anywhere, to tell a damaged transfer from a
+ * damaged block, and the command is then ended with a suitable error. For a
+ * damaged transfer the initiator only needs to try again. A card that stays
+ * busy through a retry is treated as a damaged block.
+ */
+static void hdd_card_crc_failed(uint32_t lba)
+{
+	debug(HDD, DEBUG_ERROR, DEBUG_HDD_CRC_READ_FAILED);
+	crc_stats.read_errors++;
+
+	uint8_t intact = 0;
+	for (uint8_t i = 0; ! intact && i < HDD_CRC_RETRIES; i++)
+	{
+		if (! mem_op_start_wait()) break;
+		uint8_t arg[4];
+		hdd_card_arg(arg, lba);
+		if (mem_op_cmd_args(17, arg) == 0x00
+				&& mem_wait_for_data() == MEM_DATA_TOKEN)
+		{
+			mem_crc_start();
+			for (uint16_t j = 0; j < 514; j++)
+			{
+				usart_tx(MEM_USART, 0xFF);
+				while (mem_data_not_ready());
+				CRC.DATAIN = phy_reverse(usart_rx(MEM_USART));
+			}
+			intact = ! mem_crc_residue();
+		}
+		mem_op_end();
+	}
+
+	if (intact)
+	{
+		crc_stats.read_recovered++;
+		logic_set_sense(SENSE_KEY_ABORTED_COMMAND, SENSE_DATA_NO_INFORMATION);
+	}
+	else
+	{
+		hdd_card_fault();
+		logic_set_sense(SENSE_KEY_MEDIUM_ERROR, SENSE_DATA_READ_ERROR);
+	}
+	logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+}
+
+/*
+ * ============================================================================
+ * 
+ *   WRITE-BACK CACHE
+ * 
+ * ============================================================================
+ */
+
+/*
+ * Writes the cached run to the card as a single CMD24 or CMD25 operation.
+ * Returns zero if the card was busy and nothing was done, in which case this
+ * should be tried again later. If the card fails the write, the data is
+ * dropped and reported as a write error on the next write or SYNCHRONIZE
+ * CACHE.
+ */
+static uint8_t hdd_cache_flush(void)
+{
+	if (cache.count == 0) return 1;
+	if (! mem_op_start()) return 0;
+
+	debug_dual(HDD, DEBUG_INFO, DEBUG_HDD_CACHE_FLUSH, cache.count);
+	uint8_t okay = hdd_card_write(cache.lba, cache.count, cache.data[0], 512);
+	mem_op_end();
+
+	// the data is still here, so a flush damaged on the way can be retried
+	for (uint8_t i = 0;
+			! okay && (card_flags & HDD_CARD_CRC) && i < HDD_CRC_RETRIES;
+			i++)
+	{
+		if (! mem_op_start_wait()) break;
+		okay = hdd_card_write(cache.lba, cache.count, cache.data[0], 512);
+		mem_op_end();
+	}
+
+	if (! okay)
+	{
+		hdd_card_fault();
+		cache_error = 1;
+	}
+	cache.count = 0;
+	return 1;
+}
+
+/*
+ * Checks if the given run of blocks overlaps the cached run.
+ */
+static uint8_t hdd_cache_overlaps(uint32_t lba, uint16_t length)
+{
+	return cache.count > 0
+			&& lba < cache.lba + cache.count
+			&& lba + length > cache.lba;
+}
+
+/*
+ * Reports a write error if an earlier flush failed. Returns nonzero if the
+ * error was reported, in which case the command is over.
+ */
+static uint8_t hdd_cache_report_error(void)
+{
+	if (! cache_error) return 0;
+
+	cache_error = 0;
+	logic_set_sense(SENSE_KEY_MEDIUM_ERROR, SENSE_DATA_WRITE_ERROR);
+	logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+	return 1;
+}
+
+/*
+ * Tries to accept a write into the cache. Returns zero if the write can't be
+ * cached and should be written directly instead, after flushing the cache.
+ * Otherwise, the command has been handled.
+ */
+static uint8_t hdd_cache_write(uint32_t lba, uint16_t length)
+{
+	if (! (vol->flags & HDD_VOLUME_WCE)) return 0;
+	if (length > HDD_CACHE_BLOCKS) return 0;
+
+	// the write must start within or right after the run, and fit
+	if (cache.count > 0
+			&& (lba < cache.lba
+				|| lba > cache.lba + cache.count
+				|| lba + length > cache.lba + HDD_CACHE_BLOCKS
+				|| lba + length > cache_limit))
+	{
+		if (! hdd_cache_flush())
+		{
+			debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+			logic_complete(LOGIC_STATUS_BUSY);
+			return 1;
+		}
+	}
+	if (cache.count == 0)
+	{
+		cache.lba = lba;
+		cache.lba_check = ~lba;
+		cache_start = system_time32();
+		if (card_au)
+		{
+			cache_limit = lba - (lba % card_au) + card_au;
+		}
+		else
+		{
+			cache_limit = 0xFFFFFFFF;
+		}
+
+		// a run can't start out crossing into the next allocation unit
+		if (lba + length > cache_limit) return 0;
+	}
+
+	debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_CACHE_STAGED);
+	uint8_t offset = (uint8_t) (lba - cache.lba);
+	phy_phase(PHY_PHASE_DATA_OUT);
+	phy_data_ask_bulk(cache.data[offset], length * 512);
+	if (! phy_is_active()) return 1;
+
+	if (offset + length > cache.count)
+	{
+		cache.count = offset + length;
+	}
+	cache_time = system_time32();
+	logic_complete(LOGIC_STATUS_GOOD);
+	return 1;
+}
+
 /*
  * ============================================================================
  * 
@@ -69,18 +636,58 @@ static uint8_t buffer[BUFFER_LENGTH] = {
  * task on either the device or the PHY.
  */
 
+/*
+ * Ends the command for when we are not ready. Until card initialization is
+ * over the initiator is told to keep waiting; once it has failed, that no
+ * medium is present.
+ */
+static void hdd_not_ready(void)
+{
+	if (hdd_no_card)
+	{
+		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_NO_MEDIUM);
+	}
+	else
+	{
+		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
+	}
+	logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+}
+
+/*
+ * Checks that a parsed data operation fits within the current volume, then
+ * moves its LBA from the volume to the card, also providing it as a number.
+ * If it doesn't fit, the command is ended with ILLEGAL REQUEST and this
+ * returns false.
+ */
+static uint8_t hdd_volume_map(LogicDataOp* op, uint32_t* lba)
+{
+	uint32_t v = ((uint32_t) op->lba[0] << 24)
+			| ((uint32_t) op->lba[1] << 16)
+			| ((uint32_t) op->lba[2] << 8)
+			| op->lba[3];
+	if (v >= vol->blocks || v + op->length > vol->blocks)
+	{
+		logic_set_sense(SENSE_KEY_ILLEGAL_REQUEST, SENSE_DATA_LBA_RANGE);
+		logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+		return 0;
+	}
+	v += vol->offset;
+	hdd_card_arg(op->lba, v);
+	*lba = v;
+	return 1;
+}
+
 static void hdd_test_unit_ready(void)
 {
 	if (hdd_ready)
 	{
-		logic_status(LOGIC_STATUS_GOOD);
+		logic_complete(LOGIC_STATUS_GOOD);
 	}
 	else
 	{
-		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		hdd_not_ready();
 	}
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 }
 
 static void hdd_inquiry(uint8_t* cmd)
@@ -90,8 +697,7 @@ static void hdd_inquiry(uint8_t* cmd)
 		alloc = HDD_INQUIRY_LENGTH;
 
 	logic_data_in_pgm(inquiry_data, alloc);
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void hdd_read_capacity(uint8_t* cmd)
@@ -101,11 +707,23 @@ static void hdd_read_capacity(uint8_t* cmd)
 		// RelAdr set, we're not playing that game
 		logic_cmd_illegal_arg(1);
 	}
+	else if (! hdd_ready)
+	{
+		// the size isn't known yet, so don't report one
+		hdd_not_ready();
+	}
 	else
 	{
+		uint32_t last = vol->blocks - 1;
+		uint8_t capacity_data[8] = {
+			(uint8_t) (last >> 24),
+			(uint8_t) (last >> 16),
+			(uint8_t) (last >> 8),
+			(uint8_t) last,
+			0x00, 0x00, 0x02, 0x00 // 512 byte blocks
+		};
 		logic_data_in(capacity_data, 8);
-		logic_status(LOGIC_STATUS_GOOD);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		logic_complete(LOGIC_STATUS_GOOD);
 	}
 }
 
@@ -113,9 +731,37 @@ static void hdd_read_capacity(uint8_t* cmd)
  * Minimalistic implementation of the FORMAT UNIT command, supporting only
  * no-arg defect lists.
  * 
- * The flash card handles all this internally so this is likely useless to
- * support anyway.
+ * The flash card handles defects internally, so the only useful thing to do
+ * is erase the whole volume, which is much quicker than having the initiator
+ * write every block and leaves the card with nothing to preserve during
+ * later writes. Cards without erase support just report success.
  */
+static void hdd_format_erase(void)
+{
+	if (card_flags & HDD_CARD_ERASE)
+	{
+		// cached writes may be for another volume, so can't just be dropped
+		if (! hdd_cache_flush() || ! mem_op_start())
+		{
+			debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+			logic_complete(LOGIC_STATUS_BUSY);
+			return;
+		}
+		uint8_t okay = hdd_card_erase(vol->offset,
+				vol->offset + vol->blocks - 1);
+		mem_op_end();
+		if (! okay)
+		{
+			hdd_card_fault();
+			logic_set_sense(SENSE_KEY_MEDIUM_ERROR,
+					SENSE_DATA_FORMAT_FAILED);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+			return;
+		}
+	}
+	logic_complete(LOGIC_STATUS_GOOD);
+}
+
 static void hdd_format(uint8_t* cmd)
 {
 	if (hdd_ready)
@@ -123,8 +769,7 @@ static void hdd_format(uint8_t* cmd)
 		uint8_t fmt = cmd[1];
 		if (fmt == 0x00)
 		{
-			logic_status(LOGIC_STATUS_GOOD);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			hdd_format_erase();
 		}
 		else if (fmt == 0x10
 				|| fmt == 0x18)
@@ -142,16 +787,14 @@ static void hdd_format(uint8_t* cmd)
 			// TODO: should be bother checking the flags?
 			if (parms[2] == 0x00 && parms[3] == 0x00)
 			{
-				logic_status(LOGIC_STATUS_GOOD);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				hdd_format_erase();
 			}
 			else
 			{
 				logic_set_sense_pointer(SENSE_KEY_ILLEGAL_REQUEST,
 						SENSE_DATA_INVALID_CDB_PARAM,
 						0xC0, 0x02);
-				logic_status(LOGIC_STATUS_CHECK_CONDITION);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 			}
 		}
 		else
@@ -161,9 +804,7 @@ static void hdd_format(uint8_t* cmd)
 	}
 	else
 	{
-		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		hdd_not_ready();
 	}
 }
 
@@ -171,10 +812,8 @@ static void hdd_read(uint8_t* cmd)
 {
 	if (! hdd_ready)
 	{
-		debug(DEBUG_HDD_NOT_READY);
-		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_NOT_READY);
+		hdd_not_ready();
 		return;
 	}
 
@@ -182,7 +821,7 @@ static void hdd_read(uint8_t* cmd)
 	LogicDataOp op = logic_data;
 	if (op.invalid)
 	{
-		debug(DEBUG_HDD_OP_INVALID);
+		debug(HDD, DEBUG_ERROR, DEBUG_HDD_OP_INVALID);
 		hdd_error = 1;
 		logic_cmd_illegal_arg(op.invalid - 1);
 		return;
@@ -190,13 +829,21 @@ static void hdd_read(uint8_t* cmd)
 
 	if (op.length > 0)
 	{
-		debug(DEBUG_HDD_READ_STARTING);
-
-		if (! mem_op_start())
+		debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_READ_STARTING);
+		trace16(TRACE_HDD_BLOCKS, op.length);
+
+		// cached writes must reach the card before they can be read back
+		uint32_t lba;
+		if (! hdd_volume_map(&op, &lba)) return;
+		uint8_t flushed = 1;
+		if (hdd_cache_overlaps(lba, op.length))
+		{
+			flushed = hdd_cache_flush();
+		}
+		if (! flushed || ! mem_op_start())
 		{
-			debug(DEBUG_HDD_MEM_CARD_BUSY);
-			logic_status(LOGIC_STATUS_BUSY);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+			logic_complete(LOGIC_STATUS_BUSY);
 			return;
 		}
 
@@ -210,22 +857,21 @@ static void hdd_read(uint8_t* cmd)
 		if (op.length == 1)
 		{
 			opcode = 17;
-			debug(DEBUG_HDD_READ_SINGLE);
+			debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_READ_SINGLE);
 		}
 		else
 		{
 			opcode = 18;
-			debug(DEBUG_HDD_READ_MULTIPLE);
+			debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_READ_MULTIPLE);
 		}
 		uint8_t v = mem_op_cmd_args(opcode, op.lba);
 		if (v != 0x00)
 		{
-			debug_dual(DEBUG_HDD_MEM_CMD_REJECTED, v);
-			hdd_error = 1;
+			debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_CMD_REJECTED, v);
+			hdd_card_fault();
 			logic_set_sense(SENSE_KEY_HARDWARE_ERROR,
 					SENSE_DATA_NO_INFORMATION);
-			logic_status(LOGIC_STATUS_CHECK_CONDITION);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 			return;
 		}
 
@@ -233,25 +879,42 @@ static void hdd_read(uint8_t* cmd)
 		 * Switch to the correct phase and begin the data reading process.
 		 */
 		phy_phase(PHY_PHASE_DATA_IN);
+		uint8_t crc = card_flags & HDD_CARD_CRC;
 		for (uint16_t i = 0; i < op.length; i++)
 		{
 			v = mem_wait_for_data();
 			if (v == MEM_DATA_TOKEN)
 			{
 				/*
-				 * Transfer actual data, then transfer two dummy bytes for CRC,
+				 * Transfer actual data, then transfer the rest of the CRC,
 				 * and one post-command byte to generate the 8 cycles needed
 				 * for command commit.
 				 * 
 				 * The byte required by the below call should already be in the
 				 * USART buffer per the contract with the data wait call.
 				 */
-				phy_data_offer_stream_block(&MEM_USART);
-				for (uint8_t j = 0; j < 2; j++)
+				if (crc)
 				{
-					MEM_USART.DATA = 0xFF;
-					while (! (MEM_USART.STATUS & USART_RXCIF_bm));
-					MEM_USART.DATA;
+					mem_crc_start();
+				}
+				phy_data_offer_stream_block(&MEM_USART, crc);
+				usart_tx(MEM_USART, 0xFF);
+				while (! (MEM_USART.STATUS & USART_RXCIF_bm));
+				CRC.DATAIN = phy_reverse(usart_rx(MEM_USART));
+				usart_tx(MEM_USART, 0xFF);
+				while (! (MEM_USART.STATUS & USART_RXCIF_bm));
+				usart_rx(MEM_USART);
+
+				if (crc && mem_crc_residue())
+				{
+					if (opcode == 18)
+					{
+						while (! (MEM_USART.STATUS & USART_TXCIF_bm));
+						mem_op_cmd(12);
+					}
+					mem_op_end();
+					hdd_card_crc_failed(lba + i);
+					return;
 				}
 			}
 			else
@@ -265,12 +928,11 @@ static void hdd_read(uint8_t* cmd)
 				mem_op_end();
 
 				// indicate failure to initiator
-				debug_dual(DEBUG_HDD_MEM_BAD_HEADER, v);
-				hdd_error = 1;
+				debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_BAD_HEADER, v);
+				hdd_card_fault();
 				logic_set_sense(SENSE_KEY_MEDIUM_ERROR,
 						SENSE_DATA_NO_INFORMATION);
-				logic_status(LOGIC_STATUS_CHECK_CONDITION);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 				return;
 			}
 		}
@@ -284,19 +946,16 @@ static void hdd_read(uint8_t* cmd)
 		mem_op_end();
 	}
 
-	debug(DEBUG_HDD_READ_OKAY);
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_READ_OKAY);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void hdd_write(uint8_t* cmd)
 {
 	if (! hdd_ready)
 	{
-		debug(DEBUG_HDD_NOT_READY);
-		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_NOT_READY);
+		hdd_not_ready();
 		return;
 	}
 
@@ -304,21 +963,26 @@ static void hdd_write(uint8_t* cmd)
 	LogicDataOp op = logic_data;
 	if (op.invalid)
 	{
-		debug(DEBUG_HDD_OP_INVALID);
+		debug(HDD, DEBUG_ERROR, DEBUG_HDD_OP_INVALID);
 		hdd_error = 1;
 		logic_cmd_illegal_arg(op.invalid - 1);
 		return;
 	}
 
+	if (hdd_cache_report_error()) return;
+
 	if (op.length > 0)
 	{
-		debug(DEBUG_HDD_WRITE_STARTING);
+		debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_WRITE_STARTING);
+		trace16(TRACE_HDD_BLOCKS, op.length);
 
-		if (! mem_op_start())
+		uint32_t lba;
+		if (! hdd_volume_map(&op, &lba)) return;
+		if (hdd_cache_write(lba, op.length)) return;
+		if (! hdd_cache_flush() || ! mem_op_start())
 		{
-			debug(DEBUG_HDD_MEM_CARD_BUSY);
-			logic_status(LOGIC_STATUS_BUSY);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+			logic_complete(LOGIC_STATUS_BUSY);
 			return;
 		}
 
@@ -332,22 +996,22 @@ static void hdd_write(uint8_t* cmd)
 		if (op.length == 1)
 		{
 			opcode = 24;
-			debug(DEBUG_HDD_WRITE_SINGLE);
+			debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_WRITE_SINGLE);
 		}
 		else
 		{
 			opcode = 25;
-			debug(DEBUG_HDD_WRITE_MULTIPLE);
+			debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_WRITE_MULTIPLE);
+			hdd_card_pre_erase(op.length);
 		}
 		uint8_t v = mem_op_cmd_args(opcode, op.lba);
 		if (v != 0x00)
 		{
-			debug_dual(DEBUG_HDD_MEM_CMD_REJECTED, v);
-			hdd_error = 1;
+			debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_CMD_REJECTED, v);
+			hdd_card_fault();
 			logic_set_sense(SENSE_KEY_HARDWARE_ERROR,
 					SENSE_DATA_NO_INFORMATION);
-			logic_status(LOGIC_STATUS_CHECK_CONDITION);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 			return;
 		}
 		uint8_t send_token = (op.length == 1
@@ -365,77 +1029,54 @@ static void hdd_write(uint8_t* cmd)
 			 * time. This also handles sending at least one 0xFF before the
 			 * packet header.
 			 */
-			uint8_t response;
-			do
-			{
-				MEM_USART.DATA = 0xFF;
-				while (mem_data_not_ready());
-				response = MEM_USART.DATA;
-			}
-			while (response != 0xFF);
+			hdd_card_wait();
 
 			/*
 			 * Send start token, then send 512 bytes of data. This will
 			 * overflow RX.
 			 */
-			while (! (MEM_USART.STATUS & USART_DREIF_bm));
-			MEM_USART.DATA = send_token;
-			phy_data_ask_stream_block(&MEM_USART);
-
-			// wait for byte sending to stop so RX can be re-synced
-			while (! (MEM_USART.STATUS & USART_TXCIF_bm));
-			while (MEM_USART.STATUS & USART_RXCIF_bm)
+			uint8_t crc = card_flags & HDD_CARD_CRC;
+			if (crc)
 			{
-				MEM_USART.DATA;
+				mem_crc_start();
 			}
-
-			/*
-			 * Finish sending packet, by providing 16 bit fake CRC, the clocks
-			 * for the data response, and an extra 8 clocks to commit the
-			 * writing process.
-			 */
-			MEM_USART.DATA = 0xFF; // CRCH
-			MEM_USART.DATA = 0xFF; // CRCL
-			while (mem_data_not_ready());
-			MEM_USART.DATA; // CRCH back
-			MEM_USART.DATA = 0xFF; // data response
-			while (mem_data_not_ready());
-			MEM_USART.DATA; // CRCL back
-			MEM_USART.DATA = 0xFF; // commit clocks
-			while (mem_data_not_ready());
-			response = MEM_USART.DATA; // data response back
-			while (mem_data_not_ready());
-			MEM_USART.DATA;
+			while (! (MEM_USART.STATUS & USART_DREIF_bm));
+			usart_tx(MEM_USART, send_token);
+			phy_data_ask_stream_block(&MEM_USART, crc);
 
 			/*
 			 * Check if data response is OK.
 			 */
-			uint8_t okay = ((response & 0x1F) == 0x05);
-			if (! okay)
+			uint8_t response = hdd_card_block_end();
+			if (! hdd_card_accepted(response))
 			{
 				/*
-				 * Failure during read of some kind. Wait for card to come out
-				 * of busy status (if possible), halt further operations, and
-				 * indicate a MEDIUM ERROR to the initiator.
-				 * 
-				 * 
-				 * FOLLOWING IS BAD AND WILL NOT WORK RIGHT
-				 * USE THE VERSION BELOW THE LOOP
+				 * Failure during write of some kind. Wait for card to come
+				 * out of busy status, halt further operations, and indicate
+				 * a MEDIUM ERROR to the initiator. If the block was only
+				 * damaged on the way to the card, the initiator just needs
+				 * to try again.
 				 */
+				hdd_card_wait();
 				if (opcode == 25)
 				{
-					while (! (MEM_USART.STATUS & USART_DREIF_bm));
-					MEM_USART.DATA = MEM_STOP_TOKEN;
-					while (! (MEM_USART.STATUS & USART_DREIF_bm));
-					MEM_USART.DATA = 0xFF;
+					hdd_card_stop();
 				}
 				mem_op_end();
-				debug_dual(DEBUG_HDD_MEM_BAD_HEADER, response);
-				hdd_error = 1;
-				logic_set_sense(SENSE_KEY_MEDIUM_ERROR,
-						SENSE_DATA_NO_INFORMATION);
-				logic_status(LOGIC_STATUS_CHECK_CONDITION);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				debug_dual(HDD, DEBUG_ERROR,
+						DEBUG_HDD_MEM_BAD_HEADER, response);
+				if (hdd_card_crc_error(response))
+				{
+					logic_set_sense(SENSE_KEY_ABORTED_COMMAND,
+							SENSE_DATA_NO_INFORMATION);
+				}
+				else
+				{
+					hdd_card_fault();
+					logic_set_sense(SENSE_KEY_MEDIUM_ERROR,
+							SENSE_DATA_NO_INFORMATION);
+				}
+				logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 				return;
 			}
 		}
@@ -443,57 +1084,119 @@ static void hdd_write(uint8_t* cmd)
 		/*
 		 * Wait for the card to become ready again before we proceed.
 		 */
-		uint8_t response;
-		do
-		{
-			MEM_USART.DATA = 0xFF;
-			while (mem_data_not_ready());
-			response = MEM_USART.DATA;
-		}
-		while (response != 0xFF);
+		hdd_card_wait();
 
 		// terminate writing operation if needed
 		if (opcode == 25)
 		{
-			/*
-			 * Send a stop token, a trailing 0xFF that we do not check to get
-			 * the process started, then keep sending clocks until the card
-			 * goes back to idle.
-			 */
-			MEM_USART.DATA = MEM_STOP_TOKEN;
-			while (mem_data_not_ready());
-			MEM_USART.DATA;
-			MEM_USART.DATA = 0xFF;
-			while (mem_data_not_ready());
-			MEM_USART.DATA;
-			do
-			{
-				MEM_USART.DATA = 0xFF;
-				while (mem_data_not_ready());
-				response = MEM_USART.DATA;
-			}
-			while (response != 0xFF);
+			hdd_card_stop();
 		}
 		mem_op_end();
 	}
 
-	debug(DEBUG_HDD_WRITE_OKAY);
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	debug(HDD, DEBUG_VERBOSE, DEBUG_HDD_WRITE_OKAY);
+	logic_complete(LOGIC_STATUS_GOOD);
+}
+
+/*
+ * WRITE SAME(10) writes one block of data from the initiator over a range of
+ * blocks, which is how zeroing tools tend to clear a disk. If the block is
+ * what the card gives back for erased blocks the range is erased instead,
+ * otherwise the block is written repeatedly in a single card operation.
+ * 
+ * The write-back cache is flushed first, so its first block can be borrowed
+ * to hold the data.
+ */
+static void hdd_write_same(uint8_t* cmd)
+{
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_WRITE_SAME);
+	if (! hdd_ready)
+	{
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_NOT_READY);
+		hdd_not_ready();
+		return;
+	}
+	if (cmd[1] & 0x06)
+	{
+		// PBDATA and LBDATA ask for per-block changes we don't do
+		logic_cmd_illegal_arg(1);
+		return;
+	}
+
+	uint32_t lba = ((uint32_t) cmd[2] << 24)
+			| ((uint32_t) cmd[3] << 16)
+			| ((uint32_t) cmd[4] << 8)
+			| cmd[5];
+	uint32_t count = (cmd[7] << 8) | cmd[8];
+	if (lba >= vol->blocks || lba + count > vol->blocks)
+	{
+		logic_set_sense(SENSE_KEY_ILLEGAL_REQUEST, SENSE_DATA_LBA_RANGE);
+		logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+		return;
+	}
+	if (count == 0)
+	{
+		// zero means everything through the end of the disk
+		count = vol->blocks - lba;
+	}
+	lba += vol->offset;
+
+	if (hdd_cache_report_error()) return;
+	if (! hdd_cache_flush())
+	{
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+		logic_complete(LOGIC_STATUS_BUSY);
+		return;
+	}
+	uint8_t* data = cache.data[0];
+	phy_phase(PHY_PHASE_DATA_OUT);
+	phy_data_ask_bulk(data, 512);
+	if (! phy_is_active()) return;
+
+	uint8_t erased = (card_flags & HDD_CARD_ERASED_ONES) ? 0xFF : 0x00;
+	uint8_t uniform = card_flags & HDD_CARD_ERASE;
+	for (uint16_t i = 0; uniform && i < 512; i++)
+	{
+		uniform = data[i] == erased;
+	}
+
+	if (! mem_op_start())
+	{
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+		logic_complete(LOGIC_STATUS_BUSY);
+		return;
+	}
+	uint8_t okay;
+	if (uniform)
+	{
+		okay = hdd_card_erase(lba, lba + count - 1);
+	}
+	else
+	{
+		okay = hdd_card_write(lba, count, data, 0);
+	}
+	mem_op_end();
+
+	if (! okay)
+	{
+		hdd_card_fault();
+		logic_set_sense(SENSE_KEY_MEDIUM_ERROR, SENSE_DATA_WRITE_ERROR);
+		logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+		return;
+	}
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void hdd_mode_sense(uint8_t* cmd)
 {
 	if (! hdd_ready)
 	{
-		debug(DEBUG_HDD_NOT_READY);
-		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_NOT_READY);
+		hdd_not_ready();
 		return;
 	}
 
-	debug(DEBUG_HDD_MODE_SENSE);
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_MODE_SENSE);
 
 	// extract basic command values
 	uint8_t cmd_dbd = cmd[1] & 0x8;
@@ -683,9 +1386,10 @@ static void hdd_mode_sense(uint8_t* cmd)
 		 * volume capacity. With a fixed 512 byte sector size, this allows
 		 * incrementing in 4096 block steps, or 2MB each.
 		 */
-		cyl[0] = capacity_data[0] >> 4;
-		cyl[1] = (capacity_data[0] << 4) | (capacity_data[1] >> 4);
-		cyl[2] = (capacity_data[1] << 4) | (capacity_data[2] >> 4);
+		uint32_t cylinders = vol->blocks >> 12;
+		cyl[0] = (uint8_t) (cylinders >> 16);
+		cyl[1] = (uint8_t) (cylinders >> 8);
+		cyl[2] = (uint8_t) cylinders;
 
 		mode_data[mode_pos++] = 0x04;
 		mode_data[mode_pos++] = 0x16;
@@ -774,13 +1478,18 @@ static void hdd_mode_sense(uint8_t* cmd)
 		mode_data[mode_pos++] = 0x08;
 		mode_data[mode_pos++] = 0x0A;
 
-		if (cmd_pc != 0x01)
+		if (cmd_pc == 0x01)
+		{
+			mode_data[mode_pos++] = 0x04; // only WCE can be changed
+		}
+		else if (cmd_pc == 0x02
+				|| ! (vol->flags & HDD_VOLUME_WCE))
 		{
 			mode_data[mode_pos++] = 0x01; // only RCD set, no read cache
 		}
 		else
 		{
-			mode_data[mode_pos++] = 0x00;
+			mode_data[mode_pos++] = 0x05; // RCD and WCE set
 		}
 
 		for (uint8_t i = 1; i < 0x0A; i++)
@@ -804,8 +1513,7 @@ static void hdd_mode_sense(uint8_t* cmd)
 		}
 
 		logic_data_in(mode_data, mode_pos);
-		logic_status(LOGIC_STATUS_GOOD);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		logic_complete(LOGIC_STATUS_GOOD);
 	}
 	else
 	{
@@ -813,58 +1521,151 @@ static void hdd_mode_sense(uint8_t* cmd)
 	}
 }
 
+/*
+ * VERIFY(10) reads the blocks from the card and checks that each one comes
+ * back with a good data token. With BYTCHK set the initiator also sends the
+ * blocks, which are compared against the card as they arrive, ending the
+ * command with MISCOMPARE at the first block that doesn't match.
+ */
 static void hdd_verify(uint8_t* cmd)
 {
-	debug(DEBUG_HDD_VERIFY);
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_VERIFY);
 	if (! hdd_ready)
 	{
-		debug(DEBUG_HDD_NOT_READY);
-		logic_set_sense(SENSE_KEY_NOT_READY, SENSE_DATA_LUN_BECOMING_RDY);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_NOT_READY);
+		hdd_not_ready();
 		return;
 	}
 
-	if (cmd[1] & 1)
+	logic_parse_data_op(cmd);
+	LogicDataOp op = logic_data;
+	if (op.invalid)
 	{
-		// RelAdr set
-		logic_cmd_illegal_arg(1);
+		debug(HDD, DEBUG_ERROR, DEBUG_HDD_OP_INVALID);
+		logic_cmd_illegal_arg(op.invalid - 1);
 		return;
 	}
-	if (cmd[1] & 2)
+	uint8_t bytchk = cmd[1] & 2;
+
+	if (op.length > 0)
 	{
-		/*
-		 * This is a dummy operation: we just pretend to care about what the
-		 * initiator is asking for, and we don't verify anything: just get
-		 * the DATA IN length we need to do and report that everything is OK.
-		 */
-		phy_phase(PHY_PHASE_DATA_IN);
-		uint16_t len = (cmd[7] << 8) | cmd[8];
-		for (uint16_t i = 0; i < len; i++)
+		// cached writes must reach the card before they can be checked
+		uint32_t lba;
+		if (! hdd_volume_map(&op, &lba)) return;
+		uint8_t flushed = 1;
+		if (hdd_cache_overlaps(lba, op.length))
+		{
+			flushed = hdd_cache_flush();
+		}
+		if (! flushed || ! mem_op_start())
+		{
+			debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+			logic_complete(LOGIC_STATUS_BUSY);
+			return;
+		}
+
+		uint8_t opcode = (op.length == 1) ? 17 : 18;
+		uint8_t v = mem_op_cmd_args(opcode, op.lba);
+		if (v != 0x00)
+		{
+			debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_CMD_REJECTED, v);
+			hdd_card_fault();
+			logic_set_sense(SENSE_KEY_HARDWARE_ERROR,
+					SENSE_DATA_NO_INFORMATION);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+			return;
+		}
+
+		if (bytchk)
+		{
+			phy_phase(PHY_PHASE_DATA_OUT);
+		}
+		uint8_t crc = card_flags & HDD_CARD_CRC;
+		uint8_t sense_key = 0;
+		uint16_t i;
+		for (i = 0; sense_key == 0 && i < op.length; i++)
 		{
-			for (uint16_t j = 0; j < 512; j++)
+			v = mem_wait_for_data();
+			if (v != MEM_DATA_TOKEN)
+			{
+				debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_MEM_BAD_HEADER, v);
+				hdd_card_fault();
+				sense_key = SENSE_KEY_MEDIUM_ERROR;
+				break;
+			}
+
+			if (crc)
+			{
+				mem_crc_start();
+			}
+			if (bytchk)
 			{
-				// this will be glacial, but this should be an uncommon
-				// operation anyway
-				phy_data_ask();
+				if (phy_data_ask_compare_block(&MEM_USART, crc))
+				{
+					debug(HDD, DEBUG_INFO, DEBUG_HDD_MISCOMPARE);
+					sense_key = SENSE_KEY_MISCOMPARE;
+				}
+				usart_tx(MEM_USART, 0xFF);
+				while (! (MEM_USART.STATUS & USART_RXCIF_bm));
+				CRC.DATAIN = phy_reverse(usart_rx(MEM_USART));
+				usart_tx(MEM_USART, 0xFF);
+				while (! (MEM_USART.STATUS & USART_RXCIF_bm));
+				usart_rx(MEM_USART);
+			}
+			else
+			{
+				// nothing to compare against, so just check the data and CRC
+				for (uint16_t j = 0; j < 514; j++)
+				{
+					usart_tx(MEM_USART, 0xFF);
+					while (! (MEM_USART.STATUS & USART_RXCIF_bm));
+					CRC.DATAIN = phy_reverse(usart_rx(MEM_USART));
+				}
+			}
+
+			// a damaged transfer also makes the comparison meaningless
+			if (crc && mem_crc_residue())
+			{
+				sense_key = SENSE_KEY_ABORTED_COMMAND;
+				break;
 			}
 		}
+
+		// terminate reading operation, if needed
+		if (opcode == 18)
+		{
+			while (! (MEM_USART.STATUS & USART_TXCIF_bm));
+			mem_op_cmd(12);
+		}
+		mem_op_end();
+
+		if (sense_key == SENSE_KEY_ABORTED_COMMAND)
+		{
+			hdd_card_crc_failed(lba + i);
+			return;
+		}
+		else if (sense_key == SENSE_KEY_MISCOMPARE)
+		{
+			logic_set_sense(SENSE_KEY_MISCOMPARE, SENSE_DATA_MISCOMPARE);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+			return;
+		}
+		else if (sense_key)
+		{
+			logic_set_sense(SENSE_KEY_MEDIUM_ERROR,
+					SENSE_DATA_NO_INFORMATION);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+			return;
+		}
 	}
 
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void hdd_read_buffer(uint8_t* cmd)
 {
-	debug(DEBUG_HDD_READ_BUFFER);
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_READ_BUFFER);
 	uint8_t cmd_mode = cmd[1] & 0x7;
-	// we only support mode 0
-	if (cmd_mode)
-	{
-		logic_cmd_illegal_arg(1);
-		return;
-	}
 
 	// figure how long the READ BUFFER needs to be
 	uint8_t length;
@@ -876,6 +1677,98 @@ static void hdd_read_buffer(uint8_t* cmd)
 	{
 		length = cmd[8];
 	}
+
+	if (cmd_mode == HDD_BUFFER_MODE_VENDOR)
+	{
+		/*
+		 * Vendor specific mode, used to provide internal information about
+		 * the device, selected by the buffer ID.
+		 */
+		if (cmd[2] == HDD_BUFFER_ID_TASKS)
+		{
+			uint8_t stats[MAIN_TASK_STATS_LENGTH];
+			uint8_t stats_length = main_task_stats(stats);
+			if (length > stats_length)
+			{
+				length = stats_length;
+			}
+			logic_data_in(stats, length);
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		else if (cmd[2] == HDD_BUFFER_ID_DEBUG)
+		{
+			uint8_t levels[HDD_BUFFER_DEBUG_LENGTH];
+			levels[0] = DEBUG_MASK_REGISTER;
+			debug_levels(levels + 1);
+			if (length > HDD_BUFFER_DEBUG_LENGTH)
+			{
+				length = HDD_BUFFER_DEBUG_LENGTH;
+			}
+			logic_data_in(levels, length);
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		else if (cmd[2] == HDD_BUFFER_ID_FLIGHT)
+		{
+			if (length > FLIGHT_SAVED_LENGTH)
+			{
+				length = FLIGHT_SAVED_LENGTH;
+			}
+			logic_data_in(flight_saved(), length);
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		else if (cmd[2] == HDD_BUFFER_ID_METER)
+		{
+			uint8_t data[METER_LENGTH];
+			meter_read(data);
+			if (length > METER_LENGTH)
+			{
+				length = METER_LENGTH;
+			}
+			logic_data_in(data, length);
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		else if (cmd[2] == HDD_BUFFER_ID_BOOT)
+		{
+			uint8_t boot[MAIN_BOOT_STATS_LENGTH];
+			uint8_t boot_length = main_boot_stats(boot);
+			if (length > boot_length)
+			{
+				length = boot_length;
+			}
+			logic_data_in(boot, length);
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		else if (cmd[2] == HDD_BUFFER_ID_CRC)
+		{
+			uint8_t data[HDD_BUFFER_CRC_LENGTH] = {
+				(card_flags & HDD_CARD_CRC) ? 1 : 0,
+				(uint8_t) (crc_stats.read_errors >> 8),
+				(uint8_t) crc_stats.read_errors,
+				(uint8_t) (crc_stats.read_recovered >> 8),
+				(uint8_t) crc_stats.read_recovered,
+				(uint8_t) (crc_stats.write_errors >> 8),
+				(uint8_t) crc_stats.write_errors
+			};
+			if (length > HDD_BUFFER_CRC_LENGTH)
+			{
+				length = HDD_BUFFER_CRC_LENGTH;
+			}
+			logic_data_in(data, length);
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		else
+		{
+			logic_cmd_illegal_arg(2);
+		}
+		return;
+	}
+	else if (cmd_mode)
+	{
+		// otherwise we only support mode 0
+		logic_cmd_illegal_arg(1);
+		return;
+	}
+
 	if (length > BUFFER_LENGTH)
 	{
 		length = BUFFER_LENGTH;
@@ -883,17 +1776,59 @@ static void hdd_read_buffer(uint8_t* cmd)
 
 	// send the data
 	logic_data_in(buffer, length);
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void hdd_write_buffer(uint8_t* cmd)
 {
-	debug(DEBUG_HDD_WRITE_BUFFER);
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_WRITE_BUFFER);
 	uint8_t cmd_mode = cmd[1] & 0x7;
-	// we only support mode 0
-	if (cmd_mode)
+	if (cmd_mode == HDD_BUFFER_MODE_VENDOR)
 	{
+		// only the debug mask can be written, and the meter and CRC resets
+		if (cmd[2] == HDD_BUFFER_ID_METER || cmd[2] == HDD_BUFFER_ID_CRC)
+		{
+			if (cmd[6] > 0 || cmd[7] > 0 || cmd[8] > 0)
+			{
+				logic_cmd_illegal_arg(8);
+			}
+			else
+			{
+				if (cmd[2] == HDD_BUFFER_ID_METER)
+				{
+					meter_reset();
+				}
+				else
+				{
+					crc_stats.read_errors = 0;
+					crc_stats.read_recovered = 0;
+					crc_stats.write_errors = 0;
+				}
+				logic_complete(LOGIC_STATUS_GOOD);
+			}
+		}
+		else if (cmd[2] != HDD_BUFFER_ID_DEBUG)
+		{
+			logic_cmd_illegal_arg(2);
+		}
+		else if (cmd[6] > 0 || cmd[7] > 0 || cmd[8] != 1)
+		{
+			logic_cmd_illegal_arg(8);
+		}
+		else
+		{
+			uint8_t mask;
+			if (logic_data_out(&mask, 1))
+			{
+				DEBUG_MASK_REGISTER = mask;
+			}
+			logic_complete(LOGIC_STATUS_GOOD);
+		}
+		return;
+	}
+	else if (cmd_mode)
+	{
+		// otherwise we only support mode 0
 		logic_cmd_illegal_arg(1);
 		return;
 	}
@@ -910,8 +1845,7 @@ static void hdd_write_buffer(uint8_t* cmd)
 	if (length < 4)
 	{
 		// too short?
-		logic_status(LOGIC_STATUS_GOOD);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		logic_complete(LOGIC_STATUS_GOOD);
 		return;
 	}
 
@@ -921,21 +1855,108 @@ static void hdd_write_buffer(uint8_t* cmd)
 		phy_data_ask();
 	}
 	logic_data_out(buffer + 4, length);
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
-// hacky version that just accepts without complaint anything
+/*
+ * Accepts MODE SELECT(6) and MODE SELECT(10), acting only on the WCE bit of
+ * the caching page, for the current volume. Everything else is accepted
+ * without complaint and ignored. If SP is set, the WCE setting is saved to
+ * EEPROM, where it becomes the setting for every volume once the card is
+ * next brought up.
+ */
 static void hdd_mode_select(uint8_t* cmd)
 {
-	debug(DEBUG_HDD_MODE_SELECT);
-	uint8_t length = cmd[4];
-	if (length > 0)
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_MODE_SELECT);
+	uint8_t length;
+	uint16_t pos;
+	if (cmd[0] == 0x55)
+	{
+		length = (cmd[7] > 0) ? 255 : cmd[8];
+		pos = 8;
+	}
+	else
+	{
+		length = cmd[4];
+		pos = 4;
+	}
+	if (length < pos)
+	{
+		if (length > 0)
+		{
+			logic_data_out_dummy(length);
+		}
+		logic_complete(LOGIC_STATUS_GOOD);
+		return;
+	}
+	if (logic_data_out(mode_data, length) != length) return;
+
+	// skip the block descriptors, then walk the pages
+	if (pos == 8)
+	{
+		pos += (mode_data[6] << 8) | mode_data[7];
+	}
+	else
+	{
+		pos += mode_data[3];
+	}
+	uint8_t found = 0;
+	uint8_t wce = vol->flags & HDD_VOLUME_WCE;
+	while (pos + 2 < length)
+	{
+		uint8_t page = mode_data[pos] & 0x3F;
+		if (page == 0x08)
+		{
+			found = 1;
+			wce = (mode_data[pos + 2] & 0x04) ? HDD_VOLUME_WCE : 0;
+		}
+		pos += 2 + mode_data[pos + 1];
+	}
+	if (! found)
+	{
+		logic_complete(LOGIC_STATUS_GOOD);
+		return;
+	}
+
+	// write out anything cached before turning the cache off
+	if (hdd_ready && ! wce && ! hdd_cache_flush())
+	{
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+		logic_complete(LOGIC_STATUS_BUSY);
+		return;
+	}
+	vol->flags = (vol->flags & ~HDD_VOLUME_WCE) | wce;
+	if (cmd[1] & 0x01)
+	{
+		uint8_t flags = GLOBAL_CONFIG_REGISTER & ~GLOBAL_FLAG_WCE;
+		if (wce)
+		{
+			flags |= GLOBAL_FLAG_WCE;
+		}
+		GLOBAL_CONFIG_REGISTER = flags;
+		config_write_flags(flags);
+	}
+	logic_complete(LOGIC_STATUS_GOOD);
+}
+
+static void hdd_synchronize_cache(void)
+{
+	debug(HDD, DEBUG_INFO, DEBUG_HDD_SYNC_CACHE);
+	if (! hdd_ready)
+	{
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_NOT_READY);
+		hdd_not_ready();
+		return;
+	}
+
+	if (! hdd_cache_flush())
 	{
-		logic_data_out_dummy(length);
+		debug(HDD, DEBUG_INFO, DEBUG_HDD_MEM_CARD_BUSY);
+		logic_complete(LOGIC_STATUS_BUSY);
+		return;
 	}
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	if (hdd_cache_report_error()) return;
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 /*
@@ -946,18 +1967,299 @@ static void hdd_mode_select(uint8_t* cmd)
  * ============================================================================
  */
 
-void hdd_set_ready(uint32_t blocks)
+void hdd_init(uint8_t rst_stat)
 {
-	/*
-	 * We strip off the low 12 bits to conform with the sizing reported by the
-	 * rigid disk geometry page in MODE SENSE.
-	 */
-	capacity_data[0] = (uint8_t) (blocks >> 24);
-	capacity_data[1] = (uint8_t) (blocks >> 16);
-	capacity_data[2] = (uint8_t) ((blocks >> 8) & 0xF0);
-	capacity_data[3] = 0;
-	hdd_ready = 1;
+	uint8_t valid = (rst_stat & RST_SRF_bm)
+			&& ! (rst_stat & (RST_PORF_bm | RST_BORF_bm))
+			&& cache.magic == HDD_CACHE_MAGIC
+			&& cache.lba_check == ~cache.lba
+			&& cache.count <= HDD_CACHE_BLOCKS;
+	if (! valid)
+	{
+		cache.magic = HDD_CACHE_MAGIC;
+		cache.count = 0;
+	}
+}
+
+uint8_t hdd_cache_task(void)
+{
+	if (! hdd_ready || cache.count == 0) return MAIN_TASK_IDLE;
+
+	// let more writes arrive unless the run can't grow or has gotten old
+	uint32_t now = system_time32();
+	if (cache.count < HDD_CACHE_BLOCKS
+			&& cache.lba + cache.count < cache_limit
+			&& now - cache_time < HDD_CACHE_DELAY
+			&& now - cache_start < HDD_CACHE_MAX_AGE)
+	{
+		return MAIN_TASK_IDLE;
+	}
+	hdd_cache_flush();
+	return MAIN_TASK_IDLE;
+}
+
+/*
+ * Sets up the volume when there is no volume table, given the result of the
+ * image search: the image file if the card has one, or else the whole card.
+ * This returns false if the card could not be read well enough to tell what
+ * should be served, in which case no volumes are set up.
+ */
+static uint8_t hdd_volume_image(uint8_t result)
+{
+	FsImage* image = &setup_image;
+	if (result == FS_IMAGE_FOUND
+			&& (image->blocks <= 4096
+				|| image->blocks > card_blocks
+				|| image->start > card_blocks - image->blocks))
+	{
+		result = FS_IMAGE_INVALID;
+	}
+
+	volume_count = 1;
+	volumes[0].id = HDD_VOLUME_DEFAULT_ID;
+	if (result == FS_IMAGE_FOUND)
+	{
+		debug_dual(HDD, DEBUG_INFO, DEBUG_HDD_IMAGE_FOUND,
+				image->reads > 0xFF ? 0xFF : image->reads);
+		volumes[0].offset = image->start;
+		volumes[0].blocks = hdd_volume_size(image->blocks);
+	}
+	else if (result == FS_IMAGE_NONE)
+	{
+		volumes[0].offset = 0;
+		volumes[0].blocks = hdd_volume_size(card_blocks);
+	}
+	else
+	{
+		// don't hand out the filesystem in place of the intended image
+		debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_IMAGE_UNUSABLE, result);
+		volume_count = 0;
+	}
+	return result != FS_IMAGE_ERROR;
+}
+
+/*
+ * Sets up the volumes from the volume table in the given first block of the
+ * card, see hdd.h for the format. This returns false, leaving the volumes
+ * alone, if the block doesn't hold a volume table.
+ */
+static const uint8_t volume_magic[] PROGMEM = {
+	'S', 'C', 'U', 'Z', 'N', 'E', 'T', HDD_VOLUME_VERSION
+};
+static uint8_t hdd_volume_table(uint8_t* table)
+{
+	for (uint8_t i = 0; i < sizeof(volume_magic); i++)
+	{
+		if (table[i] != pgm_read_byte(&(volume_magic[i]))) return 0;
+	}
+
+	volume_count = 0;
+	uint8_t entries = table[HDD_VOLUME_COUNT_OFFSET];
+	for (uint8_t i = 0; i < entries && volume_count < HDD_VOLUME_MAX; i++)
+	{
+		uint8_t* e = table + HDD_VOLUME_ENTRY_OFFSET
+				+ i * HDD_VOLUME_ENTRY_LENGTH;
+		uint32_t offset = ((uint32_t) e[4] << 24)
+				| ((uint32_t) e[5] << 16)
+				| ((uint32_t) e[6] << 8)
+				| e[7];
+		uint32_t blocks = ((uint32_t) e[8] << 24)
+				| ((uint32_t) e[9] << 16)
+				| ((uint32_t) e[10] << 8)
+				| e[11];
+
+		uint8_t valid = e[0] < 8
+				&& offset > 0
+				&& blocks > 4096
+				&& offset < card_blocks
+				&& blocks <= card_blocks - offset;
+		for (uint8_t j = 0; valid && j < volume_count; j++)
+		{
+			valid = (volumes[j].id != e[0]);
+		}
+		if (! valid)
+		{
+			debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_VOLUME_INVALID, i);
+			continue;
+		}
+
+		volumes[volume_count].id = e[0];
+		volumes[volume_count].offset = offset;
+		volumes[volume_count].blocks = hdd_volume_size(blocks);
+		volume_count++;
+	}
+	debug_dual(HDD, DEBUG_INFO, DEBUG_HDD_VOLUME_TABLE, volume_count);
+	return 1;
+}
+
+uint8_t hdd_probe_task(void)
+{
+	if (! hdd_ready) return MAIN_TASK_IDLE;
+	uint32_t now = system_time32();
+	if (now - card_probe_time < HDD_CARD_PROBE_INTERVAL) return MAIN_TASK_IDLE;
+
+	// a busy card is certainly still there
+	card_probe_time = now;
+	if (! mem_op_start()) return MAIN_TASK_IDLE;
+
+	// CMD13 is answered with R2, so collect the second byte too
+	uint8_t v = mem_op_cmd(13);
+	hdd_card_skip();
+	mem_op_end();
+	if (v == 0x00)
+	{
+		card_faults = 0;
+	}
+	else
+	{
+		debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_PROBE_FAILED, v);
+		hdd_card_fault();
+	}
+	return MAIN_TASK_IDLE;
+}
+
+void hdd_set_ready(uint32_t blocks, uint8_t* scr, uint8_t* status)
+{
+	card_blocks = blocks;
+	card_flags = 0;
+	if (scr != NULL)
+	{
+		card_flags |= HDD_CARD_PRE_ERASE | HDD_CARD_ERASE;
+		if (scr[1] & 0x80)
+		{
+			card_flags |= HDD_CARD_ERASED_ONES;
+		}
+	}
+	card_au = 0;
+	if (status != NULL)
+	{
+		card_au = mem_au_size(status);
+		debug_dual(HDD, DEBUG_INFO, DEBUG_HDD_CARD_AU, status[10] >> 4);
+	}
+
+	hdd_ready = 0;
 	hdd_error = 0;
+	hdd_no_card = 0;
+	card_faults = 0;
+	card_lost = 0;
+	volume_count = 0;
+	setup_step = HDD_STEP_CRC;
+}
+
+/*
+ * Finishes hdd_setup_step() once the volumes are known.
+ */
+static uint8_t hdd_setup_done(void)
+{
+	for (uint8_t i = 0; i < volume_count; i++)
+	{
+		volumes[i].changed = card_seen;
+		if (GLOBAL_CONFIG_REGISTER & GLOBAL_FLAG_WCE)
+		{
+			volumes[i].flags = HDD_VOLUME_WCE;
+		}
+		else
+		{
+			volumes[i].flags = 0;
+		}
+	}
+	card_seen = 1;
+	card_probe_time = system_time32();
+	hdd_ready = 1;
+	return HDD_SETUP_DONE;
+}
+
+uint8_t hdd_setup_step(void)
+{
+	uint8_t result;
+	if (setup_step == HDD_STEP_CRC)
+	{
+		if ((GLOBAL_CONFIG_REGISTER & GLOBAL_FLAG_CRC) && mem_crc_enable())
+		{
+			card_flags |= HDD_CARD_CRC;
+		}
+		setup_step = HDD_STEP_CID;
+		return HDD_SETUP_MORE;
+	}
+	else if (setup_step == HDD_STEP_CID)
+	{
+		/*
+		 * Anything left in the cache from before a reset or losing the card
+		 * is only written out if this is the same card (and we can tell).
+		 */
+		uint8_t cid[16];
+		uint32_t card = 0;
+		if (mem_read_cid(cid))
+		{
+			card = ((uint32_t) cid[9] << 24)
+					| ((uint32_t) cid[10] << 16)
+					| ((uint32_t) cid[11] << 8)
+					| cid[12];
+		}
+		if (cache.count > 0 && (card == 0 || card != cache.card))
+		{
+			debug_dual(HDD, DEBUG_ERROR, DEBUG_HDD_CACHE_OTHER_CARD,
+					cache.count);
+			cache.count = 0;
+		}
+		cache.card = card;
+		setup_step = HDD_STEP_FLUSH;
+		return HDD_SETUP_MORE;
+	}
+	else if (setup_step == HDD_STEP_FLUSH)
+	{
+		/*
+		 * If the card is busy, the run stays for hdd_cache_task() to write
+		 * out later. A free cache block can hold the volume table or
+		 * filesystem.
+		 */
+		hdd_cache_flush();
+		setup_buffer = NULL;
+		if (cache.count < HDD_CACHE_BLOCKS)
+		{
+			setup_buffer = cache.data[cache.count];
+		}
+		setup_step = HDD_STEP_TABLE;
+		return HDD_SETUP_MORE;
+	}
+	else if (setup_step == HDD_STEP_TABLE)
+	{
+		if (setup_buffer != NULL && mem_read_block(0, setup_buffer))
+		{
+			if (hdd_volume_table(setup_buffer)) return hdd_setup_done();
+			fs_find_start(setup_buffer, &setup_image);
+			setup_step = HDD_STEP_IMAGE;
+			return HDD_SETUP_MORE;
+		}
+		result = FS_IMAGE_ERROR;
+	}
+	else
+	{
+		result = fs_find_step(setup_buffer, &setup_image);
+		if (result == FS_IMAGE_BUSY) return HDD_SETUP_MORE;
+	}
+
+	if (! hdd_volume_image(result)) return HDD_SETUP_FAILED;
+	return hdd_setup_done();
+}
+
+uint8_t hdd_volumes(uint8_t* ids)
+{
+	for (uint8_t i = 0; i < volume_count; i++)
+	{
+		ids[i] = volumes[i].id;
+	}
+	return volume_count;
+}
+
+uint8_t hdd_card_lost(void)
+{
+	return card_lost;
+}
+
+void hdd_set_failed(void)
+{
+	hdd_no_card = 1;
 }
 
 uint8_t hdd_has_error(void)
@@ -965,70 +2267,103 @@ uint8_t hdd_has_error(void)
 	return hdd_error;
 }
 
-void hdd_main(void)
+void hdd_main(uint8_t volume)
 {
 	if (! logic_ready()) return;
-	logic_start(0, 1);
+	uint32_t start = system_time32();
+	if (volume >= HDD_VOLUME_MAX)
+	{
+		volume = 0;
+	}
+	vol = &(volumes[volume]);
+	logic_start(volume, 1);
 
 	uint8_t cmd[10];
-	if (! logic_command(cmd)) return;
-
-	switch (cmd[0])
-	{
-		case 0x04: // FORMAT UNIT
-			hdd_format(cmd);
-			break;
-		case 0x12: // INQUIRY
-			hdd_inquiry(cmd);
-			break;
-		case 0x08: // READ(6)
-		case 0x28: // READ(10)
-			hdd_read(cmd);
-			break;
-		case 0x25: // READ CAPACITY
-			hdd_read_capacity(cmd);
-			break;
-		case 0x17: // RELEASE
-			logic_status(LOGIC_STATUS_GOOD);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
-			break;
-		case 0x03: // REQUEST SENSE
-			logic_request_sense(cmd);
-			break;
-		case 0x16: // RESERVE
-			logic_status(LOGIC_STATUS_GOOD);
-			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
-			break;
-		case 0x1D: // SEND DIAGNOSTIC
-			logic_send_diagnostic(cmd);
-			break;
-		case 0x00: // TEST UNIT READY
-			hdd_test_unit_ready();
-			break;
-		case 0x0A: // WRITE(6)
-		case 0x2A: // WRITE(10)
-			hdd_write(cmd);
-			break;
-		case 0x1A: // MODE SENSE(6)
-		case 0x5A: // MODE SENSE(10)
-			hdd_mode_sense(cmd);
-			break;
-		case 0x15: // MODE SELECT(6)
-			hdd_mode_select(cmd);
-			break;
-		case 0x2F: // VERIFY
-			hdd_verify(cmd);
-			break;
-		case 0x3C: // READ BUFFER
-			hdd_read_buffer(cmd);
-			break;
-		case 0x3B: // WRITE BUFFER
-			hdd_write_buffer(cmd);
-			break;
-		default:
-			logic_cmd_illegal_op();
+	cmd[0] = 0xFF; // counted with other opcodes if the CDB never arrives
+	if (! logic_command(cmd))
+	{
+		logic_hist_add(&hist, cmd[0], start);
+		return;
+	}
+
+	// report a changed card once, to anything but INQUIRY and REQUEST SENSE
+	if (vol->changed && cmd[0] != 0x12 && cmd[0] != 0x03)
+	{
+		vol->changed = 0;
+		logic_set_sense(SENSE_KEY_UNIT_ATTENTION, SENSE_DATA_MEDIUM_CHANGED);
+		logic_complete(LOGIC_STATUS_CHECK_CONDITION);
+	}
+	else
+	{
+		switch (cmd[0])
+		{
+			case 0x04: // FORMAT UNIT
+				hdd_format(cmd);
+				break;
+			case 0x12: // INQUIRY
+				hdd_inquiry(cmd);
+				break;
+			case 0x08: // READ(6)
+			case 0x28: // READ(10)
+				hdd_read(cmd);
+				break;
+			case 0x25: // READ CAPACITY
+				hdd_read_capacity(cmd);
+				break;
+			case 0x17: // RELEASE
+				logic_complete(LOGIC_STATUS_GOOD);
+				break;
+			case 0x03: // REQUEST SENSE
+				logic_request_sense(cmd);
+				break;
+			case 0x16: // RESERVE
+				logic_complete(LOGIC_STATUS_GOOD);
+				break;
+			case 0x1D: // SEND DIAGNOSTIC
+				logic_send_diagnostic(cmd);
+				break;
+			case 0x00: // TEST UNIT READY
+				hdd_test_unit_ready();
+				break;
+			case 0x0A: // WRITE(6)
+			case 0x2A: // WRITE(10)
+				hdd_write(cmd);
+				break;
+			case 0x1A: // MODE SENSE(6)
+			case 0x5A: // MODE SENSE(10)
+				hdd_mode_sense(cmd);
+				break;
+			case 0x15: // MODE SELECT(6)
+			case 0x55: // MODE SELECT(10)
+				hdd_mode_select(cmd);
+				break;
+			case 0x41: // WRITE SAME(10)
+				hdd_write_same(cmd);
+				break;
+			case 0x35: // SYNCHRONIZE CACHE
+				hdd_synchronize_cache();
+				break;
+			case 0x2F: // VERIFY
+				hdd_verify(cmd);
+				break;
+			case 0x3C: // READ BUFFER
+				hdd_read_buffer(cmd);
+				break;
+			case 0x3B: // WRITE BUFFER
+				hdd_write_buffer(cmd);
+				break;
+			case 0x4C: // LOG SELECT
+				logic_log_select(cmd, &hist);
+				break;
+			case 0x4D: // LOG SENSE
+				logic_log_sense(cmd, &hist);
+				break;
+			default:
+				logic_cmd_illegal_op();
+		}
 	}
 	logic_done();
+	logic_hist_add(&hist, cmd[0], start);
 }
 
 #endif /* HDD_ENABLED */
@@ -27,11 +27,48 @@
 /*
  * Simplistic hard drive emulator using a memory card as the data backend.
  * 
- * To use, call hdd_set_ready() when the memory card is activated. Whenever
- * the PHY targeting indicates the HDD is being accessed, call hdd_main(),
- * which will take over logical control of the bus to complete the operation.
+ * To use, call hdd_set_ready() when the memory card is activated, followed by
+ * hdd_setup_step() until the card has been set up. Whenever the PHY targeting
+ * indicates the HDD is being accessed, call hdd_main(), which will take over
+ * logical control of the bus to complete the operation.
  */
 
+/*
+ * The card can be split into several volumes, each answering as its own
+ * target, by putting a volume table in the first block of the card. That
+ * block is never part of a volume. The table is laid out as follows:
+ * 
+ * Bytes 0-7: 'SCUZNET' in ASCII, followed by HDD_VOLUME_VERSION.
+ * Byte 8: number of entries that follow.
+ * Bytes 9-15: reserved, should be 0.
+ * 
+ * Then, starting at byte 16, each entry is 12 bytes:
+ * 
+ * Byte 0: SCSI ID of the volume, 0-7.
+ * Bytes 1-3: reserved, should be 0.
+ * Bytes 4-7: first block of the volume on the card, in big endian order.
+ * Bytes 8-11: length of the volume in blocks, in big endian order.
+ * 
+ * Volumes must not overlap, start at block 0, or run past the end of the
+ * card, and must be longer than 4096 blocks; entries that break these rules,
+ * or repeat an ID, are skipped. Only the first HDD_VOLUME_MAX good entries
+ * are used. Each length is rounded down to a multiple of 4096, plus one, to
+ * match the drive geometry reported by MODE SENSE.
+ * 
+ * Without a table, a single volume answers on the ID in the device
+ * configuration. If the card has a FAT32 or exFAT filesystem with a
+ * contiguous SCUZNET.IMG in the root directory, that file is the volume (see
+ * fs.h); if the file is there but can't be used, no volume is served, so the
+ * filesystem is not exposed by mistake. Otherwise the volume is the whole
+ * card. Writes to an image never change its size or location, so the
+ * filesystem stays intact.
+ */
+#define HDD_VOLUME_VERSION      1
+#define HDD_VOLUME_COUNT_OFFSET 8
+#define HDD_VOLUME_ENTRY_OFFSET 16
+#define HDD_VOLUME_ENTRY_LENGTH 12
+#define HDD_VOLUME_DEFAULT_ID   0xFF
+
 /*
  * Note: the following commands must be supported for direct-access devices:
  * 
@@ -47,14 +84,94 @@
  * TEST UNIT READY      (0x00)
  * WRITE(6)             (0x0A)
  * WRITE(10)            (0x2A)
+ * 
+ * WRITE SAME(10) (0x41) is also supported, so that disks can be cleared
+ * without sending every block over the bus.
  */
 
+/*
+ * Called once during startup with the RST.STATUS value, before the card is
+ * initialized. Unless this was a software reset, such as from /RST or BUS
+ * DEVICE RESET, any write-back cache contents left in SRAM are discarded.
+ */
+void hdd_init(uint8_t);
+
 /*
  * Called when the memory card has been detected and is ready to go. This
  * should be provided with the number of 512 byte blocks the card has been
- * detected as having.
+ * detected as having, the 8 byte SCR, and the 64 byte SD Status, with NULL
+ * for the last two if they could not be read. The SCR and SD Status are not
+ * needed after this returns.
+ * 
+ * The rest of the setup is done by hdd_setup_step(), which must then be
+ * called until it gives back something other than HDD_SETUP_MORE. Commands
+ * are answered with NOT READY until it is finished.
+ */
+void hdd_set_ready(uint32_t, uint8_t*, uint8_t*);
+
+/*
+ * Takes the next step in setting up a card given to hdd_set_ready(). Each
+ * step does at most one or two card operations, so selection isn't held off
+ * for long between calls.
+ * 
+ * Any write-back cache contents kept by hdd_init() or from before the card
+ * was lost are written to the card along the way, but only if it is the
+ * same card they were meant for. Then the volume table is read from the
+ * card, or failing that the image file is looked for. Once this has given
+ * back HDD_SETUP_DONE, hdd_volumes() gives the targets that should be
+ * answered. If this is not the first card, the next command to each volume
+ * is answered with UNIT ATTENTION, MEDIUM MAY HAVE CHANGED.
+ * 
+ * If the card could not be read well enough to find the volumes, this gives
+ * back HDD_SETUP_FAILED and the HDD is left not ready; hdd_set_failed()
+ * should be called and the card brought up again later.
+ */
+#define HDD_SETUP_MORE          0
+#define HDD_SETUP_DONE          1
+#define HDD_SETUP_FAILED        2
+uint8_t hdd_setup_step(void);
+
+/*
+ * Writes the SCSI ID of each volume on the card into the given array, which
+ * must be at least HDD_VOLUME_MAX bytes long, in volume number order, and
+ * returns the number of volumes. HDD_VOLUME_DEFAULT_ID stands for the ID in
+ * the device configuration. This is only valid after hdd_setup_step() has
+ * given back HDD_SETUP_DONE.
+ */
+uint8_t hdd_volumes(uint8_t*);
+
+/*
+ * Provides whether the card has been given up on after repeated failures,
+ * presumably because it was removed. When this is true, the card should be
+ * brought up again from scratch with mem_reset_card() and mem_init_card(),
+ * then hdd_set_ready() or hdd_set_failed() called as at startup. Commands are
+ * answered with NOT READY in the meantime.
+ */
+uint8_t hdd_card_lost(void);
+
+/*
+ * Background task that checks the card is still there while it is idle, as
+ * described for HDD_CARD_PROBE_INTERVAL. This should be registered with
+ * main_task_add().
+ */
+uint8_t hdd_probe_task(void);
+
+/*
+ * Called instead of hdd_set_ready() if the memory card could not be brought
+ * up at all, or after hdd_setup_step() fails. Until the card is ready or this
+ * is called, commands that need the card are answered with NOT READY,
+ * LOGICAL UNIT BECOMING READY; after this they are answered with NOT READY,
+ * MEDIUM NOT PRESENT.
+ */
+void hdd_set_failed(void);
+
+/*
+ * Background task that writes the write-back cache out to the card once
+ * writes have stopped arriving for HDD_CACHE_DELAY, once the oldest write in
+ * it reaches HDD_CACHE_MAX_AGE, or once it can't grow any further. This
+ * should be registered with main_task_add().
  */
-void hdd_set_ready(uint32_t);
+uint8_t hdd_cache_task(void);
 
 /*
  * Provides whether or not the memory card has experienced a major error.
@@ -68,10 +185,12 @@ void hdd_set_ready(uint32_t);
 uint8_t hdd_has_error(void);
 
 /*
- * Called whenever the PHY detects that the hard drive has been selected. This
- * will proceed through the bus phases as needed.
+ * Called whenever the PHY detects that the hard drive has been selected, with
+ * the number of the volume for the selected target. This will proceed through
+ * the bus phases as needed. Before the card is ready, volume 0 should be used
+ * for the ID in the device configuration.
  */
-void hdd_main(void);
+void hdd_main(uint8_t);
 
 #endif /* HDD_ENABLED */
 
@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "bus.h"
+#include "card.h"
+#include "enc28j60.h"
+#include "host.h"
+#include "sim.h"
+
+/*
+ * ============================================================================
+ * 
+ *   STORAGE BENCHMARK
+ * 
+ * ============================================================================
+ * 
+ * Runs a reproducible mix of READ(10) and WRITE(10) commands against the
+ * firmware, with the simulated card timing given on the command line, and
+ * reports throughput and command latency percentiles. Every block written is
+ * remembered by version, and every block read is checked against it, so the
+ * benchmark also catches caching mistakes.
+ * 
+ * The mixes are:
+ * 
+ * seq:    64 block transfers that walk through the region, half reads.
+ * random: 8 block transfers at random 4KB aligned places, 70% reads.
+ * hfs:    what an HFS volume sees while copying many small files: single
+ *         block updates of the master directory block and the volume bitmap,
+ *         single block B-tree node reads and writes in the catalog area near
+ *         the start of the volume, and 16 block file data transfers
+ *         elsewhere, about 65% reads.
+ */
+
+#define BENCH_HDD_ID            3
+#define BENCH_LINK_ID           4
+#define BENCH_MAX_BLOCKS        256
+
+#define BENCH_MIX_SEQ           0
+#define BENCH_MIX_RANDOM        1
+#define BENCH_MIX_HFS           2
+
+// HFS layout, in blocks from the start of the volume
+#define BENCH_HFS_MDB           2
+#define BENCH_HFS_BITMAP        3
+#define BENCH_HFS_BITMAP_BLOCKS 16
+#define BENCH_HFS_CATALOG       64
+#define BENCH_HFS_CATALOG_BLOCKS 2048
+
+typedef struct BenchStats_t {
+	uint32_t count;
+	uint64_t bytes;
+	uint64_t busy;
+	uint64_t* latency;
+} BenchStats;
+
+static Card card;
+static Enc28j60 enc;
+static BusCommand command;
+static uint8_t data_in[BENCH_MAX_BLOCKS * 512];
+static uint8_t data_out[BENCH_MAX_BLOCKS * 512];
+
+// options
+static uint8_t mix = BENCH_MIX_RANDOM;
+static uint32_t ops = 1000;
+static int16_t read_pct = -1;
+static uint16_t length;
+static uint32_t region = 32 * 2048;
+static uint32_t seed = 1;
+static uint32_t think;
+static uint8_t flags = GLOBAL_FLAG_PARITY;
+static uint8_t imaged;
+
+// progress
+static uint8_t ready;
+static uint32_t issued;
+static uint32_t mismatches;
+static uint32_t cursor;
+static uint32_t random_state;
+static uint16_t* versions;
+static uint16_t next_version;
+static uint64_t first_start;
+static BenchStats reads, writes;
+
+static uint32_t bench_random(void)
+{
+	// xorshift32
+	uint32_t x = random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random_state = x;
+	return x;
+}
+
+static uint32_t bench_block_seed(uint32_t lba, uint16_t version)
+{
+	return (lba * 65599UL) ^ ((uint32_t) version << 20) ^ seed;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   COMMANDS
+ * 
+ * ============================================================================
+ */
+
+static void bench_rw(uint8_t write, uint32_t lba, uint16_t blocks)
+{
+	if (lba + blocks > region)
+	{
+		lba = region - blocks;
+	}
+
+	memset(&command, 0, sizeof(command));
+	command.start_at = sim_now + (uint64_t) think * 1000;
+	command.id = BENCH_HDD_ID;
+	command.identify = 0x80;
+	command.cdb[0] = write ? 0x2A : 0x28;
+	command.cdb[2] = (uint8_t) (lba >> 24);
+	command.cdb[3] = (uint8_t) (lba >> 16);
+	command.cdb[4] = (uint8_t) (lba >> 8);
+	command.cdb[5] = (uint8_t) lba;
+	command.cdb[7] = (uint8_t) (blocks >> 8);
+	command.cdb[8] = (uint8_t) blocks;
+	command.in = data_in;
+	command.out = data_out;
+
+	if (write)
+	{
+		uint16_t version = ++next_version;
+		if (next_version == 0xFFFF)
+		{
+			next_version = 0;
+		}
+		for (uint16_t b = 0; b < blocks; b++)
+		{
+			versions[lba + b] = version;
+			uint32_t s = bench_block_seed(lba + b, version);
+			for (uint16_t i = 0; i < 512; i++)
+			{
+				data_out[b * 512 + i] = host_pattern(s, i);
+			}
+		}
+		command.out_len = blocks * 512UL;
+	}
+	else
+	{
+		command.in_max = blocks * 512UL;
+	}
+}
+
+static void bench_check(BusCommand* c)
+{
+	uint32_t lba = ((uint32_t) c->cdb[2] << 24) | ((uint32_t) c->cdb[3] << 16)
+			| ((uint32_t) c->cdb[4] << 8) | c->cdb[5];
+	uint16_t blocks = (c->cdb[7] << 8) | c->cdb[8];
+	uint8_t write = c->cdb[0] == 0x2A;
+	BenchStats* stats = write ? &writes : &reads;
+
+	if (c->status != 0x00 || c->timeout)
+	{
+		bus_error("%s at %lu, %u blocks: status %02X",
+				write ? "WRITE" : "READ", (unsigned long) lba, blocks,
+				c->status);
+	}
+	else if (! write)
+	{
+		if (c->in_len != blocks * 512UL)
+		{
+			bus_error("READ at %lu: %lu bytes", (unsigned long) lba,
+					(unsigned long) c->in_len);
+		}
+		for (uint16_t b = 0; b < blocks && b * 512UL < c->in_len; b++)
+		{
+			uint16_t version = versions[lba + b];
+			// blocks of an image that were never written could hold anything
+			if (version == 0 && imaged) continue;
+			uint32_t s = bench_block_seed(lba + b, version);
+			for (uint16_t i = 0; i < 512; i++)
+			{
+				uint8_t expect = version ? host_pattern(s, i) : 0x00;
+				if (c->in[b * 512 + i] != expect)
+				{
+					if (mismatches++ < 10)
+					{
+						bus_error("READ block %lu has wrong data at byte %u",
+								(unsigned long) (lba + b), i);
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	stats->latency[stats->count] = c->ended - c->selected;
+	stats->count++;
+	stats->bytes += blocks * 512UL;
+	stats->busy += c->ended - c->selected;
+}
+
+/*
+ * Picks the next command for the chosen mix.
+ */
+static void bench_pick(void)
+{
+	uint32_t r = bench_random();
+	uint8_t write;
+	if (mix == BENCH_MIX_SEQ)
+	{
+		uint16_t n = length ? length : 64;
+		write = (r % 100) >= (uint32_t) (read_pct >= 0 ? read_pct : 50);
+		if (cursor + n > region)
+		{
+			cursor = 0;
+		}
+		bench_rw(write, cursor, n);
+		cursor += n;
+	}
+	else if (mix == BENCH_MIX_RANDOM)
+	{
+		uint16_t n = length ? length : 8;
+		write = (r % 100) >= (uint32_t) (read_pct >= 0 ? read_pct : 70);
+		uint32_t slots = region / n;
+		bench_rw(write, (bench_random() % slots) * n, n);
+	}
+	else
+	{
+		write = (r % 100) >= (uint32_t) (read_pct >= 0 ? read_pct : 65);
+		uint32_t kind = bench_random() % 100;
+		if (kind < 10)
+		{
+			bench_rw(write, BENCH_HFS_MDB, 1);
+		}
+		else if (kind < 20)
+		{
+			bench_rw(write, BENCH_HFS_BITMAP
+					+ bench_random() % BENCH_HFS_BITMAP_BLOCKS, 1);
+		}
+		else if (kind < 60)
+		{
+			bench_rw(write, BENCH_HFS_CATALOG
+					+ bench_random() % BENCH_HFS_CATALOG_BLOCKS, 1);
+		}
+		else
+		{
+			uint16_t n = length ? length : 16;
+			uint32_t base = BENCH_HFS_CATALOG + BENCH_HFS_CATALOG_BLOCKS;
+			uint32_t slots = (region - base) / n;
+			bench_rw(write, base + (bench_random() % slots) * n, n);
+		}
+	}
+}
+
+/*
+ * ============================================================================
+ * 
+ *   REPORT
+ * 
+ * ============================================================================
+ */
+
+static void bench_report_line(const char* name, BenchStats* stats)
+{
+	double mb = stats->bytes / 1048576.0;
+	printf("%-6s %7lu %9.2f %8.3f %8.1f %8.1f %8.1f %8.1f\n",
+			name, (unsigned long) stats->count, mb,
+			stats->busy ? mb / (stats->busy / 1e9) : 0.0,
+			host_percentile(stats->latency, stats->count, 50) / 1000.0,
+			host_percentile(stats->latency, stats->count, 90) / 1000.0,
+			host_percentile(stats->latency, stats->count, 99) / 1000.0,
+			host_percentile(stats->latency, stats->count, 100) / 1000.0);
+}
+
+static void bench_report(void)
+{
+	static const char* names[] = { "seq", "random", "hfs" };
+	uint64_t elapsed = sim_now - first_start;
+	BenchStats all;
+	all.count = reads.count + writes.count;
+	all.bytes = reads.bytes + writes.bytes;
+	all.busy = reads.busy + writes.busy;
+	all.latency = malloc(sizeof(uint64_t) * (all.count + 1));
+	memcpy(all.latency, reads.latency, sizeof(uint64_t) * reads.count);
+	memcpy(all.latency + reads.count, writes.latency,
+			sizeof(uint64_t) * writes.count);
+
+	printf("mix %s, %lu commands over %lu blocks, seed %lu, flags %02X\n",
+			names[mix], (unsigned long) ops, (unsigned long) region,
+			(unsigned long) seed, flags);
+	printf("card: access %lu us, next block %lu us, write busy %lu us, "
+			"spikes of %lu us at %lu ppm\n",
+			(unsigned long) (card.timing.read / 1000),
+			(unsigned long) (card.timing.read_next / 1000),
+			(unsigned long) (card.timing.write / 1000),
+			(unsigned long) (card.timing.spike / 1000),
+			(unsigned long) card.timing.spike_ppm);
+	printf("%-6s %7s %9s %8s %8s %8s %8s %8s\n",
+			"", "cmds", "MB", "MB/s", "p50 us", "p90 us", "p99 us", "max us");
+	bench_report_line("READ", &reads);
+	bench_report_line("WRITE", &writes);
+	bench_report_line("all", &all);
+	printf("%.3f MB/s over %.1f ms; card read %lu, wrote %lu blocks, "
+			"%lu spikes; %lu bad reads\n",
+			elapsed ? (all.bytes / 1048576.0) / (elapsed / 1e9) : 0.0,
+			elapsed / 1e6,
+			(unsigned long) card.reads, (unsigned long) card.writes,
+			(unsigned long) card.spikes, (unsigned long) mismatches);
+	free(all.latency);
+}
+
+static BusCommand* bench_next(void* ctx, BusCommand* done)
+{
+	(void) ctx;
+	if (! ready)
+	{
+		if (done != NULL && done->status == 0x00)
+		{
+			ready = 1;
+		}
+		else
+		{
+			if (done != NULL && sim_now > 5000000000ULL)
+			{
+				bus_error("card never became ready");
+				return NULL;
+			}
+			memset(&command, 0, sizeof(command));
+			command.start_at = sim_now + (done ? 10000000 : 0);
+			command.id = BENCH_HDD_ID;
+			command.identify = 0x80;
+			return &command;
+		}
+	}
+	else if (done != NULL)
+	{
+		bench_check(done);
+	}
+
+	if (issued == ops)
+	{
+		bench_report();
+		return NULL;
+	}
+	bench_pick();
+	if (issued == 0)
+	{
+		first_start = command.start_at;
+	}
+	issued++;
+	return &command;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   SETUP
+ * 
+ * ============================================================================
+ */
+
+static void bench_usage(void)
+{
+	fprintf(stderr,
+			"usage: scuznet disk [options]\n"
+			"  -m seq|random|hfs  command mix (random)\n"
+			"  -n count           commands to run (1000)\n"
+			"  -l blocks          transfer length, instead of the mix's\n"
+			"  -r percent         reads, instead of the mix's\n"
+			"  -z MB              region of the disk used (32)\n"
+			"  -t us              think time between commands (0)\n"
+			"  -s seed            for the mix and the card (1)\n"
+			"  -f hex             configuration flags, see SETTINGS.html (01)\n"
+			"  -i image           card image, instead of a blank card\n"
+			"  -c MB              blank card size (64)\n"
+			"  -a us              card read access latency (100)\n"
+			"  -b us              card latency between CMD18 blocks (0)\n"
+			"  -w us              card busy after each block written (250)\n"
+			"  -k us              card busy spike length (0)\n"
+			"  -p ppm             card busy spike chance per block (0)\n");
+	exit(EXIT_FAILURE);
+}
+
+int bench_disk(int argc, char** argv)
+{
+	const char* image = NULL;
+	uint32_t card_mb = 64;
+	CardTiming timing = {
+		.read = CARD_READ_NS,
+		.read_next = CARD_READ_NEXT_NS,
+		.write = CARD_WRITE_NS,
+		.erase = CARD_ERASE_NS,
+		.stop = CARD_STOP_NS
+	};
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* a = argv[i];
+		if (a[0] != '-' || a[1] == '\0' || a[2] != '\0' || i + 1 >= argc)
+		{
+			bench_usage();
+		}
+		const char* v = argv[++i];
+		uint32_t n = (uint32_t) strtoul(v, NULL, 0);
+		switch (a[1])
+		{
+			case 'm':
+				if (! strcmp(v, "seq")) mix = BENCH_MIX_SEQ;
+				else if (! strcmp(v, "random")) mix = BENCH_MIX_RANDOM;
+				else if (! strcmp(v, "hfs")) mix = BENCH_MIX_HFS;
+				else bench_usage();
+				break;
+			case 'n': ops = n; break;
+			case 'l': length = (uint16_t) n; break;
+			case 'r': read_pct = (int16_t) n; break;
+			case 'z': region = n * 2048; break;
+			case 't': think = n; break;
+			case 's': seed = n; break;
+			case 'f': flags = (uint8_t) strtoul(v, NULL, 16); break;
+			case 'i': image = v; imaged = 1; break;
+			case 'c': card_mb = n; break;
+			case 'a': timing.read = n * 1000; break;
+			case 'b': timing.read_next = n * 1000; break;
+			case 'w': timing.write = n * 1000; break;
+			case 'k': timing.spike = n * 1000; break;
+			case 'p': timing.spike_ppm = n; break;
+			default: bench_usage();
+		}
+	}
+	if (length > BENCH_MAX_BLOCKS || read_pct > 100)
+	{
+		bench_usage();
+	}
+
+	if (image != NULL ? ! card_open(&card, image)
+			: ! card_blank(&card, card_mb * 2048))
+	{
+		return EXIT_FAILURE;
+	}
+	// keep clear of the end of the card, which is not part of the volume
+	if (region > card.blocks - 4096)
+	{
+		region = card.blocks - 4096;
+	}
+	if (region < BENCH_HFS_CATALOG + BENCH_HFS_CATALOG_BLOCKS + 256)
+	{
+		fprintf(stderr, "region too small\n");
+		return EXIT_FAILURE;
+	}
+	versions = calloc(region, sizeof(uint16_t));
+	reads.latency = calloc(ops + 1, sizeof(uint64_t));
+	writes.latency = calloc(ops + 1, sizeof(uint64_t));
+	if (versions == NULL || reads.latency == NULL || writes.latency == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	timing.seed = seed;
+	card.timing = timing;
+	random_state = seed ? seed * 2654435761UL : 1;
+	host_config(flags, BENCH_HDD_ID, BENCH_LINK_ID);
+	card_attach(&card);
+	enc28j60_attach(&enc);
+	bus_init();
+	bus_run(bench_next, NULL);
+	return firmware_main();
+}
@@ -0,0 +1,500 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "bus.h"
+#include "card.h"
+#include "enc28j60.h"
+#include "host.h"
+#include "pcap.h"
+#include "sim.h"
+
+/*
+ * ============================================================================
+ * 
+ *   LINK BENCHMARK
+ * 
+ * ============================================================================
+ * 
+ * Replays a capture through the firmware. Frames sent by the Macintosh in
+ * the capture are given to the firmware with 0x0A commands at their capture
+ * times, the way the DaynaPort driver sends them; all others arrive at the
+ * simulated Ethernet controller at their capture times. The driver polls with
+ * 0x08 commands at a fixed interval, and polls again at once when the last
+ * read said more frames were waiting.
+ * 
+ * Each frame read is checked against the one that arrived, and each frame
+ * the controller transmits against the one sent, and transmitted frames can
+ * be saved to a capture for further checks.
+ */
+
+#define BENCH_HDD_ID            3
+#define BENCH_LINK_ID           4
+#define BENCH_READ_LENGTH       1524
+#define BENCH_MAX_PENDING       1024
+
+static Card card;
+static Enc28j60 enc;
+static BusCommand command;
+static uint8_t data_in[BENCH_READ_LENGTH];
+static uint8_t data_out[PCAP_MAX_FRAME + 8];
+
+// options
+static uint32_t interval = 10000;
+static uint32_t speed = 100;
+static uint8_t mac[6];
+static uint8_t capture_mac[6];
+static FILE* output;
+
+// the capture, split by direction
+static PcapFrame* frames;
+static uint32_t frame_count;
+static uint32_t* rx_list;
+static uint32_t rx_count;
+static uint32_t rx_next;
+static uint32_t* tx_list;
+static uint32_t tx_count;
+static uint32_t tx_next;
+
+// frames in flight, by index into frames, with their arrival times
+static uint32_t accepted[BENCH_MAX_PENDING];
+static uint32_t accepted_head, accepted_len;
+static uint32_t sent[BENCH_MAX_PENDING];
+static uint32_t sent_head, sent_len;
+
+// progress
+static uint8_t started;
+static uint8_t more;
+static uint8_t empty;
+static uint64_t start;
+static uint64_t last_poll;
+
+// results
+static uint32_t rx_delivered, tx_done;
+static uint32_t polls, empty_polls, sends;
+static uint32_t mismatches;
+static uint64_t bus_bytes;
+static uint64_t* rx_dwell;
+static uint64_t* tx_dwell;
+
+static uint64_t bench_time(uint32_t frame)
+{
+	return start + frames[frame].time * 100 / speed;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   CONTROLLER
+ * 
+ * ============================================================================
+ */
+
+static void bench_arrive(void* ctx, uint64_t now)
+{
+	(void) ctx;
+	if (! started) return;
+	while (rx_next < rx_count && bench_time(rx_list[rx_next]) <= now)
+	{
+		uint32_t f = rx_list[rx_next++];
+		if (enc28j60_receive(&enc, frames[f].data, frames[f].length))
+		{
+			if (accepted_len == BENCH_MAX_PENDING)
+			{
+				bus_error("too many frames waiting");
+				exit(EXIT_FAILURE);
+			}
+			accepted[(accepted_head + accepted_len++) % BENCH_MAX_PENDING] = f;
+		}
+	}
+}
+
+static void bench_transmit(void* ctx, const uint8_t* data, uint16_t length,
+		uint64_t when)
+{
+	(void) ctx;
+	if (output != NULL)
+	{
+		pcap_write(output, when - start, data, length);
+	}
+	if (sent_len == 0)
+	{
+		bus_error("transmitted a frame that was never sent");
+		return;
+	}
+	uint32_t f = sent[sent_head];
+	sent_head = (sent_head + 1) % BENCH_MAX_PENDING;
+	sent_len--;
+
+	// short frames are padded
+	if (length < frames[f].length
+			|| memcmp(data, frames[f].data, frames[f].length) != 0)
+	{
+		if (mismatches++ < 10)
+		{
+			bus_error("transmitted frame %lu differs from the one sent",
+					(unsigned long) f);
+		}
+	}
+	tx_dwell[tx_done++] = when - bench_time(f);
+}
+
+/*
+ * ============================================================================
+ * 
+ *   DRIVER
+ * 
+ * ============================================================================
+ */
+
+static void bench_command(uint64_t at, const uint8_t* cdb)
+{
+	memset(&command, 0, sizeof(command));
+	command.start_at = at;
+	command.id = BENCH_LINK_ID;
+	command.identify = 0x80;
+	memcpy(command.cdb, cdb, 6);
+	command.in = data_in;
+	command.in_max = sizeof(data_in);
+	command.out = data_out;
+}
+
+static void bench_send(uint64_t at)
+{
+	uint32_t f = tx_list[tx_next++];
+	uint16_t length = frames[f].length;
+	const uint8_t cdb[6] = {
+		0x0A, 0x00, 0x00, (uint8_t) (length >> 8), (uint8_t) length, 0x80
+	};
+	bench_command(at, cdb);
+
+	// the length, the frame, and four bytes the firmware skips
+	memset(data_out, 0, length + 8);
+	data_out[0] = (uint8_t) (length >> 8);
+	data_out[1] = (uint8_t) length;
+	memcpy(data_out + 4, frames[f].data, length);
+	command.out_len = length + 8;
+
+	if (sent_len == BENCH_MAX_PENDING)
+	{
+		bus_error("too many frames being sent");
+		exit(EXIT_FAILURE);
+	}
+	sent[(sent_head + sent_len++) % BENCH_MAX_PENDING] = f;
+}
+
+static void bench_poll(uint64_t at)
+{
+	const uint8_t cdb[6] = {
+		0x08, 0x00, 0x00,
+		(uint8_t) (BENCH_READ_LENGTH >> 8), (uint8_t) BENCH_READ_LENGTH,
+		0xC0
+	};
+	bench_command(at, cdb);
+}
+
+static void bench_read_done(BusCommand* c)
+{
+	polls++;
+	last_poll = c->selected;
+	uint16_t length = (c->in_len >= 6) ? ((c->in[0] << 8) | c->in[1]) : 0;
+	more = (c->in_len >= 6) && (c->in[5] & 0x10);
+	empty = (length == 0);
+	if (empty)
+	{
+		empty_polls++;
+		return;
+	}
+
+	if (accepted_len == 0)
+	{
+		bus_error("read a frame that never arrived");
+		return;
+	}
+	uint32_t f = accepted[accepted_head];
+	accepted_head = (accepted_head + 1) % BENCH_MAX_PENDING;
+	accepted_len--;
+
+	// the length given includes the FCS
+	if (length != frames[f].length + 4 || c->in_len != 6U + length
+			|| memcmp(c->in + 6, frames[f].data, frames[f].length) != 0)
+	{
+		if (mismatches++ < 10)
+		{
+			bus_error("frame %lu read back wrong, %u bytes",
+					(unsigned long) f, length);
+		}
+	}
+	rx_dwell[rx_delivered++] = c->in_done - bench_time(f);
+}
+
+static void bench_report(void)
+{
+	// let the last transmission finish
+	enc28j60_update(&enc, UINT64_MAX);
+	uint64_t elapsed = sim_now - start;
+	double seconds = elapsed / 1e9;
+	uint32_t moved = rx_delivered + tx_done;
+
+	printf("%lu frames in the capture: %lu to the Mac, %lu from it\n",
+			(unsigned long) frame_count, (unsigned long) rx_count,
+			(unsigned long) tx_count);
+	printf("polling every %lu us, at %lu%% of capture speed, over %.1f ms\n",
+			(unsigned long) interval, (unsigned long) speed, elapsed / 1e6);
+	printf("received %lu frames (%.1f/s): %lu filtered, %lu overflowed\n",
+			(unsigned long) rx_delivered, rx_delivered / seconds,
+			(unsigned long) enc.rx_filtered,
+			(unsigned long) enc.rx_overflows);
+	printf("sent %lu frames (%.1f/s): %lu aborted by the next send\n",
+			(unsigned long) tx_done, tx_done / seconds,
+			(unsigned long) enc.tx_aborted);
+	printf("%.1f frames/s; %lu polls, %lu empty, %lu sends; "
+			"%.1f bus bytes per frame\n",
+			moved / seconds, (unsigned long) polls,
+			(unsigned long) empty_polls, (unsigned long) sends,
+			moved ? (double) bus_bytes / moved : 0.0);
+	printf("%-8s %8s %8s %8s %8s\n",
+			"", "p50 us", "p90 us", "p99 us", "max us");
+	printf("%-8s %8.1f %8.1f %8.1f %8.1f\n", "RX dwell",
+			host_percentile(rx_dwell, rx_delivered, 50) / 1000.0,
+			host_percentile(rx_dwell, rx_delivered, 90) / 1000.0,
+			host_percentile(rx_dwell, rx_delivered, 99) / 1000.0,
+			host_percentile(rx_dwell, rx_delivered, 100) / 1000.0);
+	printf("%-8s %8.1f %8.1f %8.1f %8.1f\n", "TX dwell",
+			host_percentile(tx_dwell, tx_done, 50) / 1000.0,
+			host_percentile(tx_dwell, tx_done, 90) / 1000.0,
+			host_percentile(tx_dwell, tx_done, 99) / 1000.0,
+			host_percentile(tx_dwell, tx_done, 100) / 1000.0);
+	if (mismatches)
+	{
+		printf("%lu frames were corrupted\n", (unsigned long) mismatches);
+	}
+	if (output != NULL)
+	{
+		fclose(output);
+	}
+}
+
+static BusCommand* bench_next(void* ctx, BusCommand* done)
+{
+	(void) ctx;
+	if (done != NULL)
+	{
+		if (done->status != 0x00 || done->timeout)
+		{
+			bus_error("command %02X: status %02X", done->cdb[0], done->status);
+		}
+		bus_bytes += 1 + 6 + done->in_len + done->out_taken + 2;
+		if (! started)
+		{
+			// the link is up once its first command completes
+			started = 1;
+			start = sim_now;
+			last_poll = start;
+			bus_bytes = 0;
+		}
+		else if (done->cdb[0] == 0x08)
+		{
+			bench_read_done(done);
+		}
+	}
+	else
+	{
+		const uint8_t inquiry[6] = { 0x12, 0x00, 0x00, 0x00, 0xFF, 0x00 };
+		bench_command(sim_now, inquiry);
+		return &command;
+	}
+	enc28j60_update(&enc, sim_now);
+
+	uint64_t poll_at = last_poll + (uint64_t) interval * 1000;
+	if (tx_next < tx_count && bench_time(tx_list[tx_next]) <= sim_now)
+	{
+		sends++;
+		bench_send(sim_now);
+	}
+	else if (more)
+	{
+		bench_poll(sim_now);
+	}
+	else if (tx_next < tx_count && bench_time(tx_list[tx_next]) < poll_at)
+	{
+		sends++;
+		bench_send(bench_time(tx_list[tx_next]));
+	}
+	else if (rx_next == rx_count && tx_next == tx_count
+			&& accepted_len == 0 && empty)
+	{
+		bench_report();
+		return NULL;
+	}
+	else if (rx_next == rx_count && tx_next == tx_count && empty
+			&& enc28j60_pending(&enc) == 0)
+	{
+		bus_error("%lu frames lost in the controller",
+				(unsigned long) accepted_len);
+		bench_report();
+		return NULL;
+	}
+	else
+	{
+		bench_poll(poll_at);
+	}
+	return &command;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   SETUP
+ * 
+ * ============================================================================
+ */
+
+static void bench_usage(void)
+{
+	fprintf(stderr,
+			"usage: scuznet link [options] <capture.pcap>\n"
+			"  -p us              driver polling interval (10000)\n"
+			"  -x percent         replay speed, of capture time (100)\n"
+			"  -a mac             the Mac's address in the capture, as\n"
+			"                     xx:xx:xx:xx:xx:xx (the firmware's)\n"
+			"  -o output.pcap     save the frames the firmware transmits\n");
+	exit(EXIT_FAILURE);
+}
+
+static uint8_t bench_parse_mac(const char* text, uint8_t* dst)
+{
+	unsigned int b[6];
+	if (sscanf(text, "%x:%x:%x:%x:%x:%x",
+			&b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+	{
+		return 0;
+	}
+	for (uint8_t i = 0; i < 6; i++)
+	{
+		dst[i] = (uint8_t) b[i];
+	}
+	return 1;
+}
+
+int bench_link(int argc, char** argv)
+{
+	const char* input = NULL;
+	const char* output_path = NULL;
+	const uint8_t firmware_mac[6] = {
+		NET_MAC_DEFAULT_ADDR_1, NET_MAC_DEFAULT_ADDR_2,
+		NET_MAC_DEFAULT_ADDR_3, NET_MAC_DEFAULT_ADDR_4,
+		NET_MAC_DEFAULT_ADDR_5, NET_MAC_DEFAULT_ADDR_6
+	};
+	memcpy(mac, firmware_mac, sizeof(mac));
+	memcpy(capture_mac, firmware_mac, sizeof(mac));
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* a = argv[i];
+		if (a[0] != '-')
+		{
+			if (input != NULL) bench_usage();
+			input = a;
+			continue;
+		}
+		if (a[1] == '\0' || a[2] != '\0' || i + 1 >= argc)
+		{
+			bench_usage();
+		}
+		const char* v = argv[++i];
+		switch (a[1])
+		{
+			case 'p': interval = (uint32_t) strtoul(v, NULL, 0); break;
+			case 'x': speed = (uint32_t) strtoul(v, NULL, 0); break;
+			case 'o': output_path = v; break;
+			case 'a':
+				if (! bench_parse_mac(v, capture_mac)) bench_usage();
+				break;
+			default: bench_usage();
+		}
+	}
+	if (input == NULL || speed == 0)
+	{
+		bench_usage();
+	}
+
+	uint32_t skipped;
+	frames = pcap_load(input, &frame_count, &skipped);
+	if (frames == NULL)
+	{
+		return EXIT_FAILURE;
+	}
+	if (skipped)
+	{
+		fprintf(stderr, "%s: skipped %lu frames that were too long\n",
+				input, (unsigned long) skipped);
+	}
+	rx_list = malloc(sizeof(uint32_t) * (frame_count + 1));
+	tx_list = malloc(sizeof(uint32_t) * (frame_count + 1));
+	rx_dwell = malloc(sizeof(uint64_t) * (frame_count + 1));
+	tx_dwell = malloc(sizeof(uint64_t) * (frame_count + 1));
+	if (rx_list == NULL || tx_list == NULL
+			|| rx_dwell == NULL || tx_dwell == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	// the Mac in the capture becomes the firmware's address
+	for (uint32_t i = 0; i < frame_count; i++)
+	{
+		uint8_t* data = frames[i].data;
+		if (! memcmp(data + 6, capture_mac, 6))
+		{
+			memcpy(data + 6, mac, 6);
+			tx_list[tx_count++] = i;
+		}
+		else
+		{
+			if (! memcmp(data, capture_mac, 6))
+			{
+				memcpy(data, mac, 6);
+			}
+			rx_list[rx_count++] = i;
+		}
+	}
+
+	if (output_path != NULL)
+	{
+		output = pcap_create(output_path);
+		if (output == NULL)
+		{
+			return EXIT_FAILURE;
+		}
+	}
+
+	host_config(GLOBAL_FLAG_PARITY, BENCH_HDD_ID, BENCH_LINK_ID);
+	card_blank(&card, 2048);
+	card_attach(&card);
+	enc28j60_attach(&enc);
+	enc.transmit = bench_transmit;
+	enc.arrive = bench_arrive;
+	bus_init();
+	bus_run(bench_next, NULL);
+	return firmware_main();
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "config.h"
+#include "init.h"
+#include "sim.h"
+
+/*
+ * Stands in for init.c in the host build. The clock, interrupt controller
+ * and debugging USART need no setup here, and the system timer pair in
+ * sim.c already counts simulated time.
+ */
+
+void init_mcu(void)
+{
+	sim_reset();
+}
+
+void init_clock(void)
+{
+}
+
+void init_debug(void)
+{
+}
+
+void init_timer(void)
+{
+}
+
+uint32_t system_time32(void)
+{
+	// as in init.c
+	uint16_t high = SYSTEM_TIMER_HIGH.CNT;
+	uint16_t low = SYSTEM_TIMER.CNT;
+	uint16_t check = SYSTEM_TIMER_HIGH.CNT;
+	if (high != check)
+	{
+		low = SYSTEM_TIMER.CNT;
+	}
+	return ((uint32_t) check << 16) | low;
+}
+
+void init_isr(void)
+{
+}
+
+/*
+ * The firmware is not restarted. Callers already go bus free if the reset
+ * does not happen, which is what is tested here.
+ */
+void mcu_reset(void)
+{
+	fprintf(stderr, "board: MCU reset requested at %llu us, ignored\n",
+			(unsigned long long) (sim_now / 1000));
+}
@@ -0,0 +1,602 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "config.h"
+#include "flight.h"
+#include "phy.h"
+#include "trace.h"
+#include "bus.h"
+
+BusTiming bus_timing = {
+	.select = 4000,
+	.gap = 20000,
+	.phase = 400,
+	.async = 600
+};
+uint8_t bus_sync_period = 50;
+uint8_t bus_sync_offset = 0;
+uint32_t bus_errors;
+
+uint8_t phy_reverse_table[256];
+
+/*
+ * How long the initiator waits for an answer to selection, per the spec.
+ */
+#define BUS_SELECT_TIMEOUT_NS   250000000ULL
+
+// the real GPIOR2, to avoid calling our own hook
+#define bus_active()            (sim_gpior2_value & PHY_STATUS_ACTIVE_bm)
+
+// target side state, as kept by phy.c
+static uint8_t ready;
+static uint8_t targets;
+static uint8_t active_target;
+
+// initiator state
+static BusNext next;
+static void* next_ctx;
+static BusCommand* cmd;
+static BusCommand* done;
+static uint64_t select_at;
+static uint64_t bus_free;
+static uint8_t atn;
+static uint8_t cdb_pos;
+static uint8_t msg_out[8];
+static uint8_t msg_out_len;
+static uint8_t msg_out_pos;
+static uint8_t msg_in[8];
+static uint8_t msg_in_len;
+static uint8_t sdtr_sent;
+
+// CDB lengths by group code, as in phy.c
+static const uint8_t cdb_length[8] = {
+	6, 10, 10, 1, 1, 1, 1, 1
+};
+
+/*
+ * ============================================================================
+ * 
+ *   INITIATOR
+ * 
+ * ============================================================================
+ */
+
+void bus_error(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "bus: %llu us: ", (unsigned long long) (sim_now / 1000));
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+	bus_errors++;
+}
+
+static void bus_message_out(const uint8_t* message, uint8_t len)
+{
+	for (uint8_t i = 0; i < len && msg_out_len < sizeof(msg_out); i++)
+	{
+		msg_out[msg_out_len++] = message[i];
+	}
+	atn = 1;
+}
+
+static void bus_select(void)
+{
+	if (! (targets & (1 << cmd->id)))
+	{
+		cmd->timeout = 1;
+		cmd->status = 0xFF;
+		cmd->selected = sim_now;
+		cmd->ended = sim_now + BUS_SELECT_TIMEOUT_NS;
+		bus_free = cmd->ended;
+		done = cmd;
+		cmd = NULL;
+		return;
+	}
+
+	sim_delay(bus_timing.select);
+	cmd->selected = sim_now;
+	cmd->out_taken = 0;
+	cmd->in_len = 0;
+	cmd->in_done = 0;
+	cmd->status = 0xFF;
+	cmd->message = 0xFF;
+	cmd->timeout = 0;
+	cdb_pos = 0;
+	msg_out_len = 0;
+	msg_out_pos = 0;
+	msg_in_len = 0;
+	sdtr_sent = 0;
+	atn = 0;
+	if (cmd->identify)
+	{
+		bus_message_out(&(cmd->identify), 1);
+		if (cmd->sdtr)
+		{
+			uint8_t sdtr[] = { 0x01, 0x03, 0x01,
+					bus_sync_period, bus_sync_offset };
+			bus_message_out(sdtr, sizeof(sdtr));
+			sdtr_sent = 1;
+		}
+	}
+
+	active_target = 1 << cmd->id;
+	PHY_REGISTER_PHASE = PHY_PHASE_DATA_OUT;
+	sim_gpior2_value |= PHY_STATUS_ACTIVE_bm;
+}
+
+/*
+ * Called each time the firmware looks at PHY_REGISTER_STATUS. While the bus
+ * is free this gets the next command from the driver, and selects the
+ * firmware once the command is due.
+ */
+static void bus_hook(void)
+{
+	if (bus_active() || next == NULL || ! ready) return;
+
+	// the firmware is idle and checking for us, so it isn't stuck
+	sim_progress();
+
+	if (cmd == NULL)
+	{
+		cmd = next(next_ctx, done);
+		done = NULL;
+		if (cmd == NULL)
+		{
+			fflush(stdout);
+			exit(bus_errors ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+		select_at = bus_free + bus_timing.gap;
+		if (cmd->start_at > select_at)
+		{
+			select_at = cmd->start_at;
+		}
+	}
+	if (sim_now >= select_at)
+	{
+		if (cmd->idle)
+		{
+			cmd->ended = sim_now;
+			done = cmd;
+			cmd = NULL;
+		}
+		else
+		{
+			bus_select();
+		}
+	}
+}
+
+/*
+ * Takes a MESSAGE IN byte, checking the target's answer to our SYNCHRONOUS
+ * DATA TRANSFER REQUEST and rejecting any other extended message.
+ */
+static void bus_message_in(uint8_t v)
+{
+	if (msg_in_len == 0 && v != 0x01)
+	{
+		cmd->message = v;
+		if (v == 0x07 && sdtr_sent)
+		{
+			sdtr_sent = 0;
+		}
+		return;
+	}
+
+	msg_in[msg_in_len++] = v;
+	if (msg_in_len < 2 || msg_in_len < msg_in[1] + 2)
+	{
+		if (msg_in_len >= sizeof(msg_in))
+		{
+			msg_in_len = 0;
+			bus_message_out((const uint8_t[]) { 0x07 }, 1);
+		}
+		return;
+	}
+	msg_in_len = 0;
+
+	if (msg_in[1] != 3 || msg_in[2] != 0x01)
+	{
+		bus_message_out((const uint8_t[]) { 0x07 }, 1);
+		return;
+	}
+	uint8_t period = msg_in[3];
+	uint8_t offset = msg_in[4];
+	if (sdtr_sent)
+	{
+		// answer to our SDTR; the firmware only transfers asynchronously
+		sdtr_sent = 0;
+		if (offset != 0)
+		{
+			bus_error("SDTR answer %u/%u is not asynchronous",
+					period, offset);
+		}
+	}
+	else
+	{
+		// the firmware never starts negotiation itself
+		bus_error("SDTR %u/%u sent by the target", period, offset);
+		bus_message_out((const uint8_t[]) { 0x07 }, 1);
+	}
+}
+
+/*
+ * Moves one byte from the target to the initiator.
+ */
+static void bus_in(uint8_t v)
+{
+	uint8_t phase = PHY_REGISTER_PHASE;
+	sim_delay(bus_timing.async);
+
+	switch (phase)
+	{
+		case PHY_PHASE_DATA_IN:
+			cmd->in_done = sim_now;
+			if (cmd->in_len < cmd->in_max)
+			{
+				cmd->in[cmd->in_len] = v;
+			}
+			cmd->in_len++;
+			break;
+		case PHY_PHASE_STATUS:
+			cmd->status = v;
+			break;
+		case PHY_PHASE_MESSAGE_IN:
+			bus_message_in(v);
+			break;
+		default:
+			bus_error("byte offered in phase %02X", phase);
+	}
+}
+
+/*
+ * Moves one byte from the initiator to the target.
+ */
+static uint8_t bus_out(void)
+{
+	uint8_t v = 0;
+	uint8_t phase = PHY_REGISTER_PHASE;
+	sim_delay(bus_timing.async);
+
+	switch (phase)
+	{
+		case PHY_PHASE_MESSAGE_OUT:
+			if (msg_out_pos < msg_out_len)
+			{
+				v = msg_out[msg_out_pos++];
+			}
+			else
+			{
+				v = 0x08; // NO OPERATION
+			}
+			if (msg_out_pos >= msg_out_len)
+			{
+				msg_out_len = 0;
+				msg_out_pos = 0;
+				atn = 0;
+			}
+			break;
+		case PHY_PHASE_COMMAND:
+			if (cdb_pos >= cdb_length[cmd->cdb[0] >> 5])
+			{
+				bus_error("target asked for CDB byte %u", cdb_pos);
+			}
+			else
+			{
+				v = cmd->cdb[cdb_pos];
+			}
+			cdb_pos++;
+			break;
+		case PHY_PHASE_DATA_OUT:
+			if (cmd->out_taken < cmd->out_len)
+			{
+				v = cmd->out[cmd->out_taken];
+			}
+			else if (cmd->out_taken == cmd->out_len)
+			{
+				bus_error("target asked for more than %lu DATA OUT bytes",
+						(unsigned long) cmd->out_len);
+			}
+			cmd->out_taken++;
+			break;
+		default:
+			bus_error("byte asked for in phase %02X", phase);
+	}
+	return v;
+}
+
+static uint8_t bus_port_in(void* dev, uint8_t out)
+{
+	(void) dev;
+	return (out & ~PHY_PIN_R_ATN) | (atn ? PHY_PIN_R_ATN : 0);
+}
+
+static void bus_wait_dre(USART_t* usart)
+{
+	while (! (sim_usart(usart)->STATUS & USART_DREIF_bm));
+}
+
+void bus_init(void)
+{
+	for (uint16_t i = 0; i < 256; i++)
+	{
+		uint8_t r = 0;
+		for (uint8_t b = 0; b < 8; b++)
+		{
+			if (i & (1 << b))
+			{
+				r |= 0x80 >> b;
+			}
+		}
+		phy_reverse_table[i] = r;
+	}
+	sim_port_attach(&sim_portc, bus_port_in, NULL, NULL);
+	sim_gpior2_hook = bus_hook;
+}
+
+void bus_run(BusNext n, void* ctx)
+{
+	next = n;
+	next_ctx = ctx;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   PHY INTERFACE
+ * 
+ * ============================================================================
+ * 
+ * Each of these follows the matching call in phy.c, including the checks for
+ * being active and for the phase.
+ */
+
+void phy_init(uint8_t mask)
+{
+	PHY_REGISTER_PHASE = 0;
+	targets = mask;
+}
+
+void phy_set_targets(uint8_t mask)
+{
+	targets = mask;
+}
+
+void phy_init_hold(void)
+{
+	ready = 1;
+}
+
+uint8_t phy_get_target(void)
+{
+	return active_target;
+}
+
+void phy_debug(void)
+{
+	// reselection is not simulated
+}
+
+void phy_data_offer(uint8_t data)
+{
+	if (! (PHY_REGISTER_PHASE & 0x01)) return;
+	if (! bus_active()) return;
+
+	bus_in(data);
+}
+
+void phy_data_offer_bulk(uint8_t* data, uint16_t len)
+{
+	if (! (PHY_REGISTER_PHASE & 0x01)) return;
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		bus_in(data[i]);
+	}
+}
+
+void phy_data_offer_stream(USART_t* usart, uint16_t len)
+{
+	if (! (PHY_REGISTER_PHASE & 0x01)) return;
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		sim_usart_tx(usart, 0xFF);
+		bus_in(sim_usart_rx(usart));
+	}
+}
+
+void phy_data_offer_stream_block(USART_t* usart, uint8_t crc)
+{
+	if (! (PHY_REGISTER_PHASE & 0x01)) return;
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < 512; i++)
+	{
+		uint8_t v = sim_usart_rx(usart);
+		sim_usart_tx(usart, 0xFF);
+		if (crc) CRC.DATAIN = phy_reverse(v);
+		bus_in(v);
+	}
+	uint8_t v = sim_usart_rx(usart);
+	if (crc) CRC.DATAIN = phy_reverse(v);
+	sim_usart_tx(usart, 0xFF);
+}
+
+void phy_data_offer_stream_atn(USART_t* usart, uint16_t len)
+{
+	if (! (PHY_REGISTER_PHASE & 0x01)) return;
+	if (! bus_active()) return;
+
+	while (len > 0 && ! atn)
+	{
+		uint8_t v = sim_usart_rx(usart);
+		len--;
+		if (len != 0)
+		{
+			bus_wait_dre(usart);
+			sim_usart_tx(usart, 0xFF);
+		}
+		bus_in(v);
+	}
+}
+
+uint8_t phy_data_ask(void)
+{
+	if (! bus_active()) return 0;
+
+	return bus_out();
+}
+
+uint8_t phy_data_ask_cdb(uint8_t* command)
+{
+	if (! bus_active()) return 0;
+
+	command[0] = bus_out();
+	uint8_t len = cdb_length[command[0] >> 5];
+	for (uint8_t i = 1; i < len; i++)
+	{
+		command[i] = bus_out();
+	}
+	return len;
+}
+
+void phy_data_ask_bulk(uint8_t* data, uint16_t len)
+{
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		data[i] = bus_out();
+	}
+}
+
+void phy_data_ask_stream(USART_t* usart, uint16_t len)
+{
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		uint8_t v = bus_out();
+		bus_wait_dre(usart);
+		sim_usart_tx(usart, v);
+	}
+}
+
+void phy_data_ask_stream_block(USART_t* usart, uint8_t crc)
+{
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < 512; i++)
+	{
+		uint8_t v = bus_out();
+		if (crc) CRC.DATAIN = phy_reverse(v);
+		bus_wait_dre(usart);
+		sim_usart_tx(usart, v);
+	}
+}
+
+uint8_t phy_data_ask_compare_block(USART_t* usart, uint8_t crc)
+{
+	uint8_t diff = 0;
+
+	if (! bus_active()) return 0;
+
+	for (uint16_t i = 0; i < 512; i++)
+	{
+		uint8_t c = sim_usart_rx(usart);
+		sim_usart_tx(usart, 0xFF);
+		if (crc) CRC.DATAIN = phy_reverse(c);
+		diff |= bus_out() ^ c;
+	}
+	uint8_t c = sim_usart_rx(usart);
+	if (crc) CRC.DATAIN = phy_reverse(c);
+	sim_usart_tx(usart, 0xFF);
+	return diff;
+}
+
+void phy_data_ask_stream_0x80(USART_t* usart, uint16_t len)
+{
+	if (! bus_active()) return;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		uint8_t v = bus_out();
+		if ((i >= 4) && (i < (len - 4)))
+		{
+			bus_wait_dre(usart);
+			sim_usart_tx(usart, v);
+		}
+	}
+}
+
+void phy_phase(uint8_t new_phase)
+{
+	if (! bus_active()) return;
+	if (PHY_REGISTER_PHASE == new_phase) return;
+
+	sim_delay(bus_timing.phase);
+	PHY_REGISTER_PHASE = new_phase;
+	trace(TRACE_PHASE, new_phase);
+	flight(TRACE_PHASE, new_phase);
+	if (new_phase != PHY_PHASE_BUS_FREE) return;
+
+	sim_gpior2_value &= ~(PHY_STATUS_ACTIVE_bm | PHY_STATUS_CONTINUED_bm);
+	if (msg_out_len)
+	{
+		bus_error("bus free with %u message bytes still to send",
+				msg_out_len - msg_out_pos);
+	}
+	msg_out_len = 0;
+	msg_out_pos = 0;
+	atn = 0;
+	cmd->ended = sim_now;
+	bus_free = sim_now;
+	done = cmd;
+	cmd = NULL;
+}
+
+uint8_t phy_complete(uint8_t status)
+{
+	if (! bus_active()) return 0;
+
+	sim_delay(bus_timing.phase);
+	PHY_REGISTER_PHASE = PHY_PHASE_STATUS;
+	trace(TRACE_PHASE, PHY_PHASE_STATUS);
+	flight(TRACE_PHASE, PHY_PHASE_STATUS);
+	bus_in(status);
+	if (atn) return PHY_PHASE_STATUS;
+
+	sim_delay(bus_timing.phase);
+	PHY_REGISTER_PHASE = PHY_PHASE_MESSAGE_IN;
+	trace(TRACE_PHASE, PHY_PHASE_MESSAGE_IN);
+	flight(TRACE_PHASE, PHY_PHASE_MESSAGE_IN);
+	bus_in(0x00);
+	if (atn) return PHY_PHASE_MESSAGE_IN;
+
+	phy_phase(PHY_PHASE_BUS_FREE);
+	return 0;
+}
+
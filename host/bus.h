@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * 
+ *   SIMULATED SCSI BUS
+ * 
+ * ============================================================================
+ * 
+ * Stands in for phy.c in the host build. The calls in phy.h move bytes
+ * between the firmware and a simulated initiator instead of driving pins,
+ * and charge simulated time for each handshake and phase change. The stream
+ * calls keep the same USART contracts as the kernels in phy.c, so the memory
+ * card and Ethernet controller code around them is exercised as written.
+ * 
+ * The initiator runs the commands it is given by a driver, one at a time. It
+ * selects the firmware when the firmware next checks phy_is_active() after
+ * the start time of the command has passed, the way the selection interrupt
+ * would, and answers MESSAGE IN phases the way a host adapter would. It can
+ * offer synchronous transfers, and checks that the firmware's answer keeps
+ * them asynchronous.
+ */
+
+/*
+ * A command for the initiator to run, and what came of it.
+ */
+typedef struct BusCommand_t {
+	// filled in by the driver
+	uint64_t start_at;      // earliest selection time, in ns
+	uint8_t id;             // SCSI ID to select
+	uint8_t identify;       // IDENTIFY message, or 0 to select without /ATN
+	uint8_t sdtr;           // if set, send our SDTR after IDENTIFY
+	uint8_t idle;           // if set, only let time pass until start_at
+	uint8_t cdb[10];
+	uint8_t* out;           // DATA OUT bytes
+	uint32_t out_len;
+	uint8_t* in;            // buffer for DATA IN bytes
+	uint32_t in_max;
+
+	// filled in by the bus
+	uint64_t selected;      // when the firmware saw the selection
+	uint64_t ended;         // when the bus went free
+	uint32_t out_taken;     // DATA OUT bytes asked for
+	uint32_t in_len;        // DATA IN bytes offered, even past in_max
+	uint64_t in_done;       // when the last DATA IN byte was taken
+	uint8_t status;         // status byte, or 0xFF if none was sent
+	uint8_t message;        // last single byte MESSAGE IN
+	uint8_t timeout;        // set if nothing answered the selection
+} BusCommand;
+
+/*
+ * Gives the next command for the initiator to run, after the given one has
+ * finished (or NULL on the first call). Returning NULL ends the simulation.
+ */
+typedef BusCommand* (*BusNext)(void* ctx, BusCommand* done);
+
+/*
+ * Costs of bus operations, in ns. The defaults are close to an early 68030
+ * machine with an NCR 5380: about 1.6MB/s asynchronous.
+ */
+typedef struct BusTiming_t {
+	uint32_t select;        // arbitration and selection
+	uint32_t gap;           // least time from bus free to the next selection
+	uint32_t phase;         // bus settle after a phase change
+	uint32_t async;         // one asynchronous /REQ / /ACK handshake
+} BusTiming;
+extern BusTiming bus_timing;
+
+/*
+ * The synchronous transfer capability the initiator offers in its SDTR.
+ */
+extern uint8_t bus_sync_period;
+extern uint8_t bus_sync_offset;
+
+/*
+ * Number of protocol errors seen so far. Drivers add their own failed checks
+ * here through bus_error().
+ */
+extern uint32_t bus_errors;
+void bus_error(const char* fmt, ...);
+
+/*
+ * Attaches the bus to the simulated MCU. This must be called before the
+ * firmware starts.
+ */
+void bus_init(void);
+
+/*
+ * Sets the driver the initiator takes its commands from. When the driver
+ * runs out, the process exits, with a failure status if bus_errors is
+ * nonzero.
+ */
+void bus_run(BusNext, void*);
+
+#endif /* BUS_H */
@@ -0,0 +1,909 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// for fseeko() and ftello()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "config.h"
+#include "mem.h"
+#include "hdd.h"
+#include "card.h"
+
+// states for data transfers
+#define CARD_IDLE               0
+#define CARD_READ               1
+#define CARD_WRITE_TOKEN        2
+#define CARD_WRITE_DATA         3
+
+// R1 bits
+#define CARD_R1_IDLE            0x01
+#define CARD_R1_ILLEGAL         0x04
+#define CARD_R1_CRC             0x08
+#define CARD_R1_PARAMETER       0x40
+
+/*
+ * ============================================================================
+ * 
+ *   IMAGE AND CHECKSUMS
+ * 
+ * ============================================================================
+ */
+
+void card_read(Card* card, uint32_t lba, uint8_t* data)
+{
+	memset(data, 0, 512);
+	if (fseeko(card->image, (off_t) lba * 512, SEEK_SET) == 0)
+	{
+		// anything past the end of a blank card reads as zero
+		if (fread(data, 1, 512, card->image) < 512)
+		{
+			clearerr(card->image);
+		}
+	}
+}
+
+void card_write(Card* card, uint32_t lba, const uint8_t* data)
+{
+	if (fseeko(card->image, (off_t) lba * 512, SEEK_SET) != 0
+			|| fwrite(data, 1, 512, card->image) != 512)
+	{
+		perror("card: image write failed");
+	}
+}
+
+static uint8_t card_crc7(const uint8_t* data, uint8_t len)
+{
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < len; i++)
+	{
+		uint8_t b = data[i];
+		for (uint8_t j = 0; j < 8; j++)
+		{
+			crc <<= 1;
+			if ((b ^ crc) & 0x80)
+			{
+				crc ^= 0x09;
+			}
+			b <<= 1;
+		}
+	}
+	return (crc << 1) | 1;
+}
+
+static uint16_t card_crc16(const uint8_t* data, uint16_t len)
+{
+	uint16_t crc = 0;
+	for (uint16_t i = 0; i < len; i++)
+	{
+		crc ^= (uint16_t) data[i] << 8;
+		for (uint8_t j = 0; j < 8; j++)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static void card_setup(Card* card, FILE* image, uint32_t blocks)
+{
+	memset(card, 0, sizeof(Card));
+	card->image = image;
+	card->blocks = blocks & ~((uint32_t) 1023);
+	card->serial = 0x5C0221E7;
+	card->present = 1;
+	card->cs = 1;
+	card->idle = 1;
+	card->timing.read = CARD_READ_NS;
+	card->timing.read_next = CARD_READ_NEXT_NS;
+	card->timing.write = CARD_WRITE_NS;
+	card->timing.erase = CARD_ERASE_NS;
+	card->timing.stop = CARD_STOP_NS;
+	card->timing.seed = 1;
+}
+
+/*
+ * Gives the busy spike for the next block, if there is one.
+ */
+static uint32_t card_spike(Card* card)
+{
+	if (card->timing.spike_ppm == 0) return 0;
+
+	// xorshift32
+	uint32_t x = card->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	card->random = x;
+	if (x % 1000000 < card->timing.spike_ppm)
+	{
+		card->spikes++;
+		return card->timing.spike;
+	}
+	return 0;
+}
+
+uint8_t card_open(Card* card, const char* path)
+{
+	FILE* image = fopen(path, "r+b");
+	if (image == NULL)
+	{
+		perror(path);
+		return 0;
+	}
+	fseeko(image, 0, SEEK_END);
+	card_setup(card, image, (uint32_t) (ftello(image) / 512));
+	if (card->blocks == 0)
+	{
+		fprintf(stderr, "%s: image must be at least 512KB\n", path);
+		fclose(image);
+		return 0;
+	}
+	return 1;
+}
+
+uint8_t card_blank(Card* card, uint32_t blocks)
+{
+	FILE* image = tmpfile();
+	if (image == NULL)
+	{
+		perror("card: can't create image");
+		return 0;
+	}
+	card_setup(card, image, blocks);
+	return card->blocks != 0;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   LAYOUTS
+ * 
+ * ============================================================================
+ */
+
+static void card_put32be(uint8_t* data, uint32_t v)
+{
+	data[0] = (uint8_t) (v >> 24);
+	data[1] = (uint8_t) (v >> 16);
+	data[2] = (uint8_t) (v >> 8);
+	data[3] = (uint8_t) v;
+}
+
+static void card_put16(uint8_t* data, uint16_t v)
+{
+	data[0] = (uint8_t) v;
+	data[1] = (uint8_t) (v >> 8);
+}
+
+static void card_put32(uint8_t* data, uint32_t v)
+{
+	card_put16(data, (uint16_t) v);
+	card_put16(data + 2, (uint16_t) (v >> 16));
+}
+
+/*
+ * Puts an ASCII name into UTF-16, as exFAT and long FAT names use.
+ */
+static void card_put_name(uint8_t* data, const char* name)
+{
+	for (uint8_t i = 0; name[i] != '\0'; i++)
+	{
+		card_put16(data + i * 2, (uint8_t) name[i]);
+	}
+}
+
+/*
+ * Writes the FAT, given the cluster each cluster points to, zeroing the
+ * whole of each copy first.
+ */
+static void card_put_fat(Card* card, uint32_t lba, uint32_t length,
+		uint8_t copies, const uint32_t* next, uint32_t count)
+{
+	uint8_t block[512];
+	for (uint8_t c = 0; c < copies; c++)
+	{
+		for (uint32_t i = 0; i < length; i++)
+		{
+			memset(block, 0, sizeof(block));
+			for (uint32_t j = 0; j < 128 && i * 128 + j < count; j++)
+			{
+				card_put32(block + j * 4, next[i * 128 + j]);
+			}
+			card_write(card, lba + c * length + i, block);
+		}
+	}
+}
+
+/*
+ * Links the given run of clusters into a chain in the FAT, ending it with
+ * the given marker.
+ */
+static void card_chain(uint32_t* next, uint32_t first, uint32_t count,
+		uint32_t end)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		next[first + i] = (i + 1 < count) ? first + i + 1 : end;
+	}
+}
+
+void card_format_table(Card* card, const CardVolume* volumes, uint8_t count)
+{
+	uint8_t block[512];
+	memset(block, 0, sizeof(block));
+	memcpy(block, "SCUZNET", 7);
+	block[7] = HDD_VOLUME_VERSION;
+	block[HDD_VOLUME_COUNT_OFFSET] = count;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		uint8_t* e = block + HDD_VOLUME_ENTRY_OFFSET
+				+ i * HDD_VOLUME_ENTRY_LENGTH;
+		e[0] = volumes[i].id;
+		card_put32be(e + 4, volumes[i].offset);
+		card_put32be(e + 8, volumes[i].blocks);
+	}
+	card_write(card, 0, block);
+}
+
+uint32_t card_format_fat32(Card* card, uint32_t blocks, uint8_t fragmented)
+{
+	// 4KB clusters, two FATs, the root directory in cluster 2
+	const uint32_t part = 2048;
+	const uint32_t reserved = 32;
+	if (card->blocks <= part + reserved) return 0;
+	uint32_t size = card->blocks - part;
+	uint32_t fat_length = ((size >> 3) + 2 + 127) >> 7;
+	uint32_t data = reserved + 2 * fat_length;
+	if (size <= data) return 0;
+	uint32_t clusters = (size - data) >> 3;
+	uint32_t count = (blocks + 7) >> 3;
+	if (blocks == 0 || count + 2 + fragmented > clusters) return 0;
+
+	uint8_t block[512];
+	memset(block, 0, sizeof(block));
+	block[446 + 4] = 0x0C;
+	card_put32(block + 446 + 8, part);
+	card_put32(block + 446 + 12, size);
+	block[510] = 0x55;
+	block[511] = 0xAA;
+	card_write(card, 0, block);
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, "\xEB\x58\x90MSWIN4.1", 11);
+	card_put16(block + 11, 512);
+	block[13] = 8;
+	card_put16(block + 14, (uint16_t) reserved);
+	block[16] = 2;
+	block[21] = 0xF8;
+	card_put32(block + 28, part);
+	card_put32(block + 32, size);
+	card_put32(block + 36, fat_length);
+	card_put32(block + 44, 2);
+	block[66] = 0x29;
+	memcpy(block + 71, "SCUZNET    FAT32   ", 19);
+	block[510] = 0x55;
+	block[511] = 0xAA;
+	card_write(card, part, block);
+
+	// the image from cluster 3, possibly with a free cluster half way
+	uint32_t* next = calloc(clusters + 2, sizeof(uint32_t));
+	if (next == NULL) return 0;
+	next[0] = 0x0FFFFFF8;
+	next[1] = 0x0FFFFFFF;
+	next[2] = 0x0FFFFFFF;
+	if (fragmented)
+	{
+		uint32_t half = count / 2;
+		card_chain(next, 3, half, half + 4);
+		card_chain(next, half + 4, count - half, 0x0FFFFFFF);
+	}
+	else
+	{
+		card_chain(next, 3, count, 0x0FFFFFFF);
+	}
+	card_put_fat(card, part + reserved, fat_length, 2, next, clusters + 2);
+	free(next);
+
+	// root directory: a label, a long name, a deleted file and a directory
+	uint32_t heap = part + data;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		memset(block, 0, sizeof(block));
+		card_write(card, heap + i, block);
+	}
+	memcpy(block, "SCUZNET    ", 11);
+	block[11] = 0x08;
+	uint8_t* e = block + 32;
+	e[0] = 0x41;
+	card_put_name(e + 1, "scuzn");
+	e[11] = 0x0F;
+	card_put_name(e + 14, "et.img");
+	e = block + 64;
+	memcpy(e, "\xE5" "CUZNET IMG", 11);
+	e[11] = 0x20;
+	e = block + 96;
+	memcpy(e, "SCUZNET    ", 11);
+	e[11] = 0x10;
+	e = block + 128;
+	memcpy(e, "SCUZNET IMG", 11);
+	e[11] = 0x20;
+	card_put16(e + 20, 0);
+	card_put16(e + 26, 3);
+	card_put32(e + 28, blocks * 512);
+	card_write(card, heap, block);
+
+	return heap + 8;
+}
+
+uint32_t card_format_exfat(Card* card, uint32_t blocks, uint8_t chained)
+{
+	// 4KB clusters, with the root directory, bitmap and up-case table first
+	const uint32_t fat = 128;
+	const uint32_t heap = 2048;
+	if (card->blocks <= heap) return 0;
+	uint32_t clusters = (card->blocks - heap) >> 3;
+	uint32_t fat_length = (clusters + 2 + 127) >> 7;
+	uint32_t count = (blocks + 7) >> 3;
+	if (fat + fat_length > heap || blocks == 0 || count + 4 > clusters)
+	{
+		return 0;
+	}
+
+	uint8_t block[512];
+	memset(block, 0, sizeof(block));
+	memcpy(block, "\xEB\x76\x90" "EXFAT   ", 11);
+	card_put32(block + 72, card->blocks);
+	card_put32(block + 80, fat);
+	card_put32(block + 84, fat_length);
+	card_put32(block + 88, heap);
+	card_put32(block + 92, clusters);
+	card_put32(block + 96, 2);
+	card_put16(block + 104, 0x0100);
+	block[108] = 9;
+	block[109] = 3;
+	block[110] = 1;
+	block[111] = 0x80;
+	block[510] = 0x55;
+	block[511] = 0xAA;
+	card_write(card, 0, block);
+
+	uint32_t* next = calloc(clusters + 2, sizeof(uint32_t));
+	if (next == NULL) return 0;
+	next[0] = 0xFFFFFFF8;
+	next[1] = 0xFFFFFFFF;
+	next[2] = 0xFFFFFFFF;
+	next[3] = 0xFFFFFFFF;
+	next[4] = 0xFFFFFFFF;
+	if (chained)
+	{
+		card_chain(next, 5, count, 0xFFFFFFFF);
+	}
+	card_put_fat(card, fat, fat_length, 1, next, clusters + 2);
+	free(next);
+
+	// root directory: label, bitmap, up-case table, a directory, the image
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		memset(block, 0, sizeof(block));
+		card_write(card, heap + i, block);
+	}
+	block[0] = 0x83;
+	block[1] = 7;
+	card_put_name(block + 2, "SCUZNET");
+	uint8_t* e = block + 32;
+	e[0] = 0x81;
+	card_put32(e + 20, 3);
+	card_put32(e + 24, (clusters + 7) / 8);
+	e = block + 64;
+	e[0] = 0x82;
+	card_put32(e + 20, 4);
+	card_put32(e + 24, 5836);
+	e = block + 96;
+	e[0] = 0x85;
+	e[1] = 2;
+	e[4] = 0x10;
+	e = block + 128;
+	e[0] = 0xC0;
+	e[1] = 0x03;
+	e[3] = 11;
+	e = block + 160;
+	e[0] = 0xC1;
+	card_put_name(e + 2, "scuznet.img");
+	e = block + 192;
+	e[0] = 0x85;
+	e[1] = 2;
+	e[4] = 0x20;
+	e = block + 224;
+	e[0] = 0xC0;
+	e[1] = chained ? 0x01 : 0x03;
+	e[3] = 11;
+	card_put32(e + 8, blocks * 512);
+	card_put32(e + 20, 5);
+	card_put32(e + 24, blocks * 512);
+	e = block + 256;
+	e[0] = 0xC1;
+	card_put_name(e + 2, "scuznet.img");
+	card_write(card, heap, block);
+
+	return heap + 3 * 8;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   REGISTERS
+ * 
+ * ============================================================================
+ */
+
+static void card_csd(Card* card, uint8_t* csd)
+{
+	uint32_t size = card->blocks / 1024 - 1;
+	const uint8_t base[16] = {
+		0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
+		0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x00
+	};
+	memcpy(csd, base, 16);
+	csd[7] = (uint8_t) ((size >> 16) & 0x3F);
+	csd[8] = (uint8_t) (size >> 8);
+	csd[9] = (uint8_t) size;
+	csd[15] = card_crc7(csd, 15);
+}
+
+static void card_cid(Card* card, uint8_t* cid)
+{
+	const uint8_t base[16] = {
+		0x03, 'S', 'D', 'S', 'C', 'U', 'Z', 'N',
+		0x10, 0x00, 0x00, 0x00, 0x00, 0x01, 0x31, 0x00
+	};
+	memcpy(cid, base, 16);
+	cid[9] = (uint8_t) (card->serial >> 24);
+	cid[10] = (uint8_t) (card->serial >> 16);
+	cid[11] = (uint8_t) (card->serial >> 8);
+	cid[12] = (uint8_t) card->serial;
+	cid[15] = card_crc7(cid, 15);
+}
+
+/*
+ * SD 3.0, erased blocks read as zero, CMD23 supported.
+ */
+static const uint8_t card_scr[8] = {
+	0x02, 0x35, 0x80, 0x02, 0x00, 0x00, 0x00, 0x00
+};
+
+/*
+ * ============================================================================
+ * 
+ *   PROTOCOL
+ * 
+ * ============================================================================
+ */
+
+static void card_queue(Card* card, uint8_t v)
+{
+	if (card->queue_len >= sizeof(card->queue)) return;
+	uint8_t i = (card->queue_head + card->queue_len) % sizeof(card->queue);
+	card->queue[i] = v;
+	card->queue_len++;
+}
+
+/*
+ * Queues a data block with its token and CRC, after the minimum access time
+ * of one byte.
+ */
+static void card_queue_data(Card* card, const uint8_t* data, uint8_t len)
+{
+	uint16_t crc = card_crc16(data, len);
+	card_queue(card, 0xFF);
+	card_queue(card, MEM_DATA_TOKEN);
+	for (uint8_t i = 0; i < len; i++)
+	{
+		card_queue(card, data[i]);
+	}
+	card_queue(card, (uint8_t) (crc >> 8));
+	card_queue(card, (uint8_t) crc);
+}
+
+/*
+ * Gives the next byte of a block read, or 0xFF while waiting for the block.
+ */
+static uint8_t card_read_next(Card* card, uint64_t when)
+{
+	if (card->pos == 0xFFFF)
+	{
+		if (card->gap || when < card->ready_at)
+		{
+			card->gap = 0;
+			return 0xFF;
+		}
+		if (card->lba >= card->blocks)
+		{
+			// ran off the end of the card during CMD18
+			card->state = CARD_IDLE;
+			return 0xFF;
+		}
+		card_read(card, card->lba, card->block);
+		uint16_t crc = card_crc16(card->block, 512);
+		card->block[512] = (uint8_t) (crc >> 8);
+		card->block[513] = (uint8_t) crc;
+		if (card->damage_reads)
+		{
+			card->damage_reads--;
+			card->block[0] ^= 0x01;
+		}
+		card->reads++;
+		card->pos = 0;
+		return MEM_DATA_TOKEN;
+	}
+
+	uint8_t v = card->block[card->pos++];
+	if (card->pos == 514)
+	{
+		if (card->multiple)
+		{
+			// next block, with at least one byte of 0xFF before it
+			card->lba++;
+			card->pos = 0xFFFF;
+			card->gap = 1;
+			card->ready_at = when + card->timing.read_next + card_spike(card);
+		}
+		else
+		{
+			card->state = CARD_IDLE;
+		}
+	}
+	return v;
+}
+
+/*
+ * Gives the byte the card shifts out during an exchange ending at the given
+ * time, before it has seen the byte coming in.
+ */
+static uint8_t card_out(Card* card, uint64_t when)
+{
+	if (card->queue_len)
+	{
+		uint8_t v = card->queue[card->queue_head];
+		card->queue_head = (card->queue_head + 1) % sizeof(card->queue);
+		card->queue_len--;
+		return v;
+	}
+	if (when < card->busy_until) return 0x00;
+	if (card->state == CARD_READ) return card_read_next(card, when);
+	return 0xFF;
+}
+
+static uint32_t card_arg(Card* card)
+{
+	return ((uint32_t) card->cmd[1] << 24)
+			| ((uint32_t) card->cmd[2] << 16)
+			| ((uint32_t) card->cmd[3] << 8)
+			| card->cmd[4];
+}
+
+/*
+ * Acts on a complete command. The response goes out after one byte of 0xFF,
+ * or for CMD12, after one more byte of whatever was being sent.
+ */
+static void card_command(Card* card, uint64_t when)
+{
+	uint8_t op = card->cmd[0] & 0x3F;
+	uint32_t arg = card_arg(card);
+	uint8_t app = card->app;
+	card->app = 0;
+
+	uint8_t r1 = card->idle ? CARD_R1_IDLE : 0x00;
+	if ((card->crc_on || op == 0 || op == 8)
+			&& card_crc7(card->cmd, 5) != card->cmd[5])
+	{
+		card_queue(card, 0xFF);
+		card_queue(card, r1 | CARD_R1_CRC);
+		return;
+	}
+
+	if (op == 12)
+	{
+		card_queue(card, card_out(card, when));
+		card_queue(card, 0xFF);
+		card_queue(card, r1);
+		card->state = CARD_IDLE;
+		card->busy_until = when + card->timing.stop;
+		return;
+	}
+
+	card_queue(card, 0xFF);
+	if (card->idle && ! (op == 0 || op == 8 || op == 55 || op == 58
+			|| op == 59 || (app && op == 41)))
+	{
+		card_queue(card, r1 | CARD_R1_ILLEGAL);
+		return;
+	}
+
+	uint8_t reg[64];
+	if (app && op == 41)
+	{
+		if (card->init_polls < CARD_INIT_POLLS)
+		{
+			card->init_polls++;
+		}
+		else
+		{
+			card->idle = 0;
+		}
+		card_queue(card, card->idle ? CARD_R1_IDLE : 0x00);
+	}
+	else if (app && op == 13)
+	{
+		card_queue(card, r1);
+		card_queue(card, 0x00);
+		memset(reg, 0, sizeof(reg));
+		reg[10] = 0x90; // 4MB allocation units
+		card_queue_data(card, reg, 64);
+	}
+	else if (app && op == 51)
+	{
+		card_queue(card, r1);
+		card_queue_data(card, card_scr, 8);
+	}
+	else if (app && op == 23)
+	{
+		card_queue(card, r1);
+	}
+	else if (op == 0)
+	{
+		card->idle = 1;
+		card->crc_on = 0;
+		card->init_polls = 0;
+		card->state = CARD_IDLE;
+		card_queue(card, CARD_R1_IDLE);
+	}
+	else if (op == 8)
+	{
+		card_queue(card, r1);
+		card_queue(card, 0x00);
+		card_queue(card, 0x00);
+		card_queue(card, card->cmd[3] & 0x0F);
+		card_queue(card, card->cmd[4]);
+	}
+	else if (op == 9 || op == 10)
+	{
+		card_queue(card, r1);
+		if (op == 9)
+		{
+			card_csd(card, reg);
+		}
+		else
+		{
+			card_cid(card, reg);
+		}
+		card_queue_data(card, reg, 16);
+	}
+	else if (op == 13)
+	{
+		card_queue(card, r1);
+		card_queue(card, 0x00);
+	}
+	else if (op == 16)
+	{
+		card_queue(card, arg == 512 ? r1 : r1 | CARD_R1_PARAMETER);
+	}
+	else if (op == 17 || op == 18 || op == 24 || op == 25)
+	{
+		if (arg >= card->blocks)
+		{
+			card_queue(card, r1 | CARD_R1_PARAMETER);
+			return;
+		}
+		card_queue(card, r1);
+		card->lba = arg;
+		card->multiple = (op == 18 || op == 25);
+		if (op == 17 || op == 18)
+		{
+			card->state = CARD_READ;
+			card->pos = 0xFFFF;
+			card->ready_at = when + card->timing.read + card_spike(card);
+		}
+		else
+		{
+			card->state = CARD_WRITE_TOKEN;
+		}
+	}
+	else if (op == 32)
+	{
+		card->erase_start = arg;
+		card_queue(card, r1);
+	}
+	else if (op == 33)
+	{
+		card->erase_end = arg;
+		card_queue(card, r1);
+	}
+	else if (op == 38)
+	{
+		if (card->erase_start > card->erase_end
+				|| card->erase_end >= card->blocks)
+		{
+			card_queue(card, r1 | CARD_R1_PARAMETER);
+			return;
+		}
+		card_queue(card, r1);
+		uint8_t zero[512];
+		memset(zero, 0, sizeof(zero));
+		for (uint32_t i = card->erase_start; i <= card->erase_end; i++)
+		{
+			card_write(card, i, zero);
+			card->erases++;
+		}
+		card->busy_until = when + card->timing.erase;
+	}
+	else if (op == 55)
+	{
+		card->app = 1;
+		card_queue(card, r1);
+	}
+	else if (op == 58)
+	{
+		card_queue(card, r1);
+		card_queue(card, 0xC0); // powered up, SDHC
+		card_queue(card, 0xFF);
+		card_queue(card, 0x80);
+		card_queue(card, 0x00);
+	}
+	else if (op == 59)
+	{
+		card->crc_on = arg & 1;
+		card_queue(card, r1);
+	}
+	else
+	{
+		card_queue(card, r1 | CARD_R1_ILLEGAL);
+	}
+}
+
+/*
+ * Takes a byte of a block being written.
+ */
+static void card_write_byte(Card* card, uint8_t v, uint64_t when)
+{
+	card->block[card->pos++] = v;
+	if (card->pos < 514) return;
+
+	if (card->damage_writes)
+	{
+		card->damage_writes--;
+		card->block[0] ^= 0x01;
+	}
+	uint16_t crc = ((uint16_t) card->block[512] << 8) | card->block[513];
+	if (card->crc_on && crc != card_crc16(card->block, 512))
+	{
+		card->crc_errors++;
+		card_queue(card, 0xEB);
+		card->state = card->multiple ? CARD_WRITE_TOKEN : CARD_IDLE;
+		return;
+	}
+
+	card_write(card, card->lba, card->block);
+	card->writes++;
+	card->lba++;
+	card_queue(card, 0xE5);
+	card->busy_until = when + card->timing.write + card_spike(card);
+	card->state = card->multiple ? CARD_WRITE_TOKEN : CARD_IDLE;
+}
+
+static uint8_t card_exchange(void* dev, uint8_t in, uint64_t when)
+{
+	Card* card = dev;
+	// MEM_PORT, without the cost of an access
+	if (! card->present || (sim_port_out(&sim_porte) & MEM_PIN_CS))
+	{
+		return 0xFF;
+	}
+
+	uint8_t out = card_out(card, when);
+
+	if (card->state == CARD_WRITE_DATA)
+	{
+		card_write_byte(card, in, when);
+	}
+	else if (card->cmd_len > 0 || (in & 0xC0) == 0x40)
+	{
+		card->cmd[card->cmd_len++] = in;
+		if (card->cmd_len == 6)
+		{
+			card->cmd_len = 0;
+			card_command(card, when);
+		}
+	}
+	else if (card->state == CARD_WRITE_TOKEN && when >= card->busy_until)
+	{
+		if ((in == MEM_DATA_TOKEN && ! card->multiple)
+				|| (in == MEM_DATA_TOKEN_MULTIPLE && card->multiple))
+		{
+			card->state = CARD_WRITE_DATA;
+			card->pos = 0;
+		}
+		else if (in == MEM_STOP_TOKEN && card->multiple)
+		{
+			card_queue(card, 0xFF);
+			card->busy_until = when + card->timing.stop;
+			card->state = CARD_IDLE;
+		}
+	}
+	return out;
+}
+
+/*
+ * MISO is held low while the card is busy and selected.
+ */
+static uint8_t card_port_in(void* dev, uint8_t out)
+{
+	Card* card = dev;
+	uint8_t miso = MEM_PIN_RX;
+	if (card->present && ! (out & MEM_PIN_CS) && sim_now < card->busy_until)
+	{
+		miso = 0;
+	}
+	return (out & ~MEM_PIN_RX) | miso;
+}
+
+/*
+ * Raising /CS ends any command in progress.
+ */
+static void card_port_edge(void* dev, uint8_t rise, uint8_t fall)
+{
+	Card* card = dev;
+	(void) fall;
+	if (rise & MEM_PIN_CS)
+	{
+		card->cmd_len = 0;
+		card->queue_len = 0;
+		if (card->state == CARD_READ || card->state == CARD_WRITE_DATA)
+		{
+			card->state = CARD_IDLE;
+		}
+	}
+}
+
+void card_remove(Card* card)
+{
+	card->present = 0;
+	card->idle = 1;
+	card->app = 0;
+	card->crc_on = 0;
+	card->init_polls = 0;
+	card->cmd_len = 0;
+	card->queue_len = 0;
+	card->busy_until = 0;
+	card->state = CARD_IDLE;
+}
+
+void card_insert(Card* card)
+{
+	card->present = 1;
+}
+
+void card_attach(Card* card)
+{
+	card->random = card->timing.seed ? card->timing.seed : 1;
+	sim_usart_attach(&MEM_USART, card_exchange, card);
+	sim_port_attach(&MEM_PORT, card_port_in, card_port_edge, card);
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CARD_H
+#define CARD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * ============================================================================
+ * 
+ *   SIMULATED MEMORY CARD
+ * 
+ * ============================================================================
+ * 
+ * An SDHC card in SPI mode, attached to the memory card USART and port, with
+ * its blocks kept in an image file. The model follows the card side of the
+ * protocol closely enough to catch the mistakes that matter on real cards:
+ * the response arrives after one byte of 0xFF, a CMD12 is followed by a stuff
+ * byte, multiple block reads need a byte of 0xFF between blocks, each written
+ * block is followed by a data response and a busy period, and MISO is held
+ * low while the card is busy, even with no clocks.
+ * 
+ * Data CRCs are always sent, and are checked on writes once CRC checking has
+ * been turned on with CMD59, the same as real cards. Blocks can be damaged on
+ * their way to or from the card, to exercise the firmware's CRC handling.
+ */
+
+/*
+ * How long the card takes to do things by default, in ns.
+ */
+#define CARD_READ_NS            100000
+#define CARD_READ_NEXT_NS       0
+#define CARD_WRITE_NS           250000
+#define CARD_ERASE_NS           1000000
+#define CARD_STOP_NS            2000
+
+/*
+ * Card timing, in ns. Each block read or written may also take a random busy
+ * spike, as real cards do when they do housekeeping such as garbage
+ * collection, with the given chance per million blocks. Spikes come from a
+ * fixed sequence for each seed, so runs can be repeated.
+ */
+typedef struct CardTiming_t {
+	uint32_t read;          // CMD17/18 access latency, until the first block
+	uint32_t read_next;     // more latency before each later CMD18 block
+	uint32_t write;         // busy after each block of CMD24/25
+	uint32_t erase;         // busy after CMD38
+	uint32_t stop;          // busy after CMD12 or a stop token
+	uint32_t spike;         // length of a busy spike
+	uint32_t spike_ppm;     // chance of a spike for each block
+	uint32_t seed;
+} CardTiming;
+
+/*
+ * ACMD41 calls answered with the idle bit before the card is ready.
+ */
+#define CARD_INIT_POLLS         2
+
+typedef struct Card_t {
+	FILE* image;
+	uint32_t blocks;
+	uint32_t serial;        // product serial number in the CID
+	uint8_t present;        // if zero, the card does not answer at all
+	CardTiming timing;
+
+	// blocks still to be damaged in transit, which flips a bit of their data
+	uint16_t damage_reads;  // blocks the card sends, after the CRC is made
+	uint16_t damage_writes; // blocks the card receives, before it is checked
+
+	// activity counts, in blocks
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t erases;
+	uint32_t crc_errors;
+	uint32_t spikes;
+
+	// protocol state
+	uint8_t cs;
+	uint8_t idle;
+	uint8_t app;
+	uint8_t crc_on;
+	uint8_t init_polls;
+	uint8_t cmd[6];
+	uint8_t cmd_len;
+	uint8_t queue[128];
+	uint8_t queue_head;
+	uint8_t queue_len;
+	uint64_t busy_until;
+	uint8_t state;
+	uint8_t multiple;
+	uint32_t lba;
+	uint16_t pos;
+	uint8_t gap;
+	uint64_t ready_at;
+	uint32_t erase_start;
+	uint32_t erase_end;
+	uint8_t block[514];
+	uint32_t random;
+} Card;
+
+/*
+ * Opens the given image file as the card contents. The card size is the image
+ * size rounded down to a multiple of 512KB, since that is the unit the CSD
+ * gives it in. Gives back zero if the image can't be used.
+ */
+uint8_t card_open(Card*, const char* path);
+
+/*
+ * Makes the card a blank one of the given number of blocks, kept in a
+ * temporary file. The size is rounded down as above.
+ */
+uint8_t card_blank(Card*, uint32_t blocks);
+
+/*
+ * Connects the card to the memory card USART and port. Changes to the timing
+ * should be made before this.
+ */
+void card_attach(Card*);
+
+/*
+ * A volume in a volume table, see hdd.h.
+ */
+typedef struct CardVolume_t {
+	uint8_t id;
+	uint32_t offset;
+	uint32_t blocks;
+} CardVolume;
+
+/*
+ * Writes a volume table with the given entries into the first block of the
+ * card, as it would be set up on a PC. The entries are not checked, so bad
+ * ones can be tried too.
+ */
+void card_format_table(Card*, const CardVolume* volumes, uint8_t count);
+
+/*
+ * Formats the card with a filesystem holding a SCUZNET.IMG of the given
+ * number of blocks, see fs.h, and gives back the first block of the image,
+ * or zero if it doesn't fit. Only the structures that readers look at are
+ * written: checksums and the contents of the image are left alone.
+ * 
+ * FAT32 goes in an MBR partition starting at 1MB, and the image can be
+ * split in two by a free cluster. exFAT fills the card, and the image can
+ * be given a FAT chain instead of being marked contiguous.
+ */
+uint32_t card_format_fat32(Card*, uint32_t blocks, uint8_t fragmented);
+uint32_t card_format_exfat(Card*, uint32_t blocks, uint8_t chained);
+
+/*
+ * Pulls the card out, or puts it back in. A card put back in has been powered
+ * off, so it starts again in the idle state, but keeps its contents.
+ */
+void card_remove(Card*);
+void card_insert(Card*);
+
+/*
+ * Reads or writes a block of the image directly, bypassing the protocol.
+ */
+void card_read(Card*, uint32_t lba, uint8_t* data);
+void card_write(Card*, uint32_t lba, const uint8_t* data);
+
+#endif /* CARD_H */
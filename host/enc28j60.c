@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "config.h"
+#include "enc.h"
+#include "enc28j60.h"
+#include "sim.h"
+
+// the register at the given address in the current bank, or a common one
+#define REG(e, a)               ((e)->regs[(a) >= 0x1B ? 0 : \
+		(e)->regs[0][ENC_ECON1 & ENC_REG_MASK] & 0x03][a])
+#define BANK(e, r)              ((e)->regs[((r) >> 5) & 0x03][(r) & ENC_REG_MASK])
+#define PAIR(e, r)              ((uint16_t) (BANK(e, r) | (BANK(e, (r) + 1) << 8)))
+
+// instruction in progress after the opcode byte
+#define OP_NONE                 0
+#define OP_READ                 1
+#define OP_READ_MAC             2
+#define OP_WRITE                3
+#define OP_SET                  4
+#define OP_CLEAR                5
+#define OP_READ_BUFFER          6
+#define OP_WRITE_BUFFER         7
+#define OP_IGNORE               8
+
+// 10Mbps, plus preamble, SFD and the interframe gap
+#define WIRE_NS_PER_BYTE        800
+#define WIRE_OVERHEAD_BYTES     20
+
+/*
+ * ============================================================================
+ * 
+ *   REGISTERS
+ * 
+ * ============================================================================
+ */
+
+static void enc28j60_set_pair(Enc28j60* enc, uint8_t r, uint16_t v)
+{
+	BANK(enc, r) = (uint8_t) v;
+	BANK(enc, r + 1) = (uint8_t) (v >> 8);
+}
+
+static void enc28j60_reset(Enc28j60* enc)
+{
+	memset(enc->regs, 0, sizeof(enc->regs));
+	memset(enc->phy, 0, sizeof(enc->phy));
+	BANK(enc, ENC_ECON2) = ENC_AUTOINC_bm;
+	BANK(enc, ENC_ERXFCON) = ENC_UCEN_bm | ENC_CRCEN_bm | ENC_BCEN_bm;
+	enc28j60_set_pair(enc, ENC_ERXNDL, 0x1FFF);
+	enc28j60_set_pair(enc, ENC_ERXRDPTL, 0x05FA);
+	enc28j60_set_pair(enc, ENC_ETXNDL, 0x0000);
+	BANK(enc, ENC_EREVID) = 0x06;
+	enc->phy[ENC_PHY_PHID1] = 0x0083;
+	enc->phy[ENC_PHY_PHID2] = 0x1400;
+	enc->phy[ENC_PHY_PHSTAT2] = ENC_LSTAT_bm;
+	enc->op = OP_NONE;
+	enc->tx_pending = 0;
+}
+
+/*
+ * The MAC and MII registers, which send a dummy byte before their value.
+ */
+static uint8_t enc28j60_is_mac(uint8_t bank, uint8_t addr)
+{
+	return (bank == 2 && addr < 0x1A)
+			|| (bank == 3 && (addr <= 0x05 || addr == 0x0A));
+}
+
+static uint8_t enc28j60_interrupt(Enc28j60* enc)
+{
+	uint8_t eie = BANK(enc, ENC_EIE);
+	uint8_t eir = BANK(enc, ENC_EIR);
+	return (eie & ENC_INTIE_bm) && (eie & eir & ~ENC_INTIE_bm);
+}
+
+/*
+ * Brings the registers the hardware keeps up to date in line with the rest.
+ */
+static void enc28j60_refresh(Enc28j60* enc)
+{
+	if (BANK(enc, ENC_EPKTCNT) > 0)
+	{
+		BANK(enc, ENC_EIR) |= ENC_PKTIF_bm;
+	}
+	else
+	{
+		BANK(enc, ENC_EIR) &= ~ENC_PKTIF_bm;
+	}
+
+	uint8_t estat = BANK(enc, ENC_ESTAT) & ~(ENC_CLKRDY_bm | ENC_INT_bm);
+	if (sim_now >= enc->clkrdy_at)
+	{
+		estat |= ENC_CLKRDY_bm;
+	}
+	if (enc28j60_interrupt(enc))
+	{
+		estat |= ENC_INT_bm;
+	}
+	BANK(enc, ENC_ESTAT) = estat;
+}
+
+static void enc28j60_transmit_start(Enc28j60* enc, uint64_t when)
+{
+	enc->tx_start = PAIR(enc, ENC_ETXSTL);
+	enc->tx_end = PAIR(enc, ENC_ETXNDL);
+	uint16_t length = (uint16_t) (enc->tx_end - enc->tx_start);
+	if (length < 60)
+	{
+		length = 60;
+	}
+	enc->tx_done = when
+			+ (uint64_t) (length + 4 + WIRE_OVERHEAD_BYTES) * WIRE_NS_PER_BYTE;
+	enc->tx_pending = 1;
+}
+
+/*
+ * Handles the side effects of a register changing.
+ */
+static void enc28j60_written(Enc28j60* enc, uint8_t bank, uint8_t addr,
+		uint8_t old, uint64_t when)
+{
+	uint8_t* reg = &(enc->regs[addr >= 0x1B ? 0 : bank][addr]);
+	uint8_t v = *reg;
+
+	if (addr == (ENC_ECON1 & ENC_REG_MASK))
+	{
+		if ((v & ENC_TXRST_bm) && enc->tx_pending)
+		{
+			enc->tx_pending = 0;
+			enc->tx_aborted++;
+			*reg &= ~ENC_TXRTS_bm;
+		}
+		else if ((v & ENC_TXRTS_bm) && ! (old & ENC_TXRTS_bm))
+		{
+			enc28j60_transmit_start(enc, when);
+		}
+	}
+	else if (addr == (ENC_ECON2 & ENC_REG_MASK))
+	{
+		if (v & ENC_PKTDEC_bm)
+		{
+			if (BANK(enc, ENC_EPKTCNT) > 0)
+			{
+				BANK(enc, ENC_EPKTCNT)--;
+			}
+			*reg &= ~ENC_PKTDEC_bm;
+		}
+	}
+	else if (addr == (ENC_EIR & ENC_REG_MASK))
+	{
+		// PKTIF cannot be changed
+		*reg = (v & ~ENC_PKTIF_bm) | (old & ENC_PKTIF_bm);
+	}
+	else if (bank == 0 && addr == (ENC_ERXSTL & ENC_REG_MASK))
+	{
+		// the write pointer follows the start of the ring
+		enc28j60_set_pair(enc, ENC_ERXWRPTL, PAIR(enc, ENC_ERXSTL));
+	}
+	else if (bank == 0 && addr == (ENC_ERXSTH & ENC_REG_MASK))
+	{
+		enc28j60_set_pair(enc, ENC_ERXWRPTL, PAIR(enc, ENC_ERXSTL));
+	}
+	else if (bank == 2 && addr == (ENC_MICMD & ENC_REG_MASK))
+	{
+		if (v & ENC_MIIRD_bm)
+		{
+			uint16_t r = enc->phy[BANK(enc, ENC_MIREGADR) & 0x1F];
+			BANK(enc, ENC_MIRDL) = (uint8_t) r;
+			BANK(enc, ENC_MIRDH) = (uint8_t) (r >> 8);
+		}
+	}
+	else if (bank == 2 && addr == (ENC_MIWRH & ENC_REG_MASK))
+	{
+		enc->phy[BANK(enc, ENC_MIREGADR) & 0x1F] =
+				BANK(enc, ENC_MIWRL) | (v << 8);
+	}
+	enc28j60_refresh(enc);
+}
+
+/*
+ * Registers the firmware cannot write.
+ */
+static uint8_t enc28j60_read_only(uint8_t bank, uint8_t addr)
+{
+	return addr == (ENC_ESTAT & ENC_REG_MASK)
+			|| (bank == 0 && (addr == (ENC_ERXWRPTL & ENC_REG_MASK)
+					|| addr == (ENC_ERXWRPTH & ENC_REG_MASK)))
+			|| (bank == 1 && addr == (ENC_EPKTCNT & ENC_REG_MASK))
+			|| (bank == 2 && (addr == (ENC_MIRDL & ENC_REG_MASK)
+					|| addr == (ENC_MIRDH & ENC_REG_MASK)))
+			|| (bank == 3 && addr == (ENC_EREVID & ENC_REG_MASK));
+}
+
+/*
+ * ============================================================================
+ * 
+ *   BUFFER MEMORY
+ * 
+ * ============================================================================
+ */
+
+static uint8_t enc28j60_buffer_read(Enc28j60* enc)
+{
+	uint16_t p = PAIR(enc, ENC_ERDPTL) & (ENC28J60_BUFFER - 1);
+	uint8_t v = enc->buffer[p];
+	if (BANK(enc, ENC_ECON2) & ENC_AUTOINC_bm)
+	{
+		// reads wrap around the end of the receive ring
+		if (p == PAIR(enc, ENC_ERXNDL))
+		{
+			p = PAIR(enc, ENC_ERXSTL);
+		}
+		else
+		{
+			p = (p + 1) & (ENC28J60_BUFFER - 1);
+		}
+		enc28j60_set_pair(enc, ENC_ERDPTL, p);
+	}
+	return v;
+}
+
+static void enc28j60_buffer_write(Enc28j60* enc, uint8_t v)
+{
+	uint16_t p = PAIR(enc, ENC_EWRPTL) & (ENC28J60_BUFFER - 1);
+	enc->buffer[p] = v;
+	if (BANK(enc, ENC_ECON2) & ENC_AUTOINC_bm)
+	{
+		enc28j60_set_pair(enc, ENC_EWRPTL, (p + 1) & (ENC28J60_BUFFER - 1));
+	}
+}
+
+/*
+ * ============================================================================
+ * 
+ *   WIRE
+ * 
+ * ============================================================================
+ */
+
+static uint32_t enc28j60_crc32(const uint8_t* data, uint16_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for (uint16_t i = 0; i < length; i++)
+	{
+		crc ^= data[i];
+		for (uint8_t j = 0; j < 8; j++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+static uint8_t enc28j60_filter(Enc28j60* enc, const uint8_t* frame)
+{
+	uint8_t f = BANK(enc, ENC_ERXFCON);
+	uint8_t enabled = f & (ENC_UCEN_bm | ENC_PMEN_bm | ENC_MPEN_bm
+			| ENC_HTEN_bm | ENC_MCEN_bm | ENC_BCEN_bm);
+	if (! enabled)
+	{
+		return 1;
+	}
+
+	uint8_t mac[6] = {
+		BANK(enc, ENC_MAADR1), BANK(enc, ENC_MAADR2), BANK(enc, ENC_MAADR3),
+		BANK(enc, ENC_MAADR4), BANK(enc, ENC_MAADR5), BANK(enc, ENC_MAADR6)
+	};
+	uint8_t broadcast = 1;
+	for (uint8_t i = 0; i < 6; i++)
+	{
+		if (frame[i] != 0xFF)
+		{
+			broadcast = 0;
+		}
+	}
+
+	// the pattern match, magic packet and hash filters are not modelled
+	uint8_t uc = memcmp(frame, mac, 6) == 0;
+	uint8_t mc = (frame[0] & 0x01) && ! broadcast;
+	uint8_t results[3] = { uc, mc, broadcast };
+	uint8_t masks[3] = { ENC_UCEN_bm, ENC_MCEN_bm, ENC_BCEN_bm };
+	uint8_t any = 0, all = 1;
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		if (f & masks[i])
+		{
+			any |= results[i];
+			all &= results[i];
+		}
+	}
+	return (f & ENC_ANDOR_bm) ? all : any;
+}
+
+uint8_t enc28j60_receive(Enc28j60* enc, const uint8_t* frame, uint16_t length)
+{
+	if (! (BANK(enc, ENC_ECON1) & ENC_RXEN_bm) || length < 14)
+	{
+		return 0;
+	}
+	if (! enc28j60_filter(enc, frame))
+	{
+		enc->rx_filtered++;
+		return 0;
+	}
+
+	uint16_t start = PAIR(enc, ENC_ERXSTL);
+	uint16_t end = PAIR(enc, ENC_ERXNDL);
+	uint16_t wr = PAIR(enc, ENC_ERXWRPTL);
+	uint16_t rd = PAIR(enc, ENC_ERXRDPTL);
+	uint16_t size = end - start + 1;
+
+	// the header, the frame and its FCS, padded to an even address
+	uint16_t count = length + 4;
+	uint16_t need = 6 + count;
+	need += need & 1;
+	uint16_t used = (wr >= rd) ? (wr - rd) : (size - (rd - wr));
+	if (used + need >= size || BANK(enc, ENC_EPKTCNT) == 0xFF)
+	{
+		enc->rx_overflows++;
+		BANK(enc, ENC_EIR) |= ENC_RXERIF_bm;
+		enc28j60_refresh(enc);
+		return 0;
+	}
+
+	uint16_t next = wr + need;
+	if (next > end)
+	{
+		next = start + (next - end - 1);
+	}
+
+	uint32_t crc = enc28j60_crc32(frame, length);
+	uint8_t header[6] = {
+		(uint8_t) next, (uint8_t) (next >> 8),
+		(uint8_t) count, (uint8_t) (count >> 8),
+		0x80, // received OK
+		0x00
+	};
+	if (frame[0] & 0x01)
+	{
+		header[5] |= (frame[0] == 0xFF) ? 0x02 : 0x01;
+	}
+
+	uint16_t p = wr;
+	for (uint16_t i = 0; i < need; i++)
+	{
+		uint8_t v;
+		if (i < 6)
+		{
+			v = header[i];
+		}
+		else if (i < 6 + length)
+		{
+			v = frame[i - 6];
+		}
+		else if (i < 6 + count)
+		{
+			v = (uint8_t) (crc >> (8 * (i - 6 - length)));
+		}
+		else
+		{
+			v = 0;
+		}
+		enc->buffer[p] = v;
+		p = (p == end) ? start : p + 1;
+	}
+
+	enc28j60_set_pair(enc, ENC_ERXWRPTL, next);
+	BANK(enc, ENC_EPKTCNT)++;
+	enc->rx_frames++;
+	enc28j60_refresh(enc);
+	return 1;
+}
+
+static void enc28j60_transmit_done(Enc28j60* enc)
+{
+	enc->tx_pending = 0;
+
+	// skip the per packet control byte
+	uint8_t frame[1536];
+	uint16_t length = 0;
+	for (uint16_t p = enc->tx_start + 1;
+			p <= enc->tx_end && length < sizeof(frame); p++)
+	{
+		frame[length++] = enc->buffer[p & (ENC28J60_BUFFER - 1)];
+	}
+	if ((BANK(enc, ENC_MACON3) & ENC_PADCFG0_bm) && length < 60)
+	{
+		memset(frame + length, 0, 60 - length);
+		length = 60;
+	}
+
+	BANK(enc, ENC_ECON1) &= ~ENC_TXRTS_bm;
+	BANK(enc, ENC_EIR) |= ENC_TXIF_bm;
+	enc28j60_refresh(enc);
+	enc->tx_frames++;
+	if (enc->transmit)
+	{
+		enc->transmit(enc->transmit_ctx, frame, length, enc->tx_done);
+	}
+}
+
+void enc28j60_update(Enc28j60* enc, uint64_t now)
+{
+	if (enc->tx_pending && now >= enc->tx_done)
+	{
+		enc28j60_transmit_done(enc);
+	}
+	if (enc->arrive)
+	{
+		enc->arrive(enc->arrive_ctx, now);
+	}
+}
+
+uint8_t enc28j60_pending(Enc28j60* enc)
+{
+	return BANK(enc, ENC_EPKTCNT);
+}
+
+/*
+ * ============================================================================
+ * 
+ *   SPI
+ * 
+ * ============================================================================
+ */
+
+/*
+ * Gives the byte shifted out during the next exchange, which for most
+ * instructions is decided by what the previous bytes were.
+ */
+static uint8_t enc28j60_out(Enc28j60* enc)
+{
+	uint8_t bank = BANK(enc, ENC_ECON1) & 0x03;
+	uint8_t addr = enc->cmd & ENC_REG_MASK;
+	switch (enc->op)
+	{
+		case OP_READ:
+			return REG(enc, addr);
+		case OP_READ_MAC:
+			// dummy byte first
+			return (enc->count == 1) ? 0x00 : enc->regs[bank][addr];
+		case OP_READ_BUFFER:
+			return enc28j60_buffer_read(enc);
+		default:
+			return 0xFF;
+	}
+}
+
+static uint8_t enc28j60_exchange(void* dev, uint8_t in, uint64_t when)
+{
+	Enc28j60* enc = dev;
+	// ENC_PORT, without the cost of an access
+	if (sim_port_out(&sim_portf) & ENC_PIN_CS)
+	{
+		return 0xFF;
+	}
+	enc28j60_update(enc, when);
+
+	if (enc->op == OP_NONE)
+	{
+		uint8_t bank = BANK(enc, ENC_ECON1) & 0x03;
+		uint8_t addr = in & ENC_REG_MASK;
+		enc->cmd = in;
+		enc->count = 0;
+		enc28j60_refresh(enc);
+		if (in == ENC_OP_RBM)
+		{
+			enc->op = OP_READ_BUFFER;
+		}
+		else if (in == ENC_OP_WBM)
+		{
+			enc->op = OP_WRITE_BUFFER;
+		}
+		else if (in == ENC_OP_SRC)
+		{
+			enc28j60_reset(enc);
+			enc->clkrdy_at = when + ENC28J60_CLKRDY_NS;
+			enc->op = OP_IGNORE;
+		}
+		else
+		{
+			switch (in & 0xE0)
+			{
+				case ENC_OP_RCR:
+					enc->op = (addr < 0x1A && enc28j60_is_mac(bank, addr))
+							? OP_READ_MAC : OP_READ;
+					break;
+				case ENC_OP_WCR: enc->op = OP_WRITE; break;
+				case ENC_OP_BFS: enc->op = OP_SET; break;
+				case ENC_OP_BFC: enc->op = OP_CLEAR; break;
+				default: enc->op = OP_IGNORE; break;
+			}
+		}
+		return 0xFF;
+	}
+
+	enc->count++;
+	uint8_t out = enc28j60_out(enc);
+	uint8_t bank = BANK(enc, ENC_ECON1) & 0x03;
+	uint8_t addr = enc->cmd & ENC_REG_MASK;
+	uint8_t* reg = &(enc->regs[addr >= 0x1B ? 0 : bank][addr]);
+	uint8_t old = *reg;
+	switch (enc->op)
+	{
+		case OP_WRITE:
+			if (addr != 0x1A && ! enc28j60_read_only(bank, addr))
+			{
+				*reg = in;
+				enc28j60_written(enc, bank, addr, old, when);
+			}
+			enc->op = OP_IGNORE;
+			break;
+		case OP_SET:
+		case OP_CLEAR:
+			// bit field operations only work on the ETH registers
+			if (addr != 0x1A && ! enc28j60_read_only(bank, addr)
+					&& ! enc28j60_is_mac(bank, addr))
+			{
+				*reg = (enc->op == OP_SET) ? (old | in) : (old & ~in);
+				enc28j60_written(enc, bank, addr, old, when);
+			}
+			enc->op = OP_IGNORE;
+			break;
+		case OP_WRITE_BUFFER:
+			enc28j60_buffer_write(enc, in);
+			break;
+		case OP_READ:
+			enc->op = OP_IGNORE;
+			break;
+		default:
+			break;
+	}
+	return out;
+}
+
+/*
+ * /INT is driven low while an enabled interrupt is pending.
+ */
+static uint8_t enc28j60_port_in(void* dev, uint8_t out)
+{
+	Enc28j60* enc = dev;
+	enc28j60_update(enc, sim_now);
+	enc28j60_refresh(enc);
+	uint8_t pin = enc28j60_interrupt(enc) ? 0 : ENC_PIN_INT;
+	return (out & ~ENC_PIN_INT) | pin;
+}
+
+/*
+ * Raising /CS ends the instruction in progress, and /RESET going high starts
+ * the oscillator start-up timer.
+ */
+static void enc28j60_port_edge(void* dev, uint8_t rise, uint8_t fall)
+{
+	Enc28j60* enc = dev;
+	if (rise & ENC_PIN_CS)
+	{
+		enc->op = OP_NONE;
+	}
+	if (fall & ENC_PIN_RST)
+	{
+		enc28j60_reset(enc);
+		enc->clkrdy_at = UINT64_MAX;
+	}
+	if (rise & ENC_PIN_RST)
+	{
+		enc->clkrdy_at = sim_now + ENC28J60_CLKRDY_NS;
+	}
+}
+
+void enc28j60_attach(Enc28j60* enc)
+{
+	enc28j60_reset(enc);
+	enc->clkrdy_at = 0;
+	sim_usart_attach(&ENC_USART, enc28j60_exchange, enc);
+	sim_port_attach(&ENC_PORT, enc28j60_port_in, enc28j60_port_edge, enc);
+}
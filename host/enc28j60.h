@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENC28J60_H
+#define ENC28J60_H
+
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * 
+ *   SIMULATED ETHERNET CONTROLLER
+ * 
+ * ============================================================================
+ * 
+ * An ENC28J60 attached to the Ethernet controller USART and port. The model
+ * covers the SPI instruction set, the banked control registers, the MAC and
+ * MII registers that return a dummy byte first, the 8KB buffer with its
+ * receive ring, and /INT. Frames given to enc28j60_receive() are filtered
+ * and placed in the ring with the usual six byte header, and frames the
+ * firmware transmits are handed to a callback once they have gone out on the
+ * wire, at 10Mbps.
+ */
+
+#define ENC28J60_BUFFER         8192
+
+/*
+ * Time from /RESET going high until ESTAT.CLKRDY is set, in ns.
+ */
+#define ENC28J60_CLKRDY_NS      300000
+
+/*
+ * Called when a frame has been transmitted, without its FCS.
+ */
+typedef void (*Enc28j60Transmit)(void* ctx, const uint8_t* frame,
+		uint16_t length, uint64_t when);
+
+/*
+ * Called whenever the model catches up with simulated time, so frames due by
+ * the given time can be handed to enc28j60_receive().
+ */
+typedef void (*Enc28j60Arrive)(void* ctx, uint64_t now);
+
+typedef struct Enc28j60_t {
+	Enc28j60Transmit transmit;
+	void* transmit_ctx;
+	Enc28j60Arrive arrive;
+	void* arrive_ctx;
+
+	// frame counts
+	uint32_t rx_frames;
+	uint32_t rx_filtered;
+	uint32_t rx_overflows;
+	uint32_t tx_frames;
+	uint32_t tx_aborted;
+
+	// chip state
+	uint8_t buffer[ENC28J60_BUFFER];
+	uint8_t regs[4][32];
+	uint16_t phy[32];
+	uint64_t clkrdy_at;
+	uint8_t cmd;
+	uint8_t op;
+	uint8_t count;
+	uint16_t tx_start;
+	uint16_t tx_end;
+	uint64_t tx_done;
+	uint8_t tx_pending;
+} Enc28j60;
+
+/*
+ * Resets the controller and connects it to the Ethernet controller USART and
+ * port.
+ */
+void enc28j60_attach(Enc28j60*);
+
+/*
+ * Gives the controller a frame from the wire, without its FCS, which is put
+ * in the receive ring if reception is on, the filters pass it, and there is
+ * room. Gives back nonzero if the frame was kept.
+ */
+uint8_t enc28j60_receive(Enc28j60*, const uint8_t* frame, uint16_t length);
+
+/*
+ * Finishes any transmission done by the given time, and takes any frames
+ * that have arrived by then.
+ */
+void enc28j60_update(Enc28j60*, uint64_t now);
+
+/*
+ * Number of frames waiting in the receive ring.
+ */
+uint8_t enc28j60_pending(Enc28j60*);
+
+#endif /* ENC28J60_H */
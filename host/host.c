@@ -0,0 +1,662 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// for strdup()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "bus.h"
+#include "card.h"
+#include "enc28j60.h"
+#include "host.h"
+#include "sim.h"
+
+/*
+ * ============================================================================
+ * 
+ *   HOST BUILD DRIVER
+ * 
+ * ============================================================================
+ * 
+ * Runs the firmware against the simulated bus, memory card and Ethernet
+ * controller, following a script of commands for the initiator. See
+ * host/README.md for the script format.
+ */
+
+#define HOST_MAX_LINES          4096
+#define HOST_MAX_DATA           (256UL * 512)
+
+// the command in progress, and its line in the script
+static BusCommand command;
+static uint8_t data_in[HOST_MAX_DATA];
+static uint8_t data_out[HOST_MAX_DATA];
+static char* lines[HOST_MAX_LINES];
+static uint16_t line_count;
+static uint16_t line_pos;
+static uint16_t command_line;
+
+// checks for the command in progress
+static uint8_t expect_status;
+static uint8_t expect_any_status;
+static uint8_t expect_timeout;
+static uint8_t expect[HOST_MAX_LINES];
+static uint16_t expect_len;
+static uint8_t check_pattern;
+static uint32_t check_seed;
+
+// repeating TEST UNIT READY
+static uint16_t ready_tries;
+
+// current defaults
+static uint8_t target = DEVICE_ID_HDD;
+static uint8_t verbose;
+static uint32_t commands;
+
+static Card card;
+static Enc28j60 enc;
+
+uint8_t host_pattern(uint32_t seed, uint32_t i)
+{
+	uint32_t x = (seed * 2654435761UL) ^ ((i >> 9) * 40503UL) ^ (i * 7);
+	return (uint8_t) (x ^ (x >> 8) ^ (x >> 16));
+}
+
+static int host_compare(const void* a, const void* b)
+{
+	uint64_t x = *((const uint64_t*) a);
+	uint64_t y = *((const uint64_t*) b);
+	return (x > y) - (x < y);
+}
+
+uint64_t host_percentile(uint64_t* samples, uint32_t count, uint8_t pct)
+{
+	if (count == 0) return 0;
+	qsort(samples, count, sizeof(uint64_t), host_compare);
+	uint32_t i = (uint32_t) (((uint64_t) count * pct + 99) / 100);
+	return samples[i > 0 ? i - 1 : 0];
+}
+
+void host_config(uint8_t flags, uint8_t hdd_id, uint8_t link_id)
+{
+	const uint8_t mac[6] = {
+		NET_MAC_DEFAULT_ADDR_1, NET_MAC_DEFAULT_ADDR_2,
+		NET_MAC_DEFAULT_ADDR_3, NET_MAC_DEFAULT_ADDR_4,
+		NET_MAC_DEFAULT_ADDR_5, NET_MAC_DEFAULT_ADDR_6
+	};
+	memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+	sim_eeprom[CONFIG_OFFSET_VALIDITY] = CONFIG_EEPROM_VALIDITY;
+	sim_eeprom[CONFIG_OFFSET_FLAGS] = flags;
+	sim_eeprom[CONFIG_OFFSET_ID_HDD] = hdd_id;
+	sim_eeprom[CONFIG_OFFSET_ID_LINK] = link_id;
+	memcpy(sim_eeprom + CONFIG_OFFSET_MAC, mac, sizeof(mac));
+}
+
+static void host_fail(const char* msg)
+{
+	fprintf(stderr, "host: line %u: %s\n", line_pos, msg);
+	exit(EXIT_FAILURE);
+}
+
+static uint32_t host_number(const char* token, int base)
+{
+	char* end;
+	if (token == NULL)
+	{
+		host_fail("missing number");
+	}
+	unsigned long v = strtoul(token, &end, base);
+	if (*end != '\0')
+	{
+		host_fail("bad number");
+	}
+	return (uint32_t) v;
+}
+
+/*
+ * Reads hex bytes until a token that is not one, returning that token.
+ */
+static char* host_bytes(uint8_t* dst, uint16_t max, uint16_t* len)
+{
+	char* t;
+	*len = 0;
+	while ((t = strtok(NULL, " \t")) != NULL)
+	{
+		char* end;
+		unsigned long v = strtoul(t, &end, 16);
+		if (strlen(t) != 2 || *end != '\0')
+		{
+			break;
+		}
+		if (*len >= max)
+		{
+			host_fail("too many bytes");
+		}
+		dst[(*len)++] = (uint8_t) v;
+	}
+	return t;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   RESULTS
+ * 
+ * ============================================================================
+ */
+
+static void host_report(BusCommand* c)
+{
+	commands++;
+	if (verbose)
+	{
+		printf("%10llu us  id %u  %02X  status %02X  in %5u  out %5u  "
+				"%8.1f us\n",
+				(unsigned long long) (c->selected / 1000), c->id, c->cdb[0],
+				c->status, c->in_len, c->out_taken,
+				(c->ended - c->selected) / 1000.0);
+		if (verbose > 1)
+		{
+			for (uint32_t i = 0; i < c->in_len && i < c->in_max; i++)
+			{
+				printf((i % 16 == 15) ? "%02X\n" : "%02X ", c->in[i]);
+			}
+			if (c->in_len % 16)
+			{
+				printf("\n");
+			}
+		}
+	}
+}
+
+static void host_check(BusCommand* c)
+{
+	host_report(c);
+	if (c->timeout != expect_timeout)
+	{
+		bus_error(c->timeout ? "line %u: selection of ID %u timed out"
+				: "line %u: ID %u answered selection",
+				command_line, c->id);
+		return;
+	}
+	if (c->timeout)
+	{
+		return;
+	}
+	if (! expect_any_status && c->status != expect_status)
+	{
+		bus_error("line %u: status %02X, expected %02X",
+				command_line, c->status, expect_status);
+	}
+	if (expect_len > c->in_len)
+	{
+		bus_error("line %u: got %u bytes, expected at least %u",
+				command_line, c->in_len, expect_len);
+	}
+	else
+	{
+		for (uint16_t i = 0; i < expect_len; i++)
+		{
+			if (c->in[i] != expect[i])
+			{
+				bus_error("line %u: byte %u is %02X, expected %02X",
+						command_line, i, c->in[i], expect[i]);
+				break;
+			}
+		}
+	}
+	if (check_pattern)
+	{
+		for (uint32_t i = 0; i < c->in_len && i < c->in_max; i++)
+		{
+			if (c->in[i] != host_pattern(check_seed, i))
+			{
+				bus_error("line %u: byte %u does not match pattern %u",
+						command_line, i, check_seed);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * ============================================================================
+ * 
+ *   SCRIPT
+ * 
+ * ============================================================================
+ */
+
+static void host_command_reset(void)
+{
+	memset(&command, 0, sizeof(command));
+	command.start_at = sim_now;
+	command.id = target;
+	command.identify = 0x80;
+	command.in = data_in;
+	command.out = data_out;
+	expect_status = 0x00;
+	expect_any_status = 0;
+	expect_timeout = 0;
+	expect_len = 0;
+	check_pattern = 0;
+}
+
+static void host_parse_command(void)
+{
+	uint16_t cdb_len;
+	host_command_reset();
+	char* t = host_bytes(command.cdb, sizeof(command.cdb), &cdb_len);
+	if (cdb_len == 0)
+	{
+		host_fail("missing CDB");
+	}
+	while (t != NULL)
+	{
+		if (! strcmp(t, "in"))
+		{
+			command.in_max = host_number(strtok(NULL, " \t"), 0);
+			if (command.in_max > HOST_MAX_DATA)
+			{
+				host_fail("DATA IN too long");
+			}
+			t = strtok(NULL, " \t");
+		}
+		else if (! strcmp(t, "out"))
+		{
+			command.out_len = host_number(strtok(NULL, " \t"), 0);
+			uint32_t seed = host_number(strtok(NULL, " \t"), 0);
+			if (command.out_len > HOST_MAX_DATA)
+			{
+				host_fail("DATA OUT too long");
+			}
+			for (uint32_t i = 0; i < command.out_len; i++)
+			{
+				data_out[i] = host_pattern(seed, i);
+			}
+			t = strtok(NULL, " \t");
+		}
+		else if (! strcmp(t, "data"))
+		{
+			uint16_t len;
+			t = host_bytes(data_out, sizeof(expect), &len);
+			command.out_len = len;
+		}
+		else if (! strcmp(t, "expect"))
+		{
+			t = host_bytes(expect, sizeof(expect), &expect_len);
+		}
+		else if (! strcmp(t, "check"))
+		{
+			check_pattern = 1;
+			check_seed = host_number(strtok(NULL, " \t"), 0);
+			t = strtok(NULL, " \t");
+		}
+		else if (! strcmp(t, "status"))
+		{
+			t = strtok(NULL, " \t");
+			if (t != NULL && ! strcmp(t, "any"))
+			{
+				expect_any_status = 1;
+			}
+			else if (t != NULL && ! strcmp(t, "none"))
+			{
+				expect_timeout = 1;
+			}
+			else
+			{
+				expect_status = (uint8_t) host_number(t, 16);
+			}
+			t = strtok(NULL, " \t");
+		}
+		else if (! strcmp(t, "sdtr"))
+		{
+			command.sdtr = 1;
+			t = strtok(NULL, " \t");
+		}
+		else if (! strcmp(t, "noatn"))
+		{
+			command.identify = 0;
+			t = strtok(NULL, " \t");
+		}
+		else
+		{
+			host_fail("unknown command option");
+		}
+	}
+}
+
+/*
+ * Writes the test pattern straight into blocks of the card, as if they had
+ * been written through the bus with a single command.
+ */
+static void host_fill(uint32_t lba, uint32_t blocks, uint32_t seed)
+{
+	uint8_t data[512];
+	for (uint32_t i = 0; i < blocks; i++)
+	{
+		for (uint16_t j = 0; j < 512; j++)
+		{
+			data[j] = host_pattern(seed, i * 512 + j);
+		}
+		card_write(&card, lba + i, data);
+	}
+}
+
+static void host_format(void)
+{
+	char* t = strtok(NULL, " \t");
+	if (t != NULL && ! strcmp(t, "table"))
+	{
+		CardVolume volumes[8];
+		uint8_t count = 0;
+		while ((t = strtok(NULL, " \t")) != NULL)
+		{
+			if (count >= 8)
+			{
+				host_fail("too many volumes");
+			}
+			volumes[count].id = (uint8_t) host_number(t, 0);
+			volumes[count].offset = host_number(strtok(NULL, " \t"), 0);
+			volumes[count].blocks = host_number(strtok(NULL, " \t"), 0);
+			count++;
+		}
+		card_format_table(&card, volumes, count);
+	}
+	else if (t != NULL && (! strcmp(t, "fat32") || ! strcmp(t, "exfat")))
+	{
+		uint8_t exfat = ! strcmp(t, "exfat");
+		uint32_t blocks = host_number(strtok(NULL, " \t"), 0);
+		uint32_t seed = host_number(strtok(NULL, " \t"), 0);
+		uint8_t option = 0;
+		t = strtok(NULL, " \t");
+		if (t != NULL)
+		{
+			if (strcmp(t, exfat ? "chained" : "fragmented"))
+			{
+				host_fail("unknown filesystem option");
+			}
+			option = 1;
+		}
+		uint32_t start = exfat ? card_format_exfat(&card, blocks, option)
+				: card_format_fat32(&card, blocks, option);
+		if (start == 0)
+		{
+			host_fail("image does not fit on the card");
+		}
+		host_fill(start, blocks, seed);
+	}
+	else
+	{
+		host_fail("unknown card layout");
+	}
+}
+
+static void host_frame(void)
+{
+	uint8_t frame[1518];
+	uint16_t len;
+	if (host_bytes(frame, sizeof(frame), &len) != NULL)
+	{
+		host_fail("frame is hex bytes only");
+	}
+	if (! enc28j60_receive(&enc, frame, len))
+	{
+		fprintf(stderr, "host: line %u: frame dropped\n", line_pos);
+	}
+}
+
+/*
+ * Handles directives until one needs the initiator, and gives back the
+ * command to run, or NULL at the end of the script.
+ */
+static BusCommand* host_next(void* ctx, BusCommand* done)
+{
+	(void) ctx;
+	if (done != NULL && ! done->idle)
+	{
+		if (ready_tries > 0)
+		{
+			host_report(done);
+			if (done->status == 0x00)
+			{
+				ready_tries = 0;
+			}
+			else if (--ready_tries == 0)
+			{
+				bus_error("line %u: never became ready", command_line);
+			}
+			else
+			{
+				command.start_at = sim_now + 10000000;
+				return &command;
+			}
+		}
+		else
+		{
+			host_check(done);
+		}
+	}
+
+	while (line_pos < line_count)
+	{
+		char* line = lines[line_pos++];
+		char* t = strtok(line, " \t");
+		if (t == NULL || t[0] == '#')
+		{
+			continue;
+		}
+		else if (! strcmp(t, "config") || ! strcmp(t, "card")
+				|| ! strcmp(t, "image"))
+		{
+			// handled before the firmware started
+			continue;
+		}
+		else if (! strcmp(t, "target"))
+		{
+			target = (uint8_t) host_number(strtok(NULL, " \t"), 0);
+		}
+		else if (! strcmp(t, "sync"))
+		{
+			bus_sync_period = (uint8_t) host_number(strtok(NULL, " \t"), 0);
+			bus_sync_offset = (uint8_t) host_number(strtok(NULL, " \t"), 0);
+		}
+		else if (! strcmp(t, "damage"))
+		{
+			card.damage_reads = (uint16_t) host_number(strtok(NULL, " \t"), 0);
+			card.damage_writes = (uint16_t) host_number(strtok(NULL, " \t"), 0);
+		}
+		else if (! strcmp(t, "format"))
+		{
+			host_format();
+		}
+		else if (! strcmp(t, "fill"))
+		{
+			uint32_t lba = host_number(strtok(NULL, " \t"), 0);
+			uint32_t blocks = host_number(strtok(NULL, " \t"), 0);
+			host_fill(lba, blocks, host_number(strtok(NULL, " \t"), 0));
+		}
+		else if (! strcmp(t, "remove"))
+		{
+			card_remove(&card);
+		}
+		else if (! strcmp(t, "insert"))
+		{
+			card_insert(&card);
+		}
+		else if (! strcmp(t, "wait"))
+		{
+			uint64_t us = host_number(strtok(NULL, " \t"), 0);
+			host_command_reset();
+			command.idle = 1;
+			command.start_at = sim_now + us * 1000;
+			return &command;
+		}
+		else if (! strcmp(t, "echo"))
+		{
+			char* rest = strtok(NULL, "");
+			printf("%s\n", rest ? rest : "");
+		}
+		else if (! strcmp(t, "frame"))
+		{
+			host_frame();
+		}
+		else if (! strcmp(t, "sent"))
+		{
+			uint32_t n = host_number(strtok(NULL, " \t"), 0);
+			enc28j60_update(&enc, sim_now);
+			if (enc.tx_frames != n)
+			{
+				bus_error("line %u: %u frames sent, expected %u",
+						line_pos, enc.tx_frames, n);
+			}
+		}
+		else if (! strcmp(t, "ready"))
+		{
+			char* n = strtok(NULL, " \t");
+			ready_tries = n ? (uint16_t) host_number(n, 0) : 100;
+			command_line = line_pos;
+			host_command_reset();
+			return &command;
+		}
+		else if (! strcmp(t, "cmd"))
+		{
+			command_line = line_pos;
+			host_parse_command();
+			return &command;
+		}
+		else
+		{
+			host_fail("unknown directive");
+		}
+	}
+
+	printf("%u commands, %u errors, %llu us simulated\n",
+			commands, bus_errors, (unsigned long long) (sim_now / 1000));
+	return NULL;
+}
+
+/*
+ * Applies the directives that set up the hardware before the firmware
+ * starts.
+ */
+static void host_setup(void)
+{
+	uint8_t have_card = 0;
+	memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+	for (line_pos = 0; line_pos < line_count; line_pos++)
+	{
+		char buf[256];
+		strncpy(buf, lines[line_pos], sizeof(buf) - 1);
+		buf[sizeof(buf) - 1] = '\0';
+		char* t = strtok(buf, " \t");
+		if (t == NULL)
+		{
+			continue;
+		}
+		else if (! strcmp(t, "config"))
+		{
+			uint8_t flags = (uint8_t) host_number(strtok(NULL, " \t"), 16);
+			uint8_t hdd_id = (uint8_t) host_number(strtok(NULL, " \t"), 0);
+			uint8_t link_id = (uint8_t) host_number(strtok(NULL, " \t"), 0);
+			host_config(flags, hdd_id, link_id);
+			target = hdd_id;
+		}
+		else if (! strcmp(t, "card"))
+		{
+			uint32_t mb = host_number(strtok(NULL, " \t"), 0);
+			if (! card_blank(&card, mb * 2048))
+			{
+				host_fail("cannot create card");
+			}
+			have_card = 1;
+		}
+		else if (! strcmp(t, "image"))
+		{
+			if (! card_open(&card, strtok(NULL, " \t")))
+			{
+				host_fail("cannot open image");
+			}
+			have_card = 1;
+		}
+	}
+	line_pos = 0;
+	if (! have_card)
+	{
+		card.present = 0;
+	}
+}
+
+static void host_load(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+	{
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	char buf[4096];
+	while (fgets(buf, sizeof(buf), f) != NULL)
+	{
+		if (line_count >= HOST_MAX_LINES)
+		{
+			host_fail("script too long");
+		}
+		buf[strcspn(buf, "\r\n")] = '\0';
+		lines[line_count++] = strdup(buf);
+	}
+	fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && ! strcmp(argv[1], "disk"))
+	{
+		return bench_disk(argc - 1, argv + 1);
+	}
+	if (argc > 1 && ! strcmp(argv[1], "link"))
+	{
+		return bench_link(argc - 1, argv + 1);
+	}
+
+	int arg = 1;
+	while (arg < argc && ! strcmp(argv[arg], "-v"))
+	{
+		verbose++;
+		arg++;
+	}
+	if (arg + 1 != argc)
+	{
+		fprintf(stderr, "usage: %s [-v [-v]] <script>\n"
+				"       %s disk [options]\n"
+				"       %s link [options] <capture.pcap>\n",
+				argv[0], argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	host_load(argv[arg]);
+	host_setup();
+	card_attach(&card);
+	enc28j60_attach(&enc);
+	bus_init();
+	bus_run(host_next, NULL);
+	return firmware_main();
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * 
+ *   HOST BUILD DRIVERS
+ * 
+ * ============================================================================
+ * 
+ * The drivers that run the firmware in the host build: the script runner in
+ * host.c, and the benchmarks. Each sets up the simulated devices, gives the
+ * bus its commands, and then starts the firmware, which never returns; the
+ * process exits when the driver runs out of commands.
+ */
+
+/*
+ * The firmware's main(), renamed in the build.
+ */
+int firmware_main(void);
+
+/*
+ * Writes a valid configuration with the given flags and IDs into the
+ * simulated EEPROM, with the default MAC address.
+ */
+void host_config(uint8_t flags, uint8_t hdd_id, uint8_t link_id);
+
+/*
+ * Test data that differs at every offset within a block and from block to
+ * block, so misplaced data is caught.
+ */
+uint8_t host_pattern(uint32_t seed, uint32_t i);
+
+/*
+ * Reads a percentile, in the range 0 to 100, from the given samples, which
+ * are sorted in place.
+ */
+uint64_t host_percentile(uint64_t* samples, uint32_t count, uint8_t pct);
+
+/*
+ * The benchmarks, each given the arguments after its name.
+ */
+int bench_disk(int argc, char** argv);
+int bench_link(int argc, char** argv);
+
+#endif /* HOST_H */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_HOST_H
+#define HW_HOST_H
+
+/*
+ * Hardware definitions for the host build in host/, which runs the firmware
+ * modules on a PC against simulated devices. The pin and peripheral layout
+ * is the same as the first hardware revision, so the simulated card and
+ * Ethernet controller sit where they would on a real board.
+ */
+#include "hw_v01.h"
+#include "sim.h"
+
+/*
+ * Route memory card and Ethernet controller data register traffic through
+ * the simulated USARTs; see config.h.
+ */
+#define usart_tx(u, v)          sim_usart_tx(&(u), (v))
+#define usart_rx(u)             sim_usart_rx(&(u))
+
+#endif /* HW_HOST_H */
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+/*
+ * Stand-in for the avr-libc device header in the host build, see
+ * host/README.md. Only the peripherals and constants used by the firmware
+ * modules compiled for the host are provided.
+ *
+ * Peripherals that simulated devices sit behind are reached through an
+ * access call each time they are named, which brings the registers up to
+ * date with the simulation first: this is how port strobes reach device
+ * models, and how timer counts follow simulated time. Each access also
+ * advances simulated time by the cost of an I/O instruction, so busy-wait
+ * loops on these registers make progress.
+ */
+
+#define _BV(x)                  (1U << (x))
+
+typedef volatile uint8_t register8_t;
+typedef volatile uint16_t register16_t;
+
+struct SimUsart_t;
+struct SimPort_t;
+
+typedef struct USART_struct
+{
+	register8_t DATA;
+	register8_t STATUS;
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t CTRLC;
+	register8_t BAUDCTRLA;
+	register8_t BAUDCTRLB;
+	struct SimUsart_t* sim;
+} USART_t;
+
+typedef struct PORT_struct
+{
+	register8_t DIR;
+	register8_t DIRSET;
+	register8_t DIRCLR;
+	register8_t DIRTGL;
+	register8_t OUT;
+	register8_t OUTSET;
+	register8_t OUTCLR;
+	register8_t OUTTGL;
+	register8_t IN;
+	register8_t INTCTRL;
+	register8_t INT0MASK;
+	register8_t INT1MASK;
+	register8_t INTFLAGS;
+	register8_t PIN0CTRL;
+	register8_t PIN1CTRL;
+	register8_t PIN2CTRL;
+	register8_t PIN3CTRL;
+	register8_t PIN4CTRL;
+	register8_t PIN5CTRL;
+	register8_t PIN6CTRL;
+	register8_t PIN7CTRL;
+	struct SimPort_t* sim;
+} PORT_t;
+
+typedef struct VPORT_struct
+{
+	register8_t DIR;
+	register8_t OUT;
+	register8_t IN;
+	register8_t INTFLAGS;
+	PORT_t* port;
+} VPORT_t;
+
+typedef struct TC0_struct
+{
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t CTRLC;
+	register8_t CTRLD;
+	register8_t CTRLE;
+	register8_t INTCTRLA;
+	register8_t INTCTRLB;
+	register8_t CTRLFCLR;
+	register8_t CTRLFSET;
+	register8_t INTFLAGS;
+	register8_t TEMP;
+	register16_t CNT;
+	register16_t PER;
+	register16_t CCA;
+	register16_t CCB;
+	register16_t CCC;
+	register16_t CCD;
+	uint16_t sim_mul;
+	uint16_t sim_div;
+	uint8_t sim_shift;
+} TC0_t;
+typedef TC0_t TC1_t;
+
+/*
+ * DATAIN is wider than the hardware register so a write can be told apart
+ * from the idle marker the simulation leaves there.
+ */
+typedef struct CRC_struct
+{
+	register8_t CTRL;
+	register8_t STATUS;
+	register16_t DATAIN;
+	register8_t CHECKSUM0;
+	register8_t CHECKSUM1;
+	register8_t CHECKSUM2;
+	register8_t CHECKSUM3;
+} CRC_t;
+
+typedef struct RST_struct
+{
+	register8_t STATUS;
+	register8_t CTRL;
+} RST_t;
+
+USART_t* sim_usart(USART_t*);
+PORT_t* sim_port(PORT_t*);
+VPORT_t* sim_vport(VPORT_t*);
+TC0_t* sim_timer(TC0_t*);
+CRC_t* sim_crc(void);
+
+extern USART_t sim_usarte0, sim_usarte1, sim_usartf0;
+extern PORT_t sim_porta, sim_portb, sim_portc, sim_portd;
+extern PORT_t sim_porte, sim_portf, sim_portr;
+extern VPORT_t sim_vport0, sim_vport1, sim_vport2, sim_vport3;
+extern TC0_t sim_tcc0, sim_tcc1, sim_tcd0, sim_tcd1;
+extern TC0_t sim_tce0, sim_tce1, sim_tcf0;
+extern RST_t RST;
+extern register8_t GPIOR0, GPIOR1, GPIOR3;
+
+/*
+ * GPIOR2 holds the PHY status flags, which the selection interrupt sets on
+ * real hardware. Reading it gives the simulated bus a chance to select us.
+ */
+register8_t* sim_gpior2(void);
+#define GPIOR2                  (*sim_gpior2())
+
+#define USARTE0                 (*sim_usart(&sim_usarte0))
+#define USARTE1                 (*sim_usart(&sim_usarte1))
+#define USARTF0                 (*sim_usart(&sim_usartf0))
+#define PORTA                   (*sim_port(&sim_porta))
+#define PORTB                   (*sim_port(&sim_portb))
+#define PORTC                   (*sim_port(&sim_portc))
+#define PORTD                   (*sim_port(&sim_portd))
+#define PORTE                   (*sim_port(&sim_porte))
+#define PORTF                   (*sim_port(&sim_portf))
+#define PORTR                   (*sim_port(&sim_portr))
+#define VPORT0                  (*sim_vport(&sim_vport0))
+#define VPORT1                  (*sim_vport(&sim_vport1))
+#define VPORT2                  (*sim_vport(&sim_vport2))
+#define VPORT3                  (*sim_vport(&sim_vport3))
+#define TCC0                    (*sim_timer(&sim_tcc0))
+#define TCC1                    (*sim_timer(&sim_tcc1))
+#define TCD0                    (*sim_timer(&sim_tcd0))
+#define TCD1                    (*sim_timer(&sim_tcd1))
+#define TCE0                    (*sim_timer(&sim_tce0))
+#define TCE1                    (*sim_timer(&sim_tce1))
+#define TCF0                    (*sim_timer(&sim_tcf0))
+#define CRC                     (*sim_crc())
+
+/*
+ * Interrupt vectors are never raised in the host build, but need names.
+ */
+#define USARTE0_DRE_vect        sim_vect_usarte0_dre
+#define TCC0_CCA_vect           sim_vect_tcc0_cca
+#define TCC0_CCB_vect           sim_vect_tcc0_ccb
+#define TCC1_OVF_vect           sim_vect_tcc1_ovf
+#define TCD1_CCA_vect           sim_vect_tcd1_cca
+#define PORTC_INT0_vect         sim_vect_portc_int0
+#define PORTC_INT1_vect         sim_vect_portc_int1
+
+#define USART_RXCIF_bm          0x80
+#define USART_TXCIF_bm          0x40
+#define USART_DREIF_bm          0x20
+#define USART_RXEN_bm           0x10
+#define USART_TXEN_bm           0x08
+#define USART_CMODE_MSPI_gc     0xC0
+#define USART_DREINTLVL_gm      0x03
+#define USART_DREINTLVL_OFF_gc  0x00
+#define USART_DREINTLVL_LO_gc   0x01
+
+#define PORT_INVEN_bm           0x40
+#define PORT_OPC_PULLUP_gc      0x18
+#define PORT_INT0IF_bm          0x01
+#define PORT_INT1IF_bm          0x02
+#define PORT_INT0LVL_MED_gc     0x02
+#define PORT_INT1LVL_MED_gc     0x08
+
+#define TC_CLKSEL_OFF_gc        0x00
+#define TC_CLKSEL_DIV1_gc       0x01
+#define TC_CLKSEL_DIV64_gc      0x05
+#define TC_EVACT_RESTART_gc     0x80
+#define TC_CCAINTLVL_MED_gc     0x02
+
+#define CRC_RESET_gm            0xC0
+#define CRC_RESET_RESET0_gc     0x80
+#define CRC_RESET_RESET1_gc     0xC0
+#define CRC_SOURCE_IO_gc        0x01
+#define CRC_BUSY_bm             0x01
+
+#define RST_PORF_bm             0x01
+#define RST_EXTRF_bm            0x02
+#define RST_BORF_bm             0x04
+#define RST_WDRF_bm             0x08
+#define RST_SRF_bm              0x20
+
+#define PIN0_bm                 0x01
+#define PIN1_bm                 0x02
+#define PIN2_bm                 0x04
+#define PIN3_bm                 0x08
+#define PIN4_bm                 0x10
+#define PIN5_bm                 0x20
+#define PIN6_bm                 0x40
+#define PIN7_bm                 0x80
+#define PIN0_bp                 0
+#define PIN1_bp                 1
+#define PIN2_bp                 2
+#define PIN3_bp                 3
+#define PIN4_bp                 4
+#define PIN5_bp                 5
+#define PIN6_bp                 6
+#define PIN7_bp                 7
+
+#endif /* HOST_AVR_IO_H */
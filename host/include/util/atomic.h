@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+/*
+ * The simulation is single threaded and has no interrupts, so every block is
+ * already atomic.
+ */
+#define ATOMIC_RESTORESTATE     0
+#define ATOMIC_FORCEON          0
+#define ATOMIC_BLOCK(type)      for (int sim_atomic = 1; sim_atomic; sim_atomic = 0)
+
+#endif /* HOST_UTIL_ATOMIC_H */
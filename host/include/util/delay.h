@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+#include <stdint.h>
+
+/*
+ * Delays move simulated time forward instead of spinning.
+ */
+void sim_delay(uint64_t);
+#define _delay_us(us)           sim_delay((uint64_t) ((us) * 1000.0))
+#define _delay_ms(ms)           sim_delay((uint64_t) ((ms) * 1000000.0))
+
+#endif /* HOST_UTIL_DELAY_H */
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pcap.h"
+
+#define PCAP_MAGIC_US           0xA1B2C3D4
+#define PCAP_MAGIC_NS           0xA1B23C4D
+#define PCAP_LINKTYPE_ETHERNET  1
+
+static uint32_t pcap_get32(const uint8_t* p, uint8_t swap)
+{
+	if (swap)
+	{
+		return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+				| ((uint32_t) p[2] << 8) | p[3];
+	}
+	return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16)
+			| ((uint32_t) p[1] << 8) | p[0];
+}
+
+static void pcap_put32(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t) v;
+	p[1] = (uint8_t) (v >> 8);
+	p[2] = (uint8_t) (v >> 16);
+	p[3] = (uint8_t) (v >> 24);
+}
+
+PcapFrame* pcap_load(const char* path, uint32_t* count, uint32_t* skipped)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+
+	uint8_t header[24];
+	if (fread(header, 1, sizeof(header), f) != sizeof(header))
+	{
+		fprintf(stderr, "%s: not a capture\n", path);
+		fclose(f);
+		return NULL;
+	}
+	uint8_t swap = 0;
+	uint32_t magic = pcap_get32(header, 0);
+	if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS)
+	{
+		swap = 1;
+		magic = pcap_get32(header, 1);
+	}
+	if ((magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS)
+			|| pcap_get32(header + 20, swap) != PCAP_LINKTYPE_ETHERNET)
+	{
+		fprintf(stderr, "%s: not an Ethernet pcap capture\n", path);
+		fclose(f);
+		return NULL;
+	}
+	uint32_t scale = (magic == PCAP_MAGIC_NS) ? 1 : 1000;
+
+	uint32_t size = 256;
+	PcapFrame* frames = malloc(sizeof(PcapFrame) * size);
+	uint64_t first = 0;
+	*count = 0;
+	*skipped = 0;
+	uint8_t record[16];
+	while (frames != NULL && fread(record, 1, sizeof(record), f) == 16)
+	{
+		uint64_t time = (uint64_t) pcap_get32(record, swap) * 1000000000ULL
+				+ (uint64_t) pcap_get32(record + 4, swap) * scale;
+		uint32_t length = pcap_get32(record + 8, swap);
+		uint32_t original = pcap_get32(record + 12, swap);
+		if (*count == 0 && *skipped == 0)
+		{
+			first = time;
+		}
+
+		if (length > PCAP_MAX_FRAME || length != original || length < 14)
+		{
+			(*skipped)++;
+			if (fseek(f, length, SEEK_CUR) != 0) break;
+			continue;
+		}
+		if (*count == size)
+		{
+			size *= 2;
+			PcapFrame* larger = realloc(frames, sizeof(PcapFrame) * size);
+			if (larger == NULL)
+			{
+				free(frames);
+				frames = NULL;
+				break;
+			}
+			frames = larger;
+		}
+		PcapFrame* frame = &frames[*count];
+		if (fread(frame->data, 1, length, f) != length) break;
+		frame->time = (time > first) ? time - first : 0;
+		frame->length = (uint16_t) length;
+		(*count)++;
+	}
+	fclose(f);
+	if (frames == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", path);
+	}
+	return frames;
+}
+
+FILE* pcap_create(const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	if (f == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+	uint8_t header[24];
+	memset(header, 0, sizeof(header));
+	pcap_put32(header, PCAP_MAGIC_NS);
+	header[4] = 2; // version 2.4
+	header[6] = 4;
+	pcap_put32(header + 16, 65535);
+	pcap_put32(header + 20, PCAP_LINKTYPE_ETHERNET);
+	fwrite(header, 1, sizeof(header), f);
+	return f;
+}
+
+void pcap_write(FILE* f, uint64_t time, const uint8_t* data, uint16_t length)
+{
+	uint8_t record[16];
+	pcap_put32(record, (uint32_t) (time / 1000000000ULL));
+	pcap_put32(record + 4, (uint32_t) (time % 1000000000ULL));
+	pcap_put32(record + 8, length);
+	pcap_put32(record + 12, length);
+	fwrite(record, 1, sizeof(record), f);
+	fwrite(data, 1, length, f);
+}
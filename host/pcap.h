@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * ============================================================================
+ * 
+ *   CAPTURE FILES
+ * 
+ * ============================================================================
+ * 
+ * Reads and writes Ethernet captures in the classic pcap format, with either
+ * byte order and either microsecond or nanosecond timestamps. Frames are
+ * kept without their FCS, as most capture tools save them.
+ */
+
+#define PCAP_MAX_FRAME          1514
+
+typedef struct PcapFrame_t {
+	uint64_t time;          // ns since the first frame of the capture
+	uint16_t length;
+	uint8_t data[PCAP_MAX_FRAME];
+} PcapFrame;
+
+/*
+ * Reads every frame in the given capture. Frames that are too long are
+ * skipped, and counted in the last argument. Gives back NULL on failure.
+ */
+PcapFrame* pcap_load(const char* path, uint32_t* count, uint32_t* skipped);
+
+/*
+ * Creates a capture for writing, giving back NULL on failure. Frames are
+ * written with their time in ns since the capture started.
+ */
+FILE* pcap_create(const char* path);
+void pcap_write(FILE*, uint64_t time, const uint8_t* data, uint16_t length);
+
+#endif /* PCAP_H */
@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include "sim.h"
+
+uint64_t sim_now;
+static uint64_t last_progress;
+
+uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+static SimUsart usart_e0, usart_e1, usart_f0;
+USART_t sim_usarte0 = { .sim = &usart_e0 };
+USART_t sim_usarte1 = { .sim = &usart_e1 };
+USART_t sim_usartf0 = { .sim = &usart_f0 };
+
+static SimPort port_a, port_b, port_c, port_d, port_e, port_f, port_r;
+PORT_t sim_porta = { .sim = &port_a };
+PORT_t sim_portb = { .sim = &port_b };
+PORT_t sim_portc = { .sim = &port_c };
+PORT_t sim_portd = { .sim = &port_d };
+PORT_t sim_porte = { .sim = &port_e };
+PORT_t sim_portf = { .sim = &port_f };
+PORT_t sim_portr = { .sim = &port_r };
+
+// mapped as in hw_v01.h
+VPORT_t sim_vport0 = { .port = &sim_porta };
+VPORT_t sim_vport1 = { .port = &sim_portr };
+VPORT_t sim_vport2 = { .port = &sim_portc };
+VPORT_t sim_vport3 = { .port = &sim_portd };
+
+/*
+ * Timers that count simulated time: the deskew timer at the CPU clock, and
+ * the system timer pair at 2us per tick, see config.h. The rest never count.
+ */
+TC0_t sim_tcc0, sim_tcc1, sim_tcd1, sim_tce0;
+TC0_t sim_tcd0 = { .sim_mul = 32, .sim_div = 1000 };
+TC0_t sim_tce1 = { .sim_mul = 1, .sim_div = 2000 };
+TC0_t sim_tcf0 = { .sim_mul = 1, .sim_div = 2000, .sim_shift = 16 };
+
+static CRC_t crc = { .DATAIN = 0x100 };
+static uint16_t crc_value;
+
+RST_t RST;
+register8_t GPIOR0, GPIOR1, GPIOR3;
+register8_t sim_gpior2_value;
+void (*sim_gpior2_hook)(void);
+
+/*
+ * ============================================================================
+ *
+ *   TIME
+ *
+ * ============================================================================
+ */
+
+static void sim_stall_check(void)
+{
+	if (sim_now - last_progress > SIM_STALL_NS)
+	{
+		fprintf(stderr, "sim: no device activity for %llu ms at %llu us, "
+				"firmware appears stuck\n",
+				(unsigned long long) ((sim_now - last_progress) / 1000000),
+				(unsigned long long) (sim_now / 1000));
+		abort();
+	}
+}
+
+void sim_delay(uint64_t ns)
+{
+	sim_now += ns;
+	sim_stall_check();
+}
+
+void sim_wait_until(uint64_t t)
+{
+	if (t > sim_now)
+	{
+		sim_now = t;
+	}
+	sim_stall_check();
+}
+
+void sim_progress(void)
+{
+	last_progress = sim_now;
+}
+
+/*
+ * ============================================================================
+ *
+ *   USARTS
+ *
+ * ============================================================================
+ */
+
+static uint64_t sim_usart_byte_ns(USART_t* u)
+{
+	uint16_t bsel = ((u->BAUDCTRLB & 0x0F) << 8) | u->BAUDCTRLA;
+	return 500ULL * (bsel + 1);
+}
+
+USART_t* sim_usart(USART_t* u)
+{
+	SimUsart* s = u->sim;
+	sim_delay(SIM_IO_NS);
+
+	uint8_t status = 0;
+	if (s->rx_count && s->rx_ready[0] <= sim_now)
+	{
+		status |= USART_RXCIF_bm;
+	}
+	if (s->busy_until <= sim_now + sim_usart_byte_ns(u))
+	{
+		status |= USART_DREIF_bm;
+	}
+	if (s->busy_until <= sim_now)
+	{
+		status |= USART_TXCIF_bm;
+	}
+	u->STATUS = status;
+	return u;
+}
+
+void sim_usart_attach(USART_t* u, SimExchange exchange, void* dev)
+{
+	u->sim->exchange = exchange;
+	u->sim->dev = dev;
+}
+
+void sim_usart_tx(USART_t* u, uint8_t v)
+{
+	SimUsart* s = u->sim;
+	sim_progress();
+
+	uint64_t start = s->busy_until > sim_now ? s->busy_until : sim_now;
+	uint64_t done = start + sim_usart_byte_ns(u);
+	s->busy_until = done;
+
+	uint8_t in = 0xFF;
+	if (s->exchange)
+	{
+		in = s->exchange(s->dev, v, done);
+	}
+	if ((u->CTRLB & USART_RXEN_bm) && s->rx_count < 2)
+	{
+		s->rx[s->rx_count] = in;
+		s->rx_ready[s->rx_count] = done;
+		s->rx_count++;
+	}
+}
+
+uint8_t sim_usart_rx(USART_t* u)
+{
+	SimUsart* s = u->sim;
+	sim_progress();
+
+	if (s->rx_count)
+	{
+		sim_wait_until(s->rx_ready[0]);
+		s->last = s->rx[0];
+		s->rx[0] = s->rx[1];
+		s->rx_ready[0] = s->rx_ready[1];
+		s->rx_count--;
+	}
+	return s->last;
+}
+
+/*
+ * ============================================================================
+ *
+ *   PORTS
+ *
+ * ============================================================================
+ */
+
+/*
+ * Applies any strobe writes since the last access and reports output edges.
+ */
+static void sim_port_update(PORT_t* p)
+{
+	SimPort* s = p->sim;
+
+	p->OUT = (p->OUT | p->OUTSET) & ~p->OUTCLR;
+	p->OUT ^= p->OUTTGL;
+	p->OUTSET = 0;
+	p->OUTCLR = 0;
+	p->OUTTGL = 0;
+	p->DIR = (p->DIR | p->DIRSET) & ~p->DIRCLR;
+	p->DIR ^= p->DIRTGL;
+	p->DIRSET = 0;
+	p->DIRCLR = 0;
+	p->DIRTGL = 0;
+
+	uint8_t out = p->OUT;
+	uint8_t rise = out & ~s->last_out;
+	uint8_t fall = s->last_out & ~out;
+	s->last_out = out;
+	if ((rise | fall) && s->edge)
+	{
+		s->edge(s->dev, rise, fall);
+	}
+}
+
+PORT_t* sim_port(PORT_t* p)
+{
+	SimPort* s = p->sim;
+	sim_delay(SIM_IO_NS);
+	sim_port_update(p);
+
+	uint8_t in = s->in ? s->in(s->dev, p->OUT) : p->OUT;
+	register8_t* ctrl = &(p->PIN0CTRL);
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		if (ctrl[i] & PORT_INVEN_bm)
+		{
+			in ^= 1 << i;
+		}
+	}
+	p->IN = in;
+	return p;
+}
+
+VPORT_t* sim_vport(VPORT_t* v)
+{
+	v->IN = sim_port(v->port)->IN;
+	return v;
+}
+
+void sim_port_attach(PORT_t* p, SimPortIn in, SimPortEdge edge, void* dev)
+{
+	p->sim->in = in;
+	p->sim->edge = edge;
+	p->sim->dev = dev;
+}
+
+uint8_t sim_port_out(PORT_t* p)
+{
+	sim_port_update(p);
+	return p->OUT;
+}
+
+/*
+ * ============================================================================
+ *
+ *   TIMERS, CRC, GPIOR2, EEPROM
+ *
+ * ============================================================================
+ */
+
+TC0_t* sim_timer(TC0_t* t)
+{
+	sim_delay(SIM_IO_NS);
+	if (t->sim_div)
+	{
+		uint64_t ticks = sim_now * t->sim_mul / t->sim_div;
+		t->CNT = (uint16_t) (ticks >> t->sim_shift);
+	}
+	return t;
+}
+
+/*
+ * The module in the CRC-CCITT mode used for the memory card, which shifts
+ * each byte in least significant bit first; see mem.c.
+ */
+CRC_t* sim_crc(void)
+{
+	if (crc.CTRL & CRC_RESET_gm)
+	{
+		crc_value = ((crc.CTRL & CRC_RESET_gm) == CRC_RESET_RESET1_gc)
+				? 0xFFFF : 0x0000;
+		crc.CTRL &= ~CRC_RESET_gm;
+		crc.DATAIN = 0x100;
+	}
+	if (crc.DATAIN != 0x100)
+	{
+		crc_value ^= (uint8_t) crc.DATAIN;
+		for (uint8_t i = 0; i < 8; i++)
+		{
+			crc_value = (crc_value & 1)
+					? (crc_value >> 1) ^ 0x8408 : crc_value >> 1;
+		}
+		crc.DATAIN = 0x100;
+	}
+	crc.CHECKSUM0 = (uint8_t) crc_value;
+	crc.CHECKSUM1 = (uint8_t) (crc_value >> 8);
+	return &crc;
+}
+
+register8_t* sim_gpior2(void)
+{
+	if (sim_gpior2_hook)
+	{
+		sim_gpior2_hook();
+	}
+	return &sim_gpior2_value;
+}
+
+void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+	memcpy(dst, sim_eeprom + (uintptr_t) src, n);
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n)
+{
+	memcpy(sim_eeprom + (uintptr_t) dst, src, n);
+}
+
+/*
+ * ============================================================================
+ *
+ *   RESET
+ *
+ * ============================================================================
+ */
+
+static void sim_reset_usart(USART_t* u)
+{
+	SimUsart* s = u->sim;
+	memset((void*) u, 0, offsetof(USART_t, sim));
+	s->rx_count = 0;
+	s->busy_until = 0;
+}
+
+static void sim_reset_port(PORT_t* p)
+{
+	memset((void*) p, 0, offsetof(PORT_t, sim));
+	p->sim->last_out = 0;
+}
+
+void sim_reset(void)
+{
+	sim_reset_usart(&sim_usarte0);
+	sim_reset_usart(&sim_usarte1);
+	sim_reset_usart(&sim_usartf0);
+	sim_reset_port(&sim_porta);
+	sim_reset_port(&sim_portb);
+	sim_reset_port(&sim_portc);
+	sim_reset_port(&sim_portd);
+	sim_reset_port(&sim_porte);
+	sim_reset_port(&sim_portf);
+	sim_reset_port(&sim_portr);
+	crc.CTRL = 0;
+	crc.DATAIN = 0x100;
+	crc_value = 0;
+	GPIOR0 = 0;
+	GPIOR1 = 0;
+	sim_gpior2_value = 0;
+	GPIOR3 = 0;
+	sim_progress();
+}
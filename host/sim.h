@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2019 saybur
+ *
+ * This file is part of scuznet.
+ *
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/*
+ * ============================================================================
+ *
+ *   SIMULATED MCU PERIPHERALS
+ *
+ * ============================================================================
+ *
+ * The host build keeps a single simulated clock, in nanoseconds, that only
+ * moves forward when the firmware touches the simulated hardware or a device
+ * model says an operation took time. Firmware computation is free; I/O is
+ * not.
+ *
+ * The USARTs run in MSPI mode the way the firmware uses them: a byte written
+ * to DATA goes out once the shift register is free, at the rate set in
+ * BAUDCTRLA, and the byte clocked back from the attached device lands in a
+ * two byte receive buffer when the transfer finishes. Bytes arriving with the
+ * buffer full are lost, as on the real part, so code that breaks the one byte
+ * lag contract in mem.h fails here too.
+ */
+
+/*
+ * Current simulated time, in nanoseconds.
+ */
+extern uint64_t sim_now;
+
+/*
+ * Cost of one I/O register access in a polling loop, about 4 cycles.
+ */
+#define SIM_IO_NS               125
+
+/*
+ * If simulated time moves this far without any device activity, the
+ * firmware is assumed to be stuck in a loop and the simulation is aborted.
+ */
+#define SIM_STALL_NS            10000000000ULL
+
+/*
+ * Moves time forward by the given number of nanoseconds, or to the given
+ * time if it is later than now.
+ */
+void sim_delay(uint64_t);
+void sim_wait_until(uint64_t);
+
+/*
+ * Notes that something useful happened, for the stall check above.
+ */
+void sim_progress(void);
+
+/*
+ * Called by a USART when a byte is exchanged with the attached device. The
+ * device gets the byte sent and the time the exchange finishes, and gives
+ * back the byte it shifted out at the same time.
+ */
+typedef uint8_t (*SimExchange)(void* dev, uint8_t out, uint64_t when);
+
+typedef struct SimUsart_t {
+	SimExchange exchange;
+	void* dev;
+	uint8_t rx[2];
+	uint64_t rx_ready[2];
+	uint8_t rx_count;
+	uint8_t last;
+	uint64_t busy_until;
+} SimUsart;
+
+void sim_usart_attach(USART_t*, SimExchange, void*);
+void sim_usart_tx(USART_t*, uint8_t);
+uint8_t sim_usart_rx(USART_t*);
+
+/*
+ * Devices attached to a port give the level of the input pins whenever the
+ * port is read, and are told about output pin edges as soon as they happen.
+ * Strobe writes (OUTSET, OUTCLR, ...) are applied on the next access to the
+ * port, or when a device asks for the output state; devices should ask
+ * before acting on a USART exchange.
+ */
+typedef uint8_t (*SimPortIn)(void* dev, uint8_t out);
+typedef void (*SimPortEdge)(void* dev, uint8_t rise, uint8_t fall);
+
+typedef struct SimPort_t {
+	SimPortIn in;
+	SimPortEdge edge;
+	void* dev;
+	uint8_t last_out;
+} SimPort;
+
+void sim_port_attach(PORT_t*, SimPortIn, SimPortEdge, void*);
+uint8_t sim_port_out(PORT_t*);
+
+/*
+ * The real GPIOR2, and a hook called each time the firmware reads or writes
+ * it through the register name; see avr/io.h.
+ */
+extern register8_t sim_gpior2_value;
+extern void (*sim_gpior2_hook)(void);
+
+/*
+ * The simulated EEPROM, which the driver fills in before the firmware starts.
+ */
+#define SIM_EEPROM_SIZE         2048
+extern uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+/*
+ * Puts every peripheral back into its reset state. Simulated time keeps
+ * running, and attached devices stay attached.
+ */
+void sim_reset(void);
+
+#endif /* SIM_H */
@@ -65,6 +65,7 @@
 #define DEBUG_USART             USARTD1
 #define DEBUG_PORT              PORTD
 #define DEBUG_PIN_TX            PIN7_bm
+#define DEBUG_USART_DRE_vect    USARTD1_DRE_vect
 #define LED_PORT                VPORT1
 #define LED_PIN                 PIN7_bm
 
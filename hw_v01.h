@@ -66,6 +66,7 @@
 #define DEBUG_USART             USARTE0
 #define DEBUG_PORT              PORTE
 #define DEBUG_PIN_TX            PIN3_bm
+#define DEBUG_USART_DRE_vect    USARTE0_DRE_vect
 #define LED_PORT                VPORT3
 #define LED_PIN                 PIN7_bm
 
@@ -87,6 +87,31 @@ void init_debug(void)
 	LED_PORT.OUT &= ~LED_PIN;
 }
 
+void init_timer(void)
+{
+	SYSTEM_TIMER_HIGH_CHMUX = SYSTEM_TIMER_HIGH_EVMUX;
+	SYSTEM_TIMER_HIGH.CTRLA = SYSTEM_TIMER_HIGH_CLKSEL;
+	SYSTEM_TIMER.CTRLA = SYSTEM_TIMER_CLKSEL;
+}
+
+uint32_t system_time32(void)
+{
+	/*
+	 * The overflow event takes a cycle to reach the high timer, and the two
+	 * halves can't be read at once, so read the high half on both sides of
+	 * the low half. If it changed, the low half wrapped in between, so read
+	 * it again, knowing it can't wrap again for another 131ms.
+	 */
+	uint16_t high = SYSTEM_TIMER_HIGH.CNT;
+	uint16_t low = SYSTEM_TIMER.CNT;
+	uint16_t check = SYSTEM_TIMER_HIGH.CNT;
+	if (high != check)
+	{
+		low = SYSTEM_TIMER.CNT;
+	}
+	return ((uint32_t) check << 16) | low;
+}
+
 void init_isr(void)
 {
 	PMIC.CTRL |= PMIC_HILVLEN_bm | PMIC_MEDLVLEN_bm | PMIC_LOLVLEN_bm;
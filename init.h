@@ -46,6 +46,19 @@ void init_clock(void);
  */
 void init_debug(void);
 
+/*
+ * Starts the free-running system timer. system_time() gives the current count
+ * of the timer, in SYSTEM_TIMER_TICK_US units, and system_time32() gives the
+ * full 32 bit count including the overflow timer. Neither masks interrupts,
+ * so an ISR that reads either timer must save and restore the timer's TEMP
+ * register around the read, as meter_select() does.
+ * 
+ * This should only be called once, from main(), during initial MCU startup.
+ */
+void init_timer(void);
+#define system_time()           (SYSTEM_TIMER.CNT)
+uint32_t system_time32(void);
+
 /*
  * Sets up the PMIC for all interrupt levels and activates interrupts.
  */
@@ -22,9 +22,11 @@
 #include "config.h"
 #include "debug.h"
 #include "enc.h"
+#include "init.h"
 #include "link.h"
 #include "logic.h"
 #include "net.h"
+#include "trace.h"
 
 #ifdef ENC_ENABLED
 
@@ -91,6 +93,11 @@ static uint8_t last_identify;
 static uint8_t read_buffer[6];
 static NetHeader net_header;
 
+// command latency histograms, for packet reads and writes
+static const uint8_t hist_opcodes[] = { 0x08, 0x0A };
+static uint16_t hist_counts[(sizeof(hist_opcodes) + 1) * LOGIC_HIST_BUCKETS];
+static LogicHist hist = { hist_opcodes, sizeof(hist_opcodes), hist_counts };
+
 
 /*
  * ============================================================================
@@ -114,8 +121,7 @@ static void activate_appletalk(uint8_t* cmd)
 		phy_data_ask(); // Currently being sent to debug to see what it is. // THIS SEEMS NECESSARY TO ACTIVATE APPLETALK
 
 	}
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void link_inquiry(uint8_t* cmd)
@@ -139,9 +145,8 @@ static void link_inquiry(uint8_t* cmd)
 		}
 	
 
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
-	debug(DEBUG_LINK_INQUIRY);
+	logic_complete(LOGIC_STATUS_GOOD);
+	debug(LINK, DEBUG_INFO, DEBUG_LINK_INQUIRY);
 	
 }
 
@@ -162,12 +167,13 @@ void link_set_filter(void)
 
 static void link_send_packet(uint8_t* cmd)
 {
-	debug(DEBUG_LINK_TX_REQUESTED);
+	debug(LINK, DEBUG_VERBOSE, DEBUG_LINK_TX_REQUESTED);
 
 
 	// parse the packet header, limiting total length to 2047 JGK note, masking 7 with cmd3 sets the maximum value of length to 2047 (0000011111111111 = 2047) - note that this probably isn't necessary given the if statement afterwards.  I'm not sure what the significance of 2,047 is as max packet lengths seem to be 1500 bytes.
 	uint16_t length = ((cmd[3]) << 8) + cmd[4]; // JGK 	uint16_t length = ((cmd[3] & 7) << 8) + cmd[4];
 	if (length > MAXIMUM_TRANSFER_LENGTH) length = MAXIMUM_TRANSFER_LENGTH;
+	trace16(TRACE_LINK_BYTES, length);
 
 	// get devices in the right mode for a data transfer
 
@@ -177,7 +183,7 @@ static void link_send_packet(uint8_t* cmd)
 
 	// write the status byte
 	while (! (ENC_USART.STATUS & USART_DREIF_bm));
-	ENC_USART.DATA = 0x00;
+	usart_tx(ENC_USART, 0x00);
 	
 	
 	
@@ -217,21 +223,20 @@ static void link_send_packet(uint8_t* cmd)
 		net_transmit(txbuf, length +1); //length + 1
 		txbuf = txbuf ? 0 : 1;	
 	}
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 static void link_read_packet_header(void)
 {
 	enc_read_start();
-	ENC_USART.DATA = 0xFF;
+	usart_tx(ENC_USART, 0xFF);
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-	ENC_USART.DATA; // junk RBM response
+	usart_rx(ENC_USART); // junk RBM response
 	for (uint8_t i = 0; i < 6; i++)
 	{
-		ENC_USART.DATA = 0xFF;
+		usart_tx(ENC_USART, 0xFF);
 		while (! (ENC_USART.STATUS & USART_RXCIF_bm));
-		read_buffer[i] = ENC_USART.DATA;
+		read_buffer[i] = usart_rx(ENC_USART);
 		//jgk_debug(read_buffer[i]);
 	}
 	net_process_header(read_buffer, &net_header);
@@ -248,8 +253,7 @@ static void link_read_packet(uint8_t* cmd) // JGK bringing in the cmd so we can
 		if (transfer_length == 1) 
 		{
 			
-				logic_status(LOGIC_STATUS_GOOD);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				logic_complete(LOGIC_STATUS_GOOD);
 				return;
 		}
 	
@@ -283,6 +287,7 @@ static void link_read_packet(uint8_t* cmd) // JGK bringing in the cmd so we can
 			if (data_length > 1518) data_length=1518; // 1500 packet bytes + 4 CRC bytes + 12 Address Bytes + 2 Len/Type bytes
 			if (data_length > (transfer_length-6)) data_length = transfer_length-6; // Ensure data length isn't more than the amount the driver said it can read (although this always seems to be 0x05F4 which is 1524 which is 1518 + the 6 driver preamble bytes)
 		
+			trace16(TRACE_LINK_BYTES, data_length + 6);
 			phy_phase(PHY_PHASE_DATA_IN);
 		
 			// Send the header
@@ -294,8 +299,14 @@ static void link_read_packet(uint8_t* cmd) // JGK bringing in the cmd so we can
 			
 				//jgk_debug(read_buffer[i]);
 			}
-		
-			_delay_us(100); // This pause necessary for the driver to properly read the packets. It might need to have time to parse the length out before reading the rest of it. 30us - 60us seemed to work reliably on my SE/30.  The SE did not work with 40 or 60 but did with 100.  There doesn't seem to be an significant performance penalty but there is a significant increase in compatibility.  
+			uint16_t header_sent = phy_timer_now();
+
+			/*
+			 * Not a SCSI requirement: the DaynaPort driver needs time after
+			 * the header before the packet data starts. Time spent sending
+			 * the last header byte counts towards this.
+			 */
+			phy_timer_wait(header_sent, LINK_HEADER_DELAY_US * PHY_TIMER_TICKS_PER_US); // This pause necessary for the driver to properly read the packets. It might need to have time to parse the length out before reading the rest of it. 30us - 60us seemed to work reliably on my SE/30.  The SE did not work with 40 or 60 but did with 100.  There doesn't seem to be an significant performance penalty but there is a significant increase in compatibility.  
 		
 			phy_data_offer_stream(&ENC_USART,data_length);  // Call the version that doesn't check for _atn as it seems to run about 15% faster for some reason
 			
@@ -331,8 +342,7 @@ static void link_read_packet(uint8_t* cmd) // JGK bringing in the cmd so we can
 		{
 			logic_message_out();
 		}
-		logic_status(LOGIC_STATUS_GOOD);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);	
+		logic_complete(LOGIC_STATUS_GOOD);
 }
 
 
@@ -379,8 +389,7 @@ void retrieve_statistics(void)
 	{
 		logic_message_out();
 	}
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 void link_request_sense(void)
@@ -400,8 +409,7 @@ void link_request_sense(void)
 	{
 		logic_message_out();
 	}
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 
@@ -412,11 +420,17 @@ void link_main(void)
 {
 	
 	if (! logic_ready()) return;
+	uint32_t start = system_time32();
 	
 		// normal selection by initiator
-		logic_start(1, 1);
+		logic_start(LOGIC_DEVICE_LINK, 1);
 		uint8_t cmd[10];
-		if (! logic_command(cmd)) return;
+		cmd[0] = 0xFF; // counted with other opcodes if the CDB never arrives
+		if (! logic_command(cmd))
+		{
+			logic_hist_add(&hist, cmd[0], start);
+			return;
+		}
 	
 		uint8_t identify = logic_identify();
 		if (identify != 0) last_identify = identify;
@@ -467,8 +481,13 @@ void link_main(void)
 			case 0x1C: // From Nuvolink - not observed with Daynaport so essentially ignored but left in as doesn't seem to cause any issue.
 			case 0x1D: // From Nuvolink - not observed with Daynaport so essentially ignored but left in as doesn't seem to cause any issue.
 			case 0x80: // From Nuvolink - not observed with Daynaport so essentially ignored but left in as doesn't seem to cause any issue.
-				logic_status(LOGIC_STATUS_GOOD);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				logic_complete(LOGIC_STATUS_GOOD);
+				break;
+			case 0x4C: // LOG SELECT
+				logic_log_select(cmd, &hist);
+				break;
+			case 0x4D: // LOG SENSE
+				logic_log_sense(cmd, &hist);
 				break;
 
 			default:
@@ -477,6 +496,7 @@ void link_main(void)
 
 		
 	logic_done();
+	logic_hist_add(&hist, cmd[0], start);
 
 }
 
@@ -20,9 +20,12 @@
 #include <avr/pgmspace.h>
 #include "config.h"
 #include "debug.h"
+#include "flight.h"
 #include "init.h"
 #include "logic.h"
+#include "meter.h"
 #include "phy.h"
+#include "trace.h"
 
 /*
  * Generic NO SENSE response for REQUEST SENSE when there is nothing to report.
@@ -65,6 +68,8 @@ static uint8_t device_id;
 static uint8_t last_message_in;
 static uint8_t last_identify;
 
+static void logic_message_extended(void);
+
 /*
  * ============================================================================
  * 
@@ -126,7 +131,7 @@ uint8_t logic_sense_valid(void)
 
 void logic_parse_data_op(uint8_t* cmd)
 {
-	if (cmd[0] == 0x28 || cmd[0] == 0x2A)
+	if (cmd[0] == 0x28 || cmd[0] == 0x2A || cmd[0] == 0x2F)
 	{
 		if (cmd[1] & 1)
 		{
@@ -187,6 +192,8 @@ uint8_t logic_message_out(void)
 
 		// get the message byte
 		message = phy_data_ask();
+		trace(TRACE_MESSAGE_OUT, message);
+		flight(TRACE_MESSAGE_OUT, message);
 		if (message < 0x80)
 		{
 			/*
@@ -197,13 +204,15 @@ uint8_t logic_message_out(void)
 			if (message == LOGIC_MSG_ABORT)
 			{
 				// simply go bus free
-				debug_dual(DEBUG_LOGIC_MESSAGE, LOGIC_MSG_ABORT);
+				debug_dual(LOGIC, DEBUG_INFO,
+						DEBUG_LOGIC_MESSAGE, LOGIC_MSG_ABORT);
 				phy_phase(PHY_PHASE_BUS_FREE);
 			}
 			else if (message == LOGIC_MSG_BUS_DEVICE_RESET)
 			{
 				// execute a hard reset (MCU reset)
-				debug_dual(DEBUG_LOGIC_MESSAGE, LOGIC_MSG_BUS_DEVICE_RESET);
+				debug_dual(LOGIC, DEBUG_INFO,
+						DEBUG_LOGIC_MESSAGE, LOGIC_MSG_BUS_DEVICE_RESET);
 				mcu_reset();
 				// in the event the reset fails, go bus free anyway
 				phy_phase(PHY_PHASE_BUS_FREE);
@@ -214,7 +223,8 @@ uint8_t logic_message_out(void)
 				 * Send a DISCONNECT of our own, then hang up. We should also
 				 * technically delay attempts at arbitration as well.
 				 */
-				debug_dual(DEBUG_LOGIC_MESSAGE, LOGIC_MSG_DISCONNECT);
+				debug_dual(LOGIC, DEBUG_INFO,
+						DEBUG_LOGIC_MESSAGE, LOGIC_MSG_DISCONNECT);
 				phy_phase(PHY_PHASE_MESSAGE_IN);
 				phy_data_offer(LOGIC_MSG_DISCONNECT);
 				phy_phase(PHY_PHASE_BUS_FREE);
@@ -225,7 +235,8 @@ uint8_t logic_message_out(void)
 				 * We respond by disconnecting when this happens, instead of
 				 * retrying.
 				 */
-				debug_dual(DEBUG_LOGIC_MESSAGE, LOGIC_MSG_INIT_DETECT_ERROR);
+				debug_dual(LOGIC, DEBUG_INFO,
+						DEBUG_LOGIC_MESSAGE, LOGIC_MSG_INIT_DETECT_ERROR);
 				phy_phase(PHY_PHASE_MESSAGE_IN);
 				phy_data_offer(LOGIC_MSG_DISCONNECT);
 				phy_phase(PHY_PHASE_BUS_FREE);
@@ -233,39 +244,40 @@ uint8_t logic_message_out(void)
 			else if (message == LOGIC_MSG_PARITY_ERROR)
 			{
 				// resend the last message, then allow flow to continue
-				debug_dual(DEBUG_LOGIC_MESSAGE, LOGIC_MSG_PARITY_ERROR);
+				debug_dual(LOGIC, DEBUG_INFO,
+						DEBUG_LOGIC_MESSAGE, LOGIC_MSG_PARITY_ERROR);
 				phy_phase(PHY_PHASE_MESSAGE_IN);
 				phy_data_offer(last_message_in);
 			}
 			else if (message == LOGIC_MSG_REJECT)
 			{
-				/*
-				 * We will never send a non-mandatory message except for
-				 * DISCONNECT, so this seems very unlikely to ever happen.
-				 * We respond by performing an unexpected disconnect.
-				 */
-				debug_dual(DEBUG_LOGIC_MESSAGE, LOGIC_MSG_REJECT);
-				phy_phase(PHY_PHASE_BUS_FREE);
+				debug_dual(LOGIC, DEBUG_INFO,
+						DEBUG_LOGIC_MESSAGE, LOGIC_MSG_REJECT);
+				if (last_message_in == LOGIC_MSG_EXTENDED)
+				{
+					/*
+					 * The initiator did not like our SDTR response. We were
+					 * asynchronous anyway, so there is nothing to undo.
+					 */
+					last_message_in = 0;
+				}
+				else
+				{
+					/*
+					 * We will never send a non-mandatory message except for
+					 * DISCONNECT, so this seems very unlikely to ever happen.
+					 * We respond by performing an unexpected disconnect.
+					 */
+					phy_phase(PHY_PHASE_BUS_FREE);
+				}
 			}
 			else if (message == LOGIC_MSG_NO_OPERATION)
 			{
 				// ignore this message completely
 			}
-			else if (message == 0x01)
+			else if (message == LOGIC_MSG_EXTENDED)
 			{
-				// ugh, extended message, which we read and dump to debug
-				debug(DEBUG_LOGIC_EXTENDED_MESSAGE);
-				uint8_t ext_len = phy_data_ask();
-				debug(ext_len);
-				uint16_t ext_real_len = ext_len;
-				if (ext_len == 0) ext_real_len = 256;
-				for (uint16_t i = 0; i < ext_real_len; i++)
-				{
-					debug(phy_data_ask());
-				}
-				// while we report them, they are not supported
-				// <<TODO THIS NEEDS BETTER HANDLING THAN JUST ACCEPTING>>
-				//logic_message_in(LOGIC_MSG_REJECT);
+				logic_message_extended();
 			}
 			else
 			{
@@ -301,6 +313,49 @@ uint8_t logic_message_out(void)
 	return message;
 }
 
+/*
+ * Handles the rest of an extended message, after the 0x01 byte has been read.
+ * 
+ * The only extended message supported is SYNCHRONOUS DATA TRANSFER REQUEST,
+ * which is always answered with our own SDTR with an offset of zero, keeping
+ * every device asynchronous. An SDTR agreement covers DATA OUT as well as
+ * DATA IN, and the board has no latch to capture the data lines on the /ACK
+ * edge, so synchronous DATA OUT can't be done.
+ * 
+ * All other extended messages are rejected.
+ */
+static void logic_message_extended(void)
+{
+	uint8_t ext[3];
+
+	debug(LOGIC, DEBUG_INFO, DEBUG_LOGIC_EXTENDED_MESSAGE);
+	uint8_t ext_len = phy_data_ask();
+	debug(LOGIC, DEBUG_INFO, ext_len);
+	uint16_t ext_real_len = ext_len;
+	if (ext_len == 0) ext_real_len = 256;
+	for (uint16_t i = 0; i < ext_real_len; i++)
+	{
+		uint8_t v = phy_data_ask();
+		debug(LOGIC, DEBUG_INFO, v);
+		if (i < 3) ext[i] = v;
+	}
+
+	if (ext_len == 3 && ext[0] == LOGIC_EXT_SDTR)
+	{
+		phy_phase(PHY_PHASE_MESSAGE_IN);
+		phy_data_offer(LOGIC_MSG_EXTENDED);
+		phy_data_offer(0x03);
+		phy_data_offer(LOGIC_EXT_SDTR);
+		phy_data_offer(ext[1]);
+		phy_data_offer(0x00);
+		last_message_in = LOGIC_MSG_EXTENDED;
+	}
+	else
+	{
+		logic_message_in(LOGIC_MSG_REJECT);
+	}
+}
+
 void logic_message_in(uint8_t message_in)
 {
 	if (! phy_is_active()) return;
@@ -318,45 +373,29 @@ uint8_t logic_command(uint8_t* command)
 {
 	if (! phy_is_active()) return 0;
 
-	// switch to COMMAND and get opcode
+	// switch to COMMAND and get the whole CDB at once
 	phy_phase(PHY_PHASE_COMMAND);
-	command[0] = phy_data_ask();
-
-	// check opcode group which defines length
-	uint8_t cmd_count;
-	if (command[0] < 0x20) // group 0
-	{
-		// group 0, 6 bytes
-		cmd_count = 6;
-	}
-	else if (command[0] < 0x60) // group 1 or 2
-	{
-		cmd_count = 10;
-	}
-	else // not supported
-	{
-		cmd_count = 1;
-	}
-
-	// read command bytes
-	for (uint8_t i = 1; i < cmd_count; i++)
-	{
-		command[i] = phy_data_ask();
-
-	}
+	meter_command();
+	uint8_t cmd_count = phy_data_ask_cdb(command);
+	trace(TRACE_COMMAND, command[0]);
+	flight(TRACE_COMMAND, command[0]);
 
 	// LUN handler code
-	uint8_t lun = 0xFF;
+	uint8_t lun;
 	if (last_identify)
 	{
 		// if set, pull from IDENTIFY data
 		lun = last_identify & 3;
 	}
-	else if (command[0] < 0x60)
+	else if (cmd_count > 1)
 	{
 		// otherwise we pull from CDB
 		lun = command[1] >> 5;
 	}
+	else
+	{
+		lun = 0xFF;
+	}
 	if (lun)
 	{
 		if (command[0] == 0x12) // INQUIRY
@@ -365,7 +404,7 @@ uint8_t logic_command(uint8_t* command)
 			if (alloc > 36)
 				alloc = 36;
 			logic_data_in_pgm(inquiry_data_illegal_lun, alloc);
-			logic_status(LOGIC_STATUS_GOOD);
+			logic_complete(LOGIC_STATUS_GOOD);
 		}
 		else if (command[0] == 0x03) // REQUEST SENSE
 		{
@@ -373,34 +412,28 @@ uint8_t logic_command(uint8_t* command)
 			if (alloc > 18)
 				alloc = 18;
 			logic_data_in_pgm(sense_data_illegal_lun, alloc);
-			logic_status(LOGIC_STATUS_GOOD);
+			logic_complete(LOGIC_STATUS_GOOD);
 		}
 		else
 		{
-			debug(DEBUG_LOGIC_BAD_LUN);
-			logic_status(LOGIC_STATUS_CHECK_CONDITION);
+			debug(LOGIC, DEBUG_ERROR, DEBUG_LOGIC_BAD_LUN);
+			logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 		}
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
-		logic_done();
 		return 0;
 	}
 
 	// command op out of range handler
-	if (command[0] >= 0x60)
+	if (cmd_count == 1)
 	{
 		logic_cmd_illegal_op();
-		logic_done();
 		return 0;
 	}
 
 	// check control field for flag or link bits set, which we don't support
-	if (cmd_count == 6 && command[5] & 3)
+	if (command[cmd_count - 1] & 3)
 	{
-		logic_cmd_illegal_arg(5);
-	}
-	else if (cmd_count == 10 && command[9] & 3)
-	{
-		logic_cmd_illegal_arg(9);
+		logic_cmd_illegal_arg(cmd_count - 1);
+		return 0;
 	}
 
 	/*
@@ -421,18 +454,24 @@ uint8_t logic_command(uint8_t* command)
 	return cmd_count;
 }
 
-void logic_status(uint8_t status)
+void logic_complete(uint8_t status)
 {
 	if (! phy_is_active()) return;
-	
-	phy_phase(PHY_PHASE_STATUS);
-	
-	phy_data_offer(status);
-	
-	if (phy_is_atn_asserted())
+
+	trace(TRACE_STATUS, status);
+	flight(TRACE_STATUS, status);
+	uint8_t phase = phy_complete(status);
+	if (phase == PHY_PHASE_STATUS)
 	{
 		logic_message_out();
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 	}
+	else if (phase == PHY_PHASE_MESSAGE_IN)
+	{
+		last_message_in = LOGIC_MSG_COMMAND_COMPLETE;
+		logic_message_out();
+	}
+	logic_done();
 }
 
 uint8_t logic_data_out(uint8_t* data, uint8_t len)
@@ -509,7 +548,7 @@ void logic_data_in_pgm(const uint8_t* data, uint8_t len)
 
 void logic_cmd_illegal_op(void)
 {
-	debug(DEBUG_LOGIC_BAD_CMD);
+	debug(LOGIC, DEBUG_ERROR, DEBUG_LOGIC_BAD_CMD);
 
 	// update sense data
 	devices[device_id].sense_data[0] = 0x80;
@@ -522,13 +561,12 @@ void logic_cmd_illegal_op(void)
 	devices[device_id].sense_valid = 1;
 
 	// terminate rest of command
-	logic_status(LOGIC_STATUS_CHECK_CONDITION);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 }
 
 void logic_cmd_illegal_arg(uint8_t position)
 {
-	debug(DEBUG_LOGIC_BAD_CMD_ARGS);
+	debug(LOGIC, DEBUG_ERROR, DEBUG_LOGIC_BAD_CMD_ARGS);
 
 	// update sense data
 	devices[device_id].sense_data[0] = 0x80;
@@ -543,8 +581,7 @@ void logic_cmd_illegal_arg(uint8_t position)
 	devices[device_id].sense_valid = 1;
 
 	// terminate rest of command
-	logic_status(LOGIC_STATUS_CHECK_CONDITION);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_CHECK_CONDITION);
 }
 
 void logic_set_sense(uint8_t sense, uint16_t asc)
@@ -593,8 +630,7 @@ void logic_request_sense(uint8_t* cmd)
 		logic_data_in_pgm(sense_data_no_sense, alloc);
 	}
 
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
 }
 
 void logic_send_diagnostic(uint8_t* cmd)
@@ -609,6 +645,148 @@ void logic_send_diagnostic(uint8_t* cmd)
 		}
 	}
 
-	logic_status(LOGIC_STATUS_GOOD);
-	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+	logic_complete(LOGIC_STATUS_GOOD);
+}
+
+/*
+ * ============================================================================
+ * 
+ *   LATENCY HISTOGRAMS
+ * 
+ * ============================================================================
+ */
+
+void logic_hist_add(LogicHist* hist, uint8_t opcode, uint32_t start)
+{
+	uint32_t t = (system_time32() - start) >> LOGIC_HIST_SHIFT;
+	uint8_t bucket = 0;
+	while (t > 0 && bucket < LOGIC_HIST_BUCKETS - 1)
+	{
+		t >>= 1;
+		bucket++;
+	}
+
+	// find the opcode, or end up on the shared entry after the last one
+	uint8_t i;
+	for (i = 0; i < hist->length; i++)
+	{
+		if (hist->opcodes[i] == opcode) break;
+	}
+
+	uint16_t* count = hist->counts + (i * LOGIC_HIST_BUCKETS) + bucket;
+	if (*count < 0xFFFF)
+	{
+		(*count)++;
+	}
+}
+
+/*
+ * Sends a byte of a LOG SENSE response if there is still room for it within
+ * the allocation length, and counts it either way.
+ */
+static void logic_log_offer(uint8_t v, uint16_t* pos, uint16_t alloc)
+{
+	if (*pos < alloc)
+	{
+		phy_data_offer(v);
+	}
+	(*pos)++;
+}
+
+void logic_log_sense(uint8_t* cmd, LogicHist* hist)
+{
+	if (cmd[1] & 0x01)
+	{
+		// can't save parameters
+		logic_cmd_illegal_arg(1);
+		return;
+	}
+	uint8_t page = cmd[2] & 0x3F;
+	uint16_t pointer = (cmd[5] << 8) | cmd[6];
+	uint16_t alloc = (cmd[7] << 8) | cmd[8];
+
+	if (page == 0x00)
+	{
+		uint8_t pages[6] = { 0x00, 0x00, 0x00, 0x02, 0x00,
+				LOGIC_LOG_PAGE_HIST };
+		if (alloc > 6) alloc = 6;
+		logic_data_in(pages, alloc);
+		logic_complete(LOGIC_STATUS_GOOD);
+		return;
+	}
+	else if (page != LOGIC_LOG_PAGE_HIST)
+	{
+		logic_cmd_illegal_arg(2);
+		return;
+	}
+
+	// find the parameters at or after the parameter pointer
+	if (pointer > LOGIC_LOG_PARAM_OTHER)
+	{
+		logic_cmd_illegal_arg(5);
+		return;
+	}
+	uint8_t first;
+	for (first = 0; first < hist->length; first++)
+	{
+		if (hist->opcodes[first] >= pointer) break;
+	}
+	uint16_t length = (hist->length + 1 - first)
+			* (4 + 2 * LOGIC_HIST_BUCKETS);
+
+	phy_phase(PHY_PHASE_DATA_IN);
+	uint16_t pos = 0;
+	logic_log_offer(page, &pos, alloc);
+	logic_log_offer(0x00, &pos, alloc);
+	logic_log_offer((uint8_t) (length >> 8), &pos, alloc);
+	logic_log_offer((uint8_t) length, &pos, alloc);
+	for (uint8_t i = first; i <= hist->length; i++)
+	{
+		uint16_t code = LOGIC_LOG_PARAM_OTHER;
+		if (i < hist->length)
+		{
+			code = hist->opcodes[i];
+		}
+		logic_log_offer((uint8_t) (code >> 8), &pos, alloc);
+		logic_log_offer((uint8_t) code, &pos, alloc);
+		logic_log_offer(0x03, &pos, alloc); // binary list
+		logic_log_offer(2 * LOGIC_HIST_BUCKETS, &pos, alloc);
+
+		uint16_t* counts = hist->counts + (i * LOGIC_HIST_BUCKETS);
+		for (uint8_t j = 0; j < LOGIC_HIST_BUCKETS; j++)
+		{
+			logic_log_offer((uint8_t) (counts[j] >> 8), &pos, alloc);
+			logic_log_offer((uint8_t) counts[j], &pos, alloc);
+		}
+	}
+	if (phy_is_atn_asserted())
+	{
+		logic_message_out();
+	}
+	logic_complete(LOGIC_STATUS_GOOD);
+}
+
+void logic_log_select(uint8_t* cmd, LogicHist* hist)
+{
+	if (cmd[1] & 0x01)
+	{
+		logic_cmd_illegal_arg(1);
+		return;
+	}
+	if (cmd[7] || cmd[8])
+	{
+		// we don't take parameter lists
+		logic_cmd_illegal_arg(7);
+		return;
+	}
+
+	if (cmd[1] & 0x02)
+	{
+		uint16_t n = (hist->length + 1) * LOGIC_HIST_BUCKETS;
+		for (uint16_t i = 0; i < n; i++)
+		{
+			hist->counts[i] = 0;
+		}
+	}
+	logic_complete(LOGIC_STATUS_GOOD);
 }
@@ -59,7 +59,7 @@ typedef struct LogicData_t {
 
 /*
  * Stores 32 bit LBA and transfer length from a READ(6), READ(10), WRITE(6),
- * or WRITE(10) command, along with a flag for validity.
+ * WRITE(10), or VERIFY(10) command, along with a flag for validity.
  * 
  * If the invalid flag is non-zero, it indicates the other values are not
  * legal. The value will be set to 1, plus the byte number in the CDB that is
@@ -90,6 +90,12 @@ extern LogicDataOp logic_data;
 #define LOGIC_MSG_PARITY_ERROR          0x09
 #define LOGIC_MSG_REJECT                0x07
 #define LOGIC_MSG_NO_OPERATION          0x08
+#define LOGIC_MSG_EXTENDED              0x01
+
+/*
+ * Extended message codes, sent after LOGIC_MSG_EXTENDED and the length.
+ */
+#define LOGIC_EXT_SDTR                  0x01
 
 /*
  * Common codes for the STATUS phase.
@@ -112,6 +118,8 @@ extern LogicDataOp logic_data;
 #define SENSE_KEY_MEDIUM_ERROR          0x03
 #define SENSE_KEY_NOT_READY             0x02
 #define SENSE_KEY_UNIT_ATTENTION        0x06
+#define SENSE_KEY_ABORTED_COMMAND       0x0B
+#define SENSE_KEY_MISCOMPARE            0x0E
 
 /*
  * Sense data items used by this program, in ASC/ASCQ order.
@@ -121,6 +129,13 @@ extern LogicDataOp logic_data;
 #define SENSE_DATA_INVALID_CDB_PARAM    0x2600
 #define SENSE_DATA_INVALID_CDB_FIELD    0x2400
 #define SENSE_DATA_LUN_BECOMING_RDY     0x0401
+#define SENSE_DATA_WRITE_ERROR          0x0C00
+#define SENSE_DATA_READ_ERROR           0x1100
+#define SENSE_DATA_MEDIUM_CHANGED       0x2800
+#define SENSE_DATA_MISCOMPARE           0x1D00
+#define SENSE_DATA_LBA_RANGE            0x2100
+#define SENSE_DATA_FORMAT_FAILED        0x3101
+#define SENSE_DATA_NO_MEDIUM            0x3A00
 
 /*
  * ============================================================================
@@ -176,9 +191,9 @@ uint8_t logic_identify(void);
 uint8_t logic_sense_valid(void);
 
 /*
- * Parses the LBA and transfer length from a READ(6), READ(10), WRITE(6), or
- * WRITE(10) command using the given CDB array and stores the result in the
- * global struct. See logic_data for details.
+ * Parses the LBA and transfer length from a READ(6), READ(10), WRITE(6),
+ * WRITE(10), or VERIFY(10) command using the given CDB array and stores the
+ * result in the global struct. See logic_data for details.
  */
 void logic_parse_data_op(uint8_t*);
 
@@ -213,6 +228,10 @@ void logic_parse_data_op(uint8_t*);
  * NO OPERATION             (0x08)
  * IDENTIFY                 (0x80-0xFF)
  * 
+ * The extended SYNCHRONOUS DATA TRANSFER REQUEST message is also supported,
+ * with other extended messages rejected. It is always answered with an offset
+ * of zero, so transfers stay asynchronous.
+ * 
  * This will update the last seen IDENTIFY byte if such a byte is received.
  * Once set to non-zero, further changes to this byte will not be allowed
  * (except disconnect priviledge).
@@ -257,10 +276,13 @@ void logic_message_in(uint8_t);
 uint8_t logic_command(uint8_t*);
 
 /*
- * Moves to the STATUS phase and sends the given status code to the initiator.
- * Common status codes are defined elsewhere in this header.
+ * Ends the command by moving to the STATUS phase and sending the given status
+ * code, followed by COMMAND COMPLETE, then releases the bus. Common status
+ * codes are defined elsewhere in this header.
+ * 
+ * /ATN is respected after each byte, moving to MESSAGE OUT as needed.
  */
-void logic_status(uint8_t);
+void logic_complete(uint8_t);
 
 /*
  * Moves to the DATA OUT phase and accepts a array of data from the initiator
@@ -343,6 +365,39 @@ void logic_set_sense(uint8_t, uint16_t);
  */
 void logic_set_sense_pointer(uint8_t, uint16_t, uint8_t, uint16_t);
 
+/*
+ * ============================================================================
+ * 
+ *   LATENCY HISTOGRAMS
+ * 
+ * ============================================================================
+ * 
+ * Each target can keep a histogram of the time taken by commands, from when
+ * it was selected until it released the bus, for a small set of opcodes plus
+ * one for all other opcodes. The histograms are reported through LOG SENSE
+ * and cleared through LOG SELECT, see below.
+ * 
+ * Times are sorted into LOGIC_HIST_BUCKETS buckets by powers of two. The
+ * first bucket holds commands taking under 16us, the next 16-32us, the next
+ * 32-64us, and so on, with the last bucket holding everything over 262ms.
+ * Counts saturate at 65535.
+ */
+#define LOGIC_HIST_BUCKETS      16
+#define LOGIC_HIST_SHIFT        3 // 16us in system timer ticks, as a power
+
+typedef struct LogicHist
+{
+	const uint8_t* opcodes;     // tracked individually, in ascending order
+	uint8_t length;             // the number of the above
+	uint16_t* counts;           // (length + 1) * LOGIC_HIST_BUCKETS counts
+} LogicHist;
+
+/*
+ * Adds a command to the histogram, given the opcode and the system_time32()
+ * value when the target was selected.
+ */
+void logic_hist_add(LogicHist*, uint8_t, uint32_t);
+
 /*
  * ============================================================================
  * 
@@ -373,4 +428,22 @@ void logic_request_sense(uint8_t*);
  */
 void logic_send_diagnostic(uint8_t*);
 
+/*
+ * Handles LOG SENSE for a target with the given histogram. This supports the
+ * supported pages page (0x00) and the vendor specific LOGIC_LOG_PAGE_HIST
+ * page, which has one parameter for each tracked opcode with the opcode as
+ * the parameter code, followed by a parameter for all others with code
+ * LOGIC_LOG_PARAM_OTHER. Each parameter is a binary list of the bucket
+ * counts, in big endian order.
+ */
+#define LOGIC_LOG_PAGE_HIST     0x30
+#define LOGIC_LOG_PARAM_OTHER   0x0100
+void logic_log_sense(uint8_t*, LogicHist*);
+
+/*
+ * Handles LOG SELECT for a target with the given histogram. Setting the PCR
+ * bit clears the histogram. Parameter data is not supported.
+ */
+void logic_log_select(uint8_t*, LogicHist*);
+
 #endif
@@ -17,54 +17,387 @@
  * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <avr/io.h>
 #include <util/delay.h>
 #include "config.h"
 #include "debug.h"
 #include "enc.h"
+#include "flight.h"
 #include "init.h"
 #include "hdd.h"
 #include "link.h"
 #include "logic.h"
+#include "main.h"
 #include "mem.h"
+#include "meter.h"
 #include "net.h"
 #include "phy.h"
+#include "trace.h"
 
-static uint8_t hdd_mask;
+static uint8_t hdd_id;
 static uint8_t link_mask;
 
+/*
+ * What answers on each SCSI ID, so the selected target can be dispatched
+ * without searching: nothing, the link device, or an HDD volume number.
+ */
+#define MAIN_TARGET_NONE        0xFF
+#define MAIN_TARGET_LINK        0xFE
+static uint8_t targets[8];
+
+/*
+ * Turns a target mask with a single bit set into the matching SCSI ID.
+ */
+#define main_target_id(m)       ((((m) & 0xF0) ? 4 : 0) \
+                                | (((m) & 0xCC) ? 2 : 0) \
+                                | (((m) & 0xAA) ? 1 : 0))
+
+/*
+ * Background task information, kept sorted by priority.
+ */
+typedef struct MainTask_t {
+	uint8_t (*run)(void);
+	uint8_t priority;
+	uint8_t budget;
+	uint8_t done;
+	uint32_t runs;
+	uint32_t runtime;
+} MainTask;
+static MainTask tasks[MAIN_TASK_MAX];
+static uint8_t task_count;
+
+/*
+ * When each startup phase finished, in system timer ticks, or 0 if it has
+ * not yet.
+ */
+static uint32_t boot_times[MAIN_BOOT_PHASES];
+
+#ifdef ENC_ENABLED
+static uint8_t link_ready;
+#endif
+
+/*
+ * ============================================================================
+ * 
+ *   BACKGROUND TASKS
+ * 
+ * ============================================================================
+ */
+
+void main_task_add(uint8_t (*run)(void), uint8_t priority, uint8_t budget)
+{
+	if (task_count >= MAIN_TASK_MAX) return;
+
+	// insert in priority order, after any tasks with the same priority
+	uint8_t i = task_count;
+	while (i > 0 && tasks[i - 1].priority > priority)
+	{
+		tasks[i] = tasks[i - 1];
+		i--;
+	}
+	tasks[i].run = run;
+	tasks[i].priority = priority;
+	tasks[i].budget = budget;
+	tasks[i].done = 0;
+	tasks[i].runs = 0;
+	tasks[i].runtime = 0;
+	task_count++;
+}
+
+uint8_t main_task_stats(uint8_t* data)
+{
+	uint8_t pos = 0;
+	data[pos++] = task_count;
+	data[pos++] = SYSTEM_TIMER_TICK_US;
+	for (uint8_t i = 0; i < task_count; i++)
+	{
+		data[pos++] = tasks[i].priority;
+		data[pos++] = tasks[i].budget;
+		data[pos++] = (uint8_t) (tasks[i].runs >> 24);
+		data[pos++] = (uint8_t) (tasks[i].runs >> 16);
+		data[pos++] = (uint8_t) (tasks[i].runs >> 8);
+		data[pos++] = (uint8_t) tasks[i].runs;
+		data[pos++] = (uint8_t) (tasks[i].runtime >> 24);
+		data[pos++] = (uint8_t) (tasks[i].runtime >> 16);
+		data[pos++] = (uint8_t) (tasks[i].runtime >> 8);
+		data[pos++] = (uint8_t) tasks[i].runtime;
+	}
+	return pos;
+}
+
+static void main_boot_mark(uint8_t phase)
+{
+	if (boot_times[phase] == 0)
+	{
+		boot_times[phase] = system_time32();
+	}
+}
+
+uint8_t main_boot_stats(uint8_t* data)
+{
+	uint8_t pos = 0;
+	data[pos++] = MAIN_BOOT_PHASES;
+	data[pos++] = SYSTEM_TIMER_TICK_US;
+	for (uint8_t i = 0; i < MAIN_BOOT_PHASES; i++)
+	{
+		data[pos++] = (uint8_t) (boot_times[i] >> 24);
+		data[pos++] = (uint8_t) (boot_times[i] >> 16);
+		data[pos++] = (uint8_t) (boot_times[i] >> 8);
+		data[pos++] = (uint8_t) boot_times[i];
+	}
+	return pos;
+}
+
+/*
+ * Provides the mask of every ID that something answers on.
+ */
+static uint8_t main_target_mask(void)
+{
+	uint8_t mask = 0;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		if (targets[i] != MAIN_TARGET_NONE)
+		{
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
+/*
+ * Gives each task that has not finished a chance to run, in priority order,
+ * stopping as soon as we are selected.
+ */
+static void main_tasks(void)
+{
+	for (uint8_t i = 0; i < task_count; i++)
+	{
+		if (phy_is_active()) return;
+
+		MainTask* task = &(tasks[i]);
+		if (task->done) continue;
+
+		uint16_t start = system_time();
+		uint16_t elapsed;
+		uint8_t res;
+		do
+		{
+			res = task->run();
+			elapsed = system_time() - start;
+		}
+		while (res == MAIN_TASK_MORE
+				&& elapsed < task->budget
+				&& (! phy_is_active()));
+
+		task->runs++;
+		task->runtime += elapsed;
+		if (res == MAIN_TASK_DONE)
+		{
+			task->done = 1;
+		}
+	}
+}
+
+#ifdef ENC_ENABLED
+/*
+ * Finishes setting up the Ethernet controller once its oscillator is running.
+ * If we are selected as the link device before then, main_handle() finishes
+ * the setup itself.
+ */
+static uint8_t main_task_link_init(void)
+{
+	if (link_ready) return MAIN_TASK_DONE;
+	if (! net_setup_finish()) return MAIN_TASK_IDLE;
+
+	link_set_filter();
+	link_ready = 1;
+	main_boot_mark(MAIN_BOOT_LINK);
+	return MAIN_TASK_DONE;
+}
+#endif
+
+#ifdef HDD_ENABLED
+/*
+ * Answers on the IDs of the volumes found on the card, in place of any used
+ * for the previous card. IDs already taken by the link device are skipped.
+ */
+static void main_map_volumes(void)
+{
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		if (targets[i] != MAIN_TARGET_LINK)
+		{
+			targets[i] = MAIN_TARGET_NONE;
+		}
+	}
+
+	uint8_t ids[HDD_VOLUME_MAX];
+	uint8_t count = hdd_volumes(ids);
+	for (uint8_t i = 0; i < count; i++)
+	{
+		uint8_t id = (ids[i] == HDD_VOLUME_DEFAULT_ID) ? hdd_id : ids[i];
+		if (targets[id] == MAIN_TARGET_LINK)
+		{
+			debug_dual(MAIN, DEBUG_ERROR, DEBUG_MAIN_TARGET_CONFLICT, id);
+		}
+		else
+		{
+			targets[id] = i;
+		}
+	}
+	phy_set_targets(main_target_mask());
+}
+
+/*
+ * Steps through memory card initialization, then sets the HDD up once the
+ * card is ready. Until then the HDD answers commands needing the card with
+ * NOT READY. Each step does only a little work with the card, so the rest of
+ * the main loop, and selection in particular, is never held up for long.
+ * 
+ * This keeps running afterwards: if initialization failed it is tried again
+ * every MAIN_CARD_RETRY_DELAY, and if the HDD loses the card it is started
+ * over, so cards can be swapped without a power cycle.
+ */
+#define MAIN_CARD_INIT          0
+#define MAIN_CARD_SETUP         1
+#define MAIN_CARD_READY         2
+#define MAIN_CARD_FAILED        3
+static uint8_t card_state;
+static uint32_t card_failed_time;
+
+static uint8_t main_task_card_init(void)
+{
+	if (card_state == MAIN_CARD_READY)
+	{
+		if (! hdd_card_lost()) return MAIN_TASK_IDLE;
+		mem_reset_card();
+		card_state = MAIN_CARD_INIT;
+		led_on();
+	}
+	else if (card_state == MAIN_CARD_FAILED)
+	{
+		if (system_time32() - card_failed_time < MAIN_CARD_RETRY_DELAY)
+		{
+			return MAIN_TASK_IDLE;
+		}
+		debug(MAIN, DEBUG_INFO, DEBUG_MAIN_CARD_RETRY);
+		mem_reset_card();
+		card_state = MAIN_CARD_INIT;
+	}
+
+	if (card_state == MAIN_CARD_INIT)
+	{
+		uint8_t v = mem_init_card();
+		if (v < 0x80) return MAIN_TASK_MORE;
+
+		main_boot_mark(MAIN_BOOT_CARD);
+		debug_dual(MAIN, DEBUG_INFO, DEBUG_MAIN_MEM_INIT_FOLLOWS, v);
+
+		// get the card size and start setting the HDD up if possible
+		if (v == 0xFF)
+		{
+			uint8_t csd[16];
+			if (mem_read_csd(csd))
+			{
+				uint32_t size = mem_size(csd);
+				uint8_t scr[8];
+				uint8_t status[64];
+				if (mem_read_scr(scr) && mem_read_sd_status(status))
+				{
+					hdd_set_ready(size, scr, status);
+				}
+				else
+				{
+					debug(MAIN, DEBUG_INFO, DEBUG_MAIN_BAD_SCR_REQUEST);
+					hdd_set_ready(size, NULL, NULL);
+				}
+				card_state = MAIN_CARD_SETUP;
+				return MAIN_TASK_MORE;
+			}
+			else
+			{
+				debug(MAIN, DEBUG_ERROR, DEBUG_MAIN_BAD_CSD_REQUEST);
+			}
+		}
+	}
+	else
+	{
+		uint8_t v = hdd_setup_step();
+		if (v == HDD_SETUP_MORE) return MAIN_TASK_MORE;
+
+		if (v == HDD_SETUP_DONE)
+		{
+			main_map_volumes();
+			main_boot_mark(MAIN_BOOT_VOLUMES);
+			card_state = MAIN_CARD_READY;
+		}
+	}
+	if (card_state != MAIN_CARD_READY)
+	{
+		hdd_set_failed();
+		card_state = MAIN_CARD_FAILED;
+		card_failed_time = system_time32();
+	}
+	led_off();
+	return MAIN_TASK_IDLE;
+}
+#endif
+
+/*
+ * ============================================================================
+ * 
+ *   MAIN LOOP
+ * 
+ * ============================================================================
+ */
+
 static void main_handle(void)
 {
 	
 	if (phy_is_active())
 	{
 		led_on();
-		
+		uint32_t start = meter_start();
 		
 		uint8_t target = phy_get_target();
+		trace(TRACE_SELECT, target);
+		flight(TRACE_SELECT, target);
+		main_boot_mark(MAIN_BOOT_SELECT);
+		
+		uint8_t device = MAIN_TARGET_NONE;
+		if (target != 0 && (target & (target - 1)) == 0)
+		{
+			device = targets[main_target_id(target)];
+		}
 		
-		if (target == hdd_mask)
+		if (device == MAIN_TARGET_NONE)
+		{
+			debug_dual(MAIN, DEBUG_ERROR,
+					DEBUG_MAIN_ACTIVE_NO_TARGET, phy_get_target());
+			
+			logic_done();
+		}
+		else if (device != MAIN_TARGET_LINK)
 		{
 			#ifdef HDD_ENABLED
 				
-				hdd_main();
+				hdd_main(device);
+				meter_done(METER_TARGET_HDD, start);
 			#endif
 		}
-		else if (target == link_mask)
+		else
 		{
 			#ifdef ENC_ENABLED
 				
-				
+				while (! link_ready)
+				{
+					main_task_link_init();
+				}
 				link_main();
-			
+				meter_done(METER_TARGET_LINK, start);
 			#endif
 		}
-		else
-		{
-			debug_dual(DEBUG_MAIN_ACTIVE_NO_TARGET, phy_get_target());
-			
-			logic_done();
-		}
 		led_off();
 	}
 
@@ -79,6 +412,8 @@ int main(void)
 	init_mcu();
 	init_clock();
 	init_debug();
+	init_timer();
+	meter_reset();
 	led_on();
 	#ifdef ENC_ENABLED
 		enc_init();
@@ -92,6 +427,11 @@ int main(void)
 	// PSU is having problems
 	uint8_t rst_stat = RST.STATUS;
 	RST.STATUS = 0xFF; // clear all flags for next reboot (?)
+	trace(TRACE_BOOT, rst_stat);
+	flight_init(rst_stat);
+	#ifdef HDD_ENABLED
+		hdd_init(rst_stat);
+	#endif
 	if (rst_stat & RST_BORF_bm)
 	{
 		while (1)
@@ -107,69 +447,69 @@ int main(void)
 	uint8_t device_config[CONFIG_EEPROM_LENGTH];
 	config_read(device_config);
 	GLOBAL_CONFIG_REGISTER = device_config[CONFIG_OFFSET_FLAGS];
+	main_boot_mark(MAIN_BOOT_CONFIG);
+	if (GLOBAL_CONFIG_REGISTER & GLOBAL_FLAG_DEBUG)
+	{
+		DEBUG_MASK_REGISTER = 0xFF;
+	}
+	else
+	{
+		DEBUG_MASK_REGISTER = 0x00;
+	}
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		targets[i] = MAIN_TARGET_NONE;
+	}
 	#ifdef HDD_ENABLED
-		hdd_mask = 1 << device_config[CONFIG_OFFSET_ID_HDD];
-	#else
-		hdd_mask = 0;
+		// until the card is ready, the configured ID answers as volume 0
+		hdd_id = device_config[CONFIG_OFFSET_ID_HDD];
+		targets[hdd_id] = 0;
 	#endif
 	#ifdef ENC_ENABLED
 		link_mask = 1 << device_config[CONFIG_OFFSET_ID_LINK];
+		targets[device_config[CONFIG_OFFSET_ID_LINK]] = MAIN_TARGET_LINK;
 	#else
 		link_mask = 0;
 	#endif
 
 	// print the configuration out if requested
 	#ifdef DEBUGGING
-	debug(DEBUG_CONFIG_START);
+	debug(MAIN, DEBUG_INFO, DEBUG_CONFIG_START);
 	for (uint8_t i = 0; i < CONFIG_EEPROM_LENGTH; i++)
 	{
-		debug(device_config[i]);
+		debug(MAIN, DEBUG_INFO, device_config[i]);
 	}
+	flight_dump();
 	#endif
 
 	// setup additional elements dependent on configuration
-	phy_init(hdd_mask | link_mask);
+	phy_init(main_target_mask());
 	#ifdef ENC_ENABLED
 		
+		// the rest is done once the controller oscillator is running
 		net_setup(device_config + CONFIG_OFFSET_MAC);
 		link_init(link_mask);
-		link_set_filter();
+		main_task_add(main_task_link_init, 0, MAIN_TASK_LINK_INIT_BUDGET);
 		
 	#endif
 	phy_init_hold();
+	main_boot_mark(MAIN_BOOT_PHY);
 
 	#ifdef HDD_ENABLED
-		// initialize the memory card
-		uint8_t v;
-		do
-		{
-			v = mem_init_card();
-			main_handle();
-		}
-		while (v < 0x80);
-		debug_dual(DEBUG_MAIN_MEM_INIT_FOLLOWS, v);
-
-		// get the card size and mark it as OK if possible
-		if (v == 0xFF)
-		{
-			uint8_t csd[16];
-			if (mem_read_csd(csd))
-			{
-				uint32_t size = mem_size(csd);
-				hdd_set_ready(size);
-			}
-			else
-			{
-				debug(DEBUG_MAIN_BAD_CSD_REQUEST);
-			}
-		}
+		// initialize the memory card in the background
+		main_task_add(main_task_card_init, 0, MAIN_TASK_CARD_INIT_BUDGET);
+		main_task_add(hdd_cache_task, 1, MAIN_TASK_HDD_CACHE_BUDGET);
+		main_task_add(hdd_probe_task, 2, MAIN_TASK_HDD_PROBE_BUDGET);
+	#else
+		led_off();
 	#endif
-	led_off();
 
-	// and continue main handler function
+	// and continue main handler function, doing background work when idle
 	while (1)
 	{
 		main_handle();
+		main_tasks();
+		phy_debug();
 	}
 	return 0;
 }
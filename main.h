@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MAIN_H
+#define MAIN_H
+
+#include <avr/io.h>
+#include "config.h"
+
+/*
+ * Simple cooperative scheduler for work that can be done while the bus is not
+ * selecting us.
+ * 
+ * Tasks are registered once during startup with main_task_add(), and are run
+ * from the main loop in priority order whenever there is nothing for the PHY
+ * to do. Each task is a function that does a small, bounded amount of work and
+ * then returns one of the MAIN_TASK_* codes below. The scheduler keeps calling
+ * a task for as long as it asks to continue, its time budget has not run out,
+ * and we have not been selected, then moves on.
+ * 
+ * Tasks cannot be interrupted by the scheduler: selection is handled by the
+ * PHY ISRs regardless of what a task is doing, but the command will not be
+ * processed until the task returns. Keep each call short (well under 1ms) so
+ * the initiator is not kept waiting.
+ */
+
+/*
+ * Return values for task functions.
+ * 
+ * MAIN_TASK_IDLE: nothing more to do right now, try again later.
+ * MAIN_TASK_MORE: there is more work, call again if the budget allows.
+ * MAIN_TASK_DONE: the task has finished and should never be called again.
+ */
+#define MAIN_TASK_IDLE          0
+#define MAIN_TASK_MORE          1
+#define MAIN_TASK_DONE          2
+
+/*
+ * Length of the data provided by main_task_stats(), for the maximum number of
+ * tasks: a 2 byte header plus 10 bytes per task.
+ */
+#define MAIN_TASK_STATS_LENGTH  (2 + 10 * MAIN_TASK_MAX)
+
+/*
+ * Registers a task. Lower priority values are run first. The budget is the
+ * maximum time the scheduler will spend calling the task each time through
+ * the main loop, in SYSTEM_TIMER ticks; the task is always called at least
+ * once, even if it goes over.
+ * 
+ * This should only be called during startup. Tasks beyond MAIN_TASK_MAX are
+ * ignored.
+ */
+void main_task_add(uint8_t (*)(void), uint8_t, uint8_t);
+
+/*
+ * Writes the runtime accounting information for the tasks into the given
+ * array, which must be at least MAIN_TASK_STATS_LENGTH bytes long, and
+ * returns the number of bytes written. The format is:
+ * 
+ * Byte 0: number of tasks that follow.
+ * Byte 1: length of a timer tick, in microseconds.
+ * 
+ * Then, for each task in priority order:
+ * 
+ * Byte 0: priority.
+ * Byte 1: budget, in timer ticks.
+ * Bytes 2-5: number of times the task was given time, in big endian order.
+ * Bytes 6-9: total runtime in timer ticks, in big endian order. Finished
+ *            tasks keep their final value.
+ */
+uint8_t main_task_stats(uint8_t*);
+
+/*
+ * Startup phases timed by main(), in the order they are listed in
+ * main_boot_stats():
+ * 
+ * MAIN_BOOT_CONFIG: the device configuration has been read.
+ * MAIN_BOOT_PHY: the PHY is answering selection.
+ * MAIN_BOOT_LINK: the Ethernet controller has been set up.
+ * MAIN_BOOT_CARD: memory card initialization has finished, successfully or
+ *                 not.
+ * MAIN_BOOT_SELECT: we were first selected by an initiator.
+ * MAIN_BOOT_VOLUMES: the volumes on the card have been set up. The time after
+ *                    MAIN_BOOT_CARD is mostly spent looking for an image
+ *                    file, see fs.h.
+ * 
+ * The link and card are set up in the background after the PHY is started,
+ * so those phases may finish in either order, or after the first selection.
+ */
+#define MAIN_BOOT_CONFIG        0
+#define MAIN_BOOT_PHY           1
+#define MAIN_BOOT_LINK          2
+#define MAIN_BOOT_CARD          3
+#define MAIN_BOOT_SELECT        4
+#define MAIN_BOOT_VOLUMES       5
+#define MAIN_BOOT_PHASES        6
+
+/*
+ * Length of the data provided by main_boot_stats(): a 2 byte header plus 4
+ * bytes per phase.
+ */
+#define MAIN_BOOT_STATS_LENGTH  (2 + 4 * MAIN_BOOT_PHASES)
+
+/*
+ * Writes the startup phase timings into the given array, which must be at
+ * least MAIN_BOOT_STATS_LENGTH bytes long, and returns the number of bytes
+ * written. The format is:
+ * 
+ * Byte 0: number of phases that follow.
+ * Byte 1: length of a timer tick, in microseconds.
+ * 
+ * Then, for each phase, 4 bytes giving when it finished in timer ticks since
+ * the system timer was started early in main(), in big endian order. Phases
+ * that have not finished read as 0.
+ */
+uint8_t main_boot_stats(uint8_t*);
+
+#endif /* MAIN_H */
@@ -21,6 +21,7 @@
 #include <avr/io.h>
 #include <util/atomic.h>
 #include "config.h"
+#include "init.h"
 #include "mem.h"
 #include "debug.h"
 
@@ -90,11 +91,11 @@ static void mem_card_native(void)
 	 * card into native mode and wait for bytes to finish sending before
 	 * returning.
 	 */
-	MEM_USART.DATA = 0xFF;
+	usart_tx(MEM_USART, 0xFF);
 	for (uint8_t i = 0; i < 9; i++)
 	{
 		while (! (MEM_USART.STATUS & USART_DREIF_bm));
-		MEM_USART.DATA = 0xFF;
+		usart_tx(MEM_USART, 0xFF);
 	}
 	while (! (MEM_USART.STATUS & USART_TXCIF_bm));
 	MEM_USART.STATUS = USART_TXCIF_bm;
@@ -143,18 +144,18 @@ static uint8_t mem_card_cmd(const uint8_t* cmd, uint8_t* data)
 	 * we're safe to insert a new byte. This is the "standard" approach for
 	 * using the USART throughout this code.
 	 */
-	MEM_USART.DATA = cmd[0];
+	usart_tx(MEM_USART, cmd[0]);
 	for (uint8_t i = 1; i < 6; i++)
 	{
-		MEM_USART.DATA = cmd[i];
+		usart_tx(MEM_USART, cmd[i]);
 		while (mem_data_not_ready());
-		MEM_USART.DATA;
+		usart_rx(MEM_USART);
 	}
 
 	// send first wait byte, and junk the last response to the command
-	MEM_USART.DATA = 0xFF;
+	usart_tx(MEM_USART, 0xFF);
 	while (! (MEM_USART.STATUS & USART_RXCIF_bm));
-	MEM_USART.DATA;
+	usart_rx(MEM_USART);
 
 	/*
 	 * We junk 1 additional byte if CMD12 to avoid seeing the stuff byte as a
@@ -162,18 +163,18 @@ static uint8_t mem_card_cmd(const uint8_t* cmd, uint8_t* data)
 	 */
 	if (cmd[0] == 0x4C)
 	{
-		MEM_USART.DATA = 0xFF;
+		usart_tx(MEM_USART, 0xFF);
 		while (! (MEM_USART.STATUS & USART_RXCIF_bm));
-		MEM_USART.DATA;
+		usart_rx(MEM_USART);
 	}
 
 	// send 1-8 additional wait bytes until we get a response
 	uint8_t rx = 0xFF;
 	for (uint8_t i = 0; i < 8 && rx == 0xFF; i++)
 	{
-		MEM_USART.DATA = 0xFF;
+		usart_tx(MEM_USART, 0xFF);
 		while (mem_data_not_ready());
-		rx = MEM_USART.DATA;
+		rx = usart_rx(MEM_USART);
 	}
 
 	/*
@@ -185,9 +186,9 @@ static uint8_t mem_card_cmd(const uint8_t* cmd, uint8_t* data)
 	{
 		for (uint8_t i = 0; i < 4; i++)
 		{
-			MEM_USART.DATA = 0xFF;
+			usart_tx(MEM_USART, 0xFF);
 			while (! (MEM_USART.STATUS & USART_RXCIF_bm));
-			data[i] = MEM_USART.DATA;
+			data[i] = usart_rx(MEM_USART);
 		}
 	}
 
@@ -460,6 +461,13 @@ uint8_t mem_init_card(void)
 	return mem_init_state;
 }
 
+void mem_reset_card(void)
+{
+	mem_card_release();
+	CRC.CTRL = 0;
+	mem_init_state = MEM_ISTATE_STARTING;
+}
+
 uint8_t mem_op_start(void)
 {
 	if (mem_init_state != MEM_ISTATE_SUCCESS) return 0;
@@ -477,6 +485,40 @@ uint8_t mem_op_start(void)
 	}
 }
 
+uint8_t mem_op_start_wait(void)
+{
+	uint32_t start = system_time32();
+	while (! mem_op_start())
+	{
+		if (system_time32() - start >= MEM_BUSY_TIMEOUT) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Calculates the CRC7 of the first 5 bytes of a command and stores it, with
+ * the end bit, in the last byte. Cards ignore this unless CRC checking has
+ * been turned on with CMD59, but it costs little to always provide it.
+ */
+static void mem_cmd_crc(uint8_t* cmd)
+{
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < 5; i++)
+	{
+		uint8_t b = cmd[i];
+		for (uint8_t j = 0; j < 8; j++)
+		{
+			crc <<= 1;
+			if ((b ^ crc) & 0x80)
+			{
+				crc ^= 0x09;
+			}
+			b <<= 1;
+		}
+	}
+	cmd[5] = (crc << 1) | 1;
+}
+
 uint8_t mem_op_cmd(uint8_t cmd)
 {
 	mem_cmd_buffer[0] = 0x40 + cmd;
@@ -484,6 +526,7 @@ uint8_t mem_op_cmd(uint8_t cmd)
 	{
 		mem_cmd_buffer[i + 1] = 0x00;
 	}
+	mem_cmd_crc(mem_cmd_buffer);
 	return mem_card_cmd(mem_cmd_buffer, NULL);
 }
 
@@ -494,17 +537,30 @@ uint8_t mem_op_cmd_args(uint8_t cmd, uint8_t* arg)
 	{
 		mem_cmd_buffer[i + 1] = arg[i];
 	}
+	mem_cmd_crc(mem_cmd_buffer);
 	return mem_card_cmd(mem_cmd_buffer, NULL);
 }
 
+uint8_t mem_op_acmd_args(uint8_t cmd, uint8_t* arg)
+{
+	uint8_t v = mem_op_cmd(55);
+
+	// collect the byte left behind before sending the next command
+	while (mem_data_not_ready());
+	usart_rx(MEM_USART);
+
+	if (v != 0x00) return v;
+	return mem_op_cmd_args(cmd, arg);
+}
+
 uint8_t mem_wait_for_data(void)
 {
 	uint8_t v;
 	do
 	{
-		MEM_USART.DATA = 0xFF;
+		usart_tx(MEM_USART, 0xFF);
 		while (mem_data_not_ready());
-		v = MEM_USART.DATA;
+		v = usart_rx(MEM_USART);
 	}
 	while (v == 0xFF);
 	return v;
@@ -526,7 +582,7 @@ void mem_op_end(void)
 	 */
 	while (MEM_USART.STATUS & USART_RXCIF_bm)
 	{
-		MEM_USART.DATA;
+		usart_rx(MEM_USART);
 	}
 }
 
@@ -538,44 +594,67 @@ void mem_op_end(void)
  * ============================================================================
  */
 
-static uint8_t mem_read_cxd(uint8_t opcode, uint8_t* data)
+/*
+ * Reads a short register through a data block, such as the CSD or SCR. If
+ * the opcode has MEM_APP_CMD set, CMD55 is sent first to make it an
+ * application-specific command, and if it has MEM_R2_CMD set the second
+ * response byte of an R2 response is skipped before the data.
+ */
+#define MEM_APP_CMD             0x80
+#define MEM_R2_CMD              0x40
+#define MEM_CMD_MASK            0x3F
+static uint8_t mem_read_register(uint8_t opcode, uint8_t* data, uint8_t length)
 {
 	if (! mem_op_start())
 	{
-		debug(DEBUG_MEM_NOT_READY);
+		debug(MEM, DEBUG_INFO, DEBUG_MEM_NOT_READY);
 		return 0;
 	}
 
-	uint8_t v = mem_op_cmd(opcode);
+	uint8_t v;
+	if (opcode & MEM_APP_CMD)
+	{
+		uint8_t arg[4] = { 0x00, 0x00, 0x00, 0x00 };
+		v = mem_op_acmd_args(opcode & MEM_CMD_MASK, arg);
+	}
+	else
+	{
+		v = mem_op_cmd(opcode & MEM_CMD_MASK);
+	}
+	if (opcode & MEM_R2_CMD)
+	{
+		while (mem_data_not_ready());
+		usart_rx(MEM_USART);
+	}
 	if (v != 0x00)
 	{
-		debug(DEBUG_MEM_CMD_REJECTED);
-		debug(v);
+		mem_op_end();
+		debug_dual(MEM, DEBUG_ERROR, DEBUG_MEM_CMD_REJECTED, v);
 		return 0;
 	}
 
 	v = mem_wait_for_data();
 	if (v == MEM_DATA_TOKEN)
 	{
-		// get 16 bytes of CxD data
-		for (uint8_t i = 0; i < 16; i++)
+		// get the register data
+		for (uint8_t i = 0; i < length; i++)
 		{
-			MEM_USART.DATA = 0xFF;
+			usart_tx(MEM_USART, 0xFF);
 			while (! (MEM_USART.STATUS & USART_RXCIF_bm));
-			data[i] = MEM_USART.DATA;
+			data[i] = usart_rx(MEM_USART);
 		}
 		// get CRC bytes
 		for (uint8_t i = 0; i < 2; i++)
 		{
-			MEM_USART.DATA = 0xFF;
+			usart_tx(MEM_USART, 0xFF);
 			while (! (MEM_USART.STATUS & USART_RXCIF_bm));
-			MEM_USART.DATA;
+			usart_rx(MEM_USART);
 		}
 	}
 	else
 	{
-		debug(DEBUG_MEM_BAD_DATA_TOKEN);
-		debug(v);
+		mem_op_end();
+		debug_dual(MEM, DEBUG_ERROR, DEBUG_MEM_BAD_DATA_TOKEN, v);
 		return 0;
 	}
 
@@ -585,12 +664,154 @@ static uint8_t mem_read_cxd(uint8_t opcode, uint8_t* data)
 
 uint8_t mem_read_cid(uint8_t* data)
 {
-	return mem_read_cxd(10, data);
+	return mem_read_register(10, data, 16);
 }
 
 uint8_t mem_read_csd(uint8_t* data)
 {
-	return mem_read_cxd(9, data);
+	return mem_read_register(9, data, 16);
+}
+
+uint8_t mem_read_scr(uint8_t* data)
+{
+	return mem_read_register(MEM_APP_CMD | 51, data, 8);
+}
+
+uint8_t mem_read_sd_status(uint8_t* data)
+{
+	return mem_read_register(MEM_APP_CMD | MEM_R2_CMD | 13, data, 64);
+}
+
+uint8_t mem_read_block(uint32_t lba, uint8_t* data)
+{
+	if (mem_init_state != MEM_ISTATE_SUCCESS)
+	{
+		debug(MEM, DEBUG_INFO, DEBUG_MEM_NOT_READY);
+		return 0;
+	}
+	if (! mem_op_start_wait())
+	{
+		debug(MEM, DEBUG_ERROR, DEBUG_MEM_CARD_BUSY);
+		return 0;
+	}
+
+	uint8_t arg[4];
+	arg[0] = (uint8_t) (lba >> 24);
+	arg[1] = (uint8_t) (lba >> 16);
+	arg[2] = (uint8_t) (lba >> 8);
+	arg[3] = (uint8_t) lba;
+	uint8_t v = mem_op_cmd_args(17, arg);
+	if (v != 0x00)
+	{
+		mem_op_end();
+		debug_dual(MEM, DEBUG_ERROR, DEBUG_MEM_CMD_REJECTED, v);
+		return 0;
+	}
+
+	v = mem_wait_for_data();
+	if (v != MEM_DATA_TOKEN)
+	{
+		mem_op_end();
+		debug_dual(MEM, DEBUG_ERROR, DEBUG_MEM_BAD_DATA_TOKEN, v);
+		return 0;
+	}
+
+	// get the block, then the CRC bytes
+	for (uint16_t i = 0; i < 514; i++)
+	{
+		usart_tx(MEM_USART, 0xFF);
+		while (mem_data_not_ready());
+		v = usart_rx(MEM_USART);
+		if (i < 512)
+		{
+			data[i] = v;
+		}
+	}
+	mem_op_end();
+	return 1;
+}
+
+/*
+ * The AU_SIZE field is in the upper nibble of byte 10. Values up to 0xA
+ * double each time starting from 16KB, and the rest were added later with
+ * SDXC and are not all powers of two. The table is in 16KB units.
+ */
+static const uint16_t mem_au_large[5] = { 768, 1024, 1536, 2048, 4096 };
+uint32_t mem_au_size(uint8_t* status)
+{
+	uint8_t au = status[10] >> 4;
+	uint16_t units;
+	if (au == 0)
+	{
+		return 0;
+	}
+	else if (au <= 0xA)
+	{
+		units = 1 << (au - 1);
+	}
+	else
+	{
+		units = mem_au_large[au - 0xB];
+	}
+	return ((uint32_t) units) << 5;
+}
+
+/*
+ * The CRC module shifts each byte in least significant bit first, while the
+ * card's CRC16 works most significant bit first. Feeding the module reversed
+ * bytes gives the card's CRC with its bits reversed, which is undone here.
+ */
+static uint8_t mem_reverse(uint8_t v)
+{
+	uint8_t r = 0;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		r = (r << 1) | (v & 1);
+		v >>= 1;
+	}
+	return r;
+}
+
+uint16_t mem_crc_value(void)
+{
+	return (mem_reverse(CRC.CHECKSUM0) << 8) | mem_reverse(CRC.CHECKSUM1);
+}
+
+/*
+ * Before turning CRC checking on, this makes sure the CRC module gives the
+ * expected check value for the standard test string, so that a module that
+ * behaves differently than expected turns into a debugging message instead of
+ * every block failing.
+ */
+uint8_t mem_crc_enable(void)
+{
+	const char* check = "123456789";
+	mem_crc_start();
+	for (uint8_t i = 0; check[i]; i++)
+	{
+		CRC.DATAIN = mem_reverse(check[i]);
+	}
+	if (mem_crc_value() != 0x31C3)
+	{
+		CRC.CTRL = 0;
+		debug(MEM, DEBUG_ERROR, DEBUG_MEM_CRC_SELF_TEST);
+		return 0;
+	}
+
+	uint8_t v = 0xFF;
+	if (mem_op_start())
+	{
+		uint8_t arg[4] = { 0x00, 0x00, 0x00, 0x01 };
+		v = mem_op_cmd_args(59, arg);
+		mem_op_end();
+	}
+	if (v != 0x00)
+	{
+		CRC.CTRL = 0;
+		debug_dual(MEM, DEBUG_ERROR, DEBUG_MEM_CMD_REJECTED, v);
+		return 0;
+	}
+	return 1;
 }
 
 /*
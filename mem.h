@@ -52,7 +52,7 @@
  *       {
  *         MEM_USART.DATA = 0xFF;
  *         while (mem_data_not_ready());
- *         debug(MEM_USART.DATA);
+ *         debug(MEM, DEBUG_VERBOSE, MEM_USART.DATA);
  *       }
  *     }
  *   }
@@ -104,6 +104,18 @@
  */
 #define mem_data_not_ready()    (! (MEM_USART.STATUS & USART_RXCIF_bm))
 
+/*
+ * Block CRC support, using the MCU's CRC module. Once mem_crc_enable() has
+ * succeeded, mem_crc_start() should be called before each block, and each
+ * byte of the block given to CRC.DATAIN with its bits reversed as it goes by.
+ * For blocks coming from the card, giving it the card's two CRC bytes as well
+ * leaves a residue of zero if the block is intact. For blocks going to the
+ * card, mem_crc_value() gives the CRC to send after the block.
+ */
+#define mem_crc_start()         (CRC.CTRL = CRC_RESET_RESET0_gc | CRC_SOURCE_IO_gc)
+#define mem_crc_residue()       (CRC.CHECKSUM0 | CRC.CHECKSUM1)
+uint16_t mem_crc_value(void);
+
 /*
  * ============================================================================
  *  
@@ -141,9 +153,20 @@ void mem_init(void);
  * This can be called again after MEM_ISTATE_SUCCESS, which will reset the card
  * and go through initialization again. This feature is not well tested and
  * should only be used experimentally.
+ * 
+ * To start over with a card that may have been swapped, or after
+ * initialization has failed, call mem_reset_card() first.
  */
 uint8_t mem_init_card(void);
 
+/*
+ * Forgets about the current card, so the next call to mem_init_card() goes
+ * through the full initialization sequence as for a newly inserted card. No
+ * operations can be started until that succeeds. This also turns off CRC
+ * checking, which must be enabled again on the new card if wanted.
+ */
+void mem_reset_card(void);
+
 /*
  * ============================================================================
  *  
@@ -163,6 +186,12 @@ uint8_t mem_init_card(void);
  */
 uint8_t mem_op_start(void);
 
+/*
+ * As mem_op_start(), but waits up to MEM_BUSY_TIMEOUT for the card to stop
+ * being busy. This responds with zero if the card never became ready.
+ */
+uint8_t mem_op_start_wait(void);
+
 /*
  * Sends a command to the card, and waits for the command response byte,
  * providing it back. The byte given is the non-adjusted command byte, so
@@ -175,6 +204,16 @@ uint8_t mem_op_start(void);
 uint8_t mem_op_cmd(uint8_t cmd);
 uint8_t mem_op_cmd_args(uint8_t cmd, uint8_t* arg);
 
+/*
+ * As above, but sends CMD55 first so the command is treated as an
+ * application-specific command; to send ACMD23, supply 23 to this function.
+ * If CMD55 is rejected its response is given back instead, without sending
+ * the command.
+ * 
+ * This will leave 1 byte in the USART buffer for the caller to read.
+ */
+uint8_t mem_op_acmd_args(uint8_t cmd, uint8_t* arg);
+
 /*
  * Continues to cycle bytes until a non 0xFF byte is read, then returns.
  * 
@@ -208,12 +247,46 @@ void mem_op_end(void);
 uint8_t mem_read_csd(uint8_t*);
 uint8_t mem_read_cid(uint8_t*);
 
+/*
+ * Read the SCR into the given array, which must be at least 8 bytes long.
+ * Only SD cards have this register, so this will fail on MMC cards.
+ */
+uint8_t mem_read_scr(uint8_t*);
+
+/*
+ * Read the 64 byte SD Status into the given array. As with the SCR, this is
+ * only available on SD cards.
+ */
+uint8_t mem_read_sd_status(uint8_t*);
+
+/*
+ * Read the given block of the card into the given array, which must be at
+ * least 512 bytes long. Unlike the others, this waits up to MEM_BUSY_TIMEOUT
+ * for the card if it is still busy with a write. The block CRC is not
+ * checked.
+ */
+uint8_t mem_read_block(uint32_t, uint8_t*);
+
 /*
  * Provides the size of the card in 512 byte blocks when given the CSD bytes.
  * This is not well tested for some cards: refer to the definition for details.
  */
 uint32_t mem_size(uint8_t*);
 
+/*
+ * Provides the size of the card's allocation unit in 512 byte blocks when
+ * given the SD Status bytes, or 0 if the card does not say. Writes that stay
+ * within one allocation unit are the cheapest for the card to handle.
+ */
+uint32_t mem_au_size(uint8_t*);
+
+/*
+ * Checks that the CRC module works as expected, then turns on CRC checking in
+ * the card with CMD59. After this, the card rejects blocks written to it
+ * without a correct CRC.
+ */
+uint8_t mem_crc_enable(void);
+
 #endif /* HDD_ENABLED */
 
 #endif /* MEM_H */
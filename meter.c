@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "config.h"
+#include "init.h"
+#include "meter.h"
+
+MeterData meter;
+
+/*
+ * Writes a value into the given array in big endian order, advancing the
+ * position.
+ */
+static uint8_t meter_put16(uint8_t* data, uint8_t pos, uint16_t v)
+{
+	data[pos++] = (uint8_t) (v >> 8);
+	data[pos++] = (uint8_t) v;
+	return pos;
+}
+
+static uint8_t meter_put32(uint8_t* data, uint8_t pos, uint32_t v)
+{
+	pos = meter_put16(data, pos, (uint16_t) (v >> 16));
+	return meter_put16(data, pos, (uint16_t) v);
+}
+
+void meter_reset(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		uint8_t* m = (uint8_t*) &meter;
+		for (uint8_t i = 0; i < sizeof(MeterData); i++)
+		{
+			m[i] = 0;
+		}
+		meter.sel_min = 0xFFFF;
+		meter.since = system_time32();
+	}
+}
+
+void meter_read(uint8_t* data)
+{
+	MeterData m;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		m = meter;
+	}
+
+	uint8_t pos = 0;
+	data[pos++] = SYSTEM_TIMER_TICK_US;
+	pos = meter_put32(data, pos, system_time32() - m.since);
+	pos = meter_put32(data, pos, m.selections);
+	pos = meter_put16(data, pos, m.sel_min);
+	pos = meter_put16(data, pos, m.sel_max);
+	pos = meter_put32(data, pos, m.sel_total);
+	pos = meter_put16(data, pos, m.req_max);
+	pos = meter_put32(data, pos, m.req_total);
+	for (uint8_t i = 0; i < METER_TARGETS; i++)
+	{
+		pos = meter_put32(data, pos, m.count[i]);
+		pos = meter_put32(data, pos, m.busy[i]);
+	}
+}
+
+uint32_t meter_start(void)
+{
+	uint32_t now = system_time32();
+	uint16_t since;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		since = (uint16_t) now - meter.sel_time;
+	}
+	return now - since;
+}
+
+void meter_done(uint8_t target, uint32_t start)
+{
+	meter.count[target]++;
+	meter.busy[target] += system_time32() - start;
+}
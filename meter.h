@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METER_H
+#define METER_H
+
+#include <avr/io.h>
+#include "config.h"
+#include "init.h"
+
+/*
+ * Bus utilization and selection latency meter.
+ * 
+ * This measures, since the last reset of the meter:
+ * 
+ * 1) How long the selection ISR took to assert /BSY after the initiator
+ *    released /BSY with /SEL asserted, in CPU cycles. The /BSY release time
+ *    is captured in hardware by PHY_TIMER_DESKEW, so this includes the
+ *    interrupt latency.
+ * 2) How long it took from selection to the first /REQ of the COMMAND phase,
+ *    in system timer ticks. This is mostly the time for the main loop to
+ *    notice the selection.
+ * 3) The number of selections and the time spent busy, from selection to
+ *    BUS FREE, for each of our targets, in system timer ticks.
+ * 4) The time elapsed, in system timer ticks.
+ * 
+ * Time not spent busy with one of our targets is idle from our point of view,
+ * though the bus may have been in use by other devices. Times are 32 bits,
+ * so measurements should be reset and read within about 2 hours.
+ * 
+ * The results are provided by meter_read() in big endian order:
+ * 
+ * Byte 0: SYSTEM_TIMER_TICK_US.
+ * Bytes 1-4: elapsed time.
+ * Bytes 5-8: selections seen by the ISR.
+ * Bytes 9-10: minimum selection latency, in cycles.
+ * Bytes 11-12: maximum selection latency, in cycles.
+ * Bytes 13-16: total selection latency, in cycles.
+ * Bytes 17-18: maximum time to first /REQ.
+ * Bytes 19-22: total time to first /REQ.
+ * Then for each of METER_TARGETS targets, in the order of the METER_TARGET_*
+ * values below:
+ *   Bytes 0-3: commands handled.
+ *   Bytes 4-7: time busy.
+ */
+#define METER_TARGET_HDD        0
+#define METER_TARGET_LINK       1
+#define METER_TARGETS           2
+#define METER_LENGTH            (23 + 8 * METER_TARGETS)
+
+typedef struct MeterData
+{
+	uint32_t since;
+	uint32_t selections;
+	uint16_t sel_min;
+	uint16_t sel_max;
+	uint32_t sel_total;
+	uint16_t sel_time;
+	uint16_t req_max;
+	uint32_t req_total;
+	uint32_t count[METER_TARGETS];
+	uint32_t busy[METER_TARGETS];
+} MeterData;
+extern MeterData meter;
+
+/*
+ * Clears all measurements and starts a new measurement period. This is also
+ * called once from main() during startup.
+ */
+void meter_reset(void);
+
+/*
+ * Provides the measurements as described above, as METER_LENGTH bytes.
+ */
+void meter_read(uint8_t*);
+
+/*
+ * Called from the selection ISR right after /BSY is asserted, with the number
+ * of cycles since /BSY was released.
+ * 
+ * The main loop reads the system timer without masking interrupts, and a
+ * 16 bit read goes through the timer's TEMP register, so TEMP is put back
+ * after the read here. Otherwise a main loop read interrupted between its two
+ * halves would get the high byte of this one.
+ */
+static inline __attribute__((always_inline)) void meter_select(
+		uint16_t cycles)
+{
+	uint8_t temp = SYSTEM_TIMER.TEMP;
+	meter.sel_time = system_time();
+	SYSTEM_TIMER.TEMP = temp;
+	meter.selections++;
+	meter.sel_total += cycles;
+	if (cycles < meter.sel_min) meter.sel_min = cycles;
+	if (cycles > meter.sel_max) meter.sel_max = cycles;
+}
+
+/*
+ * Called just before the first /REQ after selection.
+ */
+static inline __attribute__((always_inline)) void meter_command(void)
+{
+	uint16_t t = system_time() - meter.sel_time;
+	meter.req_total += t;
+	if (t > meter.req_max) meter.req_max = t;
+}
+
+/*
+ * Provides the system_time32() value of the last selection, for use with
+ * meter_done(). This must be called within 131ms of the selection.
+ */
+uint32_t meter_start(void);
+
+/*
+ * Called after one of our targets has gone BUS FREE, with the target and the
+ * value from meter_start().
+ */
+void meter_done(uint8_t target, uint32_t start);
+
+#endif /* METER_H */
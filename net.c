@@ -71,6 +71,17 @@ void net_setup(uint8_t* mac)
 	 */
 	enc_cmd_write(ENC_ERXFCON, ENC_UCEN_bm| ENC_CRCEN_bm);
 
+	// keep the MAC address until the MAC itself can be set up
+	mac_address[0] = mac[0];
+	mac_address[1] = mac[1];
+	mac_address[2] = mac[2];
+	mac_address[3] = mac[3];
+	mac_address[4] = mac[4];
+	mac_address[5] = mac[5];
+}
+
+uint8_t net_setup_finish(void)
+{
 	/*
 	 * 6.4: wait for oscillator startup.
 	 * 
@@ -79,11 +90,11 @@ void net_setup(uint8_t* mac)
 	 * affected, but if that assumption changes this needs a delay added.
 	 */
 	uint8_t flags;
-	do
+	enc_cmd_read(ENC_ESTAT, &flags);
+	if (! (flags & ENC_CLKRDY_bm))
 	{
-		enc_cmd_read(ENC_ESTAT, &flags);
+		return 0;
 	}
-	while (! (flags & ENC_CLKRDY_bm));
 
 	/*
 	 * 6.5: setup the MAC
@@ -99,21 +110,12 @@ void net_setup(uint8_t* mac)
 	enc_cmd_write(ENC_MAIPGL, 0x12);
 	enc_cmd_write(ENC_MAIPGH, 0x0C);
 	// assign initial MAC address to what the configuration specifies
-	enc_cmd_write(ENC_MAADR1, mac[0]); 
-	enc_cmd_write(ENC_MAADR2, mac[1]);
-	enc_cmd_write(ENC_MAADR3, mac[2]);
-	enc_cmd_write(ENC_MAADR4, mac[3]);
-	enc_cmd_write(ENC_MAADR5, mac[4]);
-	enc_cmd_write(ENC_MAADR6, mac[5]);
-
-	// Load MAC Address to global variable so available when Daynaport calls it
-
-	mac_address[0] = mac[0];
-	mac_address[1] = mac[1];
-	mac_address[2] = mac[2];
-	mac_address[3] = mac[3];
-	mac_address[4] = mac[4];
-	mac_address[5] = mac[5];
+	enc_cmd_write(ENC_MAADR1, mac_address[0]); 
+	enc_cmd_write(ENC_MAADR2, mac_address[1]);
+	enc_cmd_write(ENC_MAADR3, mac_address[2]);
+	enc_cmd_write(ENC_MAADR4, mac_address[3]);
+	enc_cmd_write(ENC_MAADR5, mac_address[4]);
+	enc_cmd_write(ENC_MAADR6, mac_address[5]);
 	/*
 	 * 6.6: configure the PHY correctly.
 	 * 
@@ -135,6 +137,7 @@ void net_setup(uint8_t* mac)
 	 */
 	enc_cmd_write(ENC_EIE, ENC_PKTIE_bm | ENC_INTIE_bm);
 	enc_cmd_set(ENC_ECON1, ENC_RXEN_bm);
+	return 1;
 }
 
 void net_process_header(uint8_t* v, NetHeader* s)
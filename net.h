@@ -87,8 +87,14 @@ typedef struct NetHeader_t {
  * 
  * This needs to be given the MAC address to configure as the built-in ROM
  * address, in LSB to MSB order.
+ * 
+ * Only the registers that can be written before the controller oscillator is
+ * running are set up here. Call net_setup_finish() afterwards until it
+ * returns true to set up the rest; this does not wait, so other startup work
+ * can be done while the oscillator starts.
  */
 void net_setup(uint8_t*);
+uint8_t net_setup_finish(void);
 
 /*
  * Fills the given NetHeader with the information contained in the given set
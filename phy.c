@@ -18,10 +18,14 @@
  */
 
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 #include <util/delay.h>
 #include "config.h"
 #include "debug.h"
+#include "flight.h"
+#include "meter.h"
+#include "trace.h"
 #include "phy.h"
 
 /*
@@ -139,13 +143,43 @@
  */
 #define PHY_TIMER_RESEL_VAL 1024
 
+/*
+ * Bus timing requirements, in PHY_TIMER_DESKEW ticks @ 32MHz.
+ * 
+ * PHY_TICKS_SETTLE is the 400ns bus settle delay. SCSI requires this between
+ * changing the phase lines and the next /REQ assertion, and also between
+ * releasing the data bus and changing /I/O, so the initiator can release the
+ * bus before we drive it (or the other way around).
+ * 
+ * PHY_TICKS_DESKEW is two deskew delays plus a cable skew delay (100ns),
+ * which is all that is needed between /ACK going away and changing /C/D or
+ * /MSG when /I/O stays the same.
+ */
+#define PHY_TICKS_SETTLE 13
+#define PHY_TICKS_DESKEW 4
+
+/*
+ * Cycles to wait after /ACK is seen before reading the data lines during
+ * DATA OUT on the non-latching paths. The initiator must have the data valid
+ * a deskew delay plus a cable skew delay (55ns) before /ACK, but our /ACK
+ * receiver and data receivers don't have matched propagation delays, so we
+ * wait a little longer. This is short enough that reading the timer would take
+ * longer than the wait itself, so it is done with a fixed cycle count.
+ */
+#define PHY_ACK_DESKEW_CYCLES 2
+
 /*
  * Lookup values needed to swap a reversed port order back to normal, or take
  * a normal value and reverse it. These are in SRAM to improve performance,
- * aligned for faster lookups (in theory).
+ * aligned for faster lookups (in theory). This is also used to feed the CRC
+ * module during memory card transfers, see mem.h; boards that don't need it
+ * for the port keep it in flash instead, where it is only used for that.
  */
 #ifdef PHY_PORT_DATA_IN_REVERSED
-static uint8_t phy_reverse_table[256] __attribute__ ((aligned (256))) = {
+uint8_t phy_reverse_table[256] __attribute__ ((aligned (256))) = {
+#else
+const uint8_t phy_reverse_table[256] PROGMEM __attribute__ ((aligned (256))) = {
+#endif
 	0, 128, 64, 192, 32, 160, 96, 224, 16, 144, 80, 208, 48, 176, 112, 240, 8, 
 	136, 72, 200, 40, 168, 104, 232, 24, 152, 88, 216, 56, 184, 120, 248, 4, 
 	132, 68, 196, 36, 164, 100, 228, 20, 148, 84, 212, 52, 180, 116, 244, 12, 
@@ -163,7 +197,6 @@ static uint8_t phy_reverse_table[256] __attribute__ ((aligned (256))) = {
 	135, 71, 199, 39, 167, 103, 231, 23, 151, 87, 215, 55, 183, 119, 247, 15, 
 	143, 79, 207, 47, 175, 111, 239, 31, 159, 95, 223, 63, 191, 127, 255
 };
-#endif
 
 /*
  * Truth table for parity calculations when outputting data, and for checking
@@ -219,6 +252,25 @@ static volatile uint8_t arbitration_target_out;
 static volatile uint8_t arbitration_target_in;
 static volatile uint8_t arbitration_block_mask;
 
+/*
+ * The last reselection step reached, as a DEBUG_PHY_RESELECT_* code, or zero
+ * once reported. The reselection ISRs must not write to the debug ring, so
+ * they store the code here and phy_debug() sends it from the main context.
+ * Each step implies the ones before it, so only the latest is kept.
+ */
+#if DEBUG_LEVEL_PHY >= DEBUG_INFO
+	static volatile uint8_t resel_step;
+	#define resel_note(v)     resel_step = (v)
+#else
+	#define resel_note(v)
+#endif
+
+/*
+ * The PHY_TIMER_DESKEW count when the phase lines were last changed, which
+ * phy_settle_wait() measures the bus settle delay from.
+ */
+static uint16_t settle_start;
+
 /*
  * Performs a raw read of the data bus and returns the result. This is the
  * preferred approach outside of an ISR.
@@ -271,14 +323,27 @@ static inline __attribute__((always_inline)) void phy_data_clear(void)
 	dbp_release();
 }
 
+/*
+ * Records that the phase lines were just changed, and waits for the bus settle
+ * delay since that point to pass. Callers should do whatever work they can
+ * between the two, as only the remaining time is spent waiting.
+ * 
+ * The timer wraps every ~2ms, so if a wait is done long after the change it
+ * may spin for up to one extra bus settle delay, which is harmless.
+ */
+static inline __attribute__((always_inline)) void phy_settle_begin(void)
+{
+	settle_start = phy_timer_now();
+}
+static inline __attribute__((always_inline)) void phy_settle_wait(void)
+{
+	phy_timer_wait(settle_start, PHY_TICKS_SETTLE);
+}
+
 void phy_init(uint8_t mask)
 {
 	PHY_REGISTER_PHASE = 0;
-	#ifdef PHY_PORT_DATA_IN_REVERSED
-		owned_masks = phy_reverse_table[mask];
-	#else
-		owned_masks = mask;
-	#endif
+	phy_set_targets(mask);
 
 	/*
 	 * Important: DCLK can get into a port conflict state that can damage the
@@ -390,6 +455,12 @@ void phy_init(uint8_t mask)
 	PHY_CFG_R_SEL |= PORT_ISC_RISING_gc;
 	PHY_PORT_CTRL_IN.INT0MASK = PHY_PIN_R_SEL;
 	PHY_PORT_CTRL_IN.INT1MASK = PHY_PIN_R_BSY;
+
+	// free-running timer for bus delays, capturing /BSY release for the meter
+	PHY_TIMER_DESKEW_CHMUX = PHY_CHMUX_BSY;
+	PHY_TIMER_DESKEW.CTRLB = TC0_CCAEN_bm;
+	PHY_TIMER_DESKEW.CTRLD = TC_EVACT_CAPT_gc | PHY_TIMER_DESKEW_EVSEL;
+	PHY_TIMER_DESKEW.CTRLA = TC_CLKSEL_DIV1_gc;
 }
 
 void phy_init_hold(void)
@@ -409,6 +480,15 @@ void phy_init_hold(void)
 	PHY_PORT_CTRL_IN.INTCTRL = PORT_INT1LVL_MED_gc;
 }
 
+void phy_set_targets(uint8_t mask)
+{
+	#ifdef PHY_PORT_DATA_IN_REVERSED
+		owned_masks = phy_reverse_table[mask];
+	#else
+		owned_masks = mask;
+	#endif
+}
+
 uint8_t phy_get_target(void)
 {
 	#ifdef PHY_PORT_DATA_IN_REVERSED
@@ -471,7 +551,7 @@ void phy_data_offer_stream(USART_t* usart, uint16_t len)
 	}
 }
 
-void phy_data_offer_stream_block(USART_t* usart)
+void phy_data_offer_stream_block(USART_t* usart, uint8_t crc)
 {
 	if (! (PHY_REGISTER_PHASE & 0x01)) return;
 	if (! phy_is_active()) return;
@@ -498,11 +578,120 @@ void phy_data_offer_stream_block(USART_t* usart)
 	 * 
 	 * This feels more than a little hacky, so if anyone has any insight on
 	 * ways to force GCC to do these things in C I'm all ears.
+	 * 
+	 * There are two copies of the loop, picked once per block: the first is
+	 * the plain one, and the second also feeds the CRC module.
 	 */
 
 	#define REP2(x) x x
 
 	uint8_t max = 0xFF;
+	if (! crc)
+	{
+		__asm__ __volatile__(
+				// fetch the first iteration's data
+				"st Z, %0"					"\n\t"	// send 0xFF to card
+				"ld XL, Z"					"\n\t"	// fetch card data to XL
+
+				// and the parity value for it
+				"ld __tmp_reg__, X"			"\n\t"
+
+				// setup for the loop, start at 0 for 256 iterations per repeat
+				"clr r18"					"\n\t"
+
+				// make sure we have enough time for the last 0xFF to cycle
+				// before the looping starts
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+				"nop"						"\n\t"
+
+	REP2(		// loop until /ACK is released
+		"1:"	"sbic %6, %7"				"\n\t"
+				"rjmp 1b"					"\n\t"
+
+				// output data to /DB0-7
+				"st Y, XL"					"\n\t"
+
+				// handle /DBP
+				"cbi %2, %3"				"\n\t"	// release /DBP
+				"sbrs __tmp_reg__, 0"		"\n\t"	// skip next if odd
+				"sbi %2, %3"				"\n\t"	//   assert /DBP
+
+				// fetch the data value for the next iteration
+				"st Z, %0"					"\n\t"	// send 0xFF to card
+				"ld XL, Z"					"\n\t"	// fetch card data to XL
+
+				// assert /REQ
+				"sbi %4, %5"				"\n\t"
+
+				// fetch parity for next iteration
+				"ld __tmp_reg__, X"			"\n\t"
+
+				// --loop [SREG preserved during /ACK check]
+				"dec r18"					"\n\t"
+
+				// loop until /ACK is asserted
+		"2:"	"sbis %6, %7"				"\n\t"
+				"rjmp 2b"					"\n\t"
+
+				// release /REQ
+				"cbi %4, %5"				"\n\t"
+
+				// then back to the loop start
+				"brne 1b"					"\n\t") /* end REP */
+
+				// restore X to what it was before call just in case
+				"clr XL"					"\n\t"
+
+				: // no output operands
+				: "r" (max), "X" (&(PHY_PORT_DATA_OUT.OUT)),
+				"I" (&(PHY_PORT_T_DBP.OUT)), "I" (PHY_PIN_T_DBP_BP),
+				"I" (&(PHY_PORT_T_REQ.OUT)), "I" (PHY_PIN_T_REQ_BP),
+				"I" (&(PHY_PORT_R_ACK.IN)), "I" (PHY_PIN_R_ACK_BP),
+				"x" (&phy_bits_set), "z" (&(usart->DATA)),
+				"y" (&(PHY_PORT_DATA_OUT.OUT))
+				: "r18" // <- clobbers
+				);
+		return;
+	}
+
+	/*
+	 * With CRC checking on, each card byte is looked up in the reverse table
+	 * and given to the CRC module between asserting /REQ and the /ACK check.
+	 * When the table is in SRAM it has the same alignment as the bits-set
+	 * array, so XH is briefly pointed at it, which costs 6 cycles per byte.
+	 * When it is in flash, Z is borrowed for an LPM instead, which costs 9
+	 * cycles per byte. This is only free if the initiator takes at least that
+	 * long to answer /REQ; otherwise each byte is slowed by the difference.
+	 */
+	#ifdef PHY_PORT_DATA_IN_REVERSED
+		#define PHY_CRC_SETUP \
+				"ldi r20, hi8(%[rev])"		"\n\t" \
+				"ldi r21, hi8(%[bits])"		"\n\t"
+		#define PHY_CRC_FEED \
+				"mov XH, r20"				"\n\t" \
+				"ld r19, X"					"\n\t" \
+				"mov XH, r21"				"\n\t" \
+				"sts %[crc], r19"			"\n\t"
+	#else
+		#define PHY_CRC_SETUP \
+				"ldi r20, hi8(%[rev])"		"\n\t"
+		#define PHY_CRC_FEED \
+				"movw r22, r30"				"\n\t" \
+				"mov r30, XL"				"\n\t" \
+				"mov r31, r20"				"\n\t" \
+				"lpm r19, Z"				"\n\t" \
+				"movw r30, r22"				"\n\t" \
+				"sts %[crc], r19"			"\n\t"
+	#endif
+
 	__asm__ __volatile__(
 			// fetch the first iteration's data
 			"st Z, %0"					"\n\t"	// send 0xFF to card
@@ -511,6 +700,10 @@ void phy_data_offer_stream_block(USART_t* usart)
 			// and the parity value for it
 			"ld __tmp_reg__, X"			"\n\t"
 
+			// give it to the CRC module
+			PHY_CRC_SETUP
+			PHY_CRC_FEED
+
 			// setup for the loop, start at 0 for 256 iterations per repeat
 			"clr r18"					"\n\t"
 
@@ -549,6 +742,9 @@ REP2(		// loop until /ACK is released
 			// fetch parity for next iteration
 			"ld __tmp_reg__, X"			"\n\t"
 
+			// give the next iteration's data to the CRC module
+			PHY_CRC_FEED
+
 			// --loop [SREG preserved during /ACK check]
 			"dec r18"					"\n\t"
 
@@ -571,8 +767,10 @@ REP2(		// loop until /ACK is released
 			"I" (&(PHY_PORT_T_REQ.OUT)), "I" (PHY_PIN_T_REQ_BP),
 			"I" (&(PHY_PORT_R_ACK.IN)), "I" (PHY_PIN_R_ACK_BP),
 			"x" (&phy_bits_set), "z" (&(usart->DATA)),
-			"y" (&(PHY_PORT_DATA_OUT.OUT))
-			: "r18" // <- clobbers
+			"y" (&(PHY_PORT_DATA_OUT.OUT)),
+			[rev] "i" (phy_reverse_table), [bits] "i" (phy_bits_set),
+			[crc] "i" (&(CRC.DATAIN))
+			: "r18", "r19", "r20", "r21", "r22", "r23" // <- clobbers
 			);
 }
 
@@ -626,6 +824,58 @@ uint8_t phy_data_ask(void)
 	return data;
 }
 
+/*
+ * Single asynchronous /REQ / /ACK handshake to get a byte from the initiator,
+ * without any of the safety checks. Used by the CDB fetch below.
+ */
+static inline __attribute__((always_inline)) uint8_t phy_data_ask_fast(void)
+{
+	while (phy_is_ack_asserted());
+	req_assert();
+	while (! phy_is_ack_asserted());
+	uint8_t data = phy_data_get();
+	#ifdef PHY_PORT_DATA_IN_REVERSED
+		data = phy_reverse_table[data];
+	#endif
+	req_release();
+	return data;
+}
+
+/*
+ * CDB lengths for each opcode group, indexed by the upper 3 bits of the
+ * opcode. Groups we don't support only get the opcode read.
+ */
+static const uint8_t phy_cdb_length[8] = {
+	6, 10, 10, 1, 1, 1, 1, 1
+};
+
+uint8_t phy_data_ask_cdb(uint8_t* cmd)
+{
+	if (! phy_is_active()) return 0;
+
+	cmd[0] = phy_data_ask_fast();
+	uint8_t len = phy_cdb_length[cmd[0] >> 5];
+
+	// unrolled, with 10 byte CDBs falling into the 6 byte fetch
+	uint8_t* p = cmd + 1;
+	switch (len)
+	{
+		case 10:
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+			// fall through
+		case 6:
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+			*p++ = phy_data_ask_fast();
+	}
+	return len;
+}
+
 void phy_data_ask_bulk(uint8_t* data, uint16_t len)
 {
 	uint8_t v;
@@ -663,7 +913,8 @@ void phy_data_ask_stream(USART_t* usart, uint16_t len)
 		req_assert();
 		// wait for initiator to give us the data
 		while (! (phy_is_ack_asserted()));
-		_delay_us(0.05); // JGK DELAY REQUIRED  If this delay isn't here, the device seems to get caught up in a handshake loop.
+		// JGK DELAY REQUIRED  If this delay isn't here, the device seems to get caught up in a handshake loop.
+		__builtin_avr_delay_cycles(PHY_ACK_DESKEW_CYCLES);
 		// read data from the bus
 		v = phy_data_get();
 
@@ -698,7 +949,8 @@ void phy_data_ask_stream_0x80(USART_t* usart, uint16_t len) //uint16_t
 		req_assert();
 		// wait for initiator to give us the data
 		while (! (phy_is_ack_asserted()));
-		_delay_us(0.05); // JGK DELAY REQUIRED  If this delay isn't here, the device seems to get caught up in a handshake loop.
+		// JGK DELAY REQUIRED  If this delay isn't here, the device seems to get caught up in a handshake loop.
+		__builtin_avr_delay_cycles(PHY_ACK_DESKEW_CYCLES);
 		// read data from the bus
 		v = phy_data_get();
 
@@ -768,12 +1020,17 @@ void phy_data_ask_stream_0x80_tobuffer(uint8_t* xmit_buf, uint16_t len) //Was pr
 */
 
 
-void phy_data_ask_stream_block(USART_t* usart)
+/*
+ * The loops behind phy_data_ask_stream_block() and
+ * phy_data_ask_compare_block(). These are always given a constant for the
+ * CRC flag, so each copy that is inlined only has the code it needs and the
+ * check is made once per block.
+ */
+static inline __attribute__((always_inline)) void phy_ask_block(
+		USART_t* usart, uint8_t crc)
 {
 	uint8_t v;
 
-	if (! phy_is_active()) return;
-
 	uint8_t i = 255;
 	do
 	{
@@ -783,7 +1040,10 @@ void phy_data_ask_stream_block(USART_t* usart)
 		v = phy_data_get();
 		req_release();
 		#ifdef PHY_PORT_DATA_IN_REVERSED
+			if (crc) CRC.DATAIN = v;
 			v = phy_reverse_table[v];
+		#else
+			if (crc) CRC.DATAIN = phy_reverse(v);
 		#endif
 		while (! (usart->STATUS & USART_DREIF_bm));
 		usart->DATA = v;
@@ -797,7 +1057,10 @@ void phy_data_ask_stream_block(USART_t* usart)
 		v = phy_data_get();
 		req_release();
 		#ifdef PHY_PORT_DATA_IN_REVERSED
+			if (crc) CRC.DATAIN = v;
 			v = phy_reverse_table[v];
+		#else
+			if (crc) CRC.DATAIN = phy_reverse(v);
 		#endif
 		while (! (usart->STATUS & USART_DREIF_bm));
 		usart->DATA = v;
@@ -805,6 +1068,91 @@ void phy_data_ask_stream_block(USART_t* usart)
 	while (i--);
 }
 
+static inline __attribute__((always_inline)) uint8_t phy_compare_block(
+		USART_t* usart, uint8_t crc)
+{
+	uint8_t v, c;
+	uint8_t diff = 0;
+
+	/*
+	 * The next card byte is requested right after the current one is
+	 * taken, so it arrives while the initiator is busy with /ACK.
+	 */
+	uint8_t i = 255;
+	do
+	{
+		while (phy_is_ack_asserted());
+		req_assert();
+		while (! (usart->STATUS & USART_RXCIF_bm));
+		c = usart->DATA;
+		usart->DATA = 0xFF;
+		if (crc) CRC.DATAIN = phy_reverse(c);
+		while (! (phy_is_ack_asserted()));
+		v = phy_data_get();
+		req_release();
+		#ifdef PHY_PORT_DATA_IN_REVERSED
+			v = phy_reverse_table[v];
+		#endif
+		diff |= v ^ c;
+	}
+	while (i--);
+	do
+	{
+		while (phy_is_ack_asserted());
+		req_assert();
+		while (! (usart->STATUS & USART_RXCIF_bm));
+		c = usart->DATA;
+		usart->DATA = 0xFF;
+		if (crc) CRC.DATAIN = phy_reverse(c);
+		while (! (phy_is_ack_asserted()));
+		v = phy_data_get();
+		req_release();
+		#ifdef PHY_PORT_DATA_IN_REVERSED
+			v = phy_reverse_table[v];
+		#endif
+		diff |= v ^ c;
+	}
+	while (i--);
+
+	// trash the extra byte, matching the offer call
+	while (! (usart->STATUS & USART_RXCIF_bm));
+	c = usart->DATA;
+	usart->DATA = 0xFF;
+	if (crc) CRC.DATAIN = phy_reverse(c);
+	return diff;
+}
+
+void phy_data_ask_stream_block(USART_t* usart, uint8_t crc)
+{
+	if (! phy_is_active()) return;
+
+	if (crc)
+	{
+		phy_ask_block(usart, 1);
+	}
+	else
+	{
+		phy_ask_block(usart, 0);
+	}
+}
+
+uint8_t phy_data_ask_compare_block(USART_t* usart, uint8_t crc)
+{
+	if (! phy_is_active()) return 0;
+
+	// verify a byte is actually waiting
+	while (! (usart->STATUS & USART_RXCIF_bm));
+
+	if (crc)
+	{
+		return phy_compare_block(usart, 1);
+	}
+	else
+	{
+		return phy_compare_block(usart, 0);
+	}
+}
+
 void phy_phase(uint8_t new_phase)
 {
 	if (! phy_is_active()) return;
@@ -817,8 +1165,20 @@ void phy_phase(uint8_t new_phase)
 	req_release();
 	while (phy_is_ack_asserted());
 
-	// wait at least 400ns for the bus to settle
-	_delay_us(0.4);
+	/*
+	 * If /I/O is changing the data bus is being turned around, which needs
+	 * the full bus settle delay. Otherwise, only the deskew is needed. The
+	 * time it takes to get here counts towards either.
+	 */
+	uint16_t released = phy_timer_now();
+	if ((PHY_REGISTER_PHASE ^ new_phase) & 0x01)
+	{
+		phy_timer_wait(released, PHY_TICKS_SETTLE);
+	}
+	else
+	{
+		phy_timer_wait(released, PHY_TICKS_DESKEW);
+	}
 
 	// change phase
 	PHY_REGISTER_PHASE = new_phase;
@@ -852,8 +1212,15 @@ void phy_phase(uint8_t new_phase)
 			msg_release();
 		}
 
-		// wait another 400ns for the bus to settle
-		_delay_us(0.4);
+		/*
+		 * The bus settle delay must pass before the data lines or /REQ are
+		 * used in the new phase. This is done once here rather than by each
+		 * transfer call, with the recording overlapping the wait.
+		 */
+		phy_settle_begin();
+		trace(TRACE_PHASE, new_phase);
+		flight(TRACE_PHASE, new_phase);
+		phy_settle_wait();
 	}
 	else
 	{
@@ -870,9 +1237,70 @@ void phy_phase(uint8_t new_phase)
 
 		// and finally release /BSY to go bus free
 		bsy_release();
+		trace(TRACE_PHASE, PHY_PHASE_BUS_FREE);
+		flight(TRACE_PHASE, PHY_PHASE_BUS_FREE);
 	}
 }
 
+uint8_t phy_complete(uint8_t status)
+{
+	if (! phy_is_active()) return 0;
+
+	/*
+	 * STATUS phase. The previous phase may have had /I/O in either state, so
+	 * the full bus settle is used both before and after the change, and the
+	 * data lines are left alone until the initiator has had that long to stop
+	 * driving them.
+	 */
+	phy_data_clear();
+	req_release();
+	while (phy_is_ack_asserted());
+	uint16_t released = phy_timer_now();
+	phy_timer_wait(released, PHY_TICKS_SETTLE);
+	PHY_REGISTER_PHASE = PHY_PHASE_STATUS;
+	io_assert();
+	cd_assert();
+	msg_release();
+	phy_settle_begin();
+	trace(TRACE_PHASE, PHY_PHASE_STATUS);
+	flight(TRACE_PHASE, PHY_PHASE_STATUS);
+	phy_settle_wait();
+	phy_data_set(status);
+	req_assert();
+	while (! phy_is_ack_asserted());
+	req_release();
+
+	/*
+	 * The initiator must assert /ATN before it releases /ACK if it wants the
+	 * bus, so only after /ACK goes away is the check valid.
+	 */
+	while (phy_is_ack_asserted());
+	released = phy_timer_now();
+	if (phy_is_atn_asserted()) return PHY_PHASE_STATUS;
+
+	/*
+	 * MESSAGE IN phase, only requiring /MSG to change. We were already
+	 * driving the data lines, so COMMAND COMPLETE can go out on them while
+	 * the bus settles.
+	 */
+	phy_timer_wait(released, PHY_TICKS_DESKEW);
+	PHY_REGISTER_PHASE = PHY_PHASE_MESSAGE_IN;
+	msg_assert();
+	phy_settle_begin();
+	trace(TRACE_PHASE, PHY_PHASE_MESSAGE_IN);
+	flight(TRACE_PHASE, PHY_PHASE_MESSAGE_IN);
+	phy_data_set(0x00);
+	phy_settle_wait();
+	req_assert();
+	while (! phy_is_ack_asserted());
+	req_release();
+	while (phy_is_ack_asserted());
+	if (phy_is_atn_asserted()) return PHY_PHASE_MESSAGE_IN;
+
+	phy_phase(PHY_PHASE_BUS_FREE);
+	return 0;
+}
+
 uint8_t phy_reselect(uint8_t target_mask)
 {
 	if (PHY_REGISTER_STATUS & PHY_STATUS_ASK_RESELECT_bm)
@@ -895,7 +1323,7 @@ uint8_t phy_reselect(uint8_t target_mask)
 	}
 
 	// store the values we will need to use for arbitration/reselection
-	debug(DEBUG_PHY_RESELECT_REQUESTED);
+	resel_note(DEBUG_PHY_RESELECT_REQUESTED);
 	PHY_REGISTER_STATUS |= PHY_STATUS_ASK_RESELECT_bm;
 	arbitration_target_out = target_mask;
 	#ifdef PHY_PORT_DATA_IN_REVERSED
@@ -935,6 +1363,21 @@ uint8_t phy_reselect(uint8_t target_mask)
 	return 1;
 }
 
+void phy_debug(void)
+{
+	#if DEBUG_LEVEL_PHY >= DEBUG_INFO
+		if (! resel_step) return;
+
+		uint8_t v;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			v = resel_step;
+			resel_step = 0;
+		}
+		debug(PHY, DEBUG_INFO, v);
+	#endif
+}
+
 /*
  * ============================================================================
  *  
@@ -983,7 +1426,7 @@ ISR(PHY_TIMER_BSY_CCA_vect)
 	/*
 	 * Note start of arbitration if enabled.
 	 */
-	debug(DEBUG_PHY_RESELECT_STARTING);
+	resel_note(DEBUG_PHY_RESELECT_STARTING);
 
 	/*
 	 * Then we need to wait ~2400ns and check if we won. If we lose, /SEL goes
@@ -1028,7 +1471,7 @@ ISR(PHY_TIMER_BSY_CCB_vect)
 		PHY_PORT_CTRL_IN.INTCTRL = PORT_INT1LVL_MED_gc; // /SEL off, /BSY on
 		PHY_PORT_DATA_OUT.OUT = 0;
 		bsy_release();
-		debug(DEBUG_PHY_RESELECT_ARB_LOST);
+		resel_note(DEBUG_PHY_RESELECT_ARB_LOST);
 	}
 	else
 	{
@@ -1056,7 +1499,7 @@ ISR(PHY_TIMER_BSY_CCB_vect)
 		PHY_TIMER_RESEL.CTRLA = TC_CLKSEL_DIV1_gc;
 
 		// release /BSY and start waiting for the initiator
-		debug(DEBUG_PHY_RESELECT_ARB_WON);
+		resel_note(DEBUG_PHY_RESELECT_ARB_WON);
 		bsy_release();
 	}
 }
@@ -1095,7 +1538,7 @@ ISR(PHY_TIMER_RESEL_vect)
 		active_target = arbitration_target_in;
 		PHY_REGISTER_PHASE = PHY_PHASE_DATA_IN;
 		PHY_REGISTER_STATUS = PHY_STATUS_ACTIVE_bm | PHY_STATUS_CONTINUED_bm;
-		debug(DEBUG_PHY_RESELECT_FINISHED);
+		resel_note(DEBUG_PHY_RESELECT_FINISHED);
 	}
 }
 */
@@ -1119,7 +1562,7 @@ ISR(PHY_CTRL_IN_INT0_vect)
 	PHY_PORT_CTRL_IN.INTCTRL = PORT_INT1LVL_MED_gc; // /SEL off, /BSY on
 
 	// note /SEL assertion
-	debug(DEBUG_PHY_RESELECT_ARB_INTERRUPTED);
+	resel_note(DEBUG_PHY_RESELECT_ARB_INTERRUPTED);
 }
 
 /*
@@ -1160,11 +1603,20 @@ ISR(PHY_CTRL_IN_INT1_vect)
 			 * 
 			 * Note: we do not check to make sure that only our own mask
 			 * is present on the bus, which is probably not a great idea.
+			 * 
+			 * The main loop may have been halfway through reading the
+			 * deskew timer, so its TEMP register is put back afterwards;
+			 * see meter_select().
 			 */
 			bsy_assert();
+			uint8_t temp = PHY_TIMER_DESKEW.TEMP;
+			uint16_t now = PHY_TIMER_DESKEW.CNT;
+			uint16_t released = PHY_TIMER_DESKEW.CCA;
+			PHY_TIMER_DESKEW.TEMP = temp;
 			active_target = raw;
 			PHY_REGISTER_PHASE = PHY_PHASE_DATA_OUT;
 			PHY_REGISTER_STATUS |= PHY_STATUS_ACTIVE_bm;
+			meter_select(now - released);
 		}
 	}
 }
@@ -21,6 +21,7 @@
 #define PHY_H
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 
 /*
  * Defines the low-level interface used by this device for communicating as a
@@ -117,6 +118,34 @@
 #define phy_is_atn_asserted()   (PHY_PORT_R_ATN.IN & PHY_PIN_R_ATN)
 #define phy_is_ack_asserted()   (PHY_PORT_R_ACK.IN & PHY_PIN_R_ACK)
 
+/*
+ * Access to the free-running bus timer, which counts at the CPU clock rate.
+ * phy_timer_now() provides the current count, and phy_timer_wait() waits until
+ * the given number of ticks have passed since a count previously provided by
+ * phy_timer_now(). The count wraps every ~2ms, so this is only for short
+ * delays, which should be no more than PHY_TIMER_MAX_US. As with
+ * system_time(), ISRs reading this timer must save and restore its TEMP
+ * register.
+ */
+#define PHY_TIMER_TICKS_PER_US  (F_CPU / 1000000)
+#define PHY_TIMER_MAX_US        (0xFFFF / PHY_TIMER_TICKS_PER_US)
+#define phy_timer_now()         (PHY_TIMER_DESKEW.CNT)
+#define phy_timer_wait(s, t)    while ((uint16_t) (PHY_TIMER_DESKEW.CNT - (s)) < (t))
+
+/*
+ * Table giving each byte value with its bits in reverse order, aligned to a
+ * 256 byte boundary. This is shared with the memory card CRC code, which
+ * should use phy_reverse() to look values up: the table is only in SRAM on
+ * boards where the PHY needs it, and is in flash otherwise.
+ */
+#ifdef PHY_PORT_DATA_IN_REVERSED
+	extern uint8_t phy_reverse_table[256];
+	#define phy_reverse(v)      (phy_reverse_table[(v)])
+#else
+	extern const uint8_t phy_reverse_table[256];
+	#define phy_reverse(v)      (pgm_read_byte(&(phy_reverse_table[(v)])))
+#endif
+
 /*
  * Initalizes the SCSI PHY, setting everything to defaults. This needs to be
  * invoked before any other calls to the SCSI PHY system.
@@ -126,6 +155,13 @@
  */
 void phy_init(uint8_t);
 
+/*
+ * Changes the mask of targets this device will respond to selection on. This
+ * may be called at any time after phy_init(); it takes effect with the next
+ * selection.
+ */
+void phy_set_targets(uint8_t);
+
 /*
  * Halts the initialization process from proceeding until /RST has gone low.
  * This is intended to stop the MCU startup in instances when /RST has been
@@ -206,8 +242,13 @@ void phy_data_offer_stream(USART_t*, uint16_t);
  * will always transfer a fixed length of 512 bytes, trash one additional byte
  * from the USART, and leave one byte pending in transmission. This call
  * offers higher throughput than the above function.
+ * 
+ * If the second parameter is nonzero, every byte taken from the USART,
+ * including the trashed one, is also given to the CRC module as described in
+ * mem.h. This slows the transfer down a little, so it should only be asked
+ * for when the card is checking CRCs.
  */
-void phy_data_offer_stream_block(USART_t*);
+void phy_data_offer_stream_block(USART_t*, uint8_t);
 
 /*
  * Specialized version of _offer_stream(), for use with the link device. This
@@ -225,6 +266,15 @@ void phy_data_offer_stream_atn(USART_t*, uint16_t);
  */
 uint8_t phy_data_ask(void);
 
+/*
+ * Used during COMMAND to get a full CDB from the initiator, storing it in the
+ * given array, which must be at least 10 bytes long. The length of the CDB is
+ * found from the group code in the opcode, and is returned. Only groups 0, 1,
+ * and 2 are supported: for other groups, only the opcode is read and 1 is
+ * returned.
+ */
+uint8_t phy_data_ask_cdb(uint8_t*);
+
 /*
  * Asks the initiator for the given number of bytes and stores them in the
  * given array. Apart from working on a series of bytes, this is identical to
@@ -244,9 +294,19 @@ void phy_data_ask_bulk(uint8_t*, uint16_t);
 void phy_data_ask_stream(USART_t*, uint16_t);
 
 /*
- * As above, but for fixed lengths of 512 bytes.
+ * As above, but for fixed lengths of 512 bytes. As with the offer call, each
+ * byte is also given to the CRC module if the second parameter is nonzero.
+ */
+void phy_data_ask_stream_block(USART_t*, uint8_t);
+
+/*
+ * Used during DATA OUT to compare 512 bytes from the initiator against 512
+ * bytes read from the memory card, without storing either. The USART contract
+ * is the same as phy_data_offer_stream_block(), including the optional CRC
+ * module feed. This gives back zero if every byte matched, or nonzero
+ * otherwise; all bytes are asked for either way.
  */
-void phy_data_ask_stream_block(USART_t*);
+uint8_t phy_data_ask_compare_block(USART_t*, uint8_t);
 
 /*
  * ============================================================================
@@ -269,6 +329,19 @@ void phy_data_ask_stream_block(USART_t*);
  */
 void phy_phase(uint8_t);
 
+/*
+ * Ends a command by moving to STATUS, sending the given status byte, moving to
+ * MESSAGE IN, sending COMMAND COMPLETE, and going BUS FREE. This avoids the
+ * overhead of doing each step separately, which matters for devices that are
+ * polled frequently.
+ * 
+ * If /ATN is asserted after either byte, this stops and returns the phase
+ * that was active when that happened, leaving the caller to handle the
+ * MESSAGE OUT and anything after it. Otherwise, this returns zero, and the
+ * bus will be free.
+ */
+uint8_t phy_complete(uint8_t);
+
 /*
  * Starts the process of reselecting the initiator. In our implementation,
  * we assume there is only one initiator and it is always at ID 7.
@@ -281,6 +354,12 @@ void phy_phase(uint8_t);
  */
 uint8_t phy_reselect(uint8_t);
 
+/*
+ * Sends debugging output for reselection progress noted by the ISRs, which
+ * can't write to the debug ring themselves. Call from the main loop.
+ */
+void phy_debug(void);
+
 // writes a single char to the uart for transmitting a packet (more complex 0x80 scenario
 
 
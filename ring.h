@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <avr/io.h>
+#include "config.h"
+#include "init.h"
+
+/*
+ * Definitions shared by debugging output (debug.h), tracing (trace.h) and the
+ * flight recorder (flight.h). This header includes neither of the first two,
+ * so both can include it.
+ * 
+ * ============================================================================
+ *  
+ *   RECORD FORMAT
+ * 
+ * ============================================================================
+ * 
+ * Each event is a fixed 4 byte record:
+ * 
+ * Byte 0: event ID, one of the TRACE_* values below.
+ * Byte 1: event argument.
+ * Bytes 2-3: system timer count when the event was recorded, in little
+ *            endian order. See SYSTEM_TIMER_TICK_US for the tick length.
+ * 
+ * Events that need a 16 bit argument are preceded by a TRACE_EXT record
+ * holding the high byte of the argument, which decoders should combine with
+ * the argument of the following record. A decoder is available in
+ * tools/tracedecode.cpp.
+ */
+#define TRACE_BOOT              0x01 // arg: RST.STATUS at startup
+#define TRACE_DROPPED           0x02 // arg: number of events lost
+#define TRACE_EXT               0x03 // arg: high byte for next record
+#define TRACE_DEBUG             0x04 // arg: debug() byte
+#define TRACE_SELECT            0x10 // arg: target mask
+#define TRACE_PHASE             0x11 // arg: new phase, BUS FREE ends command
+#define TRACE_COMMAND           0x12 // arg: opcode
+#define TRACE_STATUS            0x13 // arg: status byte
+#define TRACE_MESSAGE_OUT       0x14 // arg: message byte
+#define TRACE_HDD_BLOCKS        0x20 // arg (16 bit): blocks to transfer
+#define TRACE_LINK_BYTES        0x21 // arg (16 bit): bytes to transfer
+
+#define TRACE_RECORD_LENGTH     4
+
+/*
+ * ============================================================================
+ *  
+ *   OUTPUT RING
+ * 
+ * ============================================================================
+ * 
+ * Debugging and trace output is written to a 256 byte ring in SRAM and sent
+ * out the debug USART by the DRE interrupt, so neither ever waits for the
+ * USART. If the ring is full, new output is dropped and counted in
+ * debug_dropped. Once there is space again, the number lost since the last
+ * report (saturating at 255) is sent: as DEBUG_OUTPUT_DROPPED and a count of
+ * bytes in plain debugging builds, or as a TRACE_DROPPED record in tracing
+ * builds, where the ring carries only whole records.
+ * 
+ * The ring must only be written from the main context, not from ISRs.
+ */
+#if defined(DEBUGGING) || defined(TRACING)
+extern uint8_t debug_ring[256];
+extern volatile uint8_t debug_head;
+extern volatile uint8_t debug_tail;
+extern uint16_t debug_dropped;
+extern uint8_t debug_unreported;
+
+/*
+ * Provides the number of free bytes in the ring.
+ */
+#define debug_ring_free()     ((uint8_t) (debug_tail - debug_head - 1))
+
+/*
+ * Starts the DRE interrupt after data has been added to the ring. The ISR
+ * turns the interrupt off again when the ring is empty. This is a plain write
+ * so it can't race with the ISR.
+ */
+#define debug_ring_kick()     DEBUG_USART.CTRLA = USART_DREINTLVL_LO_gc
+
+#ifdef TRACING
+/*
+ * Writes the TRACE_DROPPED record, if there is room for it and the record
+ * that follows. Returns zero if there was not.
+ */
+uint8_t debug_report_dropped(void);
+
+/*
+ * Writes one record to the ring, or counts it as dropped if the ring is full.
+ */
+static inline __attribute__((always_inline)) void debug_record(
+		uint8_t id, uint8_t arg)
+{
+	if (debug_unreported && ! debug_report_dropped()) goto dropped;
+	if (debug_ring_free() < TRACE_RECORD_LENGTH) goto dropped;
+
+	uint16_t now = system_time();
+	uint8_t h = debug_head;
+	debug_ring[h++] = id;
+	debug_ring[h++] = arg;
+	debug_ring[h++] = (uint8_t) now;
+	debug_ring[h++] = (uint8_t) (now >> 8);
+	debug_head = h;
+	debug_ring_kick();
+	return;
+
+	dropped:
+	if (debug_unreported < 255) debug_unreported++;
+	debug_dropped++;
+}
+#else
+/*
+ * Adds a byte to the ring, or counts it as dropped if the ring is full.
+ */
+void debug_put(uint8_t);
+#endif
+#endif /* DEBUGGING || TRACING */
+
+#endif /* RING_H */
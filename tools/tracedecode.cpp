@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Host tool that decodes the binary trace stream produced by firmware built
+ * with -DTRACING (see trace.h) into a per-command timeline, with the time
+ * spent in each bus phase and the data throughput of each command, followed
+ * by a summary for each opcode.
+ * 
+ * Build with any C++11 compiler, e.g.:
+ * 
+ *   g++ -std=c++11 -O2 -o tracedecode tracedecode.cpp
+ * 
+ * Then feed it a capture of the debug USART, starting from device power-on
+ * so records are aligned:
+ * 
+ *   tracedecode [-t tick_us] [-d] [-f] [capture.bin]
+ * 
+ * -t sets the length of a timer tick in microseconds (default 2, matching
+ * SYSTEM_TIMER_TICK_US). -d includes debug() bytes in the output. -f decodes
+ * a flight recorder dump (see flight.h) instead, printing the reset cause
+ * from its header first. If no file is given the capture is read from
+ * standard input.
+ * 
+ * Timestamps are 16 bits and wrap about every 131ms with the default tick.
+ * Gaps longer than that between events cannot be detected, so idle periods
+ * may appear shorter than they were. Times within a command are accurate.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// must match ring.h
+#define TRACE_BOOT              0x01
+#define TRACE_DROPPED           0x02
+#define TRACE_EXT               0x03
+#define TRACE_DEBUG             0x04
+#define TRACE_SELECT            0x10
+#define TRACE_PHASE             0x11
+#define TRACE_COMMAND           0x12
+#define TRACE_STATUS            0x13
+#define TRACE_MESSAGE_OUT       0x14
+#define TRACE_HDD_BLOCKS        0x20
+#define TRACE_LINK_BYTES        0x21
+
+static const char* phase_name(uint8_t phase)
+{
+	switch (phase)
+	{
+		case 0x00: return "BUS FREE";
+		case 0x80: return "DATA OUT";
+		case 0x81: return "DATA IN";
+		case 0x82: return "COMMAND";
+		case 0x83: return "STATUS";
+		case 0x86: return "MESSAGE OUT";
+		case 0x87: return "MESSAGE IN";
+		default: return "UNKNOWN";
+	}
+}
+
+struct Phase {
+	uint8_t phase;
+	double start;
+	double duration;
+};
+
+struct Command {
+	bool active = false;
+	double start = 0;
+	uint8_t target = 0;
+	int opcode = -1;
+	int status = -1;
+	uint32_t bytes = 0;
+	std::vector<Phase> phases;
+	std::vector<uint8_t> messages;
+};
+
+struct Summary {
+	unsigned count = 0;
+	double total_time = 0;
+	double max_time = 0;
+	uint64_t bytes = 0;
+	double data_time = 0;
+};
+
+static std::map<int, Summary> summaries;
+
+static void finish(Command& cmd, double now, bool complete)
+{
+	if (! cmd.active) return;
+	cmd.active = false;
+
+	double total = now - cmd.start;
+	double data_time = 0;
+	if (! cmd.phases.empty())
+	{
+		cmd.phases.back().duration = now - cmd.phases.back().start;
+	}
+
+	printf("%12.1f us  target 0x%02X  ", cmd.start, cmd.target);
+	if (cmd.opcode >= 0)
+		printf("op 0x%02X  ", cmd.opcode);
+	else
+		printf("op --    ");
+	if (cmd.status >= 0)
+		printf("status 0x%02X  ", cmd.status);
+	else
+		printf("status --    ");
+	printf("total %8.1f us  [", total);
+	for (size_t i = 0; i < cmd.phases.size(); i++)
+	{
+		const Phase& p = cmd.phases[i];
+		printf("%s%s %.1f", i ? ", " : "", phase_name(p.phase), p.duration);
+		if (p.phase == 0x80 || p.phase == 0x81)
+			data_time += p.duration;
+	}
+	printf("]");
+	for (uint8_t m : cmd.messages)
+		printf("  msg 0x%02X", m);
+	if (cmd.bytes)
+	{
+		printf("  %u bytes", cmd.bytes);
+		if (data_time > 0)
+			printf(", %.2f MB/s", cmd.bytes / data_time);
+	}
+	if (! complete)
+		printf("  (incomplete)");
+	printf("\n");
+
+	Summary& s = summaries[cmd.opcode];
+	s.count++;
+	s.total_time += total;
+	if (total > s.max_time) s.max_time = total;
+	s.bytes += cmd.bytes;
+	s.data_time += data_time;
+}
+
+int main(int argc, char** argv)
+{
+	double tick = 2;
+	bool show_debug = false;
+	bool flight = false;
+	const char* path = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (! strcmp(argv[i], "-t") && i + 1 < argc)
+		{
+			tick = atof(argv[++i]);
+		}
+		else if (! strcmp(argv[i], "-d"))
+		{
+			show_debug = true;
+		}
+		else if (! strcmp(argv[i], "-f"))
+		{
+			flight = true;
+		}
+		else if (argv[i][0] == '-')
+		{
+			fprintf(stderr,
+					"usage: %s [-t tick_us] [-d] [-f] [capture.bin]\n",
+					argv[0]);
+			return 1;
+		}
+		else
+		{
+			path = argv[i];
+		}
+	}
+
+	FILE* in = stdin;
+	if (path)
+	{
+		in = fopen(path, "rb");
+		if (! in)
+		{
+			perror(path);
+			return 1;
+		}
+	}
+
+	if (flight)
+	{
+		uint8_t header[2];
+		if (fread(header, 1, 2, in) != 2)
+		{
+			fprintf(stderr, "flight recorder header missing\n");
+			return 1;
+		}
+		printf("session ended by reset, RST.STATUS 0x%02X, %u events\n",
+				header[0], header[1]);
+	}
+
+	Command cmd;
+	bool first = true;
+	uint16_t last_raw = 0;
+	double now = 0;
+	int ext = -1;
+	uint8_t rec[4];
+
+	while (fread(rec, 1, 4, in) == 4)
+	{
+		uint16_t raw = (uint16_t) (rec[2] | (rec[3] << 8));
+		if (! first)
+			now += (uint16_t) (raw - last_raw) * tick;
+		first = false;
+		last_raw = raw;
+
+		uint8_t id = rec[0];
+		uint32_t arg = rec[1];
+		if (ext >= 0 && id != TRACE_EXT)
+		{
+			arg |= (uint32_t) ext << 8;
+			ext = -1;
+		}
+
+		switch (id)
+		{
+			case TRACE_BOOT:
+				finish(cmd, now, false);
+				printf("%12.1f us  boot, reset status 0x%02X\n", now, arg);
+				break;
+			case TRACE_DROPPED:
+				printf("%12.1f us  %u events dropped\n", now, arg);
+				break;
+			case TRACE_EXT:
+				ext = rec[1];
+				break;
+			case TRACE_DEBUG:
+				if (show_debug)
+					printf("%12.1f us  debug 0x%02X\n", now, arg);
+				break;
+			case TRACE_SELECT:
+				finish(cmd, now, false);
+				cmd = Command();
+				cmd.active = true;
+				cmd.start = now;
+				cmd.target = (uint8_t) arg;
+				break;
+			case TRACE_PHASE:
+				if (! cmd.active) break;
+				if (! cmd.phases.empty())
+				{
+					Phase& p = cmd.phases.back();
+					p.duration = now - p.start;
+				}
+				if (arg == 0x00)
+				{
+					finish(cmd, now, true);
+				}
+				else
+				{
+					cmd.phases.push_back(Phase { (uint8_t) arg, now, 0 });
+				}
+				break;
+			case TRACE_COMMAND:
+				cmd.opcode = (int) arg;
+				break;
+			case TRACE_STATUS:
+				cmd.status = (int) arg;
+				break;
+			case TRACE_MESSAGE_OUT:
+				cmd.messages.push_back((uint8_t) arg);
+				break;
+			case TRACE_HDD_BLOCKS:
+				cmd.bytes += arg * 512;
+				break;
+			case TRACE_LINK_BYTES:
+				cmd.bytes += arg;
+				break;
+			default:
+				printf("%12.1f us  unknown event 0x%02X 0x%02X\n",
+						now, id, arg);
+				break;
+		}
+	}
+	finish(cmd, now, false);
+	if (in != stdin) fclose(in);
+
+	printf("\n  op     count     avg us     max us        bytes      MB/s\n");
+	for (const auto& e : summaries)
+	{
+		const Summary& s = e.second;
+		if (e.first >= 0)
+			printf("  0x%02X", e.first);
+		else
+			printf("  --  ");
+		printf("  %6u  %9.1f  %9.1f  %11llu", s.count,
+				s.total_time / s.count, s.max_time,
+				(unsigned long long) s.bytes);
+		if (s.data_time > 0)
+			printf("  %8.2f", s.bytes / s.data_time);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 saybur
+ * 
+ * This file is part of scuznet.
+ * 
+ * scuznet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * scuznet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with scuznet.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <avr/io.h>
+#include "ring.h"
+
+/*
+ * Binary event tracing for performance analysis, enabled by compiling with
+ * -DTRACING. When disabled, all calls compile to nothing.
+ * 
+ * Events are written as records (see ring.h for the format and event IDs) to
+ * the debug output ring, and sent out the debug USART by its interrupt. If
+ * the ring fills up, new events are dropped and a TRACE_DROPPED record with
+ * the number of lost events is written once there is space again.
+ * 
+ * While tracing, debug() output is recorded as TRACE_DEBUG events instead of
+ * being written directly, so the USART only carries whole records.
+ * 
+ * Tracing must only be done from the main context, not from ISRs.
+ */
+
+#ifdef TRACING
+
+/*
+ * Records an event with the given 8 bit argument.
+ */
+static inline __attribute__((always_inline)) void trace(
+		uint8_t id, uint8_t arg)
+{
+	debug_record(id, arg);
+}
+
+/*
+ * Records an event with the given 16 bit argument, as two records.
+ */
+static inline __attribute__((always_inline)) void trace16(
+		uint8_t id, uint16_t arg)
+{
+	trace(TRACE_EXT, (uint8_t) (arg >> 8));
+	trace(id, (uint8_t) arg);
+}
+
+#else
+
+static inline __attribute__((always_inline)) void trace(
+		__attribute__((unused)) uint8_t id,
+		__attribute__((unused)) uint8_t arg)
+{
+	// do nothing
+}
+static inline __attribute__((always_inline)) void trace16(
+		__attribute__((unused)) uint8_t id,
+		__attribute__((unused)) uint16_t arg)
+{
+	// do nothing
+}
+
+#endif /* TRACING */
+
+#endif /* TRACE_H */